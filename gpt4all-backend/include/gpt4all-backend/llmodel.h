@@ -29,6 +29,7 @@ public:
     using ResponseCallback    = std::function<bool(Token token, std::string_view piece)>;
     using EmbedCancelCallback = bool(unsigned *batchSizes, unsigned nBatch, const char *backend);
     using ProgressCallback    = std::function<bool(float progress)>;
+    using AbortCallback       = std::function<bool()>;
 
     class BadArchError: public std::runtime_error {
     public:
@@ -105,6 +106,8 @@ public:
         static std::vector<GPUDevice> availableGPUDevices(size_t memoryRequired = 0);
         static int32_t maxContextLength(const std::string &modelPath);
         static int32_t layerCount(const std::string &modelPath);
+        // an estimate of the memory the model takes once loaded with this context length, including its KV cache
+        static size_t estimateMemory(const std::string &modelPath, int32_t n_ctx);
         static bool isEmbeddingModel(const std::string &modelPath);
         static auto chatTemplate(const char *modelPath) -> std::expected<std::string, std::string>;
         static void setImplementationsSearchPath(const std::string &path);
@@ -150,6 +153,10 @@ public:
     virtual bool isModelBlacklisted(const std::string &modelPath) const { (void)modelPath; return false; }
     virtual bool isEmbeddingModel(const std::string &modelPath) const { (void)modelPath; return false; }
     virtual bool isModelLoaded() const = 0;
+    // Creates another instance of this loaded model with its own context and thread count that shares the
+    // weights instead of loading them again, so that both can be used from different threads at once. The
+    // weights are freed with the last instance. Returns nullptr if the backend can't do this.
+    virtual LLModel *newContext() const { return nullptr; }
     virtual size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) = 0;
     virtual size_t stateSize() const = 0;
     virtual size_t saveState(std::span<uint8_t> stateOut, std::vector<Token> &inputTokensOut) const = 0;
@@ -161,8 +168,18 @@ public:
                         const PromptCallback   &promptCallback,
                         const ResponseCallback &responseCallback,
                         const PromptContext    &ctx);
+    // Generates a response to the same prompt for each callback. Where the backend can keep several sequences
+    // in one context, the prompt is decoded once and the responses are sampled together on copies of its cache,
+    // and only the prompt is left in the cache afterwards. Otherwise they are generated one after another.
+    void promptParallel(std::string_view                   prompt,
+                        const PromptCallback              &promptCallback,
+                        std::span<const ResponseCallback>  responseCallbacks,
+                        const PromptContext               &ctx);
 
     virtual int32_t countPromptTokens(std::string_view prompt) const;
+    // The number of tokens at the start of the prompt that are already in the cache from an earlier prompt or
+    // response, and that prompting with it would not decode again.
+    virtual int32_t cachedPrefixLength(std::string_view prompt) const;
 
     virtual size_t embeddingSize() const {
         throw std::logic_error(std::string(implementation().modelType()) + " does not support embeddings");
@@ -206,10 +223,19 @@ public:
     virtual const char *gpuDeviceName() const { return nullptr; }
 
     void setProgressCallback(ProgressCallback callback) { m_progressCallback = callback; }
+    // Polled by the threads that compute a batch, so that a prompt can be stopped in the middle of one instead of
+    // after it; it must be cheap and thread-safe. Only the CPU backend checks it during a batch. Set it while the
+    // model is not in use.
+    void setAbortCallback(AbortCallback callback) { m_abortCallback = std::move(callback); }
 
     virtual int32_t contextLength() const = 0;
     virtual auto specialTokens() -> std::unordered_map<std::string, std::string> const = 0;
 
+    // For monitoring, on the thread that uses the model: the tokens in the KV cache, and how many times the
+    // context was full and its oldest tokens were erased to make room.
+    virtual int32_t cacheLength() const { return inputLength(); }
+    uint64_t contextShifts() const { return m_contextShifts; }
+
 protected:
     // These are pure virtual because subclasses need to implement as the default implementation of
     // 'prompt' above calls these functions
@@ -228,6 +254,25 @@ protected:
     virtual const std::vector<Token> &endTokens() const = 0;
     virtual bool shouldAddBOS() const = 0;
 
+    // Sequences for generating several responses at once. Sequence 0 is the one the functions above work on.
+    struct SequenceToken {
+        int32_t seq;
+        int32_t pos;
+        Token   token;
+    };
+    virtual int32_t maxSequences() const { return 1; }
+    // Makes sequences 1 to n-1 copies of the first nPast positions of sequence 0, each with its own sampler.
+    virtual void forkSequences(const PromptContext &ctx, int32_t n, int32_t nPast)
+    { (void)ctx; (void)n; (void)nPast; throw std::logic_error("multiple sequences are not supported"); }
+    virtual Token sampleSequence(int32_t seq) const
+    { (void)seq; throw std::logic_error("multiple sequences are not supported"); }
+    // decodes the tokens in one batch
+    virtual bool evalSequences(std::span<const SequenceToken> tokens)
+    { (void)tokens; throw std::logic_error("multiple sequences are not supported"); }
+    // Drops the other sequences, and what follows the first nPast positions of sequence 0.
+    virtual void joinSequences(int32_t n, int32_t nPast)
+    { (void)n; (void)nPast; throw std::logic_error("multiple sequences are not supported"); }
+
     virtual int32_t maxContextLength(std::string const &modelPath) const
     {
         (void)modelPath;
@@ -240,6 +285,15 @@ protected:
         return -1;
     }
 
+    // The weights and the KV cache for the context length, or 0 if unknown. Kept apart from requiredMem, whose
+    // callers use it to pick a GPU device and would turn down ones that can offload only some of the layers.
+    virtual size_t estimateMemory(std::string const &modelPath, int32_t n_ctx) const
+    {
+        (void)modelPath;
+        (void)n_ctx;
+        return 0;
+    }
+
     virtual auto chatTemplate(const char *modelPath) const -> std::expected<std::string, std::string>
     {
         (void)modelPath;
@@ -247,6 +301,7 @@ protected:
     }
 
     const Implementation *m_implementation = nullptr;
+    uint64_t m_contextShifts = 0;
 
     ProgressCallback m_progressCallback;
     static bool staticProgressCallback(float progress, void* ctx)
@@ -257,6 +312,14 @@ protected:
         return true;
     }
 
+    AbortCallback m_abortCallback;
+    bool aborted() const { return m_abortCallback && m_abortCallback(); }
+    static bool staticAbortCallback(void *ctx)
+    {
+        auto *model = static_cast<const LLModel *>(ctx);
+        return model && model->aborted();
+    }
+
     // prefill context with prompt
     auto decodePrompt(const PromptCallback &promptCallback,
                       const PromptContext  &promptCtx,
@@ -266,6 +329,23 @@ protected:
     void generateResponse(const ResponseCallback &responseCallback,
                           const PromptContext    &promptCtx,
                           int32_t                 nPast);
+    // generate a response on each sequence, sampled together
+    void generateParallel(std::span<const ResponseCallback> responseCallbacks,
+                          const PromptContext              &promptCtx,
+                          int32_t                           nPast);
+
+    // A response being generated, of which the end is held back while it could still become a stop sequence.
+    struct ResponseState {
+        const ResponseCallback *callback;
+        std::string             cachedResponse;
+        std::vector<Token>      cachedTokens;
+        int                     n_predicted = 0;
+    };
+    // Adds a sampled token to the response and sends what can be sent. Returns false once the response has ended.
+    // accept decodes the token; it is called before the token is sent, or after it was held back if the response
+    // goes on, and not at all for a token that ends the response unsent.
+    bool advanceResponse(ResponseState &state, Token tok, const PromptContext &promptCtx,
+                         const std::function<void()> &accept);
 
     friend class LLMImplementation;
 };
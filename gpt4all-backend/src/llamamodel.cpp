@@ -43,6 +43,9 @@ using namespace std::string_literals;
 // Maximum supported GGUF version
 static constexpr int GGUF_VER_MAX = 3;
 
+// responses that can be generated at once on one context
+static constexpr int32_t MAX_SEQUENCES = 16;
+
 static const char * const modelType_ = "LLaMA";
 
 // note: same order as LLM_ARCH_NAMES in llama.cpp
@@ -224,10 +227,15 @@ struct LLamaPrivate {
     std::vector<LLModel::Token>  inputTokens;
 
     llama_model          *model        = nullptr;
+    std::shared_ptr<llama_model> modelRef; // owns model, shared with the instances made by newContext()
     llama_context        *ctx          = nullptr;
     llama_model_params    model_params;
     llama_context_params  ctx_params;
     llama_sampler        *sampler_chain;
+
+    // the samplers of sequences 1 and up, and where in the last batch the logits of each sequence are
+    std::vector<llama_sampler *> seqSamplers;
+    std::vector<int32_t>         seqLogits;
 };
 
 LLamaModel::LLamaModel()
@@ -339,14 +347,12 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
     d_ptr->modelLoaded = false;
 
     // clean up after previous loadModel()
-    if (d_ptr->model) {
-        llama_free_model(d_ptr->model);
-        d_ptr->model = nullptr;
-    }
     if (d_ptr->ctx) {
         llama_free(d_ptr->ctx);
         d_ptr->ctx = nullptr;
     }
+    d_ptr->modelRef.reset();
+    d_ptr->model = nullptr;
 
     if (n_ctx < 8) {
         std::cerr << "warning: minimum context size is 8, using minimum size.\n";
@@ -407,6 +413,7 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
         std::cerr << "LLAMA ERROR: failed to load model from " << modelPath << std::endl;
         return false;
     }
+    d_ptr->modelRef.reset(d_ptr->model, llama_free_model);
 
     // -- initialize the context --
 
@@ -439,11 +446,14 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
     if (isEmbedding)
         d_ptr->ctx_params.embeddings = true;
 
+    d_ptr->ctx_params.abort_callback      = &LLModel::staticAbortCallback;
+    d_ptr->ctx_params.abort_callback_data = this;
+
     d_ptr->ctx = llama_new_context_with_model(d_ptr->model, d_ptr->ctx_params);
     if (!d_ptr->ctx) {
         fflush(stdout);
         std::cerr << "LLAMA ERROR: failed to init context for model " <<  modelPath << std::endl;
-        llama_free_model(d_ptr->model);
+        d_ptr->modelRef.reset();
         d_ptr->model = nullptr;
 #ifndef GGML_USE_CUDA
         d_ptr->device = -1;
@@ -491,8 +501,9 @@ LLamaModel::~LLamaModel()
     if (d_ptr->ctx) {
         llama_free(d_ptr->ctx);
     }
-    llama_free_model(d_ptr->model);
     llama_sampler_free(d_ptr->sampler_chain);
+    for (auto *chain : d_ptr->seqSamplers)
+        llama_sampler_free(chain);
 }
 
 bool LLamaModel::isModelLoaded() const
@@ -500,6 +511,44 @@ bool LLamaModel::isModelLoaded() const
     return d_ptr->modelLoaded;
 }
 
+LLModel *LLamaModel::newContext() const
+{
+    if (!d_ptr->modelLoaded)
+        return nullptr;
+
+    auto other = std::make_unique<LLamaModel>();
+    other->m_implementation     = m_implementation;
+    other->m_supportsEmbedding  = m_supportsEmbedding;
+    other->m_supportsCompletion = m_supportsCompletion;
+
+    auto *od = other->d_ptr.get();
+    od->device       = d_ptr->device;
+    od->deviceName   = d_ptr->deviceName;
+    od->n_threads    = d_ptr->n_threads;
+    od->end_tokens   = d_ptr->end_tokens;
+    od->backend_name = d_ptr->backend_name;
+    od->model_params = d_ptr->model_params;
+    od->ctx_params   = d_ptr->ctx_params;
+    od->modelRef     = d_ptr->modelRef;
+    od->model        = d_ptr->model;
+
+    // the progress callback would refer to this instance, and the weights are already loaded anyway
+    od->model_params.progress_callback = nullptr;
+    od->model_params.progress_callback_user_data = nullptr;
+    od->ctx_params.n_threads       = d_ptr->n_threads;
+    od->ctx_params.n_threads_batch = d_ptr->n_threads;
+    od->ctx_params.abort_callback_data = other.get();
+
+    od->ctx = llama_new_context_with_model(od->model, od->ctx_params);
+    if (!od->ctx) {
+        std::cerr << "LLAMA ERROR: failed to init another context for the model" << std::endl;
+        return nullptr;
+    }
+
+    od->modelLoaded = true;
+    return other.release();
+}
+
 size_t LLamaModel::stateSize() const
 {
     return llama_state_get_size(d_ptr->ctx);
@@ -553,18 +602,8 @@ std::string LLamaModel::tokenToString(Token id) const
     return std::string(result.data(), result.size());
 }
 
-void LLamaModel::initSampler(const PromptContext &promptCtx)
+static void addSamplers(llama_sampler *chain, const llama_model *model, const LLModel::PromptContext &promptCtx)
 {
-    auto *model = d_ptr->model;
-    auto *chain = d_ptr->sampler_chain;
-
-    // clear sampler chain
-    for (int i = llama_sampler_chain_n(chain) - 1; i >= 0; i--) {
-        auto *smpl = llama_sampler_chain_remove(chain, i);
-        llama_sampler_free(smpl);
-    }
-
-    // build new chain
     llama_sampler_chain_add(chain,
         llama_sampler_init_penalties(
             llama_n_vocab(model),
@@ -595,6 +634,20 @@ void LLamaModel::initSampler(const PromptContext &promptCtx)
     }
 }
 
+void LLamaModel::initSampler(const PromptContext &promptCtx)
+{
+    auto *chain = d_ptr->sampler_chain;
+
+    // clear sampler chain
+    for (int i = llama_sampler_chain_n(chain) - 1; i >= 0; i--) {
+        auto *smpl = llama_sampler_chain_remove(chain, i);
+        llama_sampler_free(smpl);
+    }
+
+    // build new chain
+    addSamplers(chain, d_ptr->model, promptCtx);
+}
+
 LLModel::Token LLamaModel::sampleToken() const
 {
     return llama_sampler_sample(d_ptr->sampler_chain, d_ptr->ctx, -1);
@@ -626,6 +679,73 @@ bool LLamaModel::evalTokens(int32_t nPast, std::span<const Token> tokens) const
     return res == 0;
 }
 
+int32_t LLamaModel::maxSequences() const
+{
+    if (!d_ptr->modelLoaded)
+        return 1;
+    // the state of a recurrent model is not kept per position, and there are only as many as n_seq_max
+    return llama_model_is_recurrent(d_ptr->model) ? 1 : MAX_SEQUENCES;
+}
+
+void LLamaModel::forkSequences(const PromptContext &promptCtx, int32_t n, int32_t nPast)
+{
+    assert(n <= MAX_SEQUENCES);
+    assert(d_ptr->seqSamplers.empty());
+
+    // the copies share the cells of the cache with sequence 0
+    for (int32_t seq = 1; seq < n; seq++) {
+        llama_kv_cache_seq_rm(d_ptr->ctx, seq, -1, -1);
+        llama_kv_cache_seq_cp(d_ptr->ctx, 0, seq, 0, nPast);
+
+        // a sampler of its own, so that they don't all pick the same tokens
+        auto *chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        addSamplers(chain, d_ptr->model, promptCtx);
+        d_ptr->seqSamplers.push_back(chain);
+    }
+    d_ptr->seqLogits.assign(n, -1); // the last token of the prompt
+}
+
+LLModel::Token LLamaModel::sampleSequence(int32_t seq) const
+{
+    auto *chain = seq ? d_ptr->seqSamplers.at(seq - 1) : d_ptr->sampler_chain;
+    return llama_sampler_sample(chain, d_ptr->ctx, d_ptr->seqLogits.at(seq));
+}
+
+bool LLamaModel::evalSequences(std::span<const SequenceToken> tokens)
+{
+    assert(!tokens.empty());
+
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+
+    batch.n_tokens = tokens.size();
+
+    for (int32_t i = 0; i < batch.n_tokens; i++) {
+        batch.token   [i] = tokens[i].token;
+        batch.pos     [i] = tokens[i].pos;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id  [i][0] = tokens[i].seq;
+        batch.logits  [i] = true;
+        d_ptr->seqLogits.at(tokens[i].seq) = i;
+    }
+
+    int res = llama_decode(d_ptr->ctx, batch);
+    llama_batch_free(batch);
+    return res == 0;
+}
+
+void LLamaModel::joinSequences(int32_t n, int32_t nPast)
+{
+    for (int32_t seq = 1; seq < n; seq++)
+        llama_kv_cache_seq_rm(d_ptr->ctx, seq, -1, -1);
+    llama_kv_cache_seq_rm(d_ptr->ctx, 0, nPast, -1);
+    setModelInputPosition(nPast);
+
+    for (auto *chain : d_ptr->seqSamplers)
+        llama_sampler_free(chain);
+    d_ptr->seqSamplers.clear();
+    d_ptr->seqLogits.clear();
+}
+
 void LLamaModel::shiftContext(const PromptContext &promptCtx, int32_t *nPast)
 {
     // infinite text generation via context shifting
@@ -726,6 +846,47 @@ int32_t LLamaModel::layerCount(std::string const &modelPath) const
     return get_arch_key_u32(modelPath, "block_count");
 }
 
+size_t LLamaModel::estimateMemory(std::string const &modelPath, int32_t n_ctx) const
+{
+    // The weights take about the size of the file, and the KV cache comes on top of them. Offloaded layers are
+    // counted all the same.
+    auto fin = std::ifstream(modelPath, std::ios::binary | std::ios::ate);
+    if (!fin)
+        return 0;
+    const size_t filesize = fin.tellg();
+
+    auto *ctx = load_gguf(modelPath.c_str());
+    if (!ctx)
+        return filesize;
+
+    size_t kvSize = 0;
+    try {
+        const std::string arch = get_arch_name(ctx);
+        auto get_u32 = [ctx, &arch](const char *name) -> int64_t {
+            int keyidx = gguf_find_key(ctx, (arch + "." + name).c_str());
+            if (keyidx == -1 || gguf_get_kv_type(ctx, keyidx) != GGUF_TYPE_UINT32)
+                return -1; // missing, or given per layer
+            return gguf_get_val_u32(ctx, keyidx);
+        };
+        int64_t n_layer   = get_u32("block_count");
+        int64_t n_embd    = get_u32("embedding_length");
+        int64_t n_head    = get_u32("attention.head_count");
+        int64_t n_head_kv = get_u32("attention.head_count_kv");
+        if (n_head_kv < 0)
+            n_head_kv = n_head;
+        if (n_layer > 0 && n_embd > 0 && n_head > 0 && n_head_kv > 0) {
+            // a K and a V row for each position in each layer, as wide as the KV heads
+            const int64_t n_embd_kv = n_embd / n_head * n_head_kv;
+            kvSize = size_t(2 * n_layer * n_ctx * n_embd_kv) * ggml_type_size(gpt_params().kv_type);
+        }
+    } catch (const std::runtime_error &) {
+        // no architecture, so only the weights are known
+    }
+
+    gguf_free(ctx);
+    return filesize + kvSize;
+}
+
 // TODO(jared): reduce redundant code and operations by combining all metadata getters for unloaded
 //              models into a class that keeps the model file open
 auto LLamaModel::chatTemplate(const char *modelPath) const -> std::expected<std::string, std::string>
@@ -27,6 +27,7 @@ public:
     bool isModelBlacklisted(const std::string &modelPath) const override;
     bool isEmbeddingModel(const std::string &modelPath) const override;
     bool isModelLoaded() const override;
+    LLModel *newContext() const override;
     size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) override;
     size_t stateSize() const override;
     size_t saveState(std::span<uint8_t> stateOut, std::vector<Token> &inputTokensOut) const override;
@@ -60,6 +61,11 @@ protected:
     Token sampleToken() const override;
     bool evalTokens(int32_t nPast, std::span<const Token> tokens) const override;
     void shiftContext(const PromptContext &promptCtx, int32_t *nPast) override;
+    int32_t maxSequences() const override;
+    void forkSequences(const PromptContext &promptCtx, int32_t n, int32_t nPast) override;
+    Token sampleSequence(int32_t seq) const override;
+    bool evalSequences(std::span<const SequenceToken> tokens) override;
+    void joinSequences(int32_t n, int32_t nPast) override;
     int32_t inputLength() const override;
     int32_t computeModelInputPosition(std::span<const Token> input) const override;
     void setModelInputPosition(int32_t pos) override;
@@ -69,6 +75,7 @@ protected:
     bool shouldAddBOS() const override;
     int32_t maxContextLength(std::string const &modelPath) const override;
     int32_t layerCount(std::string const &modelPath) const override;
+    size_t estimateMemory(std::string const &modelPath, int32_t n_ctx) const override;
     auto chatTemplate(const char *modelPath) const -> std::expected<std::string, std::string> override;
 
     void embedInternal(const std::vector<std::string> &texts, float *embeddings, std::string prefix, int dimensionality,
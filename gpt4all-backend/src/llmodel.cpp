@@ -325,6 +325,12 @@ int32_t LLModel::Implementation::layerCount(const std::string &modelPath)
     return llama ? llama->layerCount(modelPath) : -1;
 }
 
+size_t LLModel::Implementation::estimateMemory(const std::string &modelPath, int32_t n_ctx)
+{
+    auto *llama = constructGlobalLlama();
+    return llama ? llama->estimateMemory(modelPath, n_ctx) : 0;
+}
+
 bool LLModel::Implementation::isEmbeddingModel(const std::string &modelPath)
 {
     auto *llama = constructGlobalLlama();
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <optional>
@@ -39,6 +40,43 @@ void LLModel::prompt(
         generateResponse(responseCallback, promptCtx, /*n_past*/ *res);
 }
 
+void LLModel::promptParallel(
+    std::string_view                   prompt,
+    const PromptCallback              &promptCallback,
+    std::span<const ResponseCallback>  responseCallbacks,
+    const PromptContext               &promptCtx
+) {
+    const auto n = int32_t(responseCallbacks.size());
+    auto sequential = [&] {
+        // each response after the first finds most of the prompt in the cache
+        for (auto &callback : responseCallbacks)
+            this->prompt(prompt, promptCallback, callback, promptCtx);
+    };
+
+    if (n < 2 || maxSequences() < n || promptCtx.n_predict < 0)
+        return sequential();
+
+    if (!isModelLoaded())
+        throw std::invalid_argument("Attempted to prompt an unloaded model.");
+    if (!supportsCompletion())
+        throw std::invalid_argument("Not a text completion model.");
+    if (!promptCtx.n_batch)
+        throw std::invalid_argument("Batch size cannot be zero.");
+    if (!promptCtx.n_predict)
+        return; // nothing requested
+
+    auto embd_inp = tokenize(prompt);
+    if (embd_inp.empty())
+        throw std::invalid_argument("Prompt tokenized to zero tokens.");
+
+    // the sequences share the cells of the prompt, but each needs room for its own response
+    if (int64_t(embd_inp.size()) + int64_t(n) * promptCtx.n_predict > contextLength())
+        return sequential();
+
+    if (auto res = decodePrompt(promptCallback, promptCtx, std::move(embd_inp)))
+        generateParallel(responseCallbacks, promptCtx, /*n_past*/ *res);
+}
+
 int32_t LLModel::countPromptTokens(std::string_view prompt) const
 {
     if (!isModelLoaded())
@@ -46,6 +84,13 @@ int32_t LLModel::countPromptTokens(std::string_view prompt) const
     return int32_t(tokenize(prompt).size());
 }
 
+int32_t LLModel::cachedPrefixLength(std::string_view prompt) const
+{
+    if (!isModelLoaded())
+        throw std::invalid_argument("Attempted to tokenize with an unloaded model.");
+    return computeModelInputPosition(tokenize(prompt));
+}
+
 auto LLModel::decodePrompt(
     const PromptCallback &promptCallback,
     const PromptContext  &promptCtx,
@@ -101,12 +146,16 @@ auto LLModel::decodePrompt(
         // Check if the context has run out...
         if (nPast + int32_t(batch.size()) > nCtx) {
             shiftContext(promptCtx, &nPast);
+            m_contextShifts++;
             assert(nPast + int32_t(batch.size()) <= nCtx);
         }
 
         // FIXME(Adam): We should find a way to bubble these strings to the UI level to allow for translation
-        if (!evalTokens(nPast, batch))
+        if (!evalTokens(nPast, batch)) {
+            if (aborted())
+                return std::nullopt;
             throw std::runtime_error("An internal error was encountered during prompt processing.");
+        }
 
         for (auto &tok : batch) {
             appendInputToken(tok);
@@ -139,122 +188,151 @@ static std::string::size_type stringsOverlap(const std::string &s, const std::st
     return std::string::npos;
 }
 
-void LLModel::generateResponse(
-    const ResponseCallback &responseCallback,
-    const PromptContext    &promptCtx,
-    int32_t                 nPast
+bool LLModel::advanceResponse(
+    ResponseState               &state,
+    Token                        sampled,
+    const PromptContext         &promptCtx,
+    const std::function<void()> &accept
 ) {
     static const char *stopSequences[] {
         "### System", "### Instruction", "### Human", "### User", "### Response", "### Assistant", "### Context",
         "<|im_start|>", "<|im_end|>", "<|endoftext|>",
     };
 
-    initSampler(promptCtx);
+    auto &cachedResponse = state.cachedResponse;
+    auto &cachedTokens   = state.cachedTokens;
 
-    std::string cachedResponse;
-    std::vector<Token> cachedTokens;
-    int n_predicted = 0;
+    std::optional<Token> new_tok = sampled;
+    std::string new_piece = tokenToString(sampled);
+    cachedTokens.push_back(sampled);
+    cachedResponse += new_piece;
 
-    // Predict next tokens
-    for (bool stop = false; !stop;) {
-        // Sample next token
-        std::optional<Token> new_tok = sampleToken();
-        std::string new_piece = tokenToString(new_tok.value());
-        cachedTokens.push_back(new_tok.value());
-        cachedResponse += new_piece;
-
-        auto accept = [this, &promptCtx, &new_tok, &nPast] {
-            // Shift context if out of space
-            if (nPast >= contextLength()) {
-                shiftContext(promptCtx, &nPast);
-                assert(nPast < contextLength());
-            }
+    auto acceptNew = [&new_tok, &accept] {
+        new_tok.reset();
+        accept();
+    };
 
-            // Accept the token
-            Token tok = std::exchange(new_tok, std::nullopt).value();
-            if (!evalTokens(nPast, { &tok, 1 }))
-                throw std::runtime_error("An internal error was encountered during response generation.");
+    bool stop = false;
 
-            appendInputToken(tok);
-            nPast++;
-        };
+    // Check for EOS
+    auto lengthLimit = std::string::npos;
+    for (const auto token : endTokens()) {
+        if (new_tok == token) {
+            stop = true;
+            lengthLimit = cachedResponse.size() - new_piece.size();
+        }
+    }
 
-        // Check for EOS
-        auto lengthLimit = std::string::npos;
-        for (const auto token : endTokens()) {
-            if (new_tok == token) {
-                stop = true;
-                lengthLimit = cachedResponse.size() - new_piece.size();
-            }
+    if (lengthLimit != std::string::npos) {
+        // EOS matched
+    } else if (!isSpecialToken(sampled)) {
+        // Check if the response contains a stop sequence
+        for (const auto &p : stopSequences) {
+            auto match = cachedResponse.find(p);
+            if (match != std::string::npos) stop = true;
+            lengthLimit = std::min(lengthLimit, match);
+            if (match == 0) break;
         }
 
-        if (lengthLimit != std::string::npos) {
-            // EOS matched
-        } else if (!isSpecialToken(new_tok.value())) {
-            // Check if the response contains a stop sequence
+        // Check if the response matches the start of a stop sequence
+        if (lengthLimit == std::string::npos) {
             for (const auto &p : stopSequences) {
-                auto match = cachedResponse.find(p);
-                if (match != std::string::npos) stop = true;
+                auto match = stringsOverlap(cachedResponse, p);
                 lengthLimit = std::min(lengthLimit, match);
                 if (match == 0) break;
             }
+        }
+    } else if (ranges::find(stopSequences, new_piece) < std::end(stopSequences)) {
+        // Special tokens must exactly match a stop sequence
+        stop = true;
+        lengthLimit = cachedResponse.size() - new_piece.size();
+    }
 
-            // Check if the response matches the start of a stop sequence
-            if (lengthLimit == std::string::npos) {
-                for (const auto &p : stopSequences) {
-                    auto match = stringsOverlap(cachedResponse, p);
-                    lengthLimit = std::min(lengthLimit, match);
-                    if (match == 0) break;
-                }
-            }
-        } else if (ranges::find(stopSequences, new_piece) < std::end(stopSequences)) {
-            // Special tokens must exactly match a stop sequence
+    // Empty the cache, up to the length limit
+    std::string::size_type responseLength = 0;
+    while (!cachedTokens.empty()) {
+        Token tok = cachedTokens.front();
+        std::string piece = tokenToString(tok);
+
+        // Stop if the piece (or part of it) does not fit within the length limit
+        if (responseLength + (stop ? 1 : piece.size()) > lengthLimit)
+            break;
+
+        // Remove token from cache
+        assert(cachedResponse.starts_with(piece));
+        cachedTokens.erase(cachedTokens.begin(), cachedTokens.begin() + 1);
+        cachedResponse.erase(cachedResponse.begin(), cachedResponse.begin() + piece.size());
+
+        // Accept the token, if needed (not cached)
+        if (cachedTokens.empty() && new_tok)
+            acceptNew();
+
+        // Send the token
+        if (!(*state.callback)(tok, piece) || ++state.n_predicted >= promptCtx.n_predict) {
             stop = true;
-            lengthLimit = cachedResponse.size() - new_piece.size();
+            break;
         }
 
-        // Empty the cache, up to the length limit
-        std::string::size_type responseLength = 0;
-        while (!cachedTokens.empty()) {
-            Token tok = cachedTokens.front();
-            std::string piece = tokenToString(tok);
+        // FIXME(jared): we could avoid printing partial stop sequences if we didn't have to
+        // output token IDs and could cache a partial token for the next prompt call
+        responseLength += piece.size();
+    }
+    assert(cachedTokens.empty() == cachedResponse.empty());
+
+    // Accept the token, if needed (in cache)
+    if (new_tok) {
+        assert(!cachedTokens.empty() && cachedTokens.back() == new_tok);
+        if (stop) {
+            cachedTokens.pop_back();
+        } else {
+            acceptNew();
+        }
+    }
 
-            // Stop if the piece (or part of it) does not fit within the length limit
-            if (responseLength + (stop ? 1 : piece.size()) > lengthLimit)
-                break;
+    return !stop;
+}
 
-            // Remove token from cache
-            assert(cachedResponse.starts_with(piece));
-            cachedTokens.erase(cachedTokens.begin(), cachedTokens.begin() + 1);
-            cachedResponse.erase(cachedResponse.begin(), cachedResponse.begin() + piece.size());
+void LLModel::generateResponse(
+    const ResponseCallback &responseCallback,
+    const PromptContext    &promptCtx,
+    int32_t                 nPast
+) {
+    initSampler(promptCtx);
 
-            // Accept the token, if needed (not cached)
-            if (cachedTokens.empty() && new_tok)
-                accept();
+    ResponseState state { .callback = &responseCallback };
 
-            // Send the token
-            if (!responseCallback(tok, piece) || ++n_predicted >= promptCtx.n_predict) {
-                stop = true;
-                break;
+    // Predict next tokens
+    bool evalAborted = false;
+    for (bool stop = false; !stop;) {
+        // Sample next token
+        Token new_tok = sampleToken();
+
+        auto accept = [this, &promptCtx, &nPast, &evalAborted, new_tok] {
+            // Shift context if out of space
+            if (nPast >= contextLength()) {
+                shiftContext(promptCtx, &nPast);
+                m_contextShifts++;
+                assert(nPast < contextLength());
             }
 
-            // FIXME(jared): we could avoid printing partial stop sequences if we didn't have to
-            // output token IDs and could cache a partial token for the next prompt call
-            responseLength += piece.size();
-        }
-        assert(cachedTokens.empty() == cachedResponse.empty());
-
-        // Accept the token, if needed (in cache)
-        if (new_tok) {
-            assert(!cachedTokens.empty() && cachedTokens.back() == new_tok);
-            if (stop) {
-                cachedTokens.pop_back();
-            } else {
-                accept();
+            // Accept the token
+            if (!evalTokens(nPast, { &new_tok, 1 })) {
+                if (!aborted())
+                    throw std::runtime_error("An internal error was encountered during response generation.");
+                evalAborted = true; // the token is not in the cache, and nobody waits for the rest
+                return;
             }
-        }
+
+            appendInputToken(new_tok);
+            nPast++;
+        };
+
+        stop = !advanceResponse(state, new_tok, promptCtx, accept);
+        if (evalAborted)
+            return;
     }
 
+    auto &cachedTokens = state.cachedTokens;
     if (inputLength() < cachedTokens.size()) {
         /* This is theoretically possible if the longest stop sequence is greater than
          * n_ctx * contextErase tokens. */
@@ -268,6 +346,57 @@ void LLModel::generateResponse(
 #endif
 }
 
+void LLModel::generateParallel(
+    std::span<const ResponseCallback> responseCallbacks,
+    const PromptContext              &promptCtx,
+    int32_t                           nPast
+) {
+    const auto n = int32_t(responseCallbacks.size());
+
+    initSampler(promptCtx);
+    forkSequences(promptCtx, n, nPast);
+
+    try {
+        std::vector<ResponseState> states;
+        states.reserve(n);
+        for (auto &callback : responseCallbacks)
+            states.push_back({ .callback = &callback });
+        std::vector<int32_t> positions(n, nPast);
+        std::vector<char>    active   (n, true);
+        int32_t              nActive = n;
+
+        // every sequence samples from the logits of the prompt first, and then from those of its last token
+        std::vector<SequenceToken> batch;
+        for (;;) {
+            batch.clear();
+            for (int32_t seq = 0; seq < n; seq++) {
+                if (!active[seq])
+                    continue;
+                Token new_tok = sampleSequence(seq);
+                auto accept = [&batch, &positions, seq, new_tok] {
+                    batch.push_back({ seq, positions[seq]++, new_tok });
+                };
+                if (!advanceResponse(states[seq], new_tok, promptCtx, accept)) {
+                    active[seq] = false;
+                    nActive--;
+                }
+            }
+            if (!nActive)
+                break;
+
+            if (!evalSequences(batch)) {
+                if (aborted())
+                    break;
+                throw std::runtime_error("An internal error was encountered during response generation.");
+            }
+        }
+    } catch (...) {
+        joinSequences(n, nPast);
+        throw;
+    }
+    joinSequences(n, nPast);
+}
+
 void LLModel::embed(
     const std::vector<std::string> &texts, float *embeddings, std::optional<std::string> prefix, int dimensionality,
     size_t *tokenCount, bool doMean, bool atlas, EmbedCancelCallback *cancelCb
@@ -7,8 +7,13 @@ REPL to communicate with a language model similar to the chat GUI application, b
 
 import importlib.metadata
 import io
+import json
 import sys
+import time
+import urllib.error
+import urllib.request
 from collections import namedtuple
+from pathlib import Path
 from typing_extensions import Annotated
 
 import typer
@@ -29,7 +34,7 @@ SPECIAL_COMMANDS = {
 }
 
 VersionInfo = namedtuple('VersionInfo', ['major', 'minor', 'micro'])
-VERSION_INFO = VersionInfo(1, 0, 2)
+VERSION_INFO = VersionInfo(1, 1, 0)
 VERSION = '.'.join(map(str, VERSION_INFO))  # convert to string form, like: '1.2.3'
 
 CLI_START_MESSAGE = f"""
@@ -174,6 +179,62 @@ def _new_loop(gpt4all_instance):
             print() # newline before next prompt
 
 
+@app.command()
+def batch(
+    input_file: Annotated[
+        Path,
+        typer.Argument(help="JSONL file of requests in the format of OpenAI's batch API"),
+    ],
+    output_file: Annotated[
+        Path,
+        typer.Option("--output", "-o", help="File to write the results to, one line of JSON per request"),
+    ] = None,
+    port: Annotated[
+        int,
+        typer.Option("--port", "-p", help="Port of the API server of the GPT4All application"),
+    ] = 4891,
+):
+    """Run a file of requests on the API server of the GPT4All application and save their results."""
+    base_url = f"http://localhost:{port}/v1/batches"
+    if output_file is None:
+        output_file = input_file.with_name(f"{input_file.stem}-output.jsonl")
+
+    def call(url, data=None):
+        request = urllib.request.Request(url, data=data, method="GET" if data is None else "POST")
+        try:
+            with urllib.request.urlopen(request) as response:
+                return response.read()
+        except urllib.error.HTTPError as e:
+            try:
+                message = json.loads(e.read())["error"]["message"]
+            except (ValueError, KeyError, TypeError):
+                message = e.reason
+            sys.exit(f"Error: {message}")
+        except urllib.error.URLError as e:
+            sys.exit(f"Error: could not reach the API server at {url}: {e.reason}")
+
+    status = json.loads(call(base_url, input_file.read_bytes()))
+    print(f"Started {status['id']} with {status['request_counts']['total']} requests")
+    try:
+        while status["status"] in ("in_progress", "cancelling"):
+            time.sleep(1)
+            status = json.loads(call(f"{base_url}/{status['id']}"))
+            counts = status["request_counts"]
+            print(f"\r{counts['completed'] + counts['failed']}/{counts['total']} done, {counts['failed']} failed",
+                  end="", flush=True)
+    except KeyboardInterrupt:
+        # the requests that are running finish, the others are written as cancelled
+        print("\nCancelling...")
+        status = json.loads(call(f"{base_url}/{status['id']}/cancel", b""))
+        while status["status"] == "cancelling":
+            time.sleep(1)
+            status = json.loads(call(f"{base_url}/{status['id']}"))
+    print()
+
+    output_file.write_bytes(call(f"{base_url}/{status['id']}/output"))
+    print(f"Batch {status['status']}, results written to {output_file}")
+
+
 @app.command()
 def version():
     """The CLI version command."""
@@ -79,6 +79,12 @@ public:
     int32_t countPromptTokens(std::string_view prompt) const override
     { Q_UNUSED(prompt); throwNotImplemented(); }
 
+    // the whole conversation is sent with every request
+    int32_t cachedPrefixLength(std::string_view prompt) const override
+    { Q_UNUSED(prompt); return 0; }
+    int32_t cacheLength() const override
+    { return 0; }
+
     void setThreadCount(int32_t n_threads) override;
     int32_t threadCount() const override;
 
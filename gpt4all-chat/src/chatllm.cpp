@@ -7,6 +7,7 @@
 #include "localdocs.h"
 #include "mysettings.h"
 #include "network.h"
+#include "servermetrics.h"
 #include "tool.h"
 #include "toolmodel.h"
 #include "toolcallparser.h"
@@ -29,6 +30,7 @@
 #include <QMutexLocker> // IWYU pragma: keep
 #include <QRegularExpression> // IWYU pragma: keep
 #include <QRegularExpressionMatch> // IWYU pragma: keep
+#include <QScopeGuard>
 #include <QSet>
 #include <QStringView>
 #include <QTextStream>
@@ -51,6 +53,7 @@
 #include <functional>
 #include <iomanip>
 #include <limits>
+#include <memory>
 #include <optional>
 #include <ranges>
 #include <regex>
@@ -70,12 +73,11 @@ using json = nlohmann::ordered_json;
 //#define DEBUG
 //#define DEBUG_MODEL_LOADING
 
-// NOTE: not threadsafe
+// the server renders templates on several threads at once
 static const std::shared_ptr<minja::Context> &jinjaEnv()
 {
-    static std::shared_ptr<minja::Context> environment;
-    if (!environment) {
-        environment = minja::Context::builtins();
+    static const std::shared_ptr<minja::Context> environment = [] {
+        auto environment = minja::Context::builtins();
         environment->set("strftime_now", minja::simple_function(
             "strftime_now", { "format" },
             [](const std::shared_ptr<minja::Context> &, minja::Value &args) -> minja::Value {
@@ -97,7 +99,8 @@ static const std::shared_ptr<minja::Context> &jinjaEnv()
                 return std::regex_replace(str, std::regex(pattern), repl);
             }
         ));
-    }
+        return environment;
+    }();
     return environment;
 }
 
@@ -114,15 +117,15 @@ public:
     virtual bool getStopGenerating () const                                                                           = 0;
 };
 
-static auto promptModelWithTools(
-    LLModel *model, const LLModel::PromptCallback &promptCallback, BaseResponseHandler &respHandler,
-    const LLModel::PromptContext &ctx, const QByteArray &prompt, const QStringList &toolNames
-) -> std::pair<QStringList, bool>
+// Passes the response on to the handler, and stops it once the model has made a complete tool call.
+static auto toolResponseCallback(ToolCallParser &toolCallParser, BaseResponseHandler &respHandler)
+    -> LLModel::ResponseCallback
 {
-    ToolCallParser toolCallParser(toolNames);
-    auto handleResponse = [&toolCallParser, &respHandler](LLModel::Token token, std::string_view piece) -> bool {
+    return [&toolCallParser, &respHandler, timer = ResponseTimer()]
+           (LLModel::Token token, std::string_view piece) mutable -> bool {
         Q_UNUSED(token)
 
+        timer.onToken();
         toolCallParser.update(piece.data());
 
         // Split the response into two if needed
@@ -157,7 +160,15 @@ static auto promptModelWithTools(
 
         return !shouldExecuteToolCall && !respHandler.getStopGenerating();
     };
-    model->prompt(std::string_view(prompt), promptCallback, handleResponse, ctx);
+}
+
+static auto promptModelWithTools(
+    LLModel *model, const LLModel::PromptCallback &promptCallback, BaseResponseHandler &respHandler,
+    const LLModel::PromptContext &ctx, const QByteArray &prompt, const QStringList &toolNames
+) -> std::pair<QStringList, bool>
+{
+    ToolCallParser toolCallParser(toolNames);
+    model->prompt(std::string_view(prompt), promptCallback, toolResponseCallback(toolCallParser, respHandler), ctx);
 
     const bool shouldExecuteToolCall = toolCallParser.state() == ToolEnums::ParseState::Complete
         && toolCallParser.startTag() != ToolCallConstants::ThinkStartTag;
@@ -165,24 +176,43 @@ static auto promptModelWithTools(
     return { toolCallParser.buffers(), shouldExecuteToolCall };
 }
 
+/* Keeps the models that no chat is using loaded, so that going back to one does not load it again. The models in
+ * use and the resident ones share a memory budget (MySettings::modelMemoryBudget), and the least recently used
+ * resident ones are unloaded to make room for another. */
 class LLModelStore {
 public:
     static LLModelStore *globalInstance();
 
-    LLModelInfo acquireModel(); // will block until llmodel is ready
+    // Returns the resident model for the file if there is one, or else an empty LLModelInfo that reserves the given
+    // memory to load it. A budgeted model blocks while the ones in use leave no room for it. The server's models
+    // are not budgeted, so that it never waits for the chats: they only unload resident ones to make room.
+    LLModelInfo acquireModel(const QFileInfo &fileInfo, size_t requiredMem, bool budgeted);
+    // the resident model for the file, if there is one, without reserving memory for another
+    std::optional<LLModelInfo> takeModel(const QFileInfo &fileInfo);
     void releaseModel(LLModelInfo &&info); // must be called when you are done
     void destroy();
 
 private:
-    LLModelStore()
-    {
-        // seed with empty model
-        m_availableModel = LLModelInfo();
-    }
+    struct Resident {
+        LLModelInfo info;
+        quint64     lastUsed;
+    };
+
+    LLModelStore() {}
     ~LLModelStore() {}
-    std::optional<LLModelInfo> m_availableModel;
+
+    // whether a model of this size can be loaded, after unloading every resident one if evictAll is true; the
+    // first model always can
+    bool fits(size_t requiredMem, bool evictAll = false) const;
+    LLModelInfo takeResident(std::vector<Resident>::iterator resident, bool budgeted);
+
     QMutex m_mutex;
     QWaitCondition m_condition;
+    std::vector<Resident> m_residents;
+    size_t m_residentMem = 0;
+    size_t m_inUseMem = 0;
+    int m_nInUse = 0;
+    quint64 m_releases = 0;
     friend class MyLLModelStore;
 };
 
@@ -193,28 +223,91 @@ LLModelStore *LLModelStore::globalInstance()
     return storeInstance();
 }
 
-LLModelInfo LLModelStore::acquireModel()
+bool LLModelStore::fits(size_t requiredMem, bool evictAll) const
 {
+    if (!m_nInUse && (evictAll || m_residents.empty()))
+        return true;
+    const size_t budget = size_t(qMax(MySettings::globalInstance()->modelMemoryBudget(), 0)) << 20;
+    return m_inUseMem + (evictAll ? 0 : m_residentMem) + requiredMem <= budget;
+}
+
+LLModelInfo LLModelStore::takeResident(std::vector<Resident>::iterator resident, bool budgeted)
+{
+    LLModelInfo info = std::move(resident->info);
+    m_residents.erase(resident);
+    m_residentMem -= info.memory;
+    info.budgeted = budgeted;
+    if (budgeted) {
+        m_inUseMem += info.memory;
+        m_nInUse++;
+    }
+    return info;
+}
+
+LLModelInfo LLModelStore::acquireModel(const QFileInfo &fileInfo, size_t requiredMem, bool budgeted)
+{
+    std::vector<Resident> evicted; // unloaded after the lock is released
     QMutexLocker locker(&m_mutex);
-    while (!m_availableModel)
+    for (;;) {
+        auto resident = std::ranges::find_if(m_residents, [&](auto &r) { return r.info.fileInfo == fileInfo; });
+        if (resident != m_residents.end())
+            return takeResident(resident, budgeted);
+
+        // unload the resident models that were used the longest time ago, unless that would not be enough anyway
+        if (!budgeted || fits(requiredMem, /*evictAll*/ true)) {
+            std::ranges::sort(m_residents, {}, &Resident::lastUsed);
+            while (!m_residents.empty() && !fits(requiredMem)) {
+                m_residentMem -= m_residents.front().info.memory;
+                evicted.push_back(std::move(m_residents.front()));
+                m_residents.erase(m_residents.begin());
+            }
+        }
+
+        if (!budgeted || fits(requiredMem)) {
+            if (budgeted) {
+                m_inUseMem += requiredMem;
+                m_nInUse++;
+            }
+            LLModelInfo info;
+            info.memory   = requiredMem;
+            info.budgeted = budgeted;
+            return info;
+        }
         m_condition.wait(locker.mutex());
-    auto first = std::move(*m_availableModel);
-    m_availableModel.reset();
-    return first;
+    }
+}
+
+std::optional<LLModelInfo> LLModelStore::takeModel(const QFileInfo &fileInfo)
+{
+    QMutexLocker locker(&m_mutex);
+    auto resident = std::ranges::find_if(m_residents, [&](auto &r) { return r.info.fileInfo == fileInfo; });
+    if (resident == m_residents.end())
+        return std::nullopt;
+    return takeResident(resident, /*budgeted*/ true);
 }
 
 void LLModelStore::releaseModel(LLModelInfo &&info)
 {
     QMutexLocker locker(&m_mutex);
-    Q_ASSERT(!m_availableModel);
-    m_availableModel = std::move(info);
+    if (info.budgeted) {
+        Q_ASSERT(m_nInUse > 0);
+        m_inUseMem -= info.memory;
+        m_nInUse--;
+    }
+    if (info.model && info.model->isModelLoaded()) {
+        m_residentMem += info.memory;
+        m_residents.push_back({ std::move(info), ++m_releases });
+    }
     m_condition.wakeAll();
 }
 
 void LLModelStore::destroy()
 {
+    std::vector<Resident> residents;
     QMutexLocker locker(&m_mutex);
-    m_availableModel.reset();
+    residents.swap(m_residents);
+    m_residentMem = 0;
+    m_condition.wakeAll();
 }
 
 void LLModelInfo::resetModel(ChatLLM *cllm, LLModel *model) {
@@ -269,6 +362,7 @@ void ChatLLM::destroy()
     // as we explicitly unload the model in all other circumstances
     if (isModelLoaded()) {
         m_llModelInfo.resetModel(this);
+        LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo)); // gives back its memory
     }
 }
 
@@ -337,15 +431,22 @@ void ChatLLM::trySwitchContextOfLoadedModel(const ModelInfo &modelInfo)
     QString filePath = modelInfo.dirpath + modelInfo.filename();
     QFileInfo fileInfo(filePath);
 
-    acquireModel();
+    // The store does not have the model loaded, then fail
+    auto resident = LLModelStore::globalInstance()->takeModel(fileInfo);
+    if (!resident) {
+        emit trySwitchContextOfLoadedModelCompleted(0);
+        return;
+    }
+    m_llModelInfo = std::move(*resident);
+    emit loadedModelInfoChanged();
 #if defined(DEBUG_MODEL_LOADING)
         qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model.get();
 #endif
 
-    // The store gave us no already loaded model, the wrong type of model, then give it back to the
-    // store and fail
-    if (!m_llModelInfo.model || m_llModelInfo.fileInfo != fileInfo || !m_shouldBeLoaded) {
+    // We no longer need it, then give it back to the store and fail
+    if (!m_shouldBeLoaded) {
         LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+        resetModel();
         emit trySwitchContextOfLoadedModelCompleted(0);
         return;
     }
@@ -359,11 +460,19 @@ void ChatLLM::trySwitchContextOfLoadedModel(const ModelInfo &modelInfo)
     emit trySwitchContextOfLoadedModelCompleted(0);
 }
 
+// what the local model is estimated to take once loaded with its settings
+static size_t requiredMemory(const ModelInfo &modelInfo)
+{
+    auto *mySettings = MySettings::globalInstance();
+    QString filePath = modelInfo.dirpath + modelInfo.filename();
+    return LLModel::Implementation::estimateMemory(filePath.toStdString(), mySettings->modelContextLength(modelInfo));
+}
+
 bool ChatLLM::loadModel(const ModelInfo &modelInfo)
 {
     // This is a complicated method because N different possible threads are interested in the outcome
     // of this method. Why? Because we have a main/gui thread trying to monitor the state of N different
-    // possible chat threads all vying for a single resource - the currently loaded model - as the user
+    // possible chat threads all vying for the loaded models, which share a memory budget, as the user
     // switches back and forth between chats. It is important for our main/gui thread to never block
     // but simultaneously always have up2date information with regards to which chat has the model loaded
     // and what the type and name of that model is. I've tried to comment extensively in this method
@@ -381,51 +490,53 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
     QString filePath = modelInfo.dirpath + modelInfo.filename();
     QFileInfo fileInfo(filePath);
 
-    // We have a live model, but it isn't the one we want
-    bool alreadyAcquired = isModelLoaded();
-    if (alreadyAcquired) {
+    // We have a live model, but it isn't the one we want. It stays loaded in the store while there is room for it.
+    if (isModelLoaded()) {
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "already acquired model deleted" << m_llmThread.objectName() << m_llModelInfo.model.get();
+        qDebug() << "already acquired model released" << m_llmThread.objectName() << m_llModelInfo.model.get();
 #endif
-        m_llModelInfo.resetModel(this);
-    } else if (!m_isServer) {
-        // This is a blocking call that tries to retrieve the model we need from the model store.
-        // If it succeeds, then we just have to restore state. If the store has never had a model
-        // returned to it, then the modelInfo.model pointer should be null which will happen on startup
-        acquireModel();
+        LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+        resetModel();
+    }
+
+    // This is a blocking call that tries to retrieve the model we need from the model store, or else waits
+    // until the models that other chats are using leave enough room to load it. The server does not wait for
+    // the chats, so that API requests can always be answered. If the store does not have our model, then the
+    // modelInfo.model pointer should be null.
+    acquireModel(fileInfo, modelInfo.isOnline ? 0 : requiredMemory(modelInfo));
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model.get();
+    qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model.get();
 #endif
-        // At this point it is possible that while we were blocked waiting to acquire the model from the
-        // store, that our state was changed to not be loaded. If this is the case, release the model
-        // back into the store and quit loading
-        if (!m_shouldBeLoaded) {
+    // At this point it is possible that while we were blocked waiting to acquire the model from the
+    // store, that our state was changed to not be loaded. If this is the case, release the model
+    // back into the store and quit loading
+    if (!m_shouldBeLoaded) {
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "no longer need model" << m_llmThread.objectName() << m_llModelInfo.model.get();
+        qDebug() << "no longer need model" << m_llmThread.objectName() << m_llModelInfo.model.get();
 #endif
-            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
-            emit modelLoadingPercentageChanged(0.0f);
-            return false;
-        }
+        LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+        resetModel();
+        emit modelLoadingPercentageChanged(0.0f);
+        return false;
+    }
 
-        // Check if the store just gave us exactly the model we were looking for
-        if (m_llModelInfo.model && m_llModelInfo.fileInfo == fileInfo && !m_reloadingToChangeVariant) {
+    // Check if the store just gave us exactly the model we were looking for
+    if (m_llModelInfo.model && !m_reloadingToChangeVariant) {
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "store had our model" << m_llmThread.objectName() << m_llModelInfo.model.get();
+        qDebug() << "store had our model" << m_llmThread.objectName() << m_llModelInfo.model.get();
 #endif
-            emit modelLoadingPercentageChanged(1.0f);
-            setModelInfo(modelInfo);
-            Q_ASSERT(!m_modelInfo.filename().isEmpty());
-            if (m_modelInfo.filename().isEmpty())
-                emit modelLoadingError(u"Modelinfo is left null for %1"_s.arg(modelInfo.filename()));
-            return true;
-        } else {
-            // Release the memory since we have to switch to a different model.
+        emit modelLoadingPercentageChanged(1.0f);
+        setModelInfo(modelInfo);
+        Q_ASSERT(!m_modelInfo.filename().isEmpty());
+        if (m_modelInfo.filename().isEmpty())
+            emit modelLoadingError(u"Modelinfo is left null for %1"_s.arg(modelInfo.filename()));
+        return true;
+    } else if (m_llModelInfo.model) {
+        // Release the memory since we have to load it again on a different device.
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "deleting model" << m_llmThread.objectName() << m_llModelInfo.model.get();
+        qDebug() << "deleting model" << m_llmThread.objectName() << m_llModelInfo.model.get();
 #endif
-            m_llModelInfo.resetModel(this);
-        }
+        m_llModelInfo.resetModel(this);
     }
 
     // Guarantee we've released the previous models memory
@@ -486,8 +597,7 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
         modelLoadProps.insert("model", modelInfo.filename());
         Network::globalInstance()->trackChatEvent("model_load", modelLoadProps);
     } else {
-        if (!m_isServer)
-            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo)); // release back into the store
+        LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo)); // release back into the store
         resetModel();
         emit modelLoadingError(u"Could not find file for model %1"_s.arg(modelInfo.filename()));
     }
@@ -543,8 +653,7 @@ bool ChatLLM::loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadPro
         }
 
         if (!m_llModelInfo.model) {
-            if (!m_isServer)
-                LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
             resetModel();
             emit modelLoadingError(u"Error loading %1: %2"_s.arg(modelInfo.filename(), constructError));
             return false;
@@ -580,8 +689,8 @@ bool ChatLLM::loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadPro
     std::vector<LLModel::GPUDevice> availableDevices;
     const LLModel::GPUDevice *defaultDevice = nullptr;
     {
-        const size_t requiredMemory = m_llModelInfo.model->requiredMem(filePath.toStdString(), n_ctx, ngl);
-        availableDevices = m_llModelInfo.model->availableGPUDevices(requiredMemory);
+        // not filtered by memory, since a model that does not fit can still be offloaded partially
+        availableDevices = m_llModelInfo.model->availableGPUDevices(0);
         // Pick the best device
         // NB: relies on the fact that Kompute devices are listed first
         if (!availableDevices.empty() && availableDevices.front().type == 2 /*a discrete gpu*/) {
@@ -628,8 +737,7 @@ bool ChatLLM::loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadPro
 
     if (!m_shouldBeLoaded) {
         m_llModelInfo.resetModel(this);
-        if (!m_isServer)
-            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+        LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
         resetModel();
         emit modelLoadingPercentageChanged(0.0f);
         return false;
@@ -650,8 +758,7 @@ bool ChatLLM::loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadPro
 
         if (!m_shouldBeLoaded) {
             m_llModelInfo.resetModel(this);
-            if (!m_isServer)
-                LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
             resetModel();
             emit modelLoadingPercentageChanged(0.0f);
             return false;
@@ -666,8 +773,7 @@ bool ChatLLM::loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadPro
 
     if (!success) {
         m_llModelInfo.resetModel(this);
-        if (!m_isServer)
-            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+        LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
         resetModel();
         emit modelLoadingError(u"Could not load model due to invalid model file for %1"_s.arg(modelInfo.filename()));
         modelLoadProps.insert("error", "loadmodel_failed");
@@ -679,14 +785,15 @@ bool ChatLLM::loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadPro
     default:
         {
             m_llModelInfo.resetModel(this);
-            if (!m_isServer)
-                LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
+            LLModelStore::globalInstance()->releaseModel(std::move(m_llModelInfo));
             resetModel();
             emit modelLoadingError(u"Could not determine model type for %1"_s.arg(modelInfo.filename()));
         }
     }
 
     modelLoadProps.insert("$duration", modelLoadTimer.elapsed() / 1000.);
+    if (m_llModelInfo.model)
+        ServerMetrics::globalInstance()->observeModelLoad(modelLoadTimer.elapsed() / 1000.);
     return true;
 }
 
@@ -735,9 +842,9 @@ void ChatLLM::setModelInfo(const ModelInfo &modelInfo)
     emit modelInfoChanged(modelInfo);
 }
 
-void ChatLLM::acquireModel()
+void ChatLLM::acquireModel(const QFileInfo &fileInfo, size_t requiredMem)
 {
-    m_llModelInfo = LLModelStore::globalInstance()->acquireModel();
+    m_llModelInfo = LLModelStore::globalInstance()->acquireModel(fileInfo, requiredMem, /*budgeted*/ !m_isServer);
     emit loadedModelInfoChanged();
 }
 
@@ -955,6 +1062,38 @@ auto ChatLLM::promptInternalChat(const QStringList &enabledCollections, const LL
     };
 }
 
+std::string ChatLLM::renderPrompt(const LLModel *model,
+                                  const std::variant<std::span<const MessageItem>, std::string_view> &prompt) const
+{
+    // unpack prompt argument
+    const std::span<const MessageItem> *messageItems = nullptr;
+    std::string                      conversation;
+    if (auto *nonChat = std::get_if<std::string_view>(&prompt)) {
+        conversation = *nonChat; // complete the string without a template
+    } else {
+        messageItems = &std::get<std::span<const MessageItem>>(prompt);
+        conversation = applyJinjaTemplate(*messageItems);
+    }
+
+    // check for overlength last message
+    if (!dynamic_cast<const ChatAPI *>(model)) {
+        auto nCtx = model->contextLength();
+        std::string jinjaBuffer2;
+        auto lastMessageRendered = (messageItems && messageItems->size() > 1)
+            ? std::string_view(jinjaBuffer2 = applyJinjaTemplate({ &messageItems->back(), 1 }))
+            : std::string_view(conversation);
+        int32_t lastMessageLength = model->countPromptTokens(lastMessageRendered);
+        if (auto limit = nCtx - 4; lastMessageLength > limit) {
+            throw std::invalid_argument(
+                tr("Your message was too long and could not be processed (%1 > %2). "
+                   "Please try again with something shorter.").arg(lastMessageLength).arg(limit).toUtf8().constData()
+            );
+        }
+    }
+
+    return conversation;
+}
+
 class ChatViewResponseHandler : public BaseResponseHandler {
 public:
     ChatViewResponseHandler(ChatLLM *cllm, QElapsedTimer *totalTime, ChatLLM::PromptResult *result)
@@ -1022,38 +1161,13 @@ auto ChatLLM::promptInternal(
 
     auto *mySettings = MySettings::globalInstance();
 
-    // unpack prompt argument
-    const std::span<const MessageItem> *messageItems = nullptr;
-    std::string                      jinjaBuffer;
-    std::string_view                 conversation;
-    if (auto *nonChat = std::get_if<std::string_view>(&prompt)) {
-        conversation = *nonChat; // complete the string without a template
-    } else {
-        messageItems    = &std::get<std::span<const MessageItem>>(prompt);
-        jinjaBuffer  = applyJinjaTemplate(*messageItems);
-        conversation = jinjaBuffer;
-    }
-
-    // check for overlength last message
-    if (!dynamic_cast<const ChatAPI *>(m_llModelInfo.model.get())) {
-        auto nCtx = m_llModelInfo.model->contextLength();
-        std::string jinjaBuffer2;
-        auto lastMessageRendered = (messageItems && messageItems->size() > 1)
-            ? std::string_view(jinjaBuffer2 = applyJinjaTemplate({ &messageItems->back(), 1 }))
-            : conversation;
-        int32_t lastMessageLength = m_llModelInfo.model->countPromptTokens(lastMessageRendered);
-        if (auto limit = nCtx - 4; lastMessageLength > limit) {
-            throw std::invalid_argument(
-                tr("Your message was too long and could not be processed (%1 > %2). "
-                   "Please try again with something shorter.").arg(lastMessageLength).arg(limit).toUtf8().constData()
-            );
-        }
-    }
+    auto *messageItems = std::get_if<std::span<const MessageItem>>(&prompt);
+    std::string conversation = renderPrompt(m_llModelInfo.model.get(), prompt);
 
     PromptResult result {};
 
     auto handlePrompt = [this, &result](std::span<const LLModel::Token> batch, bool cached) -> bool {
-        Q_UNUSED(cached)
+        ServerMetrics::globalInstance()->countPromptTokens(batch.size(), cached);
         result.promptTokens += batch.size();
         m_timer->start();
         return !m_stopGenerating;
@@ -1066,6 +1180,10 @@ auto ChatLLM::promptInternal(
     m_timer->start();
     QStringList finalBuffers;
     bool        shouldExecuteTool;
+    const quint64 contextShifts = m_llModelInfo.model->contextShifts();
+    auto countShifts = qScopeGuard([&] {
+        ServerMetrics::globalInstance()->countContextShifts(m_llModelInfo.model->contextShifts() - contextShifts);
+    });
     try {
         emit promptProcessing();
         m_llModelInfo.model->setThreadCount(mySettings->threadCount());
@@ -1109,6 +1227,88 @@ auto ChatLLM::promptInternal(
     return result;
 }
 
+class DetachedResponseHandler : public BaseResponseHandler {
+public:
+    DetachedResponseHandler(ChatLLM::PromptResult *result, int index,
+                            const std::function<bool(int, const QByteArray &)> &onToken)
+        : m_result(result), m_index(index), m_onToken(onToken) {}
+
+    void onSplitIntoTwo(const QString &, const QString &, const QString &) override {}
+    void onSplitIntoThree(const QString &, const QString &) override {}
+
+    void onOldResponseChunk(const QByteArray &chunk) override
+    {
+        m_result->responseTokens++;
+        m_result->response.append(chunk);
+        if (!m_onToken(m_index, chunk))
+            m_stop = true;
+    }
+
+    bool onBufferResponse(const QString &, int) override
+    { return !m_stop; }
+
+    bool onRegularResponse() override
+    { return !m_stop; }
+
+    bool getStopGenerating() const override
+    { return m_stop; }
+
+private:
+    ChatLLM::PromptResult                              *m_result;
+    int                                                 m_index;
+    const std::function<bool(int, const QByteArray &)> &m_onToken;
+    bool                                                m_stop = false;
+};
+
+auto ChatLLM::promptDetached(
+    LLModel *model,
+    const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
+    const LLModel::PromptContext &ctx,
+    const LLModel::PromptCallback &onPrompt,
+    int n,
+    const std::function<bool(int, const QByteArray &)> &onToken
+) const -> std::vector<PromptResult>
+{
+    std::string conversation = renderPrompt(model, prompt);
+
+    std::vector<PromptResult> results(n);
+    // the responses share the prompt, which is only counted once even if it is decoded again for each
+    int promptTokens = 0;
+    bool responded = false;
+    auto handlePrompt = [&](std::span<const LLModel::Token> batch, bool cached) -> bool {
+        ServerMetrics::globalInstance()->countPromptTokens(batch.size(), cached);
+        if (!responded)
+            promptTokens += batch.size();
+        return onPrompt(batch, cached);
+    };
+
+    std::vector<std::unique_ptr<ToolCallParser>>          toolCallParsers;
+    std::vector<std::unique_ptr<DetachedResponseHandler>> respHandlers;
+    std::vector<LLModel::ResponseCallback>                responseCallbacks;
+    for (int i = 0; i < n; i++) {
+        toolCallParsers.push_back(std::make_unique<ToolCallParser>(ToolCallConstants::AllTagNames));
+        respHandlers.push_back(std::make_unique<DetachedResponseHandler>(&results[i], i, onToken));
+        responseCallbacks.push_back(
+            [&responded, handleResponse = toolResponseCallback(*toolCallParsers.back(), *respHandlers.back())]
+            (LLModel::Token token, std::string_view piece) mutable {
+                responded = true;
+                return handleResponse(token, piece);
+            }
+        );
+    }
+
+    const quint64 contextShifts = model->contextShifts();
+    auto countShifts = qScopeGuard([&] {
+        ServerMetrics::globalInstance()->countContextShifts(model->contextShifts() - contextShifts);
+    });
+    model->setThreadCount(MySettings::globalInstance()->threadCount());
+    model->promptParallel(std::string_view(conversation), handlePrompt, responseCallbacks, ctx);
+
+    for (auto &result : results)
+        result.promptTokens = promptTokens;
+    return results;
+}
+
 void ChatLLM::setShouldBeLoaded(bool b)
 {
 #if defined(DEBUG_MODEL_LOADING)
@@ -20,6 +20,7 @@
 #include <QtNumeric>
 
 #include <atomic>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <span>
@@ -94,6 +95,8 @@ struct LLModelInfo {
     std::unique_ptr<LLModel> model;
     QFileInfo fileInfo;
     std::optional<QString> fallbackReason;
+    size_t memory   = 0;     // estimated
+    bool   budgeted = false; // counted against the memory budget of the model store while in use
 
     // NOTE: This does not store the model type or name on purpose as this is left for ChatLLM which
     // must be able to serialize the information even if it is in the unloaded state
@@ -172,7 +175,7 @@ public:
     ModelInfo modelInfo() const;
     void setModelInfo(const ModelInfo &info);
 
-    void acquireModel();
+    void acquireModel(const QFileInfo &fileInfo, size_t requiredMem);
     void resetModel();
 
     QString deviceBackend() const
@@ -255,6 +258,21 @@ protected:
     PromptResult promptInternal(const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
                                 const LLModel::PromptContext &ctx,
                                 bool usedLocalDocs);
+    // Like promptInternal, but on the given instance of the loaded model and without the chat view, so that
+    // several can run at once on other threads. Generates n responses to the prompt, together where the model
+    // can. onToken gets the index of the response and the raw UTF-8 of each of its tokens, and stops that
+    // response by returning false.
+    std::vector<PromptResult> promptDetached(LLModel *model,
+                                             const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
+                                             const LLModel::PromptContext &ctx,
+                                             const LLModel::PromptCallback &onPrompt,
+                                             int n,
+                                             const std::function<bool(int, const QByteArray &)> &onToken) const;
+    // Applies the template if needed and checks that the last message fits in the context of the model.
+    std::string renderPrompt(const LLModel *model,
+                             const std::variant<std::span<const MessageItem>, std::string_view> &prompt) const;
+
+    LLModel *loadedModel() const { return m_llModelInfo.model.get(); }
 
 private:
     bool loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadProps);
@@ -285,6 +303,7 @@ private:
     bool m_forceMetal;
     bool m_reloadingToChangeVariant;
     friend class ChatViewResponseHandler;
+    friend class DetachedResponseHandler;
     friend class SimpleResponseHandler;
 };
 
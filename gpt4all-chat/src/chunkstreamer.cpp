@@ -0,0 +1,779 @@
+#include "database.h"
+
+#include "utils.h" // IWYU pragma: keep
+
+#include <duckx/duckx.hpp>
+#include <fmt/format.h>
+
+#include <QDataStream>
+#include <QFile>
+#include <QIODevice>
+#include <QMutexLocker>
+#include <QStringView>
+#include <QTextStream>
+#include <QThread>
+#include <QUtf8StringView>
+#include <QtMinMax>
+#include <QtTypes>
+
+#include <deque>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#ifdef GPT4ALL_USE_QTPDF
+#   include <QPdfDocument>
+#   include <QPdfSelection>
+#else
+#   include <fpdfview.h>
+#   include <fpdf_doc.h>
+#   include <fpdf_text.h>
+#endif
+
+using namespace Qt::Literals::StringLiterals;
+
+
+namespace {
+
+/* QFile that checks input for binary data. If seen, it fails the read and returns true
+ * for binarySeen(). */
+class BinaryDetectingFile: public QFile {
+public:
+    using QFile::QFile;
+
+    bool binarySeen() const { return m_binarySeen; }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override {
+        qint64 res = QFile::readData(data, maxSize);
+        return checkData(data, res);
+    }
+
+    qint64 readLineData(char *data, qint64 maxSize) override {
+        qint64 res = QFile::readLineData(data, maxSize);
+        return checkData(data, res);
+    }
+
+private:
+    qint64 checkData(const char *data, qint64 size) {
+        Q_ASSERT(!isTextModeEnabled()); // We need raw bytes from the underlying QFile
+        if (size != -1 && !m_binarySeen) {
+            for (qint64 i = 0; i < size; i++) {
+                /* Control characters we should never see in plain text:
+                 * 0x00 NUL - 0x06 ACK
+                 * 0x0E SO  - 0x1A SUB
+                 * 0x1C FS  - 0x1F US */
+                auto c = static_cast<unsigned char>(data[i]);
+                if (c < 0x07 || (c >= 0x0E && c < 0x1B) || (c >= 0x1C && c < 0x20)) {
+                    m_binarySeen = true;
+                    break;
+                }
+            }
+        }
+        return m_binarySeen ? -1 : size;
+    }
+
+    bool m_binarySeen = false;
+};
+
+} // namespace
+
+// characters of a document's text that are compressed together when it is stored, see DocumentReader::fillBlock
+static const qsizetype s_textSegmentSize = 64 * 1024;
+
+class DocumentReader {
+public:
+    struct Metadata { QString title, author, subject, keywords; };
+
+    static std::unique_ptr<DocumentReader> fromDocument(DocumentInfo info);
+
+    const DocumentInfo               &doc     () const { return m_info; }
+    const Metadata                   &metadata() const { return m_metadata; }
+    // words are views into the reader's buffer, valid until the next call to nextWord()
+    const std::optional<QStringView> &word    () const { return m_word; }
+    const std::optional<QStringView> &nextWord()       { m_word = advance(); return m_word; }
+    virtual std::optional<ChunkStreamer::Status> getError() const { return std::nullopt; }
+    virtual int page() const { return -1; }
+    // the text of every block read so far, if we were asked to record it
+    std::optional<StoredDocumentText> takeText();
+
+    virtual ~DocumentReader() = default;
+
+protected:
+    explicit DocumentReader(DocumentInfo info, bool blocksSplitWords, bool recordText = true)
+        : m_info(std::move(info))
+        , m_blocksSplitWords(blocksSplitWords)
+        , m_recordText(recordText) {}
+
+    void postInit(Metadata &&metadata = {})
+    {
+        m_metadata = std::move(metadata);
+        m_word = advance();
+    }
+
+    // appends the next block of text to m_buffer, returns false at the end of the document
+    virtual bool fillBuffer() = 0;
+
+    DocumentInfo               m_info;
+    Metadata                   m_metadata;
+    std::optional<QStringView> m_word;
+    QString                    m_buffer;
+
+private:
+    std::optional<QStringView> advance();
+    bool fillBlock();
+    void compressText(bool final);
+
+    const bool                 m_blocksSplitWords; // whether a word can continue into the next block
+    qsizetype                  m_pos = 0;          // start of the unread part of m_buffer
+
+    const bool                 m_recordText;
+    qint64                     m_textSize = 0;     // characters recorded so far
+    QString                    m_textSegment;      // the recorded text that was not compressed yet
+    QByteArray                 m_textData;         // the compressed segments, see StoredDocumentText
+    QList<std::pair<qint64, qint32>> m_textPages;  // where each page starts in the text
+};
+
+// calls fillBuffer and records the new block
+bool DocumentReader::fillBlock()
+{
+    const qsizetype start = m_buffer.size();
+    if (!fillBuffer())
+        return false;
+    if (m_recordText) {
+        if (m_textPages.isEmpty() || m_textPages.last().second != page())
+            m_textPages.append({ m_textSize, page() });
+        const auto block = QStringView(m_buffer).sliced(start);
+        m_textSize += block.size();
+        m_textSegment += block;
+        if (m_textSegment.size() >= s_textSegmentSize)
+            compressText(/*final*/ false);
+    }
+    return true;
+}
+
+// appends m_textSegment to m_textData, so that only the compressed text is kept for the whole document
+void DocumentReader::compressText(bool final)
+{
+    qsizetype size = m_textSegment.size();
+    // the halves of a surrogate pair are not valid UTF-8 on their own
+    if (!final && size && m_textSegment[size - 1].isHighSurrogate())
+        size--;
+    if (!size)
+        return;
+
+    QDataStream out(&m_textData, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_6_0);
+    out.device()->seek(m_textData.size());
+    out << qCompress(QStringView(m_textSegment).first(size).toUtf8());
+    m_textSegment.remove(0, size);
+}
+
+std::optional<StoredDocumentText> DocumentReader::takeText()
+{
+    if (!m_recordText)
+        return std::nullopt;
+
+    StoredDocumentText stored {
+        .title    = m_metadata.title,
+        .author   = m_metadata.author,
+        .subject  = m_metadata.subject,
+        .keywords = m_metadata.keywords,
+    };
+    QDataStream out(&stored.pages, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_6_0);
+    out << m_textPages;
+    compressText(/*final*/ true);
+    stored.text = std::exchange(m_textData, {});
+
+    m_textSize = 0;
+    m_textPages.clear();
+    return stored;
+}
+
+std::optional<QStringView> DocumentReader::advance()
+{
+    // find non-space char
+    for (;;) {
+        while (m_pos < m_buffer.size() && m_buffer[m_pos].isSpace())
+            ++m_pos;
+        if (m_pos < m_buffer.size())
+            break;
+        m_buffer.clear();
+        m_pos = 0;
+        if (!fillBlock())
+            return std::nullopt;
+    }
+
+    // find space char
+    qsizetype end = m_pos + 1;
+    for (;;) {
+        while (end < m_buffer.size() && !m_buffer[end].isSpace())
+            ++end;
+        if (end < m_buffer.size() || !m_blocksSplitWords)
+            break;
+        // the word may continue in the next block, keep only the part we still need
+        m_buffer.remove(0, m_pos);
+        end -= m_pos;
+        m_pos = 0;
+        if (!fillBlock())
+            break;
+    }
+
+    auto word = QStringView(m_buffer).sliced(m_pos, end - m_pos);
+    m_pos = end;
+    return word;
+}
+
+namespace {
+
+/* Extracts the pages of a document on a background thread, at most s_pageReadAhead pages ahead of
+ * the reader, so that text extraction overlaps with tokenizing and chunking. Pages are returned in
+ * order. */
+class PageReadAhead {
+public:
+    PageReadAhead(int nPages, std::function<QString (int page)> extractPage)
+        : m_nPages(nPages)
+        , m_extractPage(std::move(extractPage))
+        , m_thread(QThread::create([this] { run(); }))
+    {
+        m_thread->setObjectName("pdf-read-ahead");
+        m_thread->start();
+    }
+
+    ~PageReadAhead()
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stop = true;
+            m_cond.wakeAll();
+        }
+        m_thread->wait();
+    }
+
+    // throws std::runtime_error if a page could not be extracted
+    std::optional<QString> next()
+    {
+        QMutexLocker locker(&m_mutex);
+        while (m_pages.empty() && !m_done)
+            m_cond.wait(&m_mutex);
+        if (!m_pages.empty()) {
+            QString text = std::move(m_pages.front());
+            m_pages.pop_front();
+            m_cond.wakeAll();
+            return text;
+        }
+        if (m_error)
+            throw std::runtime_error(*m_error);
+        return std::nullopt;
+    }
+
+private:
+    static constexpr size_t s_pageReadAhead = 8;
+
+    void run()
+    {
+        for (int page = 0; page < m_nPages; page++) {
+            {
+                QMutexLocker locker(&m_mutex);
+                while (!m_stop && m_pages.size() >= s_pageReadAhead)
+                    m_cond.wait(&m_mutex);
+                if (m_stop)
+                    return;
+            }
+
+            QString text;
+            try {
+                text = m_extractPage(page);
+            } catch (const std::runtime_error &e) {
+                QMutexLocker locker(&m_mutex);
+                m_error = e.what();
+                break;
+            }
+
+            QMutexLocker locker(&m_mutex);
+            m_pages.push_back(std::move(text));
+            m_cond.wakeAll();
+        }
+
+        QMutexLocker locker(&m_mutex);
+        m_done = true;
+        m_cond.wakeAll();
+    }
+
+    const int                           m_nPages;
+    const std::function<QString (int)>  m_extractPage;
+    QMutex                              m_mutex;
+    QWaitCondition                      m_cond;
+    std::deque<QString>                 m_pages;
+    std::optional<std::string>          m_error;
+    bool                                m_done = false;
+    bool                                m_stop = false;
+    std::unique_ptr<QThread>            m_thread;
+};
+
+#ifdef GPT4ALL_USE_QTPDF
+class PdfDocumentReader final : public DocumentReader {
+public:
+    explicit PdfDocumentReader(DocumentInfo info)
+        : DocumentReader(std::move(info), /*blocksSplitWords*/ false)
+    {
+        QString path = m_info.file.canonicalFilePath();
+        if (m_doc.load(path) != QPdfDocument::Error::None)
+            throw std::runtime_error(fmt::format("Failed to load PDF: {}", path));
+        Metadata metadata {
+            .title    = m_doc.metaData(QPdfDocument::MetaDataField::Title   ).toString(),
+            .author   = m_doc.metaData(QPdfDocument::MetaDataField::Author  ).toString(),
+            .subject  = m_doc.metaData(QPdfDocument::MetaDataField::Subject ).toString(),
+            .keywords = m_doc.metaData(QPdfDocument::MetaDataField::Keywords).toString(),
+        };
+        // QPdfDocument serializes its own calls into PDFium
+        m_readAhead = std::make_unique<PageReadAhead>(m_doc.pageCount(), [this](int page) {
+            return m_doc.getAllText(page).text();
+        });
+        postInit(std::move(metadata));
+    }
+
+    ~PdfDocumentReader() override
+    {
+        m_readAhead.reset(); // before m_doc goes away
+    }
+
+    int page() const override { return m_currentPage; }
+
+private:
+    // one page per block
+    bool fillBuffer() override
+    {
+        auto pageText = m_readAhead->next();
+        if (!pageText)
+            return false;
+        m_currentPage++;
+        m_buffer += *pageText;
+        return true;
+    }
+
+    QPdfDocument                   m_doc;
+    std::unique_ptr<PageReadAhead> m_readAhead;
+    int                            m_currentPage = 0;
+};
+#else
+/* PDFium is not thread-safe, not even across separate documents, and the parser threads may be
+ * reading several PDFs at once. Every call into it must hold this lock. */
+Q_CONSTINIT static QMutex s_pdfiumMutex;
+
+struct PdfiumDocumentCloser {
+    void operator()(FPDF_DOCUMENT doc) const
+    {
+        QMutexLocker locker(&s_pdfiumMutex);
+        FPDF_CloseDocument(doc);
+    }
+};
+
+class PdfDocumentReader final : public DocumentReader {
+public:
+    explicit PdfDocumentReader(DocumentInfo info)
+        : DocumentReader(std::move(info), /*blocksSplitWords*/ false)
+    {
+        QString path = m_info.file.canonicalFilePath();
+        Metadata metadata;
+        int nPages;
+        {
+            QMutexLocker locker(&s_pdfiumMutex);
+            m_doc.reset(FPDF_LoadDocument(path.toUtf8().constData(), nullptr));
+            if (!m_doc)
+                throw std::runtime_error(fmt::format("Failed to load PDF: {}", path));
+
+            // Extract metadata
+            metadata = {
+                .title    = getMetadata("Title"   ),
+                .author   = getMetadata("Author"  ),
+                .subject  = getMetadata("Subject" ),
+                .keywords = getMetadata("Keywords"),
+            };
+            nPages = FPDF_GetPageCount(m_doc.get());
+        }
+        m_readAhead = std::make_unique<PageReadAhead>(nPages, [this](int page) {
+            return extractTextFromPage(page);
+        });
+        postInit(std::move(metadata));
+    }
+
+    ~PdfDocumentReader() override
+    {
+        m_readAhead.reset(); // before m_doc goes away
+    }
+
+    int page() const override { return m_currentPage; }
+
+private:
+    // one page per block
+    bool fillBuffer() override
+    {
+        auto pageText = m_readAhead->next();
+        if (!pageText)
+            return false;
+        m_currentPage++;
+        m_buffer += *pageText;
+        return true;
+    }
+
+    QString getMetadata(FPDF_BYTESTRING key)
+    {
+        // FPDF_GetMetaText includes a 2-byte null terminator
+        ulong nBytes = FPDF_GetMetaText(m_doc.get(), key, nullptr, 0);
+        if (nBytes <= sizeof (FPDF_WCHAR))
+            return { "" };
+        QByteArray buffer(nBytes, Qt::Uninitialized);
+        ulong nResultBytes = FPDF_GetMetaText(m_doc.get(), key, buffer.data(), buffer.size());
+        Q_ASSERT(nResultBytes % 2 == 0);
+        Q_ASSERT(nResultBytes <= nBytes);
+        return QString::fromUtf16(reinterpret_cast<const char16_t *>(buffer.data()), nResultBytes / 2 - 1);
+    }
+
+    // runs on the read-ahead thread
+    QString extractTextFromPage(int pageIndex)
+    {
+        QMutexLocker locker(&s_pdfiumMutex);
+
+        FPDF_PAGE page = FPDF_LoadPage(m_doc.get(), pageIndex);
+        if (!page)
+            throw std::runtime_error("Failed to load page.");
+
+        FPDF_TEXTPAGE textPage = FPDFText_LoadPage(page);
+        if (!textPage) {
+            FPDF_ClosePage(page);
+            throw std::runtime_error("Failed to load text page.");
+        }
+
+        QString text;
+        // FPDFText_GetText includes a 2-byte null terminator
+        if (int nChars = FPDFText_CountChars(textPage); nChars > 0) {
+            QByteArray buffer((nChars + 1) * sizeof (FPDF_WCHAR), Qt::Uninitialized);
+            int nResultChars = FPDFText_GetText(textPage, 0, nChars, reinterpret_cast<ushort *>(buffer.data()));
+            Q_ASSERT(nResultChars <= nChars + 1);
+            text = QString::fromUtf16(reinterpret_cast<const char16_t *>(buffer.data()), nResultChars - 1);
+        }
+
+        FPDFText_ClosePage(textPage);
+        FPDF_ClosePage(page);
+        return text;
+    }
+
+    // closed if the constructor throws after loading it
+    std::unique_ptr<std::remove_pointer_t<FPDF_DOCUMENT>, PdfiumDocumentCloser> m_doc;
+    std::unique_ptr<PageReadAhead> m_readAhead;
+    int                            m_currentPage = 0;
+};
+#endif // !defined(GPT4ALL_USE_QTPDF)
+
+class WordDocumentReader final : public DocumentReader {
+public:
+    explicit WordDocumentReader(DocumentInfo info)
+        : DocumentReader(std::move(info), /*blocksSplitWords*/ true)
+        , m_doc(m_info.file.canonicalFilePath().toStdString())
+    {
+        m_doc.open();
+        if (!m_doc.is_open())
+            throw std::runtime_error(fmt::format("Failed to open DOCX: {}", m_info.file.canonicalFilePath()));
+
+        m_paragraph = &m_doc.paragraphs();
+        m_run       = &m_paragraph->runs();
+        // TODO(jared): metadata for Word documents?
+        postInit();
+    }
+
+protected:
+    bool fillBuffer() override
+    {
+        for (;;) {
+            // get a run
+            while (!m_run->has_next()) {
+                // try next paragraph
+                if (!m_paragraph->has_next())
+                    return false;
+
+                m_paragraph->next();
+                m_buffer += u'\n';
+            }
+
+            bool foundText = false;
+            auto &run = m_run->get_node();
+            for (auto node = run.first_child(); node; node = node.next_sibling()) {
+                std::string node_name = node.name();
+                if (node_name == "w:t") {
+                    const char *text = node.text().get();
+                    if (*text) {
+                        foundText = true;
+                        m_buffer += QUtf8StringView(text);
+                    }
+                } else if (node_name == "w:br") {
+                    m_buffer += u'\n';
+                } else if (node_name == "w:tab") {
+                    m_buffer += u'\t';
+                }
+            }
+
+            m_run->next();
+            if (foundText) return true;
+        }
+    }
+
+    duckx::Document   m_doc;
+    duckx::Paragraph *m_paragraph;
+    duckx::Run       *m_run;
+};
+
+class TxtDocumentReader final : public DocumentReader {
+public:
+    explicit TxtDocumentReader(DocumentInfo info)
+        : DocumentReader(std::move(info), /*blocksSplitWords*/ true)
+        , m_file(m_info.file.canonicalFilePath())
+    {
+        if (!m_file.open(QIODevice::ReadOnly))
+            throw std::runtime_error(fmt::format("Failed to open text file: {}", m_file.fileName()));
+
+        m_stream.setDevice(&m_file);
+        postInit();
+    }
+
+protected:
+    bool fillBuffer() override
+    {
+        static constexpr qint64 BLOCK_SIZE = 64 * 1024; // characters
+
+        if (getError() || m_stream.atEnd())
+            return false;
+        m_buffer += m_stream.read(BLOCK_SIZE);
+        return !getError();
+    }
+
+    std::optional<ChunkStreamer::Status> getError() const override
+    {
+        if (m_file.binarySeen())
+            return ChunkStreamer::Status::BINARY_SEEN;
+        if (m_file.error())
+            return ChunkStreamer::Status::ERROR;
+        return std::nullopt;
+    }
+
+    BinaryDetectingFile m_file;
+    QTextStream m_stream;
+};
+
+// reads the text that was stored after a document was parsed, see Database::storeDocumentText
+class StoredTextReader final : public DocumentReader {
+public:
+    StoredTextReader(DocumentInfo info, const StoredDocumentText &stored)
+        : StoredTextReader(std::move(info), stored, readPages(stored.pages)) {}
+
+    int page() const override { return m_currentPage; }
+
+private:
+    StoredTextReader(DocumentInfo info, const StoredDocumentText &stored, QList<std::pair<qint64, qint32>> pages)
+        // like the original reader, don't join words across pages
+        : DocumentReader(std::move(info), /*blocksSplitWords*/ pages.size() <= 1, /*recordText*/ false)
+        , m_pages(std::move(pages))
+    {
+        QDataStream in(stored.text);
+        in.setVersion(QDataStream::Qt_6_0);
+        while (!in.atEnd()) {
+            QByteArray segment;
+            in >> segment;
+            QByteArray text = qUncompress(segment);
+            if (in.status() != QDataStream::Ok || (text.isEmpty() && !segment.isEmpty()))
+                throw std::runtime_error(fmt::format("Failed to decompress stored text of: {}",
+                                                     m_info.file.canonicalFilePath()));
+            m_text += QString::fromUtf8(text);
+        }
+
+        qint64 prev = 0;
+        for (const auto &[offset, _]: std::as_const(m_pages)) {
+            if (offset < prev || offset > m_text.size())
+                throw std::runtime_error(fmt::format("Invalid pages in stored text of: {}",
+                                                     m_info.file.canonicalFilePath()));
+            prev = offset;
+        }
+
+        postInit({ stored.title, stored.author, stored.subject, stored.keywords });
+    }
+
+    static QList<std::pair<qint64, qint32>> readPages(const QByteArray &data)
+    {
+        QList<std::pair<qint64, qint32>> pages;
+        QDataStream in(data);
+        in.setVersion(QDataStream::Qt_6_0);
+        in >> pages;
+        if (in.status() != QDataStream::Ok)
+            throw std::runtime_error("Failed to read pages of stored text");
+        return pages;
+    }
+
+    // one block per page, or blocks of BLOCK_SIZE if the document has no pages
+    bool fillBuffer() override
+    {
+        static constexpr qsizetype BLOCK_SIZE = 64 * 1024; // characters
+
+        qsizetype end;
+        if (m_pages.size() > 1) {
+            if (m_nextPage >= m_pages.size())
+                return false;
+            m_currentPage = m_pages[m_nextPage].second;
+            m_nextPage++;
+            end = m_nextPage < m_pages.size() ? m_pages[m_nextPage].first : m_text.size();
+        } else {
+            if (m_pos >= m_text.size())
+                return false;
+            if (!m_pages.isEmpty())
+                m_currentPage = m_pages.first().second;
+            end = qMin(m_pos + BLOCK_SIZE, m_text.size());
+        }
+        m_buffer += QStringView(m_text).sliced(m_pos, end - m_pos);
+        m_pos = end;
+        return true;
+    }
+
+    QString                          m_text;
+    QList<std::pair<qint64, qint32>> m_pages;
+    qsizetype                        m_nextPage = 0;
+    qsizetype                        m_pos = 0;
+    int                              m_currentPage = -1;
+};
+
+} // namespace
+
+std::unique_ptr<DocumentReader> DocumentReader::fromDocument(DocumentInfo doc)
+{
+    if (doc.isPdf())
+        return std::make_unique<PdfDocumentReader>(std::move(doc));
+    if (doc.isDocx())
+        return std::make_unique<WordDocumentReader>(std::move(doc));
+    return std::make_unique<TxtDocumentReader>(std::move(doc));
+}
+
+ChunkStreamer::ChunkStreamer(DocumentInfo doc, int chunkSize, EmbeddingTokenizer tokenizer,
+                             const StoredDocumentText *storedText)
+    : m_reader(storedText ? std::unique_ptr<DocumentReader>(std::make_unique<StoredTextReader>(std::move(doc), *storedText))
+                          : DocumentReader::fromDocument(std::move(doc)))
+    , m_chunkSize(chunkSize)
+    , m_tokenizer(std::move(tokenizer))
+{
+    auto &metadata = m_reader->metadata();
+    m_title    = metadata.title;
+    m_author   = metadata.author;
+    m_subject  = metadata.subject;
+    m_keywords = metadata.keywords;
+
+    // words are appended in place, room for a full chunk plus the word that overflows it
+    m_chunk.reserve(2 * (chunkSize + 1));
+}
+
+ChunkStreamer::~ChunkStreamer() = default;
+
+std::optional<StoredDocumentText> ChunkStreamer::takeText()
+{
+    return m_reader->takeText();
+}
+
+ChunkStreamer::Status ChunkStreamer::step(QList<ParsedChunk> &chunks, int maxChunks)
+{
+    const int maxChunkSize = m_chunkSize;
+
+    for (;;) {
+        if (auto error = m_reader->getError())
+            return *error;
+
+        // get a word, if needed
+        std::optional<QStringView> word = QStringView(); // empty view to disable EOF logic
+        if (m_chunk.length() < maxChunkSize + 1) {
+            word = m_reader->word();
+            if (m_chunk.isEmpty())
+                m_page = m_reader->page(); // page number of first word
+
+            if (word) {
+                m_chunk += *word;
+                m_chunk += u' ';
+                m_reader->nextWord();
+                m_nChunkWords++;
+            }
+        }
+
+        if (!word || m_chunk.length() >= maxChunkSize + 1) { // +1 for trailing space
+            if (!m_chunk.isEmpty()) {
+                int nThisChunkWords = 0;
+                QString chunk;
+
+                // handle overlength chunks
+                if (m_chunk.length() > maxChunkSize + 1) {
+                    // find the final space
+                    qsizetype chunkEnd = m_chunk.lastIndexOf(u' ', -2);
+
+                    qsizetype spaceSize;
+                    if (chunkEnd >= 0) {
+                        // slice off the last word
+                        spaceSize = 1;
+                        Q_ASSERT(m_nChunkWords >= 1);
+                        // one word left
+                        nThisChunkWords = m_nChunkWords - 1;
+                        m_nChunkWords = 1;
+                    } else {
+                        // slice the overlong word
+                        spaceSize = 0;
+                        chunkEnd = maxChunkSize;
+                        // partial word left, don't count it
+                        nThisChunkWords = m_nChunkWords;
+                        m_nChunkWords = 0;
+                    }
+                    // consume the first part
+                    chunk = m_chunk.first(chunkEnd);
+                    // keep the second part in place, excluding space if any
+                    m_chunk.remove(0, chunkEnd + spaceSize);
+                } else {
+                    nThisChunkWords = m_nChunkWords;
+                    m_nChunkWords = 0;
+                    // consume the whole chunk, excluding space
+                    chunk = m_chunk.first(m_chunk.length() - 1);
+                    // there is no second part, keep the allocation
+                    m_chunk.truncate(0);
+                }
+                Q_ASSERT(chunk.length() <= maxChunkSize);
+
+                int nTokens = 0;
+                if (m_tokenizer.countTokens) {
+                    for (;;) {
+                        nTokens = m_tokenizer.countTokens(chunk);
+                        if (nTokens <= m_tokenizer.maxTokens)
+                            break;
+
+                        // too long for the embedding model, give the tail to the next chunk
+                        qsizetype keep = qMax(qsizetype(1), chunk.length() * m_tokenizer.maxTokens / nTokens);
+                        qsizetype cut = chunk.lastIndexOf(u' ', keep);
+                        qsizetype spaceSize = 1;
+                        if (cut <= 0) {
+                            cut = keep;
+                            spaceSize = 0;
+                        }
+                        auto tail = QStringView(chunk).sliced(cut + spaceSize);
+                        const int nTailWords = int(tail.count(u' ')) + 1;
+                        nThisChunkWords = qMax(0, nThisChunkWords - nTailWords);
+                        m_nChunkWords += nTailWords;
+                        m_chunk.prepend(u' ');
+                        m_chunk.prepend(tail);
+                        chunk.truncate(cut);
+                    }
+                }
+
+                chunks.append({ std::move(chunk), m_page, nThisChunkWords, nTokens });
+            }
+
+            // the token limit can leave part of the last chunk behind
+            if (!word && m_chunk.isEmpty())
+                return Status::DOC_COMPLETE;
+        }
+
+        if (chunks.size() >= maxChunks)
+            return Status::INTERRUPTED;
+    }
+}
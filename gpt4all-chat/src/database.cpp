@@ -1,28 +1,30 @@
 #include "database.h"
 
+#include "folderwatcher.h"
 #include "mysettings.h"
+#include "servermetrics.h"
 #include "utils.h" // IWYU pragma: keep
 
-#include <duckx/duckx.hpp>
-#include <fmt/format.h>
 #include <usearch/index.hpp>
 #include <usearch/index_plugins.hpp>
 
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QDir>
 #include <QDirIterator>
 #include <QFile>
-#include <QFileSystemWatcher>
 #include <QFlags>
 #include <QIODevice>
 #include <QKeyValueIterator>
+#include <QMutexLocker>
 #include <QRegularExpression>
+#include <QScopeGuard>
 #include <QSqlError>
 #include <QSqlQuery>
-#include <QTextStream>
+#include <QStringTokenizer>
+#include <QThread>
 #include <QTimer>
 #include <QMap>
-#include <QUtf8StringView>
 #include <QVariant>
 #include <QtLogging>
 #include <QtMinMax>
@@ -30,17 +32,10 @@
 
 #include <algorithm>
 #include <cmath>
+#include <limits>
 #include <optional>
 #include <stdexcept>
-
-#ifdef GPT4ALL_USE_QTPDF
-#   include <QPdfDocument>
-#   include <QPdfSelection>
-#else
-#   include <fpdfview.h>
-#   include <fpdf_doc.h>
-#   include <fpdf_text.h>
-#endif
+#include <utility>
 
 using namespace Qt::Literals::StringLiterals;
 namespace ranges = std::ranges;
@@ -50,56 +45,127 @@ namespace us = unum::usearch;
 //#define DEBUG_EXAMPLE
 
 
-namespace {
-
-/* QFile that checks input for binary data. If seen, it fails the read and returns true
- * for binarySeen(). */
-class BinaryDetectingFile: public QFile {
-public:
-    using QFile::QFile;
-
-    bool binarySeen() const { return m_binarySeen; }
-
-protected:
-    qint64 readData(char *data, qint64 maxSize) override {
-        qint64 res = QFile::readData(data, maxSize);
-        return checkData(data, res);
-    }
-
-    qint64 readLineData(char *data, qint64 maxSize) override {
-        qint64 res = QFile::readLineData(data, maxSize);
-        return checkData(data, res);
-    }
-
-private:
-    qint64 checkData(const char *data, qint64 size) {
-        Q_ASSERT(!isTextModeEnabled()); // We need raw bytes from the underlying QFile
-        if (size != -1 && !m_binarySeen) {
-            for (qint64 i = 0; i < size; i++) {
-                /* Control characters we should never see in plain text:
-                 * 0x00 NUL - 0x06 ACK
-                 * 0x0E SO  - 0x1A SUB
-                 * 0x1C FS  - 0x1F US */
-                auto c = static_cast<unsigned char>(data[i]);
-                if (c < 0x07 || (c >= 0x0E && c < 0x1B) || (c >= 0x1C && c < 0x20)) {
-                    m_binarySeen = true;
-                    break;
-                }
-            }
-        }
-        return m_binarySeen ? -1 : size;
-    }
+static int s_batchSize = 100;
+// number of chunk batches that may wait for the database thread before parser threads block
+static const qsizetype s_maxQueuedBatches = 16;
+// number of chunks that may be waiting on the embedding model before we stop inserting new ones
+static const size_t s_maxPendingEmbeddings = 10 * s_batchSize;
+// number of queued documents that switches to bulk ingest, see Database::beginBulkIngest
+static const size_t s_bulkIngestThreshold = 200;
+// rows per multi-row chunk insert, 12 bound values each stays well below SQLITE_MAX_VARIABLE_NUMBER
+static const int s_chunkInsertRows = 64;
+// msecs a document whose file went missing is kept around in case it turns up under another path
+static const qint64 s_orphanGracePeriod = 5000;
+// rows of a table looked at by one slice of the consistency check, see Database::checkConsistency
+static const int s_checkSliceRows = 200;
+// msecs between slices of the consistency check, so it stays out of the way of queries
+static const int s_checkSliceInterval = 250;
+// msecs between consistency checks of the whole database
+static const int s_checkPassInterval = 60 * 60 * 1000;
+// msecs between reports of the ingestion metrics, see IngestMetrics
+static const int s_metricsInterval = 10000;
+
+// the statements that both a new database and the upgrade of a version 3 database run
+static const QString CREATE_DOCUMENTS_CONTENT_HASH_INDEX_SQL = uR"(
+    create index documents_content_hash on documents(content_hash);
+)"_s;
 
-    bool m_binarySeen = false;
-};
+static const QString CREATE_DOCUMENT_TEXTS_SQL = uR"(
+    create table document_texts(
+        document_id integer primary key,
+        title       text,
+        author      text,
+        subject     text,
+        keywords    text,
+        pages       blob not null,
+        text        blob not null,
+        foreign key(document_id) references documents(id)
+    );
+)"_s;
 
-} // namespace
+static const QString CREATE_CONSISTENCY_CHECK_SQL = uR"(
+    create table consistency_check(
+        id      integer primary key check(id = 0),
+        stage   integer not null,
+        last_id integer not null
+    );
+)"_s;
 
-static int s_batchSize = 100;
+static const QStringList FOLDER_STATISTICS_SQL = {
+    uR"(
+        create index chunks_document_id on chunks(document_id);
+    )"_s, uR"(
+        create table folder_statistics(
+            folder_id integer primary key,
+            documents integer default 0 not null,
+            chunks    integer default 0 not null,
+            words     integer default 0 not null,
+            tokens    integer default 0 not null,
+            foreign key(folder_id) references folders(id)
+        );
+    )"_s,
+    // keep folder_statistics up to date, so the statistics don't have to be counted from the chunks
+    uR"(
+        create trigger folders_statistics_insert after insert on folders begin
+            insert into folder_statistics(folder_id) values(new.id);
+        end;
+    )"_s, uR"(
+        create trigger folders_statistics_delete after delete on folders begin
+            delete from folder_statistics where folder_id = old.id;
+        end;
+    )"_s, uR"(
+        create trigger documents_statistics_insert after insert on documents begin
+            update folder_statistics set documents = documents + 1 where folder_id = new.folder_id;
+        end;
+    )"_s,
+    // chunks are normally deleted before their document, but the ones left are not counted anymore either
+    uR"(
+        create trigger documents_statistics_delete after delete on documents begin
+            update folder_statistics set
+                documents = documents - 1,
+                chunks    = chunks - (select count(*) from chunks where document_id = old.id),
+                words     = words - (select coalesce(sum(words), 0) from chunks where document_id = old.id),
+                tokens    = tokens - (select coalesce(sum(tokens), 0) from chunks where document_id = old.id)
+            where folder_id = old.folder_id;
+        end;
+    )"_s, uR"(
+        create trigger documents_statistics_move after update of folder_id on documents
+        when new.folder_id != old.folder_id begin
+            update folder_statistics set
+                documents = documents - 1,
+                chunks    = chunks - (select count(*) from chunks where document_id = old.id),
+                words     = words - (select coalesce(sum(words), 0) from chunks where document_id = old.id),
+                tokens    = tokens - (select coalesce(sum(tokens), 0) from chunks where document_id = old.id)
+            where folder_id = old.folder_id;
+            update folder_statistics set
+                documents = documents + 1,
+                chunks    = chunks + (select count(*) from chunks where document_id = new.id),
+                words     = words + (select coalesce(sum(words), 0) from chunks where document_id = new.id),
+                tokens    = tokens + (select coalesce(sum(tokens), 0) from chunks where document_id = new.id)
+            where folder_id = new.folder_id;
+        end;
+    )"_s, uR"(
+        create trigger chunks_statistics_insert after insert on chunks begin
+            update folder_statistics set
+                chunks = chunks + 1,
+                words  = words + new.words,
+                tokens = tokens + new.tokens
+            where folder_id = (select folder_id from documents where id = new.document_id);
+        end;
+    )"_s, uR"(
+        create trigger chunks_statistics_delete after delete on chunks begin
+            update folder_statistics set
+                chunks = chunks - 1,
+                words  = words - old.words,
+                tokens = tokens - old.tokens
+            where folder_id = (select folder_id from documents where id = old.document_id);
+        end;
+    )"_s,
+};
 
-static const QString INIT_DB_SQL[] = {
-    // automatically free unused disk space
-    u"pragma auto_vacuum = FULL;"_s,
+static const QStringList INIT_DB_SQL = QStringList {
+    // free unused disk space on demand, see Database::incrementalVacuum
+    u"pragma auto_vacuum = INCREMENTAL;"_s,
     // create tables
     uR"(
         create table chunks(
@@ -159,6 +225,7 @@ static const QString INIT_DB_SQL[] = {
             folder_id     integer not null,
             document_time integer not null,
             document_path text unique not null,
+            content_hash  blob,
             foreign key(folder_id) references folders(id)
         );
     )"_s, uR"(
@@ -173,21 +240,52 @@ static const QString INIT_DB_SQL[] = {
             unique(model, chunk_id)
         );
     )"_s,
+    CREATE_DOCUMENTS_CONTENT_HASH_INDEX_SQL,
+    CREATE_DOCUMENT_TEXTS_SQL,
+    CREATE_CONSISTENCY_CHECK_SQL,
+} + FOLDER_STATISTICS_SQL;
+
+// a version 3 database is upgraded in place, see Database::upgradeDb
+static const QStringList UPGRADE_DB_V3_SQL = QStringList {
+    uR"(
+        alter table documents add column content_hash blob;
+    )"_s,
+    CREATE_DOCUMENTS_CONTENT_HASH_INDEX_SQL,
+    CREATE_DOCUMENT_TEXTS_SQL,
+    CREATE_CONSISTENCY_CHECK_SQL,
+} + FOLDER_STATISTICS_SQL + QStringList {
+    uR"(
+        insert into folder_statistics(folder_id, documents, chunks, words, tokens)
+        select f.id,
+               (select count(*) from documents d where d.folder_id = f.id),
+               count(c.id), coalesce(sum(c.words), 0), coalesce(sum(c.tokens), 0)
+        from folders f
+        left join documents d on d.folder_id = f.id
+        left join chunks c on c.document_id = d.id
+        group by f.id;
+    )"_s,
 };
 
-static const QString INSERT_CHUNK_SQL = uR"(
+static const QString INSERT_CHUNKS_SQL = uR"(
     insert into chunks(document_id, chunk_text,
-        file, title, author, subject, keywords, page, line_from, line_to, words)
-        values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
+        file, title, author, subject, keywords, page, line_from, line_to, words, tokens)
+        values %1
         returning id;
 )"_s;
 
-static const QString INSERT_CHUNK_FTS_SQL = uR"(
-        insert into chunks_fts(document_id, chunk_text,
+static const QString INSERT_CHUNKS_FTS_SQL = uR"(
+        insert into chunks_fts(rowid, document_id, chunk_text,
             file, title, author, subject, keywords)
-            values(?, ?, ?, ?, ?, ?, ?);
+            values %1;
 )"_s;
 
+static QString multiRowValues(int nRows, int nColumns)
+{
+    QString row = u'(' + QString(u"?, "_s).repeated(nColumns - 1) + u"?)"_s;
+    QStringList rows(nRows, row);
+    return rows.join(u", "_s);
+}
+
 static const QString SELECT_CHUNKED_DOCUMENTS_SQL[] = {
     uR"(
         select distinct document_id from chunks;
@@ -209,6 +307,75 @@ static const QString DELETE_CHUNKS_SQL[] = {
     )"_s,
 };
 
+static const QString SELECT_DOCUMENT_CHUNKS_SQL = uR"(
+    select id, chunk_text, title, author, subject, keywords, page, words, tokens
+    from chunks where document_id = ? order by id;
+)"_s;
+
+static const QString COPY_EMBEDDING_SQL = uR"(
+    insert into embeddings(model, folder_id, chunk_id, embedding)
+    select model, ?, ?, embedding from embeddings where chunk_id = ?;
+)"_s;
+
+// chunks_fts is an external content table, so its entries must be deleted using the old values
+static const QString DELETE_CHUNKS_FTS_ENTRIES_SQL = uR"(
+    insert into chunks_fts(chunks_fts, rowid, document_id, chunk_text, file, title, author, subject, keywords)
+    select 'delete', id, document_id, chunk_text, file, title, author, subject, keywords
+    from chunks where document_id = ? and id < ?;
+)"_s;
+
+static const QString UPDATE_CHUNKS_FILE_SQL = uR"(
+    update chunks set file = ? where document_id = ?;
+)"_s;
+
+static const QString INSERT_CHUNKS_FTS_ENTRIES_SQL = uR"(
+    insert into chunks_fts(rowid, document_id, chunk_text, file, title, author, subject, keywords)
+    select id, document_id, chunk_text, file, title, author, subject, keywords
+    from chunks where document_id = ? and id < ?;
+)"_s;
+
+static const QString DELETE_CHUNK_FTS_ENTRY_SQL = uR"(
+    insert into chunks_fts(chunks_fts, rowid, document_id, chunk_text, file, title, author, subject, keywords)
+    select 'delete', id, document_id, chunk_text, file, title, author, subject, keywords
+    from chunks where id = ?;
+)"_s;
+
+static const QString DELETE_CHUNK_SQL[] = {
+    uR"(
+        delete from embeddings where chunk_id = ?;
+    )"_s, uR"(
+        delete from chunks where id = ?;
+    )"_s,
+};
+
+static const QString UPDATE_CHUNK_PAGE_SQL = uR"(
+    update chunks set page = ? where id = ?;
+)"_s;
+
+// the chunks from ftsEndId on are not in the fts index yet, so only the ones before it are updated there
+static bool renameChunks(QSqlQuery &q, int document_id, const QString &file, int ftsEndId)
+{
+    if (!q.prepare(DELETE_CHUNKS_FTS_ENTRIES_SQL))
+        return false;
+    q.addBindValue(document_id);
+    q.addBindValue(ftsEndId);
+    if (!q.exec())
+        return false;
+    if (!q.prepare(UPDATE_CHUNKS_FILE_SQL))
+        return false;
+    q.addBindValue(file);
+    q.addBindValue(document_id);
+    if (!q.exec())
+        return false;
+    if (!q.prepare(INSERT_CHUNKS_FTS_ENTRIES_SQL))
+        return false;
+    q.addBindValue(document_id);
+    q.addBindValue(ftsEndId);
+    if (!q.exec())
+        return false;
+    return true;
+}
+
 static const QString SELECT_CHUNKS_BY_DOCUMENT_SQL = uR"(
     select id from chunks WHERE document_id = ?;
 )"_s;
@@ -223,25 +390,40 @@ static const QString SELECT_CHUNKS_SQL = uR"(
     where c.id in (%1);
 )"_s;
 
+// a page of the chunks that lack an embedding, keyed by chunk id, see Database::resumeUncompletedEmbeddings
 static const QString SELECT_UNCOMPLETED_CHUNKS_SQL = uR"(
-    select co.name, co.embedding_model, c.id, d.folder_id, c.chunk_text
+    select co.embedding_model, c.id, d.folder_id, c.chunk_text
     from chunks c
     join documents d on d.id = c.document_id
-    join folders f on f.id = d.folder_id
-    join collection_items ci on ci.folder_id = f.id
+    join collection_items ci on ci.folder_id = d.folder_id
     join collections co on co.id = ci.collection_id and co.embedding_model is not null
-    where not exists(
+    where c.id > ? and c.id <= ? and not exists(
         select 1
         from embeddings e
         where e.chunk_id = c.id and e.model = co.embedding_model
-    );
+    )
+    order by c.id
+    limit ?;
+)"_s;
+
+static const QString COUNT_UNCOMPLETED_CHUNKS_SQL = uR"(
+    select folder_id, count(*) from (
+        select distinct co.embedding_model, c.id, d.folder_id
+        from chunks c
+        join documents d on d.id = c.document_id
+        join collection_items ci on ci.folder_id = d.folder_id
+        join collections co on co.id = ci.collection_id and co.embedding_model is not null
+        where not exists(
+            select 1
+            from embeddings e
+            where e.chunk_id = c.id and e.model = co.embedding_model
+        )
+    )
+    group by folder_id;
 )"_s;
 
 static const QString SELECT_COUNT_CHUNKS_SQL = uR"(
-    select count(c.id)
-    from chunks c
-    join documents d on d.id = c.document_id
-    where d.folder_id = ?;
+    select chunks from folder_statistics where folder_id = ?;
 )"_s;
 
 static const QString SELECT_CHUNKS_FTS_SQL = uR"(
@@ -264,29 +446,49 @@ static const QString SELECT_CHUNKS_FTS_SQL = uR"(
 // struct compared by embedding key, can be extended with additional unique data
 NAMED_PAIR(EmbeddingKey, QString, embedding_model, int, chunk_id)
 
-namespace {
-    struct IncompleteChunk: EmbeddingKey { int folder_id; QString text; };
-} // namespace
-
-static bool selectAllUncompletedChunks(QSqlQuery &q, QHash<IncompleteChunk, QStringList> &chunks)
+static bool selectUncompletedChunks(QSqlQuery &q, int after_chunk_id, int last_chunk_id, int limit,
+                                    QList<EmbeddingChunk> *chunks)
 {
-    if (!q.exec(SELECT_UNCOMPLETED_CHUNKS_SQL))
+    if (!q.prepare(SELECT_UNCOMPLETED_CHUNKS_SQL))
+        return false;
+    q.addBindValue(after_chunk_id);
+    q.addBindValue(last_chunk_id);
+    q.addBindValue(limit);
+    if (!q.exec())
         return false;
     while (q.next()) {
-        QString collection = q.value(0).toString();
-        IncompleteChunk ic {
-            /*EmbeddingKey*/ {
-                .embedding_model = q.value(1).toString(),
-                .chunk_id        = q.value(2).toInt(),
-            },
-            /*folder_id =*/ q.value(3).toInt(),
-            /*text      =*/ q.value(4).toString(),
-        };
-        chunks[ic] << collection;
+        chunks->append({
+            /*model     =*/ q.value(0).toString(),
+            /*folder_id =*/ q.value(2).toInt(),
+            /*chunk_id  =*/ q.value(1).toInt(),
+            /*chunk     =*/ q.value(3).toString(),
+        });
     }
     return true;
 }
 
+// a folder in more than one collection with the same embedding model lists its chunks twice
+static void dropDuplicateChunks(QList<EmbeddingChunk> &chunks)
+{
+    QSet<EmbeddingKey> seen;
+    chunks.removeIf([&seen](const EmbeddingChunk &c) {
+        EmbeddingKey key { .embedding_model = c.model, .chunk_id = c.chunk_id };
+        if (seen.contains(key))
+            return true;
+        seen << key;
+        return false;
+    });
+}
+
+static bool countUncompletedChunks(QSqlQuery &q, QHash<int, int> *counts)
+{
+    if (!q.exec(COUNT_UNCOMPLETED_CHUNKS_SQL))
+        return false;
+    while (q.next())
+        counts->insert(q.value(0).toInt(), q.value(1).toInt());
+    return true;
+}
+
 static bool selectCountChunks(QSqlQuery &q, int folder_id, int &count)
 {
     if (!q.prepare(SELECT_COUNT_CHUNKS_SQL))
@@ -370,6 +572,94 @@ static const QString FTS_REBUILD_SQL = uR"(
     insert into chunks_fts(chunks_fts) values('rebuild');
 )"_s;
 
+// the chunks inserted during a bulk ingest, see Database::endBulkIngest
+static const QString INSERT_NEW_CHUNKS_FTS_ENTRIES_SQL = uR"(
+    insert into chunks_fts(rowid, document_id, chunk_text, file, title, author, subject, keywords)
+    select id, document_id, chunk_text, file, title, author, subject, keywords
+    from chunks where id >= ?;
+)"_s;
+
+static const QString SELECT_MAX_CHUNK_ID_SQL = uR"(
+    select coalesce(max(id), 0) from chunks;
+)"_s;
+
+static const QString SELECT_CONSISTENCY_CHECK_SQL = uR"(
+    select stage, last_id from consistency_check;
+)"_s;
+
+static const QString UPDATE_CONSISTENCY_CHECK_SQL = uR"(
+    replace into consistency_check(id, stage, last_id) values(0, ?, ?);
+)"_s;
+
+// the last key of the next slice of each table, in the order they are checked
+static const QString CHECK_SLICE_END_SQL[] = {
+    uR"(
+        select max(id) from (select id from documents where id > ? order by id limit ?);
+    )"_s, uR"(
+        select max(document_id) from (
+            select document_id from document_texts where document_id > ? order by document_id limit ?
+        );
+    )"_s, uR"(
+        select max(id) from (select id from chunks where id > ? order by id limit ?);
+    )"_s, uR"(
+        select max(rowid) from (select rowid from embeddings where rowid > ? order by rowid limit ?);
+    )"_s,
+};
+
+static const QString CHECK_DOCUMENTS_SQL = uR"(
+    select d.id, d.document_path, f.id is null
+    from documents d
+    left join folders f on f.id = d.folder_id
+    where d.id > ? and d.id <= ?;
+)"_s;
+
+static const QString DELETE_ORPHANED_DOCUMENT_TEXTS_SQL = uR"(
+    delete from document_texts
+    where document_id > ? and document_id <= ?
+        and not exists(select 1 from documents d where d.id = document_id);
+)"_s;
+
+static const QString SELECT_ORPHANED_CHUNKS_SQL = uR"(
+    select c.id
+    from chunks c
+    where c.id > ? and c.id <= ?
+        and not exists(select 1 from documents d where d.id = c.document_id);
+)"_s;
+
+static const QString SELECT_CHUNK_TEXTS_SQL = uR"(
+    select id, chunk_text from chunks where id > ? and id <= ?;
+)"_s;
+
+static const QString SELECT_CHUNK_FTS_MATCH_SQL = uR"(
+    select 1 from chunks_fts where chunks_fts match ? and rowid = ?;
+)"_s;
+
+static const QString INSERT_CHUNK_FTS_ENTRY_SQL = uR"(
+    insert into chunks_fts(rowid, document_id, chunk_text, file, title, author, subject, keywords)
+    select id, document_id, chunk_text, file, title, author, subject, keywords
+    from chunks where id = ?;
+)"_s;
+
+static const QString DELETE_ORPHANED_EMBEDDINGS_SQL = uR"(
+    delete from embeddings
+    where rowid > ? and rowid <= ? and (
+        not exists(select 1 from chunks c where c.id = chunk_id)
+        or not exists(select 1 from folders f where f.id = folder_id)
+    );
+)"_s;
+
+static const QString CONNECTION_PRAGMAS_SQL[] = {
+    // readers don't block the writer, and a commit is one sequential append to the log
+    u"pragma journal_mode = WAL;"_s,
+    // safe in WAL mode: a power loss can roll back the last commits but not corrupt the db
+    u"pragma synchronous = NORMAL;"_s,
+};
+
+static const QString SELECT_AUTO_VACUUM_SQL = u"pragma auto_vacuum;"_s;
+static const QString SET_AUTO_VACUUM_INCREMENTAL_SQL = u"pragma auto_vacuum = INCREMENTAL;"_s;
+static const QString VACUUM_SQL = u"vacuum;"_s;
+static const QString INCREMENTAL_VACUUM_SQL = u"pragma incremental_vacuum;"_s;
+
 static bool addCollection(QSqlQuery &q, const QString &collection_name, const QDateTime &start_update,
                           const QDateTime &last_update, const QString &embedding_model, CollectionItem &item)
 {
@@ -537,6 +827,14 @@ static const QString FOLDER_REMOVE_ALL_DOCS_SQL[] = {
             join folders f on f.id = d.folder_id
             where f.path = ?
         );
+    )"_s, uR"(
+        delete from document_texts
+        where document_id in (
+            select d.id
+            from documents d
+            join folders f on f.id = d.folder_id
+            where f.path = ?
+        );
     )"_s, uR"(
         delete from documents
         where id in (
@@ -640,13 +938,24 @@ static bool sqlPruneCollections(QSqlQuery &q)
 }
 
 static const QString INSERT_DOCUMENTS_SQL = uR"(
-    insert into documents(folder_id, document_time, document_path) values(?, ?, ?);
+    insert into documents(folder_id, document_time, document_path, content_hash) values(?, ?, ?, ?);
     )"_s;
 
-static const QString UPDATE_DOCUMENT_TIME_SQL = uR"(
-    update documents set document_time = ? where id = ?;
+static const QString UPDATE_DOCUMENT_SQL = uR"(
+    update documents set document_time = ?, content_hash = ? where id = ?;
     )"_s;
 
+static const QString RELINK_DOCUMENT_SQL[] = {
+    uR"(
+        update documents set folder_id = ?, document_time = ?, document_path = ? where id = ?;
+    )"_s, uR"(
+        update embeddings set folder_id = ?
+        where chunk_id in (
+            select id from chunks where document_id = ?
+        );
+    )"_s,
+};
+
 static const QString DELETE_DOCUMENTS_SQL = uR"(
     delete from documents where id = ?;
     )"_s;
@@ -655,47 +964,155 @@ static const QString SELECT_DOCUMENT_SQL = uR"(
     select id, document_time from documents where document_path = ?;
     )"_s;
 
+static const QString SELECT_DOCUMENT_HASH_SQL = uR"(
+    select content_hash from documents where id = ?;
+    )"_s;
+
+static const QString SELECT_DOCUMENTS_BY_HASH_SQL = uR"(
+    select id, document_path from documents where content_hash = ?;
+    )"_s;
+
+// '0' sorts right after '/', so the range covers exactly the paths below the directory
+static const QString SELECT_DOCUMENTS_UNDER_PATH_SQL = uR"(
+    select id, document_path from documents
+    where document_path = ? or (document_path > ? and document_path < ?);
+    )"_s;
+
+static const QString INSERT_DOCUMENT_TEXT_SQL = uR"(
+    insert or replace into document_texts(document_id, title, author, subject, keywords, pages, text)
+        values(?, ?, ?, ?, ?, ?, ?);
+    )"_s;
+
+static const QString COPY_DOCUMENT_TEXT_SQL = uR"(
+    insert or replace into document_texts(document_id, title, author, subject, keywords, pages, text)
+    select ?, title, author, subject, keywords, pages, text from document_texts where document_id = ?;
+    )"_s;
+
+static const QString DELETE_DOCUMENT_TEXT_SQL = uR"(
+    delete from document_texts where document_id = ?;
+    )"_s;
+
+static const QString SELECT_DOCUMENT_TEXT_SQL = uR"(
+    select title, author, subject, keywords, pages, text from document_texts where document_id = ?;
+    )"_s;
+
 static const QString SELECT_DOCUMENTS_SQL = uR"(
     select id from documents where folder_id = ?;
     )"_s;
 
-static const QString SELECT_ALL_DOCUMENTS_SQL = uR"(
-    select id, document_path from documents;
+static const QString SELECT_ALL_DOCUMENTS_WITH_TEXT_SQL = uR"(
+    select d.id, t.document_id is not null
+    from documents d
+    left join document_texts t on t.document_id = d.id;
     )"_s;
 
-static const QString SELECT_COUNT_STATISTICS_SQL = uR"(
-    select count(distinct d.id), sum(c.words), sum(c.tokens)
-    from documents d
-    left join chunks c on d.id = c.document_id
-    where d.folder_id = ?;
+// maintained by triggers, see FOLDER_STATISTICS_SQL
+static const QString SELECT_ALL_STATISTICS_SQL = uR"(
+    select folder_id, documents, words, tokens from folder_statistics;
     )"_s;
 
-static bool addDocument(QSqlQuery &q, int folder_id, qint64 document_time, const QString &document_path, int *document_id)
+static bool addDocument(QSqlQuery &q, int folder_id, qint64 document_time, const QString &document_path,
+                        const QByteArray &content_hash, int *document_id)
 {
     if (!q.prepare(INSERT_DOCUMENTS_SQL))
         return false;
     q.addBindValue(folder_id);
     q.addBindValue(document_time);
     q.addBindValue(document_path);
+    q.addBindValue(content_hash);
     if (!q.exec())
         return false;
     *document_id = q.lastInsertId().toInt();
     return true;
 }
 
+static bool removeDocumentText(QSqlQuery &q, int document_id)
+{
+    if (!q.prepare(DELETE_DOCUMENT_TEXT_SQL))
+        return false;
+    q.addBindValue(document_id);
+    return q.exec();
+}
+
 static bool removeDocument(QSqlQuery &q, int document_id)
 {
+    if (!removeDocumentText(q, document_id))
+        return false;
     if (!q.prepare(DELETE_DOCUMENTS_SQL))
         return false;
     q.addBindValue(document_id);
     return q.exec();
 }
 
-static bool updateDocument(QSqlQuery &q, int id, qint64 document_time)
+/* The extracted text is stored after a document was parsed, so that it can be chunked again without
+ * parsing it when the chunk size changes. See StoredTextReader. */
+static bool storeDocumentText(QSqlQuery &q, int document_id, const StoredDocumentText &text)
+{
+    if (!q.prepare(INSERT_DOCUMENT_TEXT_SQL))
+        return false;
+    q.addBindValue(document_id);
+    q.addBindValue(text.title);
+    q.addBindValue(text.author);
+    q.addBindValue(text.subject);
+    q.addBindValue(text.keywords);
+    q.addBindValue(text.pages);
+    q.addBindValue(text.text);
+    return q.exec();
+}
+
+static bool copyDocumentText(QSqlQuery &q, int src_document_id, int document_id)
+{
+    if (!q.prepare(COPY_DOCUMENT_TEXT_SQL))
+        return false;
+    q.addBindValue(document_id);
+    q.addBindValue(src_document_id);
+    return q.exec();
+}
+
+static bool selectDocumentText(QSqlQuery &q, int document_id, std::optional<StoredDocumentText> *text)
+{
+    if (!q.prepare(SELECT_DOCUMENT_TEXT_SQL))
+        return false;
+    q.addBindValue(document_id);
+    if (!q.exec())
+        return false;
+    if (q.next()) {
+        *text = StoredDocumentText {
+            .title    = q.value(0).toString(),
+            .author   = q.value(1).toString(),
+            .subject  = q.value(2).toString(),
+            .keywords = q.value(3).toString(),
+            .pages    = q.value(4).toByteArray(),
+            .text     = q.value(5).toByteArray(),
+        };
+    }
+    return true;
+}
+
+static bool updateDocument(QSqlQuery &q, int id, qint64 document_time, const QByteArray &content_hash)
+{
+    if (!q.prepare(UPDATE_DOCUMENT_SQL))
+        return false;
+    q.addBindValue(document_time);
+    q.addBindValue(content_hash);
+    q.addBindValue(id);
+    return q.exec();
+}
+
+// moves a document and its embeddings to a new path and folder, keeping its chunks
+static bool relinkDocument(QSqlQuery &q, int id, int folder_id, qint64 document_time, const QString &document_path)
 {
-    if (!q.prepare(UPDATE_DOCUMENT_TIME_SQL))
+    if (!q.prepare(RELINK_DOCUMENT_SQL[0]))
         return false;
+    q.addBindValue(folder_id);
     q.addBindValue(document_time);
+    q.addBindValue(document_path);
+    q.addBindValue(id);
+    if (!q.exec())
+        return false;
+    if (!q.prepare(RELINK_DOCUMENT_SQL[1]))
+        return false;
+    q.addBindValue(folder_id);
     q.addBindValue(id);
     return q.exec();
 }
@@ -715,30 +1132,55 @@ static bool selectDocument(QSqlQuery &q, const QString &document_path, int *id,
     return true;
 }
 
-static bool selectDocuments(QSqlQuery &q, int folder_id, QList<int> *documentIds)
+// the hash is null for documents indexed before we stored it
+static bool selectDocumentHash(QSqlQuery &q, int id, QByteArray *content_hash)
 {
-    if (!q.prepare(SELECT_DOCUMENTS_SQL))
+    if (!q.prepare(SELECT_DOCUMENT_HASH_SQL))
         return false;
-    q.addBindValue(folder_id);
+    q.addBindValue(id);
+    if (!q.exec())
+        return false;
+    if (q.next())
+        *content_hash = q.value(0).toByteArray();
+    return true;
+}
+
+static bool selectDocumentsByHash(QSqlQuery &q, const QByteArray &content_hash,
+                                  QList<QPair<int, QString>> *documents)
+{
+    if (!q.prepare(SELECT_DOCUMENTS_BY_HASH_SQL))
+        return false;
+    q.addBindValue(content_hash);
     if (!q.exec())
         return false;
     while (q.next())
-        documentIds->append(q.value(0).toInt());
+        documents->append({ q.value(0).toInt(), q.value(1).toString() });
     return true;
 }
 
-static bool selectCountStatistics(QSqlQuery &q, int folder_id, int *total_docs, int *total_words, int *total_tokens)
+static bool selectDocumentsUnderPath(QSqlQuery &q, const QString &path, QList<QPair<int, QString>> *documents)
 {
-    if (!q.prepare(SELECT_COUNT_STATISTICS_SQL))
+    if (!q.prepare(SELECT_DOCUMENTS_UNDER_PATH_SQL))
+        return false;
+    q.addBindValue(path);
+    q.addBindValue(path + u'/');
+    q.addBindValue(path + u'0');
+    if (!q.exec())
+        return false;
+    while (q.next())
+        documents->append({ q.value(0).toInt(), q.value(1).toString() });
+    return true;
+}
+
+static bool selectDocuments(QSqlQuery &q, int folder_id, QList<int> *documentIds)
+{
+    if (!q.prepare(SELECT_DOCUMENTS_SQL))
         return false;
     q.addBindValue(folder_id);
     if (!q.exec())
         return false;
-    if (q.next()) {
-        *total_docs = q.value(0).toInt();
-        *total_words = q.value(1).toInt();
-        *total_tokens = q.value(2).toInt();
-    }
+    while (q.next())
+        documentIds->append(q.value(0).toInt());
     return true;
 }
 
@@ -848,44 +1290,91 @@ bool Database::refreshDocumentIdCache(QSqlQuery &q)
     return true;
 }
 
-bool Database::addChunk(QSqlQuery &q, int document_id, const QString &chunk_text, const QString &file,
-                        const QString &title, const QString &author, const QString &subject, const QString &keywords,
-                        int page, int from, int to, int words, int *chunk_id)
+QSqlQuery &Database::cachedQuery(const QString &sql)
 {
-    if (!q.prepare(INSERT_CHUNK_SQL))
-        return false;
-    q.addBindValue(document_id);
-    q.addBindValue(chunk_text);
-    q.addBindValue(file);
-    q.addBindValue(title);
-    q.addBindValue(author);
-    q.addBindValue(subject);
-    q.addBindValue(keywords);
-    q.addBindValue(page);
-    q.addBindValue(from);
-    q.addBindValue(to);
-    q.addBindValue(words);
-    if (!q.exec() || !q.next())
-        return false;
-    *chunk_id = q.value(0).toInt();
-
-    if (!q.prepare(INSERT_CHUNK_FTS_SQL))
-        return false;
-    q.addBindValue(document_id);
-    q.addBindValue(chunk_text);
-    q.addBindValue(file);
-    q.addBindValue(title);
-    q.addBindValue(author);
-    q.addBindValue(subject);
-    q.addBindValue(keywords);
-    if (!q.exec())
-        return false;
-    m_documentIdCache << document_id;
-    return true;
+    auto it = m_cachedQueries.find(sql);
+    if (it == m_cachedQueries.end()) {
+        QSqlQuery q(m_db);
+        if (!q.prepare(sql))
+            qWarning() << "ERROR: Cannot prepare sql" << q.lastError();
+        it = m_cachedQueries.insert(sql, std::move(q));
+    }
+    return *it;
 }
 
-bool Database::removeChunksByDocumentId(QSqlQuery &q, int document_id)
+bool Database::addChunks(int document_id, const QString &file, const QString &title, const QString &author,
+                         const QString &subject, const QString &keywords, const QList<ParsedChunk> &chunks,
+                         QList<int> *chunk_ids, QSqlError *error)
 {
+    // TODO: implement line_from/line_to
+    constexpr int line_from = -1;
+    constexpr int line_to = -1;
+
+    for (qsizetype start = 0; start < chunks.size(); start += s_chunkInsertRows) {
+        const int nRows = int(qMin(chunks.size() - start, qsizetype(s_chunkInsertRows)));
+        auto rows = chunks.sliced(start, nRows);
+
+        QSqlQuery &q = cachedQuery(INSERT_CHUNKS_SQL.arg(multiRowValues(nRows, 12)));
+        for (const auto &chunk: rows) {
+            q.addBindValue(document_id);
+            q.addBindValue(chunk.text);
+            q.addBindValue(file);
+            q.addBindValue(title);
+            q.addBindValue(author);
+            q.addBindValue(subject);
+            q.addBindValue(keywords);
+            q.addBindValue(chunk.page);
+            q.addBindValue(line_from);
+            q.addBindValue(line_to);
+            q.addBindValue(chunk.words);
+            q.addBindValue(chunk.tokens);
+        }
+        if (!q.exec()) {
+            *error = q.lastError();
+            return false;
+        }
+        // RETURNING rows come in no particular order, but ids are assigned in values order
+        QList<int> ids;
+        while (q.next())
+            ids << q.value(0).toInt();
+        q.finish();
+        if (ids.size() != nRows) {
+            *error = q.lastError();
+            return false;
+        }
+        ranges::sort(ids);
+        *chunk_ids << ids;
+
+        // during bulk ingest the fts entries are inserted all at once at the end instead
+        if (m_bulkIngest)
+            continue;
+
+        QSqlQuery &fq = cachedQuery(INSERT_CHUNKS_FTS_SQL.arg(multiRowValues(nRows, 8)));
+        for (qsizetype i = 0; i < nRows; i++) {
+            fq.addBindValue(ids[i]);
+            fq.addBindValue(document_id);
+            fq.addBindValue(rows[i].text);
+            fq.addBindValue(file);
+            fq.addBindValue(title);
+            fq.addBindValue(author);
+            fq.addBindValue(subject);
+            fq.addBindValue(keywords);
+        }
+        if (!fq.exec()) {
+            *error = fq.lastError();
+            return false;
+        }
+    }
+
+    m_documentIdCache << document_id;
+    return true;
+}
+
+bool Database::removeChunksByDocumentId(QSqlQuery &q, int document_id)
+{
+    // chunks of a document that is still being parsed would otherwise be inserted after this
+    cancelIngestJob(document_id);
+
     for (const auto &cmd: DELETE_CHUNKS_SQL) {
         if (!q.prepare(cmd))
             return false;
@@ -897,6 +1386,32 @@ bool Database::removeChunksByDocumentId(QSqlQuery &q, int document_id)
     return true;
 }
 
+// removes individual chunks along with their embeddings, unlike removeChunksByDocumentId this
+// leaves the ingest job of their document alone
+bool Database::removeChunks(const QList<int> &chunk_ids, QSqlError *error)
+{
+    for (int chunk_id: chunk_ids) {
+        // chunks inserted during a bulk ingest are not in the full-text index yet
+        if (chunk_id < ftsEndId()) {
+            QSqlQuery &fq = cachedQuery(DELETE_CHUNK_FTS_ENTRY_SQL);
+            fq.addBindValue(chunk_id);
+            if (!fq.exec()) {
+                *error = fq.lastError();
+                return false;
+            }
+        }
+        for (const auto &cmd: DELETE_CHUNK_SQL) {
+            QSqlQuery &cq = cachedQuery(cmd);
+            cq.addBindValue(chunk_id);
+            if (!cq.exec()) {
+                *error = cq.lastError();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 bool Database::sqlRemoveDocsByFolderPath(QSqlQuery &q, const QString &path)
 {
     for (const auto &cmd: FOLDER_REMOVE_ALL_DOCS_SQL) {
@@ -920,6 +1435,7 @@ int Database::openDatabase(const QString &modelPath, bool create, int ver)
         qWarning() << "ERROR: invalid download path" << modelPath;
         return -1;
     }
+    m_cachedQueries.clear();
     if (m_db.isOpen())
         m_db.close();
     auto dbPath = u"%1/localdocs_v%2.db"_s.arg(modelPath).arg(ver);
@@ -930,6 +1446,12 @@ int Database::openDatabase(const QString &modelPath, bool create, int ver)
         qWarning() << "ERROR: opening db" << dbPath << m_db.lastError();
         return -1;
     }
+    QSqlQuery q(m_db);
+    for (const auto &cmd: CONNECTION_PRAGMAS_SQL) {
+        // not fatal, e.g. WAL is not available on some network file systems
+        if (!q.exec(cmd))
+            qWarning() << "WARNING: Cannot configure db connection" << cmd << q.lastError();
+    }
     return hasContent();
 }
 
@@ -956,6 +1478,9 @@ bool Database::openLatestDb(const QString &modelPath, QList<CollectionItem> &old
 
     if (dbVer == LOCALDOCS_VERSION) return true; // already up-to-date
 
+    // a version 3 database can be upgraded without indexing its collections again
+    if (dbVer == 3) return upgradeDb(modelPath, dbVer);
+
     // If we're upgrading, then we need to do a select on the current version of the collections table,
     // then create the new one and populate the collections table and mark them as needing forced
     // indexing
@@ -975,6 +1500,43 @@ bool Database::openLatestDb(const QString &modelPath, QList<CollectionItem> &old
     return true;
 }
 
+bool Database::upgradeDb(const QString &modelPath, int ver)
+{
+#if defined(DEBUG)
+    qDebug() << "Upgrading localdocs version" << ver << "in place to" << LOCALDOCS_VERSION;
+#endif
+    Q_ASSERT(ver == 3);
+
+    m_cachedQueries.clear();
+    m_db.close();
+
+    // an empty database of the current version may have been left behind by an earlier attempt
+    const QString oldPath = u"%1/localdocs_v%2.db"_s.arg(modelPath).arg(ver);
+    const QString newPath = u"%1/localdocs_v%2.db"_s.arg(modelPath).arg(LOCALDOCS_VERSION);
+    if (QFile::exists(newPath) && !QFile::remove(newPath)) {
+        qWarning() << "ERROR: Cannot remove empty db" << newPath;
+        return false;
+    }
+    if (!QFile::rename(oldPath, newPath)) {
+        qWarning() << "ERROR: Cannot rename db" << oldPath << "to" << newPath;
+        return false;
+    }
+    if (openDatabase(modelPath) != 1)
+        return false;
+
+    transaction();
+    QSqlQuery q(m_db);
+    for (const auto &cmd: UPGRADE_DB_V3_SQL) {
+        if (!q.exec(cmd)) {
+            qWarning() << "ERROR: failed to upgrade tables" << q.lastError();
+            rollback();
+            return false;
+        }
+    }
+    commit();
+    return true;
+}
+
 bool Database::initDb(const QString &modelPath, const QList<CollectionItem> &oldCollections)
 {
     if (!m_db.isOpen()) {
@@ -1016,16 +1578,22 @@ Database::Database(int chunkSize, QStringList extensions)
     , m_chunkSize(chunkSize)
     , m_scannedFileExtensions(std::move(extensions))
     , m_scanIntervalTimer(new QTimer(this))
-    , m_watcher(new QFileSystemWatcher(this))
+    , m_checkTimer(new QTimer(this))
+    , m_metricsTimer(new QTimer(this))
+    , m_watcher(new FolderWatcher(this))
     , m_embLLM(new EmbeddingLLM)
     , m_databaseValid(true)
-    , m_chunkStreamer(this)
+    , m_chunkBatchQueue(s_maxQueuedBatches)
 {
     m_db = QSqlDatabase::database(QSqlDatabase::defaultConnection, false);
     if (!m_db.isValid())
         m_db = QSqlDatabase::addDatabase("QSQLITE");
     Q_ASSERT(m_db.isValid());
 
+    // leave a core for the database thread and the embedding model
+    m_parserPool.setMaxThreadCount(qBound(1, QThread::idealThreadCount() - 1, 4));
+    m_parserPool.setObjectName("parser");
+
     moveToThread(&m_dbThread);
     m_dbThread.setObjectName("database");
     m_dbThread.start();
@@ -1035,6 +1603,13 @@ Database::~Database()
 {
     m_dbThread.quit();
     m_dbThread.wait();
+
+    // unblock the parser threads so they can finish
+    for (auto &job: std::as_const(m_ingestJobs))
+        job->cancelled = true;
+    m_chunkBatchQueue.close();
+    m_parserPool.waitForDone();
+
     delete m_embLLM;
 }
 
@@ -1111,487 +1686,537 @@ static void handleDocumentError(const QString &errorMessage, int document_id, co
     qWarning() << errorMessage << document_id << document_path << error;
 }
 
-class DocumentReader {
-public:
-    struct Metadata { QString title, author, subject, keywords; };
+bool ChunkBatchQueue::push(ChunkBatch &&batch)
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_closed && !batch.job->cancelled && m_batches.size() >= m_capacity)
+        m_notFull.wait(&m_mutex);
+    if (m_closed || batch.job->cancelled)
+        return false;
+    m_batches.push_back(std::move(batch));
+    return true;
+}
 
-    static std::unique_ptr<DocumentReader> fromDocument(DocumentInfo info);
+std::optional<ChunkBatch> ChunkBatchQueue::tryPop()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_batches.empty())
+        return std::nullopt;
+    ChunkBatch batch = std::move(m_batches.front());
+    m_batches.pop_front();
+    m_notFull.wakeAll();
+    return batch;
+}
 
-    const DocumentInfo           &doc     () const { return m_info; }
-    const Metadata               &metadata() const { return m_metadata; }
-    const std::optional<QString> &word    () const { return m_word; }
-    const std::optional<QString> &nextWord()       { m_word = advance(); return m_word; }
-    virtual std::optional<ChunkStreamer::Status> getError() const { return std::nullopt; }
-    virtual int page() const { return -1; }
+qsizetype ChunkBatchQueue::size()
+{
+    QMutexLocker locker(&m_mutex);
+    return qsizetype(m_batches.size());
+}
 
-    virtual ~DocumentReader() = default;
+void ChunkBatchQueue::wakeAll()
+{
+    QMutexLocker locker(&m_mutex);
+    m_notFull.wakeAll();
+}
 
-protected:
-    explicit DocumentReader(DocumentInfo info)
-        : m_info(std::move(info)) {}
+void ChunkBatchQueue::close()
+{
+    QMutexLocker locker(&m_mutex);
+    m_closed = true;
+    m_notFull.wakeAll();
+}
 
-    void postInit(Metadata &&metadata = {})
-    {
-        m_metadata = std::move(metadata);
-        m_word = advance();
+// runs on the parser thread pool
+// the first step of a job, its result decides whether the document is parsed at all
+static void hashDocument(const std::shared_ptr<IngestJob> &job, ChunkBatchQueue *queue)
+{
+    QElapsedTimer timer;
+    timer.start();
+    QFile file(job->documentPath);
+    QCryptographicHash hash(QCryptographicHash::Blake2b_256);
+    if (!file.open(QIODevice::ReadOnly) || !hash.addData(&file)) {
+        qWarning() << "LocalDocs ERROR: Cannot read" << file.fileName() << file.errorString();
+        queue->push({ .job = job, .status = ChunkStreamer::Status::ERROR });
+        return;
     }
+    queue->push({
+        .job         = job,
+        .contentHash = hash.result(),
+        .workUsecs   = timer.nsecsElapsed() / 1000,
+        .bytes       = file.size(),
+    });
+}
 
-    virtual std::optional<QString> advance() = 0;
+static void parseDocument(const std::shared_ptr<IngestJob> &job, ChunkBatchQueue *queue)
+{
+    std::optional<ChunkStreamer> streamer;
+    try {
+        // a QFileInfo of our own, copies share a cache that is not safe to use from several threads
+        streamer.emplace(DocumentInfo { job->folder, QFileInfo(job->documentPath) }, job->chunkSize, job->tokenizer,
+                         job->storedText ? &*job->storedText : nullptr);
+    } catch (const std::runtime_error &e) {
+        qWarning() << "LocalDocs ERROR:" << e.what();
+        queue->push({ .job = job, .status = ChunkStreamer::Status::ERROR });
+        return;
+    }
 
-    DocumentInfo           m_info;
-    Metadata               m_metadata;
-    std::optional<QString> m_word;
-};
+    for (;;) {
+        ChunkBatch batch {
+            .job      = job,
+            .title    = streamer->title(),
+            .author   = streamer->author(),
+            .subject  = streamer->subject(),
+            .keywords = streamer->keywords(),
+        };
+        ChunkStreamer::Status status;
+        QElapsedTimer timer;
+        timer.start();
+        try {
+            status = streamer->step(batch.chunks, s_batchSize);
+        } catch (const std::runtime_error &e) {
+            qWarning() << "LocalDocs ERROR:" << e.what();
+            status = ChunkStreamer::Status::ERROR;
+        }
+        batch.workUsecs = timer.nsecsElapsed() / 1000;
+        const bool done = status != ChunkStreamer::Status::INTERRUPTED;
+        if (done) {
+            batch.status = status;
+            batch.bytes = QFileInfo(job->documentPath).size();
+        }
+        if (status == ChunkStreamer::Status::DOC_COMPLETE)
+            batch.text = streamer->takeText();
+        if (!queue->push(std::move(batch)) || done)
+            return;
+    }
+}
 
-namespace {
+void Database::insertChunkBatch(ChunkBatch &batch)
+{
+    IngestJob &job = *batch.job;
+    if (job.cancelled)
+        return; // the document was removed while it was being parsed
 
-#ifdef GPT4ALL_USE_QTPDF
-class PdfDocumentReader final : public DocumentReader {
-public:
-    explicit PdfDocumentReader(DocumentInfo info)
-        : DocumentReader(std::move(info))
-    {
-        QString path = info.file.canonicalFilePath();
-        if (m_doc.load(path) != QPdfDocument::Error::None)
-            throw std::runtime_error(fmt::format("Failed to load PDF: {}", path));
-        Metadata metadata {
-            .title    = m_doc.metaData(QPdfDocument::MetaDataField::Title   ).toString(),
-            .author   = m_doc.metaData(QPdfDocument::MetaDataField::Author  ).toString(),
-            .subject  = m_doc.metaData(QPdfDocument::MetaDataField::Subject ).toString(),
-            .keywords = m_doc.metaData(QPdfDocument::MetaDataField::Keywords).toString(),
-        };
-        postInit(std::move(metadata));
+    auto &stats = m_metrics.collection(collectionName(job.folder));
+    if (batch.contentHash) {
+        stats.docsHashed++;
+        stats.bytesHashed += batch.bytes;
+        stats.hashLatency.record(batch.workUsecs);
+        return handleContentHash(batch.job, *batch.contentHash);
     }
 
-    int page() const override { return m_currentPage; }
+    stats.chunksParsed += batch.chunks.size();
+    stats.parseLatency.record(batch.workUsecs);
+    if (batch.status == ChunkStreamer::Status::DOC_COMPLETE) {
+        stats.docsParsed++;
+        stats.bytesParsed += batch.bytes;
+    }
 
-private:
-    std::optional<QString> advance() override
-    {
-        QString word;
-        do {
-            while (!m_stream || m_stream->atEnd()) {
-                if (m_currentPage >= m_doc.pageCount())
-                    return std::nullopt;
-                m_pageText = m_doc.getAllText(m_currentPage++).text();
-                m_stream.emplace(&m_pageText);
+    QElapsedTimer writeTimer;
+    writeTimer.start();
+
+    const int folderId = job.folder;
+    int nChunks = 0;
+    int nAddedWords = 0;
+    int nAddedTokens = 0;
+
+    QSqlError error;
+    if (!job.previousChunks.isEmpty()
+        && job.previousMetadata == QStringList { batch.title, batch.author, batch.subject, batch.keywords }) {
+        // chunks that are the same as before keep their embeddings, only their page may have moved
+        batch.chunks.removeIf([&](const ParsedChunk &chunk) {
+            auto it = job.previousChunks.find(chunk.text);
+            if (it == job.previousChunks.end())
+                return false;
+            if (it->page != chunk.page) {
+                QSqlQuery &q = cachedQuery(UPDATE_CHUNK_PAGE_SQL);
+                q.addBindValue(chunk.page);
+                q.addBindValue(it->id);
+                if (!q.exec())
+                    qWarning() << "ERROR: Could not update page of chunk" << q.lastError();
             }
-            *m_stream >> word;
-        } while (word.isEmpty());
-        return word;
+            job.previousChunks.erase(it);
+            return true;
+        });
     }
 
-    QPdfDocument               m_doc;
-    int                        m_currentPage = 0;
-    QString                    m_pageText;
-    std::optional<QTextStream> m_stream;
-};
-#else
-class PdfDocumentReader final : public DocumentReader {
-public:
-    explicit PdfDocumentReader(DocumentInfo info)
-        : DocumentReader(std::move(info))
-    {
-        QString path = info.file.canonicalFilePath();
-        m_doc = FPDF_LoadDocument(path.toUtf8().constData(), nullptr);
-        if (!m_doc)
-            throw std::runtime_error(fmt::format("Failed to load PDF: {}", path));
-
-        // Extract metadata
-        Metadata metadata {
-            .title    = getMetadata("Title"   ),
-            .author   = getMetadata("Author"  ),
-            .subject  = getMetadata("Subject" ),
-            .keywords = getMetadata("Keywords"),
-        };
-        postInit(std::move(metadata));
+    QList<int> chunkIds;
+    if (!batch.chunks.isEmpty()
+        && !addChunks(job.documentId, job.fileName /*basename*/, batch.title, batch.author,
+                      batch.subject, batch.keywords, batch.chunks, &chunkIds, &error)) {
+        qWarning() << "ERROR: Could not insert chunks into db" << error;
+        chunkIds.clear(); // nothing to embed
     }
+    if (!batch.chunks.isEmpty()) {
+        stats.chunksWritten += chunkIds.size();
+        stats.writeLatency.record(writeTimer.nsecsElapsed() / 1000);
+    }
+
+    for (qsizetype i = 0; i < chunkIds.size(); i++) {
+        auto &chunk = batch.chunks[i];
+        nAddedWords += chunk.words;
+        nAddedTokens += chunk.tokens;
 
-    ~PdfDocumentReader() override
-    {
-        if (m_page)
-            FPDF_ClosePage(m_page);
-        if (m_doc)
-            FPDF_CloseDocument(m_doc);
+        EmbeddingChunk toEmbed;
+        toEmbed.model = job.embeddingModel;
+        toEmbed.folder_id = folderId;
+        toEmbed.chunk_id = chunkIds[i];
+        toEmbed.chunk = std::move(chunk.text);
+        appendChunk(toEmbed);
+        ++nChunks;
     }
 
-    int page() const override { return m_currentPage; }
+    updateGuiForAddedChunks(folderId, nChunks, nAddedWords, nAddedTokens);
 
-private:
-    std::optional<QString> advance() override
-    {
-        QString word;
-        do {
-            while (!m_stream || m_stream->atEnd()) {
-                if (m_currentPage >= FPDF_GetPageCount(m_doc))
-                    return std::nullopt;
-
-                if (m_page)
-                    FPDF_ClosePage(std::exchange(m_page, nullptr));
-                m_page = FPDF_LoadPage(m_doc, m_currentPage++);
-                if (!m_page)
-                    throw std::runtime_error("Failed to load page.");
-
-                m_pageText = extractTextFromPage(m_page);
-                m_stream.emplace(&m_pageText);
-            }
-            *m_stream >> word;
-        } while (word.isEmpty());
-        return word;
-    }
-
-    QString getMetadata(FPDF_BYTESTRING key)
-    {
-        // FPDF_GetMetaText includes a 2-byte null terminator
-        ulong nBytes = FPDF_GetMetaText(m_doc, key, nullptr, 0);
-        if (nBytes <= sizeof (FPDF_WCHAR))
-            return { "" };
-        QByteArray buffer(nBytes, Qt::Uninitialized);
-        ulong nResultBytes = FPDF_GetMetaText(m_doc, key, buffer.data(), buffer.size());
-        Q_ASSERT(nResultBytes % 2 == 0);
-        Q_ASSERT(nResultBytes <= nBytes);
-        return QString::fromUtf16(reinterpret_cast<const char16_t *>(buffer.data()), nResultBytes / 2 - 1);
-    }
-
-    QString extractTextFromPage(FPDF_PAGE page)
-    {
-        FPDF_TEXTPAGE textPage = FPDFText_LoadPage(page);
-        if (!textPage)
-            throw std::runtime_error("Failed to load text page.");
-
-        int nChars = FPDFText_CountChars(textPage);
-        if (!nChars)
-            return {};
-        // FPDFText_GetText includes a 2-byte null terminator
-        QByteArray buffer((nChars + 1) * sizeof (FPDF_WCHAR), Qt::Uninitialized);
-        int nResultChars = FPDFText_GetText(textPage, 0, nChars, reinterpret_cast<ushort *>(buffer.data()));
-        Q_ASSERT(nResultChars <= nChars + 1);
+    if (!batch.status)
+        return; // more to come
 
-        FPDFText_ClosePage(textPage);
-        return QString::fromUtf16(reinterpret_cast<const char16_t *>(buffer.data()), nResultChars - 1);
-    }
+    const QString &document_path = job.documentPath;
+    switch (*batch.status) {
+    case ChunkStreamer::Status::BINARY_SEEN:
+        /* When we see a binary file, we treat it like an empty file so we know not to
+         * scan it again. All existing chunks are removed, and in-progress embeddings
+         * are ignored when they complete. */
+        qInfo() << "LocalDocs: Ignoring file with binary data:" << document_path;
 
-    FPDF_DOCUMENT              m_doc = nullptr;
-    FPDF_PAGE                  m_page = nullptr;
-    int                        m_currentPage = 0;
-    QString                    m_pageText;
-    std::optional<QTextStream> m_stream;
-};
-#endif // !defined(GPT4ALL_USE_QTPDF)
-
-class WordDocumentReader final : public DocumentReader {
-public:
-    explicit WordDocumentReader(DocumentInfo info)
-        : DocumentReader(std::move(info))
-        , m_doc(info.file.canonicalFilePath().toStdString())
-    {
-        m_doc.open();
-        if (!m_doc.is_open())
-            throw std::runtime_error(fmt::format("Failed to open DOCX: {}", info.file.canonicalFilePath()));
-
-        m_paragraph = &m_doc.paragraphs();
-        m_run       = &m_paragraph->runs();
-        // TODO(jared): metadata for Word documents?
-        postInit();
-    }
-
-protected:
-    std::optional<QString> advance() override
-    {
-        // find non-space char
-        qsizetype wordStart = 0;
-        while (m_buffer.isEmpty() || m_buffer[wordStart].isSpace()) {
-            if (m_buffer.isEmpty() && !fillBuffer())
-                return std::nullopt;
-            if (m_buffer[wordStart].isSpace() && ++wordStart >= m_buffer.size()) {
-                m_buffer.clear();
-                wordStart = 0;
-            }
+        // this will also ensure in-flight embeddings are ignored
+        if (QSqlQuery q(m_db); !removeChunksByDocumentId(q, job.documentId))
+            handleDocumentError("ERROR: Cannot remove chunks of document", job.documentId, document_path, q.lastError());
+        updateCollectionStatistics();
+        job.previousChunks.clear(); // already removed
+        if (job.newContentHash && !finishDocumentUpdate(job, &error))
+            handleDocumentError("ERROR: Cannot update document", job.documentId, document_path, error);
+        break;
+    case ChunkStreamer::Status::ERROR:
+        qWarning() << "error reading" << document_path;
+        if (job.newContentHash && !finishDocumentUpdate(job, &error))
+            handleDocumentError("ERROR: Cannot update document", job.documentId, document_path, error);
+        break;
+    case ChunkStreamer::Status::DOC_COMPLETE:
+        if (job.newContentHash && !finishDocumentUpdate(job, &error)) {
+            handleDocumentError("ERROR: Cannot update document", job.documentId, document_path, error);
+            break;
         }
-
-        // find space char
-        qsizetype wordEnd = wordStart + 1;
-        while (wordEnd >= m_buffer.size() || !m_buffer[wordEnd].isSpace()) {
-            if (wordEnd >= m_buffer.size() && !fillBuffer())
-                break;
-            if (!m_buffer[wordEnd].isSpace())
-                ++wordEnd;
+        // documents without chunks are not chunked again anyway
+        if (batch.text && m_documentIdCache.contains(job.documentId)) {
+            if (QSqlQuery q(m_db); !storeDocumentText(q, job.documentId, *batch.text))
+                handleDocumentError("ERROR: Cannot store text of document", job.documentId, document_path, q.lastError());
         }
+        break;
+    case ChunkStreamer::Status::INTERRUPTED:
+        ;
+    }
 
-        if (wordStart == wordEnd)
-            return std::nullopt;
+    // removeChunksByDocumentId above may have already retired this job
+    if (m_ingestJobs.value(document_path) == batch.job) {
+        m_ingestJobs.remove(document_path);
+        finishIngestJob(job);
+    }
+}
 
-        auto size = wordEnd - wordStart;
-        QString word = std::move(m_buffer);
-        m_buffer = word.sliced(wordStart + size);
-        if (wordStart == 0)
-            word.resize(size);
-        else
-            word = word.sliced(wordStart, size);
-        return word;
+void Database::updateGuiForAddedChunks(int folder_id, int nToEmbed, int nWords, int nTokens)
+{
+    if (!nToEmbed && !nWords)
+        return;
+
+    CollectionItem item = guiCollectionItem(folder_id);
+
+    // Set the start update if we haven't done so already
+    if (nToEmbed && item.startUpdate <= item.lastUpdate && item.currentEmbeddingsToIndex == 0)
+        setStartUpdateTime(item);
+
+    item.currentEmbeddingsToIndex += nToEmbed;
+    item.totalEmbeddingsToIndex += nToEmbed;
+    item.totalWords += nWords;
+    item.totalTokens += nTokens;
+    updateGuiForCollectionItem(item);
+}
+
+static bool selectPreviousChunks(QSqlQuery &q, IngestJob &job)
+{
+    if (!q.prepare(SELECT_DOCUMENT_CHUNKS_SQL))
+        return false;
+    q.addBindValue(job.documentId);
+    if (!q.exec())
+        return false;
+    while (q.next()) {
+        if (job.previousChunks.isEmpty())
+            job.previousMetadata = { q.value(2).toString(), q.value(3).toString(), q.value(4).toString(),
+                                     q.value(5).toString() };
+        job.previousChunks.insert(q.value(1).toString(), { .id = q.value(0).toInt(), .page = q.value(6).toInt() });
     }
+    return true;
+}
 
-    bool fillBuffer()
-    {
-        for (;;) {
-            // get a run
-            while (!m_run->has_next()) {
-                // try next paragraph
-                if (!m_paragraph->has_next())
-                    return false;
+/* Decides what to do with a document once its content hash is known. Content we have already
+ * indexed is not parsed or embedded again: if only the modification time changed we just record
+ * it, a document that moved takes its chunks along to the new path, and a copy of a document gets a
+ * copy of its chunks and embeddings. */
+void Database::handleContentHash(const std::shared_ptr<IngestJob> &job, const QByteArray &hash)
+{
+    const int folder_id = job->folder;
+    const QString &document_path = job->documentPath;
+    int document_id = job->documentId;
 
-                m_paragraph->next();
-                m_buffer += u'\n';
-            }
+    // removing the chunks of the previous content below must not cancel this job
+    m_ingestJobs.remove(document_path);
 
-            bool foundText = false;
-            auto &run = m_run->get_node();
-            for (auto node = run.first_child(); node; node = node.next_sibling()) {
-                std::string node_name = node.name();
-                if (node_name == "w:t") {
-                    const char *text = node.text().get();
-                    if (*text) {
-                        foundText = true;
-                        m_buffer += QUtf8StringView(text);
-                    }
-                } else if (node_name == "w:br") {
-                    m_buffer += u'\n';
-                } else if (node_name == "w:tab") {
-                    m_buffer += u'\t';
+    QSqlQuery q(m_db);
+    auto skipDocument = [&](const QString &errorMessage) {
+        handleDocumentError(errorMessage, document_id, document_path, q.lastError());
+        finishIngestJob(*job);
+    };
+
+    if (document_id != -1) {
+        QByteArray previousHash;
+        if (!selectDocumentHash(q, document_id, &previousHash))
+            return skipDocument("ERROR: Cannot select document hash");
+        if (previousHash == hash) {
+            if (!updateDocument(q, document_id, job->documentTime, hash))
+                return skipDocument("ERROR: Could not update document_time");
+
+            // it may have lost its chunks, e.g. because the chunk size changed
+            if (!m_documentIdCache.contains(document_id)) {
+                if (!selectDocumentText(q, document_id, &job->storedText))
+                    return skipDocument("ERROR: Cannot select text of document");
+                if (job->storedText) {
+                    m_ingestJobs.insert(document_path, job);
+                    m_parserPool.start([job, queue = &m_chunkBatchQueue] { parseDocument(job, queue); });
+                    return;
                 }
             }
-
-            m_run->next();
-            if (foundText) return true;
+            return finishIngestJob(*job);
         }
     }
 
-    duckx::Document   m_doc;
-    duckx::Paragraph *m_paragraph;
-    duckx::Run       *m_run;
-    QString           m_buffer;
-};
+    QList<QPair<int, QString>> sameContent;
+    if (!selectDocumentsByHash(q, hash, &sameContent))
+        return skipDocument("ERROR: Cannot select documents by hash");
 
-class TxtDocumentReader final : public DocumentReader {
-public:
-    explicit TxtDocumentReader(DocumentInfo info)
-        : DocumentReader(std::move(info))
-        , m_file(info.file.canonicalFilePath())
-    {
-        if (!m_file.open(QIODevice::ReadOnly))
-            throw std::runtime_error(fmt::format("Failed to open text file: {}", m_file.fileName()));
-
-        m_stream.setDevice(&m_file);
-        postInit();
-    }
-
-protected:
-    std::optional<QString> advance() override
-    {
-        if (getError())
-            return std::nullopt;
-        while (!m_stream.atEnd()) {
-            QString word;
-            m_stream >> word;
-            if (getError())
-                return std::nullopt;
-            if (!word.isEmpty())
-                return word;
+    // documents that are being parsed right now don't have all of their chunks yet
+    auto isIngesting = [this](int id) {
+        for (const auto &other: std::as_const(m_ingestJobs)) {
+            if (other->documentId == id)
+                return true;
         }
-        return std::nullopt;
-    }
+        return false;
+    };
 
-    std::optional<ChunkStreamer::Status> getError() const override
-    {
-        if (m_file.binarySeen())
-            return ChunkStreamer::Status::BINARY_SEEN;
-        if (m_file.error())
-            return ChunkStreamer::Status::ERROR;
-        return std::nullopt;
+    std::optional<QPair<int, QString>> moved;
+    std::optional<int> copied;
+    for (const auto &[id, path]: std::as_const(sameContent)) {
+        if (id == document_id || isIngesting(id))
+            continue;
+        if (!QFileInfo::exists(path)) {
+            moved.emplace(id, path);
+            break;
+        }
+        if (!copied)
+            copied = id;
     }
 
-    BinaryDetectingFile m_file;
-    QTextStream m_stream;
-};
-
-} // namespace
-
-std::unique_ptr<DocumentReader> DocumentReader::fromDocument(DocumentInfo doc)
-{
-    if (doc.isPdf())
-        return std::make_unique<PdfDocumentReader>(std::move(doc));
-    if (doc.isDocx())
-        return std::make_unique<WordDocumentReader>(std::move(doc));
-    return std::make_unique<TxtDocumentReader>(std::move(doc));
-}
-
-ChunkStreamer::ChunkStreamer(Database *database)
-    : m_database(database) {}
-
-ChunkStreamer::~ChunkStreamer() = default;
+    if (moved) {
+        const auto &[moved_id, moved_path] = *moved;
+#if defined(DEBUG)
+        qDebug() << "relinking document" << moved_id << moved_path << "to" << document_path;
+#endif
+        // the document that moved here replaces the previous content of this path
+        if (document_id != -1) {
+            if (!removeChunksByDocumentId(q, document_id))
+                return skipDocument("ERROR: Cannot remove chunks of document");
+            if (!removeDocument(q, document_id))
+                return skipDocument("ERROR: Cannot remove document");
+        }
+        document_id = moved_id;
+        if (!relinkDocument(q, document_id, folder_id, job->documentTime, document_path))
+            return skipDocument("ERROR: Could not relink document");
+        const QString file = job->fileName;
+        if (QFileInfo(moved_path).fileName() != file && !renameChunks(q, document_id, file, ftsEndId()))
+            return skipDocument("ERROR: Could not rename chunks of document");
+        m_orphanedDocuments.remove(document_id);
+        updateCollectionStatistics();
+        return finishIngestJob(*job);
+    }
+
+    // Update the document for new content, or add it for the first time now
+    if (document_id != -1) {
+        if (!removeDocumentText(q, document_id))
+            return skipDocument("ERROR: Cannot remove text of document");
+        if (copied) {
+            if (!removeChunksByDocumentId(q, document_id))
+                return skipDocument("ERROR: Cannot remove chunks of document");
+            updateCollectionStatistics();
+            if (!updateDocument(q, document_id, job->documentTime, hash))
+                return skipDocument("ERROR: Could not update document_time");
+        } else {
+            // an edit usually leaves most chunks as they were, so keep them until we know which changed
+            if (!selectPreviousChunks(q, *job))
+                return skipDocument("ERROR: Cannot select chunks of document");
+            job->newContentHash = hash;
+        }
+    } else {
+        if (!addDocument(q, folder_id, job->documentTime, document_path, hash, &document_id))
+            return skipDocument("ERROR: Could not add document");
 
-void ChunkStreamer::setDocument(DocumentInfo doc, int documentId, const QString &embeddingModel)
-{
-    auto docKey = doc.key();
-    if (!m_docKey || *m_docKey != docKey) {
-        m_docKey         = docKey;
-        m_reader         = DocumentReader::fromDocument(std::move(doc));
-        m_documentId     = documentId;
-        m_embeddingModel = embeddingModel;
-        m_chunk.clear();
-        m_page = 0;
+        CollectionItem item = guiCollectionItem(folder_id);
+        item.totalDocs += 1;
+        updateGuiForCollectionItem(item);
 
         // make sure the document doesn't already have any chunks
-        if (m_database->m_documentIdCache.contains(documentId)) {
-            QSqlQuery q(m_database->m_db);
-            if (!m_database->removeChunksByDocumentId(q, documentId))
-                handleDocumentError("ERROR: Cannot remove chunks of document",
-                                    documentId, m_reader->doc().file.canonicalPath(), q.lastError());
-        }
+        if (m_documentIdCache.contains(document_id) && !removeChunksByDocumentId(q, document_id))
+            return skipDocument("ERROR: Cannot remove chunks of document");
     }
-}
+    job->documentId = document_id;
 
-std::optional<DocumentInfo::key_type> ChunkStreamer::currentDocKey() const
-{
-    return m_docKey;
+    if (copied) {
+#if defined(DEBUG)
+        qDebug() << "copying chunks of document" << *copied << "to" << document_path;
+#endif
+        QSqlError error;
+        if (!copyChunks(*copied, *job, &error))
+            handleDocumentError("ERROR: Could not copy chunks of document", document_id, document_path, error);
+        else if (!copyDocumentText(q, *copied, document_id))
+            handleDocumentError("ERROR: Could not copy text of document", document_id, document_path, q.lastError());
+        return finishIngestJob(*job);
+    }
+
+    // parse and chunk on the thread pool, the results come back through m_chunkBatchQueue
+    m_ingestJobs.insert(document_path, job);
+    m_parserPool.start([job, queue = &m_chunkBatchQueue] { parseDocument(job, queue); });
 }
 
-void ChunkStreamer::reset()
+/* Completes the update of a modified document: chunks of the previous content that did not come out
+ * of the new content again are removed, and the new time and hash are recorded. */
+bool Database::finishDocumentUpdate(IngestJob &job, QSqlError *error)
 {
-    m_docKey.reset();
+    QList<int> removed;
+    removed.reserve(job.previousChunks.size());
+    for (const auto &chunk: std::as_const(job.previousChunks))
+        removed << chunk.id;
+    job.previousChunks.clear();
+
+    if (!removeChunks(removed, error))
+        return false;
+    if (!removed.isEmpty())
+        updateCollectionStatistics();
+#if defined(DEBUG)
+    qDebug() << "removed" << removed.size() << "chunks no longer in" << job.documentPath;
+#endif
+
+    QSqlQuery q(m_db);
+    if (!updateDocument(q, job.documentId, job.documentTime, *job.newContentHash)) {
+        *error = q.lastError();
+        return false;
+    }
+    return true;
 }
 
-ChunkStreamer::Status ChunkStreamer::step()
+// copies the chunks of a document with the same content, only chunks without an embedding are embedded
+bool Database::copyChunks(int src_document_id, const IngestJob &job, QSqlError *error)
 {
-    // TODO: implement line_from/line_to
-    constexpr int line_from = -1;
-    constexpr int line_to = -1;
-    const int folderId = m_reader->doc().folder;
-    const int maxChunkSize = m_database->m_chunkSize;
-    int nChunks = 0;
-    int nAddedWords = 0;
-    Status retval;
+    QSqlQuery q(m_db);
+    if (!q.prepare(SELECT_DOCUMENT_CHUNKS_SQL)) {
+        *error = q.lastError();
+        return false;
+    }
+    q.addBindValue(src_document_id);
+    if (!q.exec()) {
+        *error = q.lastError();
+        return false;
+    }
 
-    for (;;) {
-        if (auto error = m_reader->getError()) {
-            m_docKey.reset(); // done processing
-            retval = *error;
-            break;
+    QList<int> srcIds;
+    QList<ParsedChunk> chunks;
+    QString title, author, subject, keywords;
+    while (q.next()) {
+        if (srcIds.isEmpty()) {
+            title    = q.value(2).toString();
+            author   = q.value(3).toString();
+            subject  = q.value(4).toString();
+            keywords = q.value(5).toString();
         }
+        srcIds << q.value(0).toInt();
+        chunks.append({
+            .text   = q.value(1).toString(),
+            .page   = q.value(6).toInt(),
+            .words  = q.value(7).toInt(),
+            .tokens = q.value(8).toInt(),
+        });
+    }
+    q.finish();
+    if (chunks.isEmpty())
+        return true;
 
-        // get a word, if needed
-        std::optional<QString> word = QString(); // empty string to disable EOF logic
-        if (m_chunk.length() < maxChunkSize + 1) {
-            word = m_reader->word();
-            if (m_chunk.isEmpty())
-                m_page = m_reader->page(); // page number of first word
+    QList<int> chunkIds;
+    if (!addChunks(job.documentId, job.fileName /*basename*/, title, author, subject, keywords,
+                   chunks, &chunkIds, error))
+        return false;
 
-            if (word) {
-                m_chunk += *word;
-                m_chunk += u' ';
-                m_reader->nextWord();
-                m_nChunkWords++;
-            }
+    const int folder_id = job.folder;
+    int nToEmbed = 0;
+    int nWords = 0;
+    int nTokens = 0;
+    if (!q.prepare(COPY_EMBEDDING_SQL)) {
+        *error = q.lastError();
+        return false;
+    }
+    for (qsizetype i = 0; i < chunkIds.size(); i++) {
+        q.addBindValue(folder_id);
+        q.addBindValue(chunkIds[i]);
+        q.addBindValue(srcIds[i]);
+        if (!q.exec()) {
+            *error = q.lastError();
+            return false;
         }
+        nWords += chunks[i].words;
+        nTokens += chunks[i].tokens;
+        if (q.numRowsAffected())
+            continue;
 
-        if (!word || m_chunk.length() >= maxChunkSize + 1) { // +1 for trailing space
-            if (!m_chunk.isEmpty()) {
-                int nThisChunkWords = 0;
-                auto chunk = m_chunk; // copy
-
-                // handle overlength chunks
-                if (m_chunk.length() > maxChunkSize + 1) {
-                    // find the final space
-                    qsizetype chunkEnd = chunk.lastIndexOf(u' ', -2);
-
-                    qsizetype spaceSize;
-                    if (chunkEnd >= 0) {
-                        // slice off the last word
-                        spaceSize = 1;
-                        Q_ASSERT(m_nChunkWords >= 1);
-                        // one word left
-                        nThisChunkWords = m_nChunkWords - 1;
-                        m_nChunkWords = 1;
-                    } else {
-                        // slice the overlong word
-                        spaceSize = 0;
-                        chunkEnd = maxChunkSize;
-                        // partial word left, don't count it
-                        nThisChunkWords = m_nChunkWords;
-                        m_nChunkWords = 0;
-                    }
-                    // save the second part, excluding space if any
-                    m_chunk = chunk.sliced(chunkEnd + spaceSize);
-                    // consume the first part
-                    chunk.truncate(chunkEnd);
-                } else {
-                    nThisChunkWords = m_nChunkWords;
-                    m_nChunkWords = 0;
-                    // there is no second part
-                    m_chunk.clear();
-                    // consume the whole chunk, excluding space
-                    chunk.chop(1);
-                }
-                Q_ASSERT(chunk.length() <= maxChunkSize);
-
-                QSqlQuery q(m_database->m_db);
-                int chunkId = 0;
-                auto &metadata = m_reader->metadata();
-                if (!m_database->addChunk(q,
-                    m_documentId,
-                    chunk,
-                    m_reader->doc().file.fileName(), // basename
-                    metadata.title,
-                    metadata.author,
-                    metadata.subject,
-                    metadata.keywords,
-                    m_page,
-                    line_from,
-                    line_to,
-                    nThisChunkWords,
-                    &chunkId
-                )) {
-                    qWarning() << "ERROR: Could not insert chunk into db" << q.lastError();
-                }
-
-                nAddedWords += nThisChunkWords;
-
-                EmbeddingChunk toEmbed;
-                toEmbed.model = m_embeddingModel;
-                toEmbed.folder_id = folderId;
-                toEmbed.chunk_id = chunkId;
-                toEmbed.chunk = chunk;
-                m_database->appendChunk(toEmbed);
-                ++nChunks;
-            }
+        // the source chunk was still waiting for its embedding
+        EmbeddingChunk toEmbed;
+        toEmbed.model = job.embeddingModel;
+        toEmbed.folder_id = folder_id;
+        toEmbed.chunk_id = chunkIds[i];
+        toEmbed.chunk = std::move(chunks[i].text);
+        appendChunk(toEmbed);
+        ++nToEmbed;
+    }
 
-            if (!word) {
-                retval = Status::DOC_COMPLETE;
-                m_docKey.reset(); // done processing
-                break;
-            }
-        }
+    updateGuiForAddedChunks(folder_id, nToEmbed, nWords, nTokens);
+    return true;
+}
 
-        if (m_database->scanQueueInterrupted()) {
-            retval = Status::INTERRUPTED;
-            break;
-        }
+void Database::cancelIngestJob(int document_id)
+{
+    for (auto it = m_ingestJobs.begin(); it != m_ingestJobs.end(); ++it) {
+        if ((*it)->documentId != document_id)
+            continue;
+        auto job = *it;
+        m_ingestJobs.erase(it);
+        job->cancelled = true;
+        m_chunkBatchQueue.wakeAll();
+        finishIngestJob(*job);
+        return;
     }
+}
 
-    if (nChunks) {
-        CollectionItem item = m_database->guiCollectionItem(folderId);
-
-        // Set the start update if we haven't done so already
-        if (item.startUpdate <= item.lastUpdate && item.currentEmbeddingsToIndex == 0)
-            m_database->setStartUpdateTime(item);
+void Database::finishIngestJob(const IngestJob &job)
+{
+    const int folder_id = job.folder;
+    if (!m_collectionMap.contains(folder_id))
+        return; // folder was removed
 
-        item.currentEmbeddingsToIndex += nChunks;
-        item.totalEmbeddingsToIndex += nChunks;
-        item.totalWords += nAddedWords;
-        m_database->updateGuiForCollectionItem(item);
+    auto item = guiCollectionItem(folder_id);
+    Q_ASSERT(item.currentBytesToIndex >= job.fileSize);
+    if (item.currentBytesToIndex < job.fileSize) {
+        qWarning() << "Database ERROR: underflow in current bytes to index statistics";
+        item.currentBytesToIndex = 0;
+    } else {
+        item.currentBytesToIndex -= job.fileSize;
     }
-
-    return retval;
+    updateGuiForCollectionItem(item);
+    updateFolderToIndex(folder_id, countOfDocuments(folder_id));
 }
 
 void Database::appendChunk(const EmbeddingChunk &chunk)
@@ -1604,14 +2229,58 @@ void Database::appendChunk(const EmbeddingChunk &chunk)
 
 void Database::sendChunkList()
 {
-    m_embLLM->generateDocEmbeddingsAsync(m_chunkList);
+    requestEmbeddings(m_chunkList);
     m_chunkList.clear();
 }
 
-void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings)
+void Database::requestEmbeddings(const QList<EmbeddingChunk> &chunks)
+{
+    m_pendingEmbeddings += chunks.size();
+    // results can come back in parts, e.g. when a request is split up, so the time is kept per chunk
+    const qint64 now = m_metricsClock.nsecsElapsed() / 1000;
+    for (const auto &chunk: chunks)
+        m_embeddingRequestTimes.insert(chunk.chunk_id, now);
+    m_embLLM->generateDocEmbeddingsAsync(chunks);
+}
+
+// chunks per collection, and the latency since the earliest of them was requested
+template <typename T>
+void Database::recordEmbeddings(const QVector<T> &chunks, qint64 nTokens, bool failed)
+{
+    QHash<QString, qint64> collectionNChunks;
+    std::optional<qint64> requested;
+    for (const auto &c: chunks) {
+        collectionNChunks[collectionName(c.folder_id)]++;
+        if (auto it = m_embeddingRequestTimes.find(c.chunk_id); it != m_embeddingRequestTimes.end()) {
+            requested = qMin(requested.value_or(*it), *it);
+            m_embeddingRequestTimes.erase(it);
+        }
+    }
+
+    std::optional<qint64> latency;
+    if (requested)
+        latency = m_metricsClock.nsecsElapsed() / 1000 - *requested;
+
+    for (const auto &[name, nChunks]: std::as_const(collectionNChunks).asKeyValueRange()) {
+        auto &stats = m_metrics.collection(name);
+        if (failed) {
+            stats.embedErrors += nChunks;
+        } else {
+            stats.chunksEmbedded += nChunks;
+            stats.tokensEmbedded += nTokens * nChunks / chunks.size();
+        }
+        if (latency)
+            stats.embedLatency.record(*latency);
+    }
+}
+
+void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings, qint64 nTokens)
 {
     Q_ASSERT(!embeddings.isEmpty());
 
+    m_pendingEmbeddings -= qMin(m_pendingEmbeddings, size_t(embeddings.size()));
+    recordEmbeddings(embeddings, nTokens, /*failed*/ false);
+
     QList<Embedding> sqlEmbeddings;
     for (const auto &e: embeddings) {
         auto data = QByteArray::fromRawData(
@@ -1662,6 +2331,8 @@ void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddi
 
         updateGuiForCollectionItem(item);
     }
+
+    resumeUncompletedEmbeddings();
 }
 
 void Database::handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error)
@@ -1670,6 +2341,10 @@ void Database::handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const
      * on the embedding model, but this sets the error on all collections for a given
      * folder */
 
+    m_pendingEmbeddings -= qMin(m_pendingEmbeddings, size_t(chunks.size()));
+    if (!chunks.isEmpty())
+        recordEmbeddings(chunks, 0, /*failed*/ true);
+
     QSet<int> folder_ids;
     for (const auto &c: chunks) { folder_ids << c.folder_id; }
 
@@ -1679,24 +2354,57 @@ void Database::handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const
         item.error = error;
         updateGuiForCollectionItem(item);
     }
+
+    resumeUncompletedEmbeddings();
 }
 
+QString Database::collectionName(int folder_id) const
+{
+    return m_collectionMap.value(folder_id).collection;
+}
+
+// logs the ingestion metrics, if anything happened since the last time
+void Database::reportMetrics()
+{
+    for (const auto &[folder_id, docs]: m_docsToScan) {
+        if (!docs.empty())
+            m_metrics.collection(collectionName(folder_id)).docsQueued += docs.size();
+    }
+    for (const auto &job: std::as_const(m_ingestJobs))
+        m_metrics.collection(collectionName(job->folder)).docsInProgress++;
+
+    if (m_metrics.isEmpty())
+        return;
+    m_metrics.report({
+        .chunkBatches      = m_chunkBatchQueue.size(),
+        .pendingEmbeddings = qint64(m_pendingEmbeddings),
+    });
+}
+
+// includes documents that are currently being parsed
 size_t Database::countOfDocuments(int folder_id) const
 {
+    size_t count = 0;
     if (auto it = m_docsToScan.find(folder_id); it != m_docsToScan.end())
-        return it->second.size();
-    return 0;
+        count = it->second.size();
+    for (const auto &job: m_ingestJobs)
+        count += job->folder == folder_id;
+    return count;
 }
 
+// includes documents that are currently being parsed
 size_t Database::countOfBytes(int folder_id) const
 {
+    size_t totalBytes = 0;
     if (auto it = m_docsToScan.find(folder_id); it != m_docsToScan.end()) {
-        size_t totalBytes = 0;
         for (const DocumentInfo &f : it->second)
             totalBytes += f.file.size();
-        return totalBytes;
     }
-    return 0;
+    for (const auto &job: m_ingestJobs) {
+        if (job->folder == folder_id)
+            totalBytes += job->fileSize;
+    }
+    return totalBytes;
 }
 
 DocumentInfo Database::dequeueDocument()
@@ -1714,14 +2422,19 @@ DocumentInfo Database::dequeueDocument()
 
 void Database::removeFolderFromDocumentQueue(int folder_id)
 {
-    if (auto queueIt = m_docsToScan.find(folder_id); queueIt != m_docsToScan.end()) {
-        if (auto key = m_chunkStreamer.currentDocKey()) {
-            if (ranges::any_of(queueIt->second, [&key](auto &d) { return d.key() == key; }))
-                m_chunkStreamer.reset(); // done with this document
+    // stop parsing documents of this folder, their chunks are dropped when dequeued
+    for (auto it = m_ingestJobs.begin(); it != m_ingestJobs.end();) {
+        if ((*it)->folder == folder_id) {
+            (*it)->cancelled = true;
+            it = m_ingestJobs.erase(it);
+        } else {
+            ++it;
         }
-        // remove folder from queue
-        m_docsToScan.erase(queueIt);
     }
+    m_chunkBatchQueue.wakeAll();
+
+    // remove folder from queue
+    m_docsToScan.erase(folder_id);
 }
 
 void Database::enqueueDocumentInternal(DocumentInfo &&info, bool prepend)
@@ -1736,9 +2449,16 @@ void Database::enqueueDocuments(int folder_id, std::list<DocumentInfo> &&infos)
     auto &queue = m_docsToScan[folder_id];
     queue.splice(queue.end(), std::move(infos));
 
+    size_t nQueued = 0;
+    for (const auto &[_, docs]: m_docsToScan)
+        nQueued += docs.size();
+    if (!m_bulkIngest && nQueued >= s_bulkIngestThreshold)
+        beginBulkIngest();
+
     CollectionItem item = guiCollectionItem(folder_id);
-    item.currentDocsToIndex = queue.size();
-    item.totalDocsToIndex = queue.size();
+    const size_t count = countOfDocuments(folder_id);
+    item.currentDocsToIndex = count;
+    item.totalDocsToIndex = count;
     const size_t bytes = countOfBytes(folder_id);
     item.currentBytesToIndex = bytes;
     item.totalBytesToIndex = bytes;
@@ -1746,6 +2466,93 @@ void Database::enqueueDocuments(int folder_id, std::list<DocumentInfo> &&infos)
     m_scanIntervalTimer->start();
 }
 
+/* Bulk ingest is used for initial indexing and large rescans. Chunks are only inserted into the
+ * chunks table, and their fts entries are inserted all at once when the queue has drained, which is
+ * much cheaper than maintaining the index row by row. Chunks that were indexed before are kept up to
+ * date as usual. If we are interrupted before the end, the consistency check adds the missing
+ * entries, see Database::checkChunks. */
+void Database::beginBulkIngest()
+{
+#if defined(DEBUG)
+    qDebug() << "beginBulkIngest";
+#endif
+    QSqlQuery q(m_db);
+    if (!q.exec(SELECT_MAX_CHUNK_ID_SQL) || !q.next()) {
+        qWarning() << "ERROR: Cannot select last chunk id" << q.lastError();
+        return;
+    }
+    // ids are never reused, so all of the chunks inserted from now on come after this one
+    m_bulkIngestFirstChunkId = q.value(0).toInt() + 1;
+    m_bulkIngest = true;
+}
+
+void Database::endBulkIngest()
+{
+#if defined(DEBUG)
+    qDebug() << "endBulkIngest";
+#endif
+    Q_ASSERT(m_bulkIngest);
+    m_bulkIngest = false;
+
+    QSqlQuery q(m_db);
+    bool ok = q.prepare(INSERT_NEW_CHUNKS_FTS_ENTRIES_SQL);
+    if (ok) {
+        q.addBindValue(m_bulkIngestFirstChunkId);
+        ok = q.exec();
+    }
+    if (!ok) {
+        // fall back to a rebuild, which does not depend on what the index is missing
+        qWarning() << "ERROR: Cannot insert fts entries of new chunks" << q.lastError();
+        if (!q.exec(FTS_REBUILD_SQL))
+            qWarning() << "ERROR: Cannot exec sql for fts rebuild" << q.lastError();
+    }
+    incrementalVacuum();
+}
+
+// the first chunk that is not in the fts index yet
+int Database::ftsEndId() const
+{
+    return m_bulkIngest ? m_bulkIngestFirstChunkId : std::numeric_limits<int>::max();
+}
+
+void Database::incrementalVacuum()
+{
+    QSqlQuery q(m_db);
+    if (m_vacuumPending) {
+        // the one-time switch from no auto vacuum, see useIncrementalVacuum
+        m_vacuumPending = false;
+        if (!q.exec(SET_AUTO_VACUUM_INCREMENTAL_SQL) || !q.exec(VACUUM_SQL))
+            qWarning() << "ERROR: Cannot switch to incremental vacuum" << q.lastError();
+        return;
+    }
+    if (!q.exec(INCREMENTAL_VACUUM_SQL))
+        qWarning() << "ERROR: Cannot exec sql for incremental vacuum" << q.lastError();
+}
+
+bool Database::useIncrementalVacuum()
+{
+    QSqlQuery q(m_db);
+    if (!q.exec(SELECT_AUTO_VACUUM_SQL) || !q.next()) {
+        qWarning() << "ERROR: Cannot select auto vacuum mode" << q.lastError();
+        return false;
+    }
+    const int mode = q.value(0).toInt();
+    if (mode == 2 /*INCREMENTAL*/)
+        return true;
+    q.finish();
+
+    // databases created before we switched from FULL change over right away, but one without auto
+    // vacuum only does with a full VACUUM, which can take a while on a large one, so that is left to
+    // the next incremental vacuum instead of holding up startup
+    if (!q.exec(SET_AUTO_VACUUM_INCREMENTAL_SQL)) {
+        qWarning() << "ERROR: Cannot switch to incremental vacuum" << q.lastError();
+        return false;
+    }
+    if (mode == 0 /*NONE*/)
+        m_vacuumPending = true;
+    return true;
+}
+
 bool Database::scanQueueInterrupted() const
 {
     return m_scanDurationTimer.elapsed() >= 100;
@@ -1756,24 +2563,55 @@ void Database::scanQueueBatch()
     transaction();
 
     m_scanDurationTimer.start();
+    bool madeProgress = false;
 
-    // scan for up to the maximum scan duration or until we run out of documents
-    while (!m_docsToScan.empty()) {
-        scanQueue();
+    // hand documents to the parser threads while they have room for more
+    while (!m_docsToScan.empty() && m_ingestJobs.size() < m_parserPool.maxThreadCount()) {
+        if (!scanQueue())
+            break;
+        madeProgress = true;
         if (scanQueueInterrupted())
             break;
     }
 
-    commit();
+    // insert the chunks they produced, unless the embedding model is falling behind
+    while (!scanQueueInterrupted() && m_pendingEmbeddings < s_maxPendingEmbeddings) {
+        auto batch = m_chunkBatchQueue.tryPop();
+        if (!batch)
+            break;
+        insertChunkBatch(*batch);
+        madeProgress = true;
+    }
 
-    if (m_docsToScan.empty())
-        m_scanIntervalTimer->stop();
+    QElapsedTimer commitTimer;
+    commitTimer.start();
+    commit();
+    if (madeProgress)
+        m_metrics.commitLatency().record(commitTimer.nsecsElapsed() / 1000);
+
+    if (m_docsToScan.empty() && m_ingestJobs.isEmpty()) {
+        if (m_bulkIngest)
+            endBulkIngest();
+        if (!m_orphanedDocuments.isEmpty())
+            removeOrphanedDocuments();
+        if (m_orphanedDocuments.isEmpty())
+            m_scanIntervalTimer->stop();
+        else
+            m_scanIntervalTimer->setInterval(s_orphanGracePeriod / 4); // wait for the rest to expire
+    } else {
+        // poll rather than spin while we wait on the parser threads or the embedding model
+        m_scanIntervalTimer->setInterval(madeProgress ? 0 : 10);
+    }
 }
 
-void Database::scanQueue()
+// returns false if the next document cannot be started yet
+bool Database::scanQueue()
 {
+    // a file that changed while being hashed or parsed has to wait for the previous job to finish
+    if (m_ingestJobs.contains(m_docsToScan.begin()->second.front().file.canonicalFilePath()))
+        return false;
+
     DocumentInfo info = dequeueDocument();
-    const size_t countForFolder = countOfDocuments(info.folder);
     const int folder_id = info.folder;
 
     // Update info
@@ -1781,12 +2619,16 @@ void Database::scanQueue()
 
     // If the doc has since been deleted or no longer readable, then we schedule more work and return
     // leaving the cleanup for the cleanup handler
+    auto skipDocument = [&] {
+        updateFolderToIndex(folder_id, countOfDocuments(folder_id));
+        return true;
+    };
+
     if (!info.file.exists() || !info.file.isReadable())
-        return updateFolderToIndex(folder_id, countForFolder);
+        return skipDocument();
 
     const qint64 document_time = info.file.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch();
     const QString document_path = info.file.canonicalFilePath();
-    const bool currentlyProcessing = info.currentlyProcessing;
 
     // Check and see if we already have this document
     QSqlQuery q(m_db);
@@ -1794,102 +2636,62 @@ void Database::scanQueue()
     qint64 existing_time = -1;
     if (!selectDocument(q, document_path, &existing_id, &existing_time)) {
         handleDocumentError("ERROR: Cannot select document",
-            existing_id, document_path, q.lastError());
-        return updateFolderToIndex(folder_id, countForFolder);
-    }
-
-    // If we have the document, we need to compare the last modification time and if it is newer
-    // we must rescan the document, otherwise return
-    if (existing_id != -1 && !currentlyProcessing) {
-        Q_ASSERT(existing_time != -1);
-        if (document_time == existing_time) {
-            // No need to rescan, but we do have to schedule next
-            return updateFolderToIndex(folder_id, countForFolder);
-        }
-        if (!removeChunksByDocumentId(q, existing_id)) {
-            handleDocumentError("ERROR: Cannot remove chunks of document",
-                existing_id, document_path, q.lastError());
-            return updateFolderToIndex(folder_id, countForFolder);
-        }
-        updateCollectionStatistics();
-    }
-
-    // Update the document_time for an existing document, or add it for the first time now
-    int document_id = existing_id;
-    if (!currentlyProcessing) {
-        if (document_id != -1) {
-            if (!updateDocument(q, document_id, document_time)) {
-                handleDocumentError("ERROR: Could not update document_time",
-                    document_id, document_path, q.lastError());
-                return updateFolderToIndex(folder_id, countForFolder);
-            }
-        } else {
-            if (!addDocument(q, folder_id, document_time, document_path, &document_id)) {
-                handleDocumentError("ERROR: Could not add document",
-                    document_id, document_path, q.lastError());
-                return updateFolderToIndex(folder_id, countForFolder);
-            }
-
-            CollectionItem item = guiCollectionItem(folder_id);
-            item.totalDocs += 1;
-            updateGuiForCollectionItem(item);
-        }
-    }
-
-    // Get the embedding model for this folder
-    // FIXME(jared): there can be more than one since we allow one folder to be in multiple collections
-    QString embedding_model;
-    if (!sqlGetFolderEmbeddingModel(q, folder_id, embedding_model)) {
-        handleDocumentError("ERROR: Could not get embedding model",
-            document_id, document_path, q.lastError());
-        return updateFolderToIndex(folder_id, countForFolder);
-    }
-
-    Q_ASSERT(document_id != -1);
-
-    {
-        try {
-            m_chunkStreamer.setDocument(info, document_id, embedding_model);
-        } catch (const std::runtime_error &e) {
-            qWarning() << "LocalDocs ERROR:" << e.what();
-            goto dequeue;
-        }
-    }
-
-    switch (m_chunkStreamer.step()) {
-    case ChunkStreamer::Status::INTERRUPTED:
-        info.currentlyProcessing = true;
-        enqueueDocumentInternal(std::move(info), /*prepend*/ true);
-        return updateFolderToIndex(folder_id, countForFolder + 1);
-    case ChunkStreamer::Status::BINARY_SEEN:
-        /* When we see a binary file, we treat it like an empty file so we know not to
-         * scan it again. All existing chunks are removed, and in-progress embeddings
-         * are ignored when they complete. */
-        qInfo() << "LocalDocs: Ignoring file with binary data:" << document_path;
+            existing_id, document_path, q.lastError());
+        return skipDocument();
+    }
 
-        // this will also ensure in-flight embeddings are ignored
-        if (!removeChunksByDocumentId(q, existing_id))
-            handleDocumentError("ERROR: Cannot remove chunks of document", existing_id, document_path, q.lastError());
-        updateCollectionStatistics();
-        break;
-    case ChunkStreamer::Status::ERROR:
-        qWarning() << "error reading" << document_path;
-        break;
-    case ChunkStreamer::Status::DOC_COMPLETE:
-        ;
+    // If we have the document, we need to compare the last modification time and if it is newer
+    // we must check whether its content changed, otherwise return
+    std::optional<StoredDocumentText> storedText;
+    if (existing_id != -1) {
+        Q_ASSERT(existing_time != -1);
+        if (document_time == existing_time) {
+            // No need to rescan, but we do have to schedule next
+            if (m_documentIdCache.contains(existing_id))
+                return skipDocument();
+
+            // it lost its chunks, e.g. because the chunk size changed, chunk its stored text again
+            if (!selectDocumentText(q, existing_id, &storedText)) {
+                handleDocumentError("ERROR: Cannot select text of document",
+                    existing_id, document_path, q.lastError());
+                return skipDocument();
+            }
+            if (!storedText)
+                return skipDocument();
+        }
     }
 
-dequeue:
-    auto item = guiCollectionItem(folder_id);
-    Q_ASSERT(item.currentBytesToIndex >= info.file.size());
-    if (item.currentBytesToIndex < info.file.size()) {
-        qWarning() << "Database ERROR: underflow in current bytes to index statistics";
-        item.currentBytesToIndex = 0;
+    // Get the embedding model for this folder
+    // FIXME(jared): there can be more than one since we allow one folder to be in multiple collections
+    QString embedding_model;
+    if (!sqlGetFolderEmbeddingModel(q, folder_id, embedding_model)) {
+        handleDocumentError("ERROR: Could not get embedding model",
+            existing_id, document_path, q.lastError());
+        return skipDocument();
+    }
+
+    // hash the content on the thread pool, see handleContentHash for what happens next, or chunk the
+    // stored text right away
+    auto job = std::make_shared<IngestJob>();
+    job->folder         = folder_id;
+    job->documentPath   = document_path;
+    job->fileName       = info.file.fileName();
+    job->fileSize       = info.file.size();
+    job->documentId     = existing_id;
+    job->documentTime   = document_time;
+    job->embeddingModel = embedding_model;
+    job->chunkSize      = m_chunkSize;
+    if (!m_tokenizer)
+        m_tokenizer = m_embLLM->tokenizer(); // loads the embedding model if needed, retried if that fails
+    job->tokenizer      = m_tokenizer.value_or(EmbeddingTokenizer());
+    job->storedText     = std::move(storedText);
+    m_ingestJobs.insert(document_path, job);
+    if (job->storedText) {
+        m_parserPool.start([job, queue = &m_chunkBatchQueue] { parseDocument(job, queue); });
     } else {
-        item.currentBytesToIndex -= info.file.size();
+        m_parserPool.start([job, queue = &m_chunkBatchQueue] { hashDocument(job, queue); });
     }
-    updateGuiForCollectionItem(item);
-    return updateFolderToIndex(folder_id, countForFolder);
+    return true;
 }
 
 void Database::scanDocuments(int folder_id, const QString &folder_path)
@@ -1915,6 +2717,11 @@ void Database::scanDocuments(int folder_id, const QString &folder_path)
         infos.push_back({ folder_id, fileInfo });
     }
 
+    queueDocuments(folder_id, std::move(infos));
+}
+
+void Database::queueDocuments(int folder_id, std::list<DocumentInfo> &&infos)
+{
     if (!infos.empty()) {
         CollectionItem item = guiCollectionItem(folder_id);
         item.indexing = true;
@@ -1927,10 +2734,14 @@ void Database::scanDocuments(int folder_id, const QString &folder_path)
 
 void Database::start()
 {
-    connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, &Database::directoryChanged);
+    connect(m_watcher, &FolderWatcher::changed, this, &Database::handleWatchedChanges);
     connect(m_embLLM, &EmbeddingLLM::embeddingsGenerated, this, &Database::handleEmbeddingsGenerated);
     connect(m_embLLM, &EmbeddingLLM::errorGenerated, this, &Database::handleErrorGenerated);
     m_scanIntervalTimer->callOnTimeout(this, &Database::scanQueueBatch);
+    m_checkTimer->callOnTimeout(this, &Database::checkConsistency);
+    m_metricsClock.start();
+    m_metricsTimer->callOnTimeout(this, &Database::reportMetrics);
+    m_metricsTimer->start(s_metricsInterval);
 
     const QString modelPath = MySettings::globalInstance()->modelPath();
     QList<CollectionItem> oldCollections;
@@ -1940,6 +2751,7 @@ void Database::start()
     } else if (!initDb(modelPath, oldCollections)) {
         m_databaseValid = false;
     } else {
+        useIncrementalVacuum();
         cleanDB();
         ftsIntegrityCheck();
         QSqlQuery q(m_db);
@@ -1947,6 +2759,7 @@ void Database::start()
             m_databaseValid = false;
         } else {
             addCurrentFolders();
+            startConsistencyCheck();
         }
     }
 
@@ -1981,81 +2794,101 @@ void Database::addCurrentFolders()
     updateCollectionStatistics();
 }
 
+/* Embeds the chunks that were left without an embedding, e.g. because we were closed while indexing.
+ * They are not loaded all at once, resumeUncompletedEmbeddings sends them to the embedding model a
+ * page at a time as it catches up. */
 void Database::scheduleUncompletedEmbeddings()
 {
-    QHash<IncompleteChunk, QStringList> chunkList;
+    // chunks added after this are sent to the embedding model as they are added
     QSqlQuery q(m_db);
-    if (!selectAllUncompletedChunks(q, chunkList)) {
-        qWarning() << "ERROR: Cannot select uncompleted chunks" << q.lastError();
+    if (!q.exec(SELECT_MAX_CHUNK_ID_SQL) || !q.next()) {
+        qWarning() << "ERROR: Cannot select last chunk id" << q.lastError();
         return;
     }
+    m_resumeChunkId = 0;
+    m_resumeLastChunkId = q.value(0).toInt();
+    q.finish();
+    resumeUncompletedEmbeddings();
 
-    if (chunkList.isEmpty())
+    QHash<int, int> folderNIncomplete;
+    if (!countUncompletedChunks(q, &folderNIncomplete)) {
+        qWarning() << "ERROR: Cannot count uncompleted chunks" << q.lastError();
         return;
+    }
 
-    // map of folder_id -> chunk count
-    QMap<int, int> folderNChunks;
-    for (auto it = chunkList.keyBegin(), end = chunkList.keyEnd(); it != end; ++it) {
-        int folder_id = it->folder_id;
-
-        if (folderNChunks.contains(folder_id)) continue;
+    for (const auto &[folder_id, nIncomplete]: std::as_const(folderNIncomplete).asKeyValueRange()) {
+        if (!m_collectionMap.contains(folder_id)) continue;
         int total = 0;
         if (!selectCountChunks(q, folder_id, total)) {
             qWarning() << "ERROR: Cannot count total chunks" << q.lastError();
             return;
         }
-        folderNChunks.insert(folder_id, total);
-    }
-
-    // map of (folder_id, collection) -> incomplete count
-    QMap<QPair<int, QString>, int> itemNIncomplete;
-    for (const auto &[chunk, collections]: std::as_const(chunkList).asKeyValueRange())
-        for (const auto &collection: std::as_const(collections))
-            itemNIncomplete[{ chunk.folder_id, collection }]++;
-
-    for (const auto &[key, nIncomplete]: std::as_const(itemNIncomplete).asKeyValueRange()) {
-        const auto &[folder_id, collection] = key;
 
         /* FIXME(jared): this needs to be split by collection because different
          * collections have different embedding models */
-        int total = folderNChunks.value(folder_id);
         CollectionItem item = guiCollectionItem(folder_id);
         item.totalEmbeddingsToIndex = total;
         item.currentEmbeddingsToIndex = nIncomplete;
         updateGuiForCollectionItem(item);
     }
+}
+
+// sends the next pages of uncompleted chunks, as long as the embedding model keeps up with them
+void Database::resumeUncompletedEmbeddings()
+{
+    QSqlQuery q(m_db);
+    while (m_resumeChunkId < m_resumeLastChunkId && m_pendingEmbeddings < s_maxPendingEmbeddings) {
+        QList<EmbeddingChunk> page;
+        if (!selectUncompletedChunks(q, m_resumeChunkId, m_resumeLastChunkId, s_batchSize, &page)) {
+            qWarning() << "ERROR: Cannot select uncompleted chunks" << q.lastError();
+            m_resumeChunkId = m_resumeLastChunkId;
+            return;
+        }
+        q.finish();
+
+        if (page.size() < s_batchSize) {
+            m_resumeChunkId = m_resumeLastChunkId; // this is the last page
+        } else {
+            // a chunk can span pages if it is embedded with more than one model, finish it in the next one
+            const int lastId = page.constLast().chunk_id;
+            page.removeIf([lastId](const EmbeddingChunk &c) { return c.chunk_id == lastId; });
+            if (page.isEmpty()) {
+                qWarning() << "ERROR: Too many embeddings for chunk" << lastId;
+                m_resumeChunkId = lastId;
+                continue;
+            }
+            m_resumeChunkId = page.constLast().chunk_id;
+        }
 
-    for (auto it = chunkList.keyBegin(), end = chunkList.keyEnd(); it != end;) {
-        QList<EmbeddingChunk> batch;
-        for (; it != end && batch.size() < s_batchSize; ++it)
-            batch.append({ /*model*/ it->embedding_model, /*folder_id*/ it->folder_id, /*chunk_id*/ it->chunk_id, /*chunk*/ it->text });
-        Q_ASSERT(!batch.isEmpty());
-        m_embLLM->generateDocEmbeddingsAsync(batch);
+        dropDuplicateChunks(page);
+        if (page.isEmpty())
+            continue;
+        requestEmbeddings(page);
     }
 }
 
 void Database::updateCollectionStatistics()
 {
     QSqlQuery q(m_db);
-    QList<CollectionItem> collections;
-    if (!selectAllFromCollections(q, &collections)) {
-        qWarning() << "ERROR: Cannot select collections" << q.lastError();
+    if (!q.exec(SELECT_ALL_STATISTICS_SQL)) {
+        qWarning() << "ERROR: could not select statistics" << q.lastError();
         return;
     }
 
-    for (const auto &i: std::as_const(collections)) {
-        int total_docs = 0;
-        int total_words = 0;
-        int total_tokens = 0;
-        if (!selectCountStatistics(q, i.folder_id, &total_docs, &total_words, &total_tokens)) {
-            qWarning() << "ERROR: could not count statistics for folder" << q.lastError();
-        } else {
-            CollectionItem item = guiCollectionItem(i.folder_id);
-            item.totalDocs = total_docs;
-            item.totalWords = total_words;
-            item.totalTokens = total_tokens;
-            updateGuiForCollectionItem(item);
-        }
+    while (q.next()) {
+        const int folder_id = q.value(0).toInt();
+        if (!m_collectionMap.contains(folder_id))
+            continue;
+        CollectionItem item = guiCollectionItem(folder_id);
+        const auto total_docs   = size_t(q.value(1).toLongLong());
+        const auto total_words  = size_t(q.value(2).toLongLong());
+        const auto total_tokens = size_t(q.value(3).toLongLong());
+        if (item.totalDocs == total_docs && item.totalWords == total_words && item.totalTokens == total_tokens)
+            continue;
+        item.totalDocs = total_docs;
+        item.totalWords = total_words;
+        item.totalTokens = total_tokens;
+        updateGuiForCollectionItem(item);
     }
 }
 
@@ -2210,7 +3043,7 @@ void Database::removeFolder(const QString &collection, const QString &path)
     Q_ASSERT(folder_id != -1);
     if (folder_id == -1) {
         qWarning() << "ERROR: Collected folder does not exist in db" << path;
-        m_watcher->removePath(path);
+        m_watcher->removeDirectory(path);
         return;
     }
 
@@ -2218,6 +3051,7 @@ void Database::removeFolder(const QString &collection, const QString &path)
 
     if (removeFolderInternal(collection, folder_id, path)) {
         commit();
+        incrementalVacuum();
     } else {
         rollback();
     }
@@ -2284,13 +3118,7 @@ void Database::addFolderToWatch(const QString &path)
 #if defined(DEBUG)
     qDebug() << "addFolderToWatch" << path;
 #endif
-    // pre-check because addPath returns false for already watched paths
-    if (!m_watchedPaths.contains(path)) {
-        if (!m_watcher->addPath(path))
-            qWarning() << "Database::addFolderToWatch: failed to watch" << path;
-        // add unconditionally to suppress repeated warnings
-        m_watchedPaths << path;
-    }
+    m_watcher->addDirectory(path);
 }
 
 void Database::removeFolderFromWatch(const QString &path)
@@ -2298,13 +3126,7 @@ void Database::removeFolderFromWatch(const QString &path)
 #if defined(DEBUG)
     qDebug() << "removeFolderFromWatch" << path;
 #endif
-    QDirIterator it(path, QDir::Readable | QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
-    QStringList children { path };
-    while (it.hasNext())
-        children.append(it.next());
-
-    m_watcher->removePaths(children);
-    m_watchedPaths -= QSet(children.begin(), children.end());
+    m_watcher->removeDirectory(path);
 }
 
 QList<int> Database::searchEmbeddingsHelper(const std::vector<float> &query, QSqlQuery &q, int nNeighbors)
@@ -2607,6 +3429,10 @@ void Database::retrieveFromDB(const QList<QString> &collections, const QString &
     qDebug() << "retrieveFromDB" << collections << text << retrievalSize;
 #endif
 
+    QElapsedTimer timer;
+    timer.start();
+    auto observe = qScopeGuard([&] { ServerMetrics::globalInstance()->observeRetrieval(timer.nsecsElapsed() / 1e9); });
+
     QList<int> searchResults = searchDatabase(text, collections, retrievalSize);
     if (searchResults.isEmpty())
         return;
@@ -2673,9 +3499,7 @@ bool Database::ftsIntegrityCheck()
     return true;
 }
 
-// FIXME This is very slow and non-interruptible and when we close the application and we're
-// cleaning a large table this can cause the app to take forever to shut down. This would ideally be
-// interruptible and we'd continue 'cleaning' when we restart
+// removes folders that no longer exist, the documents are checked by checkConsistency
 bool Database::cleanDB()
 {
 #if defined(DEBUG)
@@ -2706,46 +3530,341 @@ bool Database::cleanDB()
         }
     }
 
-    // Scan all documents in db to make sure they still exist
-    if (!q.prepare(SELECT_ALL_DOCUMENTS_SQL)) {
-        qWarning() << "ERROR: Cannot prepare sql for select all documents" << q.lastError();
-        rollback();
+    commit();
+    return true;
+}
+
+/* Documents that either don't exist or have become unreadable are removed once the scan queue has
+ * drained, unless the same content turns up under another path first. */
+void Database::orphanDocument(int document_id, const QString &document_path)
+{
+    if (m_orphanedDocuments.contains(document_id))
+        return;
+    m_orphanedDocuments.insert(document_id, { document_path, QDateTime::currentMSecsSinceEpoch() });
+    m_scanIntervalTimer->start();
+}
+
+// orphans the documents at or below path whose files are gone
+bool Database::orphanMissingDocuments(QSqlQuery &q, const QString &path, bool recursive)
+{
+    QList<QPair<int, QString>> documents;
+    if (!selectDocumentsUnderPath(q, path, &documents))
         return false;
+    for (const auto &[document_id, document_path]: std::as_const(documents)) {
+        QFileInfo info(document_path);
+        if (!recursive && document_path != path && info.path() != path)
+            continue;
+        if (!info.exists() || !info.isReadable())
+            orphanDocument(document_id, document_path);
     }
+    return true;
+}
 
-    if (!q.exec()) {
-        qWarning() << "ERROR: Cannot exec sql for select all documents" << q.lastError();
+void Database::removeOrphanedDocuments()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    bool removedAny = false;
+
+    transaction();
+
+    QSqlQuery q(m_db);
+    for (auto it = m_orphanedDocuments.begin(); it != m_orphanedDocuments.end();) {
+        if (now - it->missingSince < s_orphanGracePeriod) {
+            ++it;
+            continue;
+        }
+
+        const int document_id = it.key();
+        QFileInfo info(it->path);
+        it = m_orphanedDocuments.erase(it);
+        if (info.exists() && info.isReadable() && m_scannedFileExtensions.contains(info.suffix(), Qt::CaseInsensitive))
+            continue; // it came back
+
+#if defined(DEBUG)
+        qDebug() << "removing orphaned document" << document_id << info.filePath();
+#endif
+
+        // Remove all chunks and documents that either don't exist or have become unreadable
+        if (!removeChunksByDocumentId(q, document_id)) {
+            qWarning() << "ERROR: Cannot remove chunks of document_id" << document_id << q.lastError();
+            return rollback();
+        }
+
+        if (!removeDocument(q, document_id)) {
+            qWarning() << "ERROR: Cannot remove document_id" << document_id << q.lastError();
+            return rollback();
+        }
+        removedAny = true;
+    }
+
+    commit();
+
+    if (removedAny)
+        updateCollectionStatistics();
+}
+
+namespace {
+    // the tables in the order they are checked, see Database::checkConsistency
+    enum class CheckStage { Documents, DocumentTexts, Chunks, Embeddings, Done };
+} // namespace
+
+// while documents are being indexed, what the check would find is still changing
+bool Database::isIdle() const
+{
+    return m_docsToScan.empty() && m_ingestJobs.isEmpty() && m_pendingEmbeddings == 0 && m_chunkList.isEmpty()
+        && m_resumeChunkId >= m_resumeLastChunkId && m_orphanedDocuments.isEmpty();
+}
+
+/* Checks the whole database for inconsistencies a small slice at a time, while we are otherwise idle,
+ * and repairs what it finds: documents whose file is gone, text and chunks without a document,
+ * chunks missing from the full-text index or without an embedding, and embeddings without a chunk.
+ * Where it got to is kept in the database, so a check that was interrupted continues on the next
+ * start. */
+void Database::checkConsistency()
+{
+    if (!isIdle())
+        return; // try again later
+
+    QSqlQuery q(m_db);
+    if (m_checkStage == int(CheckStage::Done)) {
+        m_checkStage = int(CheckStage::Documents);
+        m_checkLastId = 0;
+        m_checkTimer->setInterval(s_checkSliceInterval);
+    }
+
+    qint64 sliceEnd = 0;
+    if (!q.prepare(CHECK_SLICE_END_SQL[m_checkStage])) {
+        qWarning() << "ERROR: Cannot prepare sql for consistency check" << q.lastError();
+        return m_checkTimer->stop();
+    }
+    q.addBindValue(m_checkLastId);
+    q.addBindValue(s_checkSliceRows);
+    if (!q.exec() || !q.next()) {
+        qWarning() << "ERROR: Cannot exec sql for consistency check" << q.lastError();
+        return m_checkTimer->stop();
+    }
+    const bool stageDone = q.isNull(0);
+    if (!stageDone)
+        sliceEnd = q.value(0).toLongLong();
+    q.finish();
+
+    transaction();
+
+    bool ok = true;
+    if (stageDone) {
+        // this table is done, continue with the next one
+        m_checkStage++;
+        m_checkLastId = 0;
+    } else {
+        switch (CheckStage(m_checkStage)) {
+        case CheckStage::Documents:     ok = checkDocuments    (q, m_checkLastId, sliceEnd); break;
+        case CheckStage::DocumentTexts: ok = checkDocumentTexts(q, m_checkLastId, sliceEnd); break;
+        case CheckStage::Chunks:        ok = checkChunks       (q, m_checkLastId, sliceEnd); break;
+        case CheckStage::Embeddings:    ok = checkEmbeddings   (q, m_checkLastId, sliceEnd); break;
+        case CheckStage::Done:          Q_UNREACHABLE();
+        }
+        m_checkLastId = sliceEnd;
+    }
+
+    if (ok) {
+        if (!q.prepare(UPDATE_CONSISTENCY_CHECK_SQL)) {
+            ok = false;
+        } else {
+            q.addBindValue(m_checkStage);
+            q.addBindValue(m_checkLastId);
+            ok = q.exec();
+        }
+    }
+    if (!ok) {
+        qWarning() << "ERROR: Consistency check failed" << q.lastError();
         rollback();
-        return false;
+        return m_checkTimer->stop();
+    }
+
+    commit();
+
+    if (!m_chunkList.isEmpty())
+        sendChunkList();
+
+    if (m_checkStage == int(CheckStage::Done)) {
+#if defined(DEBUG)
+        qDebug() << "consistency check done";
+#endif
+        m_checkTimer->setInterval(s_checkPassInterval);
+    }
+}
+
+void Database::startConsistencyCheck()
+{
+    QSqlQuery q(m_db);
+    if (!q.exec(SELECT_CONSISTENCY_CHECK_SQL)) {
+        qWarning() << "ERROR: Cannot select consistency check" << q.lastError();
+        return;
+    }
+    if (q.next()) {
+        m_checkStage = q.value(0).toInt();
+        m_checkLastId = q.value(1).toLongLong();
     }
+    if (m_checkStage < 0 || m_checkStage > int(CheckStage::Done))
+        m_checkStage = int(CheckStage::Done);
+    m_checkTimer->setInterval(s_checkSliceInterval);
+    m_checkTimer->start();
+}
+
+// orphans documents whose file is gone, and removes documents whose folder is gone
+bool Database::checkDocuments(QSqlQuery &q, qint64 from, qint64 to)
+{
+    if (!q.prepare(CHECK_DOCUMENTS_SQL))
+        return false;
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec())
+        return false;
 
+    QList<int> removed;
     while (q.next()) {
-        int document_id = q.value(0).toInt();
-        QString document_path = q.value(1).toString();
+        const int document_id = q.value(0).toInt();
+        const QString document_path = q.value(1).toString();
+        if (q.value(2).toBool()) {
+            removed << document_id;
+            continue;
+        }
         QFileInfo info(document_path);
         if (info.exists() && info.isReadable() && m_scannedFileExtensions.contains(info.suffix(), Qt::CaseInsensitive))
             continue;
-
 #if defined(DEBUG)
-        qDebug() << "clean db removing document" << document_id << document_path;
+        qDebug() << "consistency check orphaning document" << document_id << document_path;
 #endif
+        orphanDocument(document_id, document_path);
+    }
+    q.finish();
 
-        // Remove all chunks and documents that either don't exist or have become unreadable
-        QSqlQuery query(m_db);
-        if (!removeChunksByDocumentId(query, document_id)) {
-            qWarning() << "ERROR: Cannot remove chunks of document_id" << document_id << query.lastError();
-            rollback();
+    for (int document_id: std::as_const(removed)) {
+        qWarning() << "LocalDocs: removing document" << document_id << "of a folder that no longer exists";
+        if (!removeChunksByDocumentId(q, document_id) || !removeDocument(q, document_id))
             return false;
-        }
+    }
+    return true;
+}
 
-        if (!removeDocument(query, document_id)) {
-            qWarning() << "ERROR: Cannot remove document_id" << document_id << query.lastError();
-            rollback();
+bool Database::checkDocumentTexts(QSqlQuery &q, qint64 from, qint64 to)
+{
+    if (!q.prepare(DELETE_ORPHANED_DOCUMENT_TEXTS_SQL))
+        return false;
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec())
+        return false;
+    if (q.numRowsAffected() > 0)
+        qWarning() << "LocalDocs: removed" << q.numRowsAffected() << "orphaned document texts";
+    return true;
+}
+
+// a phrase query for the first few words of a chunk, which matches it if it is in the full-text index
+static QString ftsPhrase(const QString &text)
+{
+    QStringList words;
+    for (auto word: QStringTokenizer(text, u' ', Qt::SkipEmptyParts)) {
+        // words without a letter or digit are not indexed
+        if (std::none_of(word.begin(), word.end(), [](QChar c) { return c.isLetterOrNumber(); }))
+            continue;
+        words << word.trimmed().toString();
+        if (words.size() >= 4)
+            break;
+    }
+    QString phrase = words.join(u' ');
+    phrase.replace(u'"', u"\"\""_s);
+    return u'"' + phrase + u'"';
+}
+
+/* Removes chunks without a document, and repairs chunks that would not be found: missing from the
+ * full-text index, or without an embedding for a collection they are in. */
+bool Database::checkChunks(QSqlQuery &q, qint64 from, qint64 to)
+{
+    // chunks without a document
+    if (!q.prepare(SELECT_ORPHANED_CHUNKS_SQL))
+        return false;
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec())
+        return false;
+    QList<int> orphaned;
+    while (q.next())
+        orphaned << q.value(0).toInt();
+    q.finish();
+    if (!orphaned.isEmpty()) {
+        qWarning() << "LocalDocs: removing" << orphaned.size() << "orphaned chunks";
+        QSqlError error;
+        if (!removeChunks(orphaned, &error)) {
+            qWarning() << "ERROR: Cannot remove orphaned chunks" << error;
             return false;
         }
     }
 
-    commit();
+    // chunks missing from the full-text index
+    if (!q.prepare(SELECT_CHUNK_TEXTS_SQL))
+        return false;
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec())
+        return false;
+    QList<int> unindexed;
+    QSqlQuery mq(m_db);
+    while (q.next()) {
+        const QString phrase = ftsPhrase(q.value(1).toString());
+        if (phrase.size() <= 2)
+            continue; // no words to look for, it can't be found by a full-text search anyway
+        if (!mq.prepare(SELECT_CHUNK_FTS_MATCH_SQL))
+            return false;
+        mq.addBindValue(phrase);
+        mq.addBindValue(q.value(0).toInt());
+        if (!mq.exec())
+            continue; // not a query fts5 understands, so we can't tell
+        if (!mq.next())
+            unindexed << q.value(0).toInt();
+        mq.finish();
+    }
+    q.finish();
+    if (!unindexed.isEmpty())
+        qWarning() << "LocalDocs: adding" << unindexed.size() << "chunks missing from the full-text index";
+    for (int chunk_id: std::as_const(unindexed)) {
+        if (!q.prepare(INSERT_CHUNK_FTS_ENTRY_SQL))
+            return false;
+        q.addBindValue(chunk_id);
+        if (!q.exec())
+            return false;
+    }
+
+    // chunks without an embedding
+    QList<EmbeddingChunk> unembedded;
+    if (!selectUncompletedChunks(q, int(from), int(to), -1, &unembedded))
+        return false;
+    q.finish();
+    dropDuplicateChunks(unembedded);
+    if (!unembedded.isEmpty())
+        qWarning() << "LocalDocs: embedding" << unembedded.size() << "chunks that are missing an embedding";
+    QHash<int, int> folderNChunks;
+    for (const auto &chunk: std::as_const(unembedded)) {
+        appendChunk(chunk);
+        folderNChunks[chunk.folder_id]++;
+    }
+    for (const auto &[folder_id, nChunks]: std::as_const(folderNChunks).asKeyValueRange()) {
+        if (m_collectionMap.contains(folder_id))
+            updateGuiForAddedChunks(folder_id, nChunks, 0, 0);
+    }
+    return true;
+}
+
+bool Database::checkEmbeddings(QSqlQuery &q, qint64 from, qint64 to)
+{
+    if (!q.prepare(DELETE_ORPHANED_EMBEDDINGS_SQL))
+        return false;
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec())
+        return false;
+    if (q.numRowsAffected() > 0)
+        qWarning() << "LocalDocs: removed" << q.numRowsAffected() << "orphaned embeddings";
     return true;
 }
 
@@ -2759,8 +3878,7 @@ void Database::changeChunkSize(int chunkSize)
 #endif
 
     QSqlQuery q(m_db);
-    // Scan all documents in db to make sure they still exist
-    if (!q.prepare(SELECT_ALL_DOCUMENTS_SQL)) {
+    if (!q.prepare(SELECT_ALL_DOCUMENTS_WITH_TEXT_SQL)) {
         qWarning() << "ERROR: Cannot prepare sql for select all documents" << q.lastError();
         return;
     }
@@ -2772,22 +3890,32 @@ void Database::changeChunkSize(int chunkSize)
 
     transaction();
 
+    QList<int> removed;
     while (q.next()) {
         int document_id = q.value(0).toInt();
-        // Remove all chunks and documents to change the chunk size
+        bool has_text = q.value(1).toBool();
+        // Remove all chunks to change the chunk size
         QSqlQuery query(m_db);
         if (!removeChunksByDocumentId(query, document_id)) {
             qWarning() << "ERROR: Cannot remove chunks of document_id" << document_id << query.lastError();
             return rollback();
         }
 
+        // documents with stored text are chunked again from it by scanQueue, the others are parsed again
+        if (has_text)
+            continue;
         if (!removeDocument(query, document_id)) {
             qWarning() << "ERROR: Cannot remove document_id" << document_id << query.lastError();
             return rollback();
         }
+        removed << document_id;
     }
 
     commit();
+    incrementalVacuum();
+    // the orphaned documents that were kept can still be matched to a moved file
+    for (int document_id: std::as_const(removed))
+        m_orphanedDocuments.remove(document_id);
 
     m_chunkSize = chunkSize;
     addCurrentFolders();
@@ -2818,39 +3946,96 @@ void Database::changeFileExtensions(const QStringList &extensions)
     }
 }
 
-void Database::directoryChanged(const QString &path)
+void Database::handleWatchedChanges(const QStringList &files, const QStringList &directories)
 {
 #if defined(DEBUG)
-    qDebug() << "directoryChanged" << path;
+    qDebug() << "handleWatchedChanges" << files.size() << "files" << directories.size() << "directories";
 #endif
 
-    // search for a collection that contains this folder (we watch subdirectories)
-    int folder_id = -1;
-    QDir dir(path);
-    for (;;) {
-        QSqlQuery q(m_db);
-        if (!selectFolder(q, dir.path(), &folder_id)) {
-            qWarning() << "ERROR: Cannot select folder from path" << dir.path() << q.lastError();
-            return;
+    QSqlQuery q(m_db);
+    QList<CollectionItem> collections;
+    if (!selectAllFromCollections(q, &collections)) {
+        qWarning() << "ERROR: Cannot select collections" << q.lastError();
+        return;
+    }
+
+    // search for the collection folder that contains a path (we watch subdirectories)
+    auto folderOf = [&collections](const QString &path) -> const CollectionItem * {
+        const CollectionItem *folder = nullptr;
+        for (const auto &i: std::as_const(collections)) {
+            if (path != i.folder_path && !path.startsWith(i.folder_path + u'/'))
+                continue;
+            if (!folder || i.folder_path.size() > folder->folder_path.size())
+                folder = &i;
         }
-        if (folder_id != -1)
-            break;
+        return folder;
+    };
 
-        // check next parent
-        if (!dir.cdUp()) {
-            if (!dir.isRoot()) break; // folder removed
-            Q_ASSERT(false);
-            qWarning() << "ERROR: Watched folder does not exist in db" << path;
-            m_watcher->removePath(path);
-            return;
+    bool folderRemoved = false;
+    auto handleMissing = [&](const CollectionItem *folder, const QString &path) {
+        if (path == folder->folder_path) {
+            folderRemoved = true; // cleanDB takes care of it below
+        } else if (!orphanMissingDocuments(q, path, /*recursive*/ true)) {
+            qWarning() << "ERROR: Cannot select documents under path" << path << q.lastError();
+        }
+    };
+
+    std::map<int, std::list<DocumentInfo>> infos;
+    QStringList dirsToScan = directories;
+
+    for (const auto &path: files) {
+        const auto *folder = folderOf(path);
+        if (!folder)
+            continue;
+
+        QFileInfo info(path);
+        if (!info.exists()) {
+            handleMissing(folder, path);
+        } else if (info.isDir()) {
+            dirsToScan << path;
+        } else if (info.isReadable() && m_scannedFileExtensions.contains(info.suffix(), Qt::CaseInsensitive)) {
+            infos[folder->folder_id].push_back({ folder->folder_id, info });
         }
     }
 
-    // Clean the database
-    if (cleanDB())
-        updateCollectionStatistics();
+    for (const auto &path: std::as_const(dirsToScan)) {
+        const auto *folder = folderOf(path);
+        if (!folder) {
+            m_watcher->removeDirectory(path); // no longer part of a collection
+            continue;
+        }
+
+        if (!QFileInfo(path).isDir()) {
+            handleMissing(folder, path);
+            continue;
+        }
+
+        // a directory we don't know yet, e.g. one that was just created or moved here
+        if (!m_watcher->isWatching(path)) {
+            scanDocuments(folder->folder_id, path);
+            continue;
+        }
+
+        // only the directory itself changed, its subdirectories report their own changes
+        if (!orphanMissingDocuments(q, path, /*recursive*/ false))
+            qWarning() << "ERROR: Cannot select documents under path" << path << q.lastError();
+        QDirIterator it(path, QDir::Readable | QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot);
+        while (it.hasNext()) {
+            it.next();
+            QFileInfo fileInfo = it.fileInfo();
+            if (fileInfo.isDir()) {
+                if (!m_watcher->isWatching(fileInfo.canonicalFilePath()))
+                    scanDocuments(folder->folder_id, fileInfo.canonicalFilePath());
+            } else if (m_scannedFileExtensions.contains(fileInfo.suffix(), Qt::CaseInsensitive)) {
+                infos[folder->folder_id].push_back({ folder->folder_id, fileInfo });
+            }
+        }
+    }
 
-    // Rescan the documents associated with the folder
-    if (folder_id != -1)
-        scanDocuments(folder_id, path);
+    for (auto &[folder_id, folderInfos]: infos)
+        queueDocuments(folder_id, std::move(folderInfos));
+
+    // Clean the database of folders that were removed
+    if (folderRemoved && cleanDB())
+        updateCollectionStatistics();
 }
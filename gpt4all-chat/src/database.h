@@ -2,6 +2,7 @@
 #define DATABASE_H
 
 #include "embllm.h"
+#include "ingestmetrics.h"
 
 #include <QByteArray>
 #include <QChar>
@@ -11,18 +12,23 @@
 #include <QHash>
 #include <QLatin1String>
 #include <QList>
+#include <QMutex>
 #include <QObject>
 #include <QSet>
 #include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QString>
 #include <QStringList> // IWYU pragma: keep
 #include <QThread>
+#include <QThreadPool>
 #include <QUrl>
 #include <QVector> // IWYU pragma: keep
+#include <QWaitCondition>
 #include <QtAssert>
 
 #include <atomic>
 #include <cstddef>
+#include <deque>
 #include <list>
 #include <map>
 #include <memory>
@@ -34,8 +40,8 @@ using namespace Qt::Literals::StringLiterals;
 
 class Database;
 class DocumentReader;
-class QFileSystemWatcher;
-class QSqlQuery;
+class FolderWatcher;
+class QSqlError;
 class QTextStream;
 class QTimer;
 
@@ -44,6 +50,8 @@ class QTimer;
  * Version 1: GPT4All v2.5.3, embeddings in hsnwlib
  * Version 2: GPT4All v3.0.0, embeddings in sqlite
  * Version 3: GPT4All v3.4.0, hybrid search
+ * Version 4: GPT4All v3.11.0, content hashes, folder statistics, consistency check;
+ *            upgraded in place from version 3
  */
 
 // minimum supported version
@@ -53,11 +61,10 @@ static const int LOCALDOCS_MIN_VER = 1;
 // content table as recommended in the official documentation to keep the fts index in sync
 // See: https://www.sqlite.org/fts5.html#external_content_tables
 
-// FIXME: (Adam) The fts virtual table should include the chunk_id explicitly instead of relying upon
-// the id of the two tables to be in sync
+// The rowid of a chunks_fts row is the id of its chunk.
 
 // current version
-static const int LOCALDOCS_VERSION = 3;
+static const int LOCALDOCS_VERSION = 4;
 
 struct DocumentInfo
 {
@@ -65,7 +72,6 @@ struct DocumentInfo
 
     int       folder;
     QFileInfo file;
-    bool      currentlyProcessing = false;
 
     key_type key() const { return {folder, file.canonicalFilePath()}; } // for comparison
 
@@ -165,25 +171,47 @@ struct CollectionItem {
 };
 Q_DECLARE_METATYPE(CollectionItem)
 
+struct ParsedChunk {
+    QString text;
+    int     page;
+    int     words;
+    int     tokens; // 0 if unknown
+};
+
+/* The text of a document as it was extracted by its reader, so that it can be chunked again without
+ * parsing the document, e.g. when the chunk size changes. */
+struct StoredDocumentText {
+    QString    title;
+    QString    author;
+    QString    subject;
+    QString    keywords;
+    QByteArray pages; // serialized (offset into the text, page number) of each page
+    QByteArray text;  // UTF-8, compressed in segments as it was read, see DocumentReader::compressText
+};
+
 class ChunkStreamer {
 public:
     enum class Status { DOC_COMPLETE, INTERRUPTED, ERROR, BINARY_SEEN };
 
-    explicit ChunkStreamer(Database *database);
+    // throws std::runtime_error if the document cannot be opened
+    ChunkStreamer(DocumentInfo doc, int chunkSize, EmbeddingTokenizer tokenizer,
+                  const StoredDocumentText *storedText = nullptr);
     ~ChunkStreamer();
 
-    void setDocument(DocumentInfo doc, int documentId, const QString &embeddingModel);
-    std::optional<DocumentInfo::key_type> currentDocKey() const;
-    void reset();
+    const QString &title   () const { return m_title;    }
+    const QString &author  () const { return m_author;   }
+    const QString &subject () const { return m_subject;  }
+    const QString &keywords() const { return m_keywords; }
 
-    Status step();
+    // appends up to maxChunks chunks, returns INTERRUPTED if there is more to read
+    Status step(QList<ParsedChunk> &chunks, int maxChunks);
+    // the text read so far, unless it came from a StoredDocumentText to begin with
+    std::optional<StoredDocumentText> takeText();
 
 private:
-    Database                              *m_database;
-    std::optional<DocumentInfo::key_type>  m_docKey;
-    std::unique_ptr<DocumentReader>        m_reader; // may be invalid, always compare key first
-    int                                    m_documentId;
-    QString                                m_embeddingModel;
+    std::unique_ptr<DocumentReader>        m_reader;
+    int                                    m_chunkSize;
+    EmbeddingTokenizer                     m_tokenizer;
     QString                                m_title;
     QString                                m_author;
     QString                                m_subject;
@@ -195,6 +223,78 @@ private:
     int                                    m_page = 0;
 };
 
+// a chunk of the previous content of a modified document
+struct PreviousChunk {
+    int id;
+    int page;
+};
+
+/* A document that is being hashed, then parsed and chunked, on the ingestion thread pool. It is
+ * created and retired by the database thread; parser threads only read it and poll the cancelled
+ * flag. */
+struct IngestJob {
+    // plain values rather than a QFileInfo, the job is shared with the parser threads
+    int                               folder;
+    QString                           documentPath; // canonical, the file may be gone by the time we are done
+    QString                           fileName;     // without the directory
+    qint64                            fileSize;
+    int                               documentId; // -1 for a new document until its content hash is known
+    qint64                            documentTime;
+    QString                           embeddingModel;
+    int                               chunkSize;
+    EmbeddingTokenizer                tokenizer;
+    std::optional<StoredDocumentText> storedText; // chunked instead of the file if set
+    std::atomic<bool>                 cancelled = false;
+
+    /* Set if the content of an indexed document changed. Chunks that come out the same as before
+     * keep their embeddings, the rest are removed once the document is complete, and the new time
+     * and hash are only recorded then so that an interrupted update is picked up again. */
+    std::optional<QByteArray>         newContentHash;
+    QStringList                       previousMetadata; // title, author, subject, keywords
+    QMultiHash<QString, PreviousChunk> previousChunks; // by chunk text
+};
+
+struct ChunkBatch {
+    std::shared_ptr<IngestJob>           job;
+    QString                              title;
+    QString                              author;
+    QString                              subject;
+    QString                              keywords;
+    QList<ParsedChunk>                   chunks;
+    std::optional<ChunkStreamer::Status> status; // set on the last batch of a document
+    std::optional<QByteArray>            contentHash; // the only batch of the hashing step
+    std::optional<StoredDocumentText>    text; // set on the last batch of a document that was parsed
+    qint64                               workUsecs = 0; // spent producing this batch, for IngestMetrics
+    qint64                               bytes = 0; // size of the file, set on the last batch
+};
+
+/* Bounded queue between the parser threads and the database thread. Producers block while it is
+ * full, which is how a slow writer or embedder throttles parsing. */
+class ChunkBatchQueue {
+public:
+    explicit ChunkBatchQueue(qsizetype capacity)
+        : m_capacity(capacity) {}
+
+    // returns false without queueing if the job was cancelled or the queue was closed
+    bool push(ChunkBatch &&batch);
+    std::optional<ChunkBatch> tryPop();
+    qsizetype size();
+    void wakeAll();
+    void close();
+
+private:
+    QMutex                 m_mutex;
+    QWaitCondition         m_notFull;
+    std::deque<ChunkBatch> m_batches;
+    qsizetype              m_capacity;
+    bool                   m_closed = false;
+};
+
+struct OrphanedDocument {
+    QString path;
+    qint64  missingSince; // msecs since epoch
+};
+
 class Database : public QObject
 {
     Q_OBJECT
@@ -226,9 +326,9 @@ Q_SIGNALS:
     void databaseValidChanged();
 
 private Q_SLOTS:
-    void directoryChanged(const QString &path);
+    void handleWatchedChanges(const QStringList &files, const QStringList &directories);
     void addCurrentFolders();
-    void handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
+    void handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings, qint64 nTokens);
     void handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
 
 private:
@@ -236,16 +336,19 @@ private:
     void commit();
     void rollback();
 
-    bool addChunk(QSqlQuery &q, int document_id, const QString &chunk_text, const QString &file,
-                  const QString &title, const QString &author, const QString &subject, const QString &keywords,
-                  int page, int from, int to, int words, int *chunk_id);
+    QSqlQuery &cachedQuery(const QString &sql);
+    bool addChunks(int document_id, const QString &file, const QString &title, const QString &author,
+                   const QString &subject, const QString &keywords, const QList<ParsedChunk> &chunks,
+                   QList<int> *chunk_ids, QSqlError *error);
     bool refreshDocumentIdCache(QSqlQuery &q);
     bool removeChunksByDocumentId(QSqlQuery &q, int document_id);
+    bool removeChunks(const QList<int> &chunk_ids, QSqlError *error);
     bool sqlRemoveDocsByFolderPath(QSqlQuery &q, const QString &path);
     bool hasContent();
     // not found -> 0, , exists and has content -> 1, error -> -1
     int openDatabase(const QString &modelPath, bool create = true, int ver = LOCALDOCS_VERSION);
     bool openLatestDb(const QString &modelPath, QList<CollectionItem> &oldCollections);
+    bool upgradeDb(const QString &modelPath, int ver);
     bool initDb(const QString &modelPath, const QList<CollectionItem> &oldCollections);
     int checkAndAddFolderToDB(const QString &path);
     bool removeFolderInternal(const QString &collection, int folder_id, const QString &path);
@@ -254,6 +357,19 @@ private:
         const QString &keywords, int page, int maxChunks = -1);
     void appendChunk(const EmbeddingChunk &chunk);
     void sendChunkList();
+    void requestEmbeddings(const QList<EmbeddingChunk> &chunks);
+    template <typename T>
+    void recordEmbeddings(const QVector<T> &chunks, qint64 nTokens, bool failed);
+    QString collectionName(int folder_id) const;
+    void reportMetrics();
+    void insertChunkBatch(ChunkBatch &batch);
+    void updateGuiForAddedChunks(int folder_id, int nToEmbed, int nWords, int nTokens);
+    void handleContentHash(const std::shared_ptr<IngestJob> &job, const QByteArray &hash);
+    bool copyChunks(int src_document_id, const IngestJob &job, QSqlError *error);
+    bool finishDocumentUpdate(IngestJob &job, QSqlError *error);
+    void removeOrphanedDocuments();
+    void cancelIngestJob(int document_id);
+    void finishIngestJob(const IngestJob &job);
     void updateFolderToIndex(int folder_id, size_t countForFolder, bool sendChunks = true);
     size_t countOfDocuments(int folder_id) const;
     size_t countOfBytes(int folder_id) const;
@@ -261,9 +377,24 @@ private:
     void removeFolderFromDocumentQueue(int folder_id);
     void enqueueDocumentInternal(DocumentInfo &&info, bool prepend = false);
     void enqueueDocuments(int folder_id, std::list<DocumentInfo> &&infos);
-    void scanQueue();
+    bool scanQueue();
+    void queueDocuments(int folder_id, std::list<DocumentInfo> &&infos);
+    void orphanDocument(int document_id, const QString &document_path);
+    bool orphanMissingDocuments(QSqlQuery &q, const QString &path, bool recursive);
+    void beginBulkIngest();
+    void endBulkIngest();
+    int ftsEndId() const;
+    void incrementalVacuum();
+    bool useIncrementalVacuum();
     bool ftsIntegrityCheck();
     bool cleanDB();
+    bool isIdle() const;
+    void startConsistencyCheck();
+    void checkConsistency();
+    bool checkDocuments(QSqlQuery &q, qint64 from, qint64 to);
+    bool checkDocumentTexts(QSqlQuery &q, qint64 from, qint64 to);
+    bool checkChunks(QSqlQuery &q, qint64 from, qint64 to);
+    bool checkEmbeddings(QSqlQuery &q, qint64 from, qint64 to);
     void addFolderToWatch(const QString &path);
     void removeFolderFromWatch(const QString &path);
     static QList<int> searchEmbeddingsHelper(const std::vector<float> &query, QSqlQuery &q, int nNeighbors);
@@ -294,27 +425,43 @@ private:
     void removeGuiFolderById(const QString &collection, int folder_id);
     void guiCollectionListUpdated(const QList<CollectionItem> &collectionList);
     void scheduleUncompletedEmbeddings();
+    void resumeUncompletedEmbeddings();
     void updateCollectionStatistics();
 
 private:
     QSqlDatabase m_db;
+    QHash<QString, QSqlQuery> m_cachedQueries; // prepared statements by sql, cleared when m_db is reopened
+    bool m_bulkIngest = false;
+    int m_bulkIngestFirstChunkId = 0; // the chunks from this one on are not in the fts index until the bulk ingest ends
+    bool m_vacuumPending = false; // see useIncrementalVacuum
     int m_chunkSize;
     QStringList m_scannedFileExtensions;
     QTimer *m_scanIntervalTimer;
+    QTimer *m_checkTimer;
+    QTimer *m_metricsTimer;
+    int m_checkStage = 0; // see checkConsistency
+    qint64 m_checkLastId = 0; // the last key of the current table that was checked
     QElapsedTimer m_scanDurationTimer;
     std::map<int, std::list<DocumentInfo>> m_docsToScan;
     QList<ResultInfo> m_retrieve;
     QThread m_dbThread;
-    QFileSystemWatcher *m_watcher;
-    QSet<QString> m_watchedPaths;
+    FolderWatcher *m_watcher;
     EmbeddingLLM *m_embLLM;
     QVector<EmbeddingChunk> m_chunkList;
+    size_t m_pendingEmbeddings = 0; // chunks sent to m_embLLM that have not come back yet
+    int m_resumeChunkId = 0; // uncompleted chunks up to this one have been sent to m_embLLM
+    int m_resumeLastChunkId = 0; // the last chunk that was added before we started
     QHash<int, CollectionItem> m_collectionMap; // used only for tracking indexing/embedding progress
     std::atomic<bool> m_databaseValid;
-    ChunkStreamer m_chunkStreamer;
+    std::optional<EmbeddingTokenizer> m_tokenizer; // fetched from m_embLLM once it has loaded the model
+    QThreadPool m_parserPool;
+    ChunkBatchQueue m_chunkBatchQueue;
+    IngestMetrics m_metrics;
+    QElapsedTimer m_metricsClock;
+    QHash<int, qint64> m_embeddingRequestTimes; // usecs on m_metricsClock when each pending chunk was requested
+    QHash<QString, std::shared_ptr<IngestJob>> m_ingestJobs; // document path -> document being hashed or parsed
+    QHash<int, OrphanedDocument> m_orphanedDocuments; // document_id -> document whose file went missing
     QSet<int> m_documentIdCache; // cached list of documents with chunks for fast lookup
-
-    friend class ChunkStreamer;
 };
 
 #endif // DATABASE_H
@@ -1,28 +1,28 @@
 #include "embllm.h"
 
 #include "mysettings.h"
+#include "remoteembedder.h"
 
 #include <gpt4all-backend/llmodel.h>
 
 #include <QCoreApplication>
 #include <QDebug>
 #include <QFileInfo>
-#include <QGuiApplication>
-#include <QJsonArray>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonValue>
 #include <QList>
+#include <QMetaObject>
 #include <QMutexLocker> // IWYU pragma: keep
-#include <QNetworkAccessManager>
-#include <QNetworkReply>
-#include <QNetworkRequest>
+#include <QScopeGuard>
+#include <QThread>
 #include <QUrl>
 #include <Qt>
 #include <QtAssert>
 #include <QtLogging>
+#include <QtMinMax>
 
+#include <algorithm>
 #include <exception>
+#include <future>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
@@ -32,15 +32,23 @@ using namespace Qt::Literals::StringLiterals;
 
 static const QString EMBEDDING_MODEL_NAME = u"nomic-embed-text-v1.5"_s;
 static const QString LOCAL_EMBEDDING_MODEL = u"nomic-embed-text-v1.5.f16.gguf"_s;
-
-EmbeddingLLMWorker::EmbeddingLLMWorker()
+static constexpr int LOCAL_EMBEDDING_N_CTX = 2048;
+// texts embedded at once by one context
+static constexpr int LOCAL_EMBEDDING_BATCH_SIZE = 4;
+// at most, for embedTexts, where no query waits for the batches
+static constexpr int LOCAL_EMBEDDING_MAX_BATCH_SIZE = 32;
+// most contexts of the local model used for documents, each one needs its own compute buffers
+static constexpr int LOCAL_EMBEDDING_MAX_CONTEXTS = 4;
+// query embeddings kept for when the same question is asked again
+static constexpr int QUERY_CACHE_SIZE = 256;
+
+EmbeddingLLMWorker::EmbeddingLLMWorker(bool localOnly)
     : QObject(nullptr)
-    , m_networkManager(new QNetworkAccessManager(this))
+    , m_localOnly(localOnly)
     , m_stopGenerating(false)
+    , m_queryCache(QUERY_CACHE_SIZE)
 {
     moveToThread(&m_workerThread);
-    connect(this, &EmbeddingLLMWorker::requestAtlasQueryEmbedding, this, &EmbeddingLLMWorker::atlasQueryEmbeddingRequested);
-    connect(this, &EmbeddingLLMWorker::finished, &m_workerThread, &QThread::quit, Qt::DirectConnection);
     m_workerThread.setObjectName("embedding");
     m_workerThread.start();
 }
@@ -57,22 +65,45 @@ EmbeddingLLMWorker::~EmbeddingLLMWorker()
     }
 }
 
-void EmbeddingLLMWorker::wait()
+std::optional<EmbeddingTokenizer> EmbeddingLLMWorker::tokenizer()
 {
-    m_workerThread.wait();
+    QMutexLocker locker(&m_mutex);
+    if (!hasModel() && !loadModel())
+        return std::nullopt;
+    if (isRemote())
+        return EmbeddingTokenizer();
+
+    /* Tokenizing only reads the vocabulary, so this does not need m_mutex. The model stays loaded
+     * until we are destroyed. */
+    const LLModel *model = m_model;
+    // special tokens added to every input, and the prefix and separator added to documents
+    const int nSpecial = model->countPromptTokens({});
+    const int nOverhead = model->countPromptTokens("search_document:") + 1;
+    return EmbeddingTokenizer {
+        .countTokens = [model, nSpecial](QStringView text) {
+            QByteArray utf8 = text.toUtf8();
+            return model->countPromptTokens({ utf8.constData(), size_t(utf8.size()) }) - nSpecial;
+        },
+        .maxTokens = LOCAL_EMBEDDING_N_CTX - nOverhead,
+    };
 }
 
 bool EmbeddingLLMWorker::loadModel()
 {
-    constexpr int n_ctx = 2048;
+    constexpr int n_ctx = LOCAL_EMBEDDING_N_CTX;
 
-    m_nomicAPIKey.clear();
+    m_useRemote = false;
     m_model = nullptr;
+    m_extraContexts.clear();
+    {
+        QMutexLocker locker(&m_queryCacheMutex);
+        m_queryCache.clear();
+    }
 
     // TODO(jared): react to setting changes without restarting
 
-    if (MySettings::globalInstance()->localDocsUseRemoteEmbed()) {
-        m_nomicAPIKey = MySettings::globalInstance()->localDocsNomicAPIKey();
+    if (!m_localOnly && MySettings::globalInstance()->localDocsUseRemoteEmbed()) {
+        m_useRemote = true;
         return true;
     }
 
@@ -173,12 +204,66 @@ bool EmbeddingLLMWorker::loadModel()
     int n_threads = MySettings::globalInstance()->threadCount();
     m_model->setThreadCount(n_threads);
 
+    createExtraContexts();
     return true;
 }
 
+void EmbeddingLLMWorker::createExtraContexts()
+{
+    /* A single context hardly gets faster with more threads than the thread count setting, so on the
+     * CPU documents are embedded by several contexts at once, each with that many threads. They share
+     * the weights of m_model. Half of the cores are left for the chat model. */
+    if (m_model->usingGPUDevice())
+        return;
+    const int n_threads = qMax(m_model->threadCount(), 1);
+    const int nContexts = std::clamp(QThread::idealThreadCount() / 2 / n_threads, 1, LOCAL_EMBEDDING_MAX_CONTEXTS);
+
+    for (int i = 1; i < nContexts; i++) {
+        std::unique_ptr<LLModel> context(m_model->newContext());
+        if (!context)
+            break; // not supported, or out of memory
+        context->setThreadCount(n_threads);
+        m_extraContexts.push_back(std::move(context));
+    }
+    m_contextPool.setMaxThreadCount(qMax(int(m_extraContexts.size()), 1));
+
+#if defined(DEBUG)
+    qDebug() << "embllm: embedding documents with" << m_extraContexts.size() + 1 << "contexts of" << n_threads
+             << "threads";
+#endif
+}
+
 std::vector<float> EmbeddingLLMWorker::generateQueryEmbedding(const QString &text)
 {
     {
+        QMutexLocker locker(&m_queryCacheMutex);
+        if (auto *embedding = m_queryCache.object(text))
+            return *embedding;
+    }
+
+    std::vector<float> embedding = embedQuery(text);
+
+    if (!embedding.empty()) {
+        QMutexLocker locker(&m_queryCacheMutex);
+        m_queryCache.insert(text, new std::vector<float>(embedding));
+    }
+    return embedding;
+}
+
+std::vector<float> EmbeddingLLMWorker::embedQuery(const QString &text)
+{
+    {
+        // hold back document batches that have not started yet, the query only waits for running ones
+        {
+            QMutexLocker gate(&m_queryGateMutex);
+            m_pendingQueries++;
+        }
+        auto done = qScopeGuard([this] {
+            QMutexLocker gate(&m_queryGateMutex);
+            if (--m_pendingQueries == 0)
+                m_queriesDone.wakeAll();
+        });
+
         QMutexLocker locker(&m_mutex);
 
         if (!hasModel() && !loadModel()) {
@@ -186,7 +271,7 @@ std::vector<float> EmbeddingLLMWorker::generateQueryEmbedding(const QString &tex
             return {};
         }
 
-        if (!isNomic()) {
+        if (!isRemote()) {
             std::vector<float> embedding(m_model->embeddingSize());
 
             try {
@@ -200,50 +285,46 @@ std::vector<float> EmbeddingLLMWorker::generateQueryEmbedding(const QString &tex
         }
     }
 
-    EmbeddingLLMWorker worker;
-    emit worker.requestAtlasQueryEmbedding(text);
-    worker.wait();
-    return worker.lastResponse();
+    /* Sent by the embedder that sends the documents, so that the query shares their rate limit and
+     * backoff and goes ahead of the ones that are still queued. */
+    Q_ASSERT(QThread::currentThread() != &m_workerThread);
+    std::promise<std::vector<float>> promise;
+    QMetaObject::invokeMethod(this, [this, text, &promise] {
+        remote()->embedQuery(text, [&promise](std::vector<float> embedding) {
+            promise.set_value(std::move(embedding));
+        });
+    });
+    return promise.get_future().get();
 }
 
-void EmbeddingLLMWorker::sendAtlasRequest(const QStringList &texts, const QString &taskType, const QVariant &userData)
+void EmbeddingLLMWorker::waitForQueries()
 {
-    QJsonObject root;
-    root.insert("model", "nomic-embed-text-v1");
-    root.insert("texts", QJsonArray::fromStringList(texts));
-    root.insert("task_type", taskType);
-
-    QJsonDocument doc(root);
-
-    QUrl nomicUrl("https://api-atlas.nomic.ai/v1/embedding/text");
-    const QString authorization = u"Bearer %1"_s.arg(m_nomicAPIKey).trimmed();
-    QNetworkRequest request(nomicUrl);
-    request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
-    request.setRawHeader("Authorization", authorization.toUtf8());
-    request.setAttribute(QNetworkRequest::User, userData);
-    QNetworkReply *reply = m_networkManager->post(request, doc.toJson(QJsonDocument::Compact));
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
-    connect(reply, &QNetworkReply::finished, this, &EmbeddingLLMWorker::handleFinished);
+    QMutexLocker gate(&m_queryGateMutex);
+    while (m_pendingQueries > 0)
+        m_queriesDone.wait(&m_queryGateMutex);
 }
 
-void EmbeddingLLMWorker::atlasQueryEmbeddingRequested(const QString &text)
+// read once, like the rest of the embedding settings
+static RemoteEmbedderConfig remoteEmbedderConfig()
 {
-    {
-        QMutexLocker locker(&m_mutex);
-        if (!hasModel() && !loadModel()) {
-            qWarning() << "WARNING: Could not load model for embeddings";
-            return;
-        }
-
-        if (!isNomic()) {
-            qWarning() << "WARNING: Request to generate sync embeddings for local model invalid";
-            return;
-        }
+    auto *settings = MySettings::globalInstance();
+    return {
+        .url               = QUrl(settings->localDocsRemoteEmbedUrl()),
+        .apiKey            = settings->localDocsNomicAPIKey(),
+        .model             = settings->localDocsRemoteEmbedModel(),
+        .maxInFlight       = settings->localDocsRemoteEmbedMaxRequests(),
+        .requestsPerSecond = qMax(settings->localDocsRemoteEmbedRequestsPerMinute(), 0) / 60.0,
+    };
+}
 
-        Q_ASSERT(hasModel());
+RemoteEmbedder *EmbeddingLLMWorker::remote()
+{
+    if (!m_remote) {
+        m_remote = new RemoteEmbedder(remoteEmbedderConfig(), this);
+        connect(m_remote, &RemoteEmbedder::embeddingsGenerated, this, &EmbeddingLLMWorker::embeddingsGenerated);
+        connect(m_remote, &RemoteEmbedder::errorGenerated, this, &EmbeddingLLMWorker::errorGenerated);
     }
-
-    sendAtlasRequest({text}, "search_query");
+    return m_remote;
 }
 
 void EmbeddingLLMWorker::docEmbeddingsRequested(const QVector<EmbeddingChunk> &chunks)
@@ -251,160 +332,139 @@ void EmbeddingLLMWorker::docEmbeddingsRequested(const QVector<EmbeddingChunk> &c
     if (m_stopGenerating)
         return;
 
-    bool isNomic;
+    bool isRemote;
     {
         QMutexLocker locker(&m_mutex);
         if (!hasModel() && !loadModel()) {
             qWarning() << "WARNING: Could not load model for embeddings";
+            emit errorGenerated(chunks, u"ERROR: Could not load model for embeddings"_s);
             return;
         }
 
-        isNomic = this->isNomic();
+        isRemote = this->isRemote();
     }
 
-    if (!isNomic) {
-        QVector<EmbeddingResult> results;
-        results.reserve(chunks.size());
+    if (!isRemote) {
+        const size_t embeddingSize = m_model->embeddingSize();
         std::vector<std::string> texts;
         texts.reserve(chunks.size());
-        for (const auto &c: chunks) {
-            EmbeddingResult result;
-            result.model = c.model;
-            result.folder_id = c.folder_id;
-            result.chunk_id = c.chunk_id;
-            result.embedding.resize(m_model->embeddingSize());
-            results << result;
+        for (const auto &c: chunks)
             texts.push_back(c.chunk.toStdString());
+
+        std::vector<float> result(chunks.size() * embeddingSize);
+        qint64 nTokens;
+        try {
+            nTokens = embedLocal(texts, std::nullopt, -1, LOCAL_EMBEDDING_BATCH_SIZE, result.data());
+        } catch (const std::exception &e) {
+            qWarning() << "WARNING: LLModel::embed failed:" << e.what();
+            emit errorGenerated(chunks, u"ERROR: LLModel::embed failed: %1"_s.arg(e.what()));
+            return;
         }
+        if (m_stopGenerating)
+            return;
 
-        constexpr int BATCH_SIZE = 4;
-        std::vector<float> result;
-        result.resize(chunks.size() * m_model->embeddingSize());
-        for (int j = 0; j < chunks.size(); j += BATCH_SIZE) {
-            QMutexLocker locker(&m_mutex);
-            std::vector batchTexts(texts.begin() + j, texts.begin() + std::min(j + BATCH_SIZE, int(texts.size())));
-            try {
-                m_model->embed(batchTexts, result.data() + j * m_model->embeddingSize(), /*isRetrieval*/ false);
-            } catch (const std::exception &e) {
-                qWarning() << "WARNING: LLModel::embed failed:" << e.what();
-                return;
-            }
+        QVector<EmbeddingResult> results;
+        results.reserve(chunks.size());
+        for (int i = 0; i < chunks.size(); i++) {
+            const auto &c = chunks[i];
+            const float *embedding = result.data() + i * embeddingSize;
+            results << EmbeddingResult {
+                .model = c.model,
+                .folder_id = c.folder_id,
+                .chunk_id = c.chunk_id,
+                .embedding = std::vector(embedding, embedding + embeddingSize),
+            };
         }
-        for (int i = 0; i < chunks.size(); i++)
-            memcpy(results[i].embedding.data(), &result[i * m_model->embeddingSize()], m_model->embeddingSize() * sizeof(float));
 
-        emit embeddingsGenerated(results);
+        emit embeddingsGenerated(results, nTokens);
         return;
     };
 
-    QStringList texts;
-    for (auto &c: chunks)
-        texts.append(c.chunk);
-    sendAtlasRequest(texts, "search_document", QVariant::fromValue(chunks));
+    remote()->embedDocuments(chunks);
 }
 
-std::vector<float> jsonArrayToVector(const QJsonArray &jsonArray)
+std::vector<float> EmbeddingLLMWorker::embedTexts(const std::vector<std::string> &texts,
+                                                  const std::optional<std::string> &prefix, int dimensionality,
+                                                  qint64 *nTokens)
 {
-    std::vector<float> result;
-
-    for (const auto &innerValue: jsonArray) {
-        if (innerValue.isArray()) {
-            QJsonArray innerArray = innerValue.toArray();
-            result.reserve(result.size() + innerArray.size());
-            for (const auto &value: innerArray) {
-                result.push_back(static_cast<float>(value.toDouble()));
-            }
-        }
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!hasModel() && !loadModel())
+            throw std::runtime_error("could not load the embedding model");
+        if (isRemote())
+            throw std::logic_error("texts can only be embedded with the local model");
     }
 
+    // Without queries to let ahead, each context can take a bigger share of the texts in one go, which packs
+    // more of them into each decode.
+    const int nContexts = int(m_extraContexts.size()) + 1;
+    const int batchSize = std::clamp((int(texts.size()) + nContexts - 1) / nContexts, 1,
+                                     LOCAL_EMBEDDING_MAX_BATCH_SIZE);
+
+    const size_t embeddingSize = dimensionality < 0 ? m_model->embeddingSize() : size_t(dimensionality);
+    std::vector<float> result(texts.size() * embeddingSize);
+    qint64 n = embedLocal(texts, prefix, dimensionality, batchSize, result.data());
+    if (nTokens)
+        *nTokens = n;
     return result;
 }
 
-QVector<EmbeddingResult> jsonArrayToEmbeddingResults(const QVector<EmbeddingChunk>& chunks, const QJsonArray& embeddings)
+struct EmbeddingLLMWorker::LocalEmbedding {
+    const std::vector<std::string> &texts;
+    const std::optional<std::string> &prefix;
+    int dimensionality;
+    int batchSize;
+    float *result;
+    std::atomic<int> nextBatch = 0;
+    std::atomic<qint64> nTokens = 0;
+};
+
+qint64 EmbeddingLLMWorker::embedLocal(const std::vector<std::string> &texts, const std::optional<std::string> &prefix,
+                                      int dimensionality, int batchSize, float *result)
 {
-    QVector<EmbeddingResult> results;
-
-    if (chunks.size() != embeddings.size()) {
-        qWarning() << "WARNING: Size of json array result does not match input!";
-        return results;
+    // every context takes the next batch of texts until they are all embedded
+    LocalEmbedding job { texts, prefix, dimensionality, batchSize, result };
+    std::vector<std::exception_ptr> errors(m_extraContexts.size() + 1);
+    for (size_t i = 0; i < m_extraContexts.size(); i++)
+        m_contextPool.start([&, i] { embedBatches(m_extraContexts[i].get(), nullptr, job, errors[i + 1]); });
+    // m_model is also used for queries, so it is locked batch by batch
+    embedBatches(m_model, &m_mutex, job, errors[0]);
+    m_contextPool.waitForDone();
+
+    for (const auto &error: errors) {
+        if (error)
+            std::rethrow_exception(error);
     }
-
-    for (int i = 0; i < chunks.size(); ++i) {
-        const EmbeddingChunk& chunk = chunks.at(i);
-        const QJsonArray embeddingArray = embeddings.at(i).toArray();
-
-        std::vector<float> embeddingVector;
-        for (const auto &value: embeddingArray)
-            embeddingVector.push_back(static_cast<float>(value.toDouble()));
-
-        EmbeddingResult result;
-        result.model = chunk.model;
-        result.folder_id = chunk.folder_id;
-        result.chunk_id = chunk.chunk_id;
-        result.embedding = std::move(embeddingVector);
-        results.push_back(std::move(result));
-    }
-
-    return results;
+    return job.nTokens;
 }
 
-void EmbeddingLLMWorker::handleFinished()
+void EmbeddingLLMWorker::embedBatches(LLModel *model, QMutex *mutex, LocalEmbedding &job, std::exception_ptr &error)
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
-    if (!reply)
-        return;
-
-    QVariant retrievedData = reply->request().attribute(QNetworkRequest::User);
-    QVector<EmbeddingChunk> chunks;
-    if (retrievedData.isValid() && retrievedData.canConvert<QVector<EmbeddingChunk>>())
-        chunks = retrievedData.value<QVector<EmbeddingChunk>>();
-
-    QVariant response;
-    if (reply->error() != QNetworkReply::NoError) {
-        response = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
-        Q_ASSERT(response.isValid());
-    }
-    bool ok;
-    int code = response.toInt(&ok);
-    if (!ok || code != 200) {
-        QString errorDetails;
-        QString replyErrorString = reply->errorString().trimmed();
-        QByteArray replyContent = reply->readAll().trimmed();
-        errorDetails = u"ERROR: Nomic Atlas responded with error code \"%1\""_s.arg(code);
-        if (!replyErrorString.isEmpty())
-            errorDetails += u". Error Details: \"%1\""_s.arg(replyErrorString);
-        if (!replyContent.isEmpty())
-            errorDetails += u". Response Content: \"%1\""_s.arg(QString::fromUtf8(replyContent));
-        qWarning() << errorDetails;
-        emit errorGenerated(chunks, errorDetails);
-        return;
-    }
-
-    QByteArray jsonData = reply->readAll();
-
-    QJsonParseError err;
-    QJsonDocument document = QJsonDocument::fromJson(jsonData, &err);
-    if (err.error != QJsonParseError::NoError) {
-        qWarning() << "ERROR: Couldn't parse Nomic Atlas response:" << jsonData << err.errorString();
-        return;
-    }
-
-    const QJsonObject root = document.object();
-    const QJsonArray embeddings = root.value("embeddings").toArray();
+    const int nTexts = int(job.texts.size());
+    const size_t embeddingSize = job.dimensionality < 0 ? model->embeddingSize() : size_t(job.dimensionality);
+    for (;;) {
+        waitForQueries();
+        const int j = job.nextBatch.fetch_add(job.batchSize);
+        if (j >= nTexts || m_stopGenerating)
+            return;
 
-    if (!chunks.isEmpty()) {
-        emit embeddingsGenerated(jsonArrayToEmbeddingResults(chunks, embeddings));
-    } else {
-        m_lastResponse = jsonArrayToVector(embeddings);
-        emit finished();
+        QMutexLocker locker(mutex); // does nothing without one
+        std::vector batchTexts(job.texts.begin() + j, job.texts.begin() + std::min(j + job.batchSize, nTexts));
+        size_t batchTokens = 0;
+        try {
+            model->embed(batchTexts, job.result + j * embeddingSize, job.prefix, job.dimensionality, &batchTokens);
+        } catch (...) {
+            error = std::current_exception();
+            job.nextBatch = nTexts; // the others stop too, the whole request fails anyway
+            return;
+        }
+        job.nTokens += qint64(batchTokens);
     }
-
-    reply->deleteLater();
 }
 
-EmbeddingLLM::EmbeddingLLM()
+EmbeddingLLM::EmbeddingLLM(bool localOnly)
     : QObject(nullptr)
-    , m_embeddingWorker(new EmbeddingLLMWorker)
+    , m_embeddingWorker(new EmbeddingLLMWorker(localOnly))
 {
     connect(this, &EmbeddingLLM::requestDocEmbeddings, m_embeddingWorker,
         &EmbeddingLLMWorker::docEmbeddingsRequested, Qt::QueuedConnection);
@@ -425,12 +485,24 @@ QString EmbeddingLLM::model()
     return EMBEDDING_MODEL_NAME;
 }
 
+std::optional<EmbeddingTokenizer> EmbeddingLLM::tokenizer()
+{
+    return m_embeddingWorker->tokenizer();
+}
+
 // TODO(jared): embed using all necessary embedding models given collection
 std::vector<float> EmbeddingLLM::generateQueryEmbedding(const QString &text)
 {
     return m_embeddingWorker->generateQueryEmbedding(text);
 }
 
+std::vector<float> EmbeddingLLM::embedTexts(const std::vector<std::string> &texts,
+                                            const std::optional<std::string> &prefix, int dimensionality,
+                                            qint64 *nTokens)
+{
+    return m_embeddingWorker->embedTexts(texts, prefix, dimensionality, nTokens);
+}
+
 void EmbeddingLLM::generateDocEmbeddingsAsync(const QVector<EmbeddingChunk> &chunks)
 {
     emit requestDocEmbeddings(chunks);
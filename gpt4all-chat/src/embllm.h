@@ -2,19 +2,28 @@
 #define EMBLLM_H
 
 #include <QByteArray>
+#include <QCache>
 #include <QMutex>
 #include <QObject>
 #include <QString>
 #include <QStringList> // IWYU pragma: keep
+#include <QStringView>
 #include <QThread>
+#include <QThreadPool>
 #include <QVariant>
 #include <QVector> // IWYU pragma: keep
+#include <QWaitCondition>
 
 #include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
 class LLModel;
-class QNetworkAccessManager;
+class RemoteEmbedder;
 
 
 struct EmbeddingChunk {
@@ -26,6 +35,12 @@ struct EmbeddingChunk {
 
 Q_DECLARE_METATYPE(EmbeddingChunk)
 
+// Counts tokens the way the local embedding model sees them. Safe to use from any thread.
+struct EmbeddingTokenizer {
+    std::function<int (QStringView text)> countTokens; // empty if we don't embed locally
+    int maxTokens = 0; // longest document text the model embeds without truncating it
+};
+
 struct EmbeddingResult {
     QString model;
     int folder_id;
@@ -36,54 +51,74 @@ struct EmbeddingResult {
 class EmbeddingLLMWorker : public QObject {
     Q_OBJECT
 public:
-    EmbeddingLLMWorker();
+    // a local-only worker ignores the LocalDocs setting to embed remotely
+    explicit EmbeddingLLMWorker(bool localOnly = false);
     ~EmbeddingLLMWorker() override;
 
-    void wait();
-
-    std::vector<float> lastResponse() const { return m_lastResponse; }
-
     bool loadModel();
-    bool isNomic() const { return !m_nomicAPIKey.isEmpty(); }
-    bool hasModel() const { return isNomic() || m_model; }
+    bool isRemote() const { return m_useRemote; }
+    bool hasModel() const { return isRemote() || m_model; }
 
     std::vector<float> generateQueryEmbedding(const QString &text);
+    // nullopt if the model could not be loaded
+    std::optional<EmbeddingTokenizer> tokenizer();
+    // Embeds the texts with the local model and returns their embeddings one after the other. The prefix is the
+    // task type, the document one if not given. Throws if the model can't be loaded or LLModel::embed fails.
+    // Not reentrant.
+    std::vector<float> embedTexts(const std::vector<std::string> &texts, const std::optional<std::string> &prefix,
+                                  int dimensionality, qint64 *nTokens);
 
 public Q_SLOTS:
-    void atlasQueryEmbeddingRequested(const QString &text);
     void docEmbeddingsRequested(const QVector<EmbeddingChunk> &chunks);
 
 Q_SIGNALS:
-    void requestAtlasQueryEmbedding(const QString &text);
-    void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
+    void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings, qint64 nTokens); // 0 tokens if unknown
     void errorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
-    void finished();
-
-private Q_SLOTS:
-    void handleFinished();
 
 private:
-    void sendAtlasRequest(const QStringList &texts, const QString &taskType, const QVariant &userData = {});
-
-    QString m_nomicAPIKey;
-    QNetworkAccessManager *m_networkManager;
-    std::vector<float> m_lastResponse;
+    RemoteEmbedder *remote();
+    void createExtraContexts();
+    std::vector<float> embedQuery(const QString &text);
+    void waitForQueries();
+    // embeds the texts on every context at once, a batch at a time, and returns the number of tokens
+    struct LocalEmbedding;
+    qint64 embedLocal(const std::vector<std::string> &texts, const std::optional<std::string> &prefix,
+                      int dimensionality, int batchSize, float *result);
+    void embedBatches(LLModel *model, QMutex *mutex, LocalEmbedding &job, std::exception_ptr &error);
+
+    const bool m_localOnly;
+    bool m_useRemote = false;
+    RemoteEmbedder *m_remote = nullptr; // created on the worker thread when first used
     LLModel *m_model = nullptr;
+    // more contexts of m_model that embed documents alongside it, each on its own thread of m_contextPool
+    std::vector<std::unique_ptr<LLModel>> m_extraContexts;
+    QThreadPool m_contextPool;
     std::atomic<bool> m_stopGenerating;
     QThread m_workerThread;
-    QMutex m_mutex; // guards m_model and m_nomicAPIKey
+    QMutex m_mutex; // guards m_model and m_useRemote
+    // documents are not embedded while queries wait, so that they go first
+    QMutex m_queryGateMutex; // guards m_pendingQueries
+    QWaitCondition m_queriesDone;
+    int m_pendingQueries = 0;
+    // the most recently used query embeddings
+    QMutex m_queryCacheMutex;
+    QCache<QString, std::vector<float>> m_queryCache;
 };
 
 class EmbeddingLLM : public QObject
 {
     Q_OBJECT
 public:
-    EmbeddingLLM();
+    explicit EmbeddingLLM(bool localOnly = false);
     ~EmbeddingLLM() override;
 
     static QString model();
     bool loadModel();
     bool hasModel() const;
+    std::optional<EmbeddingTokenizer> tokenizer(); // synchronous
+    // synchronous, see EmbeddingLLMWorker::embedTexts
+    std::vector<float> embedTexts(const std::vector<std::string> &texts, const std::optional<std::string> &prefix,
+                                  int dimensionality, qint64 *nTokens);
 
 public Q_SLOTS:
     std::vector<float> generateQueryEmbedding(const QString &text); // synchronous
@@ -91,7 +126,7 @@ public Q_SLOTS:
 
 Q_SIGNALS:
     void requestDocEmbeddings(const QVector<EmbeddingChunk> &chunks);
-    void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
+    void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings, qint64 nTokens);
     void errorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
 
 private:
@@ -0,0 +1,228 @@
+#include "folderwatcher.h"
+
+#include <QByteArray>
+#include <QDebug>
+#include <QFile>
+#include <QFileSystemWatcher>
+#include <QList>
+#include <QTimer>
+#include <QtLogging>
+
+#ifdef Q_OS_LINUX
+#   include <QSocketNotifier>
+#   include <cerrno>
+#   include <cstring>
+#   include <sys/inotify.h>
+#   include <unistd.h>
+#endif
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// wait for this long without changes before reporting them
+static const int s_debounceDelay = 1000; // ms
+// but don't hold back changes for longer than this while they keep coming
+static const qint64 s_maxDebounceDelay = 10000; // ms
+// how often directories we could not watch are reported for scanning
+static const int s_pollInterval = 5 * 60 * 1000; // ms
+
+#ifdef Q_OS_LINUX
+// files are only reported once they are closed after writing, not on every write
+static const uint32_t s_inotifyMask = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+#endif
+
+FolderWatcher::FolderWatcher(QObject *parent)
+    : QObject(parent)
+    , m_debounceTimer(new QTimer(this))
+    , m_pollTimer(new QTimer(this))
+{
+    m_debounceTimer->setSingleShot(true);
+    m_debounceTimer->setInterval(s_debounceDelay);
+    m_debounceTimer->callOnTimeout(this, &FolderWatcher::flush);
+
+    m_pollTimer->setInterval(s_pollInterval);
+    m_pollTimer->callOnTimeout(this, [this] {
+        m_changedDirectories.unite(m_polledPaths);
+        scheduleFlush();
+    });
+
+#ifdef Q_OS_LINUX
+    m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotifyFd != -1) {
+        m_inotifyNotifier = new QSocketNotifier(m_inotifyFd, QSocketNotifier::Read, this);
+        connect(m_inotifyNotifier, &QSocketNotifier::activated, this, &FolderWatcher::readInotifyEvents);
+        return;
+    }
+    qWarning() << "FolderWatcher: inotify is not available, falling back to QFileSystemWatcher:"
+               << strerror(errno);
+#endif
+
+    m_fallbackWatcher = new QFileSystemWatcher(this);
+    connect(m_fallbackWatcher, &QFileSystemWatcher::directoryChanged, this, [this](const QString &path) {
+        m_changedDirectories << path;
+        scheduleFlush();
+    });
+}
+
+FolderWatcher::~FolderWatcher()
+{
+#ifdef Q_OS_LINUX
+    if (m_inotifyFd != -1)
+        close(m_inotifyFd);
+#endif
+}
+
+void FolderWatcher::addDirectory(const QString &path)
+{
+    if (isWatching(path))
+        return;
+
+#ifdef Q_OS_LINUX
+    if (m_inotifyFd != -1) {
+        int wd = inotify_add_watch(m_inotifyFd, QFile::encodeName(path).constData(), s_inotifyMask);
+        if (wd != -1) {
+            m_inotifyWatches.insert(wd, path);
+            m_watchedPaths << path;
+            return;
+        }
+        if (errno == ENOSPC) {
+            if (!m_watchLimitReached) {
+                qWarning() << "FolderWatcher: inotify watch limit reached, remaining directories will be scanned"
+                           << "every" << s_pollInterval / 1000 << "seconds";
+                m_watchLimitReached = true;
+            }
+        } else {
+            qWarning() << "FolderWatcher: failed to watch" << path << strerror(errno);
+        }
+        return addPolledDirectory(path);
+    }
+#endif
+
+    if (m_fallbackWatcher->addPath(path)) {
+        m_watchedPaths << path;
+        return;
+    }
+    qWarning() << "FolderWatcher: failed to watch" << path;
+    addPolledDirectory(path);
+}
+
+void FolderWatcher::removeDirectory(const QString &path)
+{
+    const QString prefix = path + u'/';
+    auto isBelow = [&](const QString &p) { return p == path || p.startsWith(prefix); };
+
+    QStringList removed;
+    for (auto it = m_watchedPaths.begin(); it != m_watchedPaths.end();) {
+        if (isBelow(*it)) {
+            removed << *it;
+            it = m_watchedPaths.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_polledPaths.removeIf(isBelow);
+    if (m_polledPaths.isEmpty())
+        m_pollTimer->stop();
+
+    if (removed.isEmpty())
+        return;
+
+#ifdef Q_OS_LINUX
+    if (m_inotifyFd != -1) {
+        for (auto it = m_inotifyWatches.begin(); it != m_inotifyWatches.end();) {
+            if (isBelow(it.value())) {
+                inotify_rm_watch(m_inotifyFd, it.key());
+                it = m_inotifyWatches.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return;
+    }
+#endif
+
+    m_fallbackWatcher->removePaths(removed);
+}
+
+void FolderWatcher::addPolledDirectory(const QString &path)
+{
+    m_polledPaths << path;
+    if (!m_pollTimer->isActive())
+        m_pollTimer->start();
+}
+
+void FolderWatcher::readInotifyEvents()
+{
+#ifdef Q_OS_LINUX
+    alignas(inotify_event) char buffer[64 * 1024];
+    for (;;) {
+        const ssize_t size = read(m_inotifyFd, buffer, sizeof buffer);
+        if (size <= 0)
+            break; // EAGAIN once we have read everything
+
+        for (const char *p = buffer; p < buffer + size;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, so every directory has to be scanned
+                qWarning() << "FolderWatcher: inotify event queue overflowed, scanning all directories";
+                m_changedDirectories.unite(m_watchedPaths);
+                continue;
+            }
+
+            const QString dir = m_inotifyWatches.value(event->wd);
+            if (dir.isNull())
+                continue; // removed by removeDirectory
+
+            if (event->mask & IN_IGNORED) {
+                // the directory was removed, or moved away and we removed the watch
+                m_inotifyWatches.remove(event->wd);
+                m_watchedPaths.remove(dir);
+                continue;
+            }
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                m_changedFiles << dir;
+                continue;
+            }
+
+            const QString path = dir + u'/' + QFile::decodeName(event->name);
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    m_changedDirectories << path;
+                } else {
+                    // its watches still refer to the old path, so drop them
+                    removeDirectory(path);
+                    m_changedFiles << path;
+                }
+            } else if (!(event->mask & IN_CREATE)) {
+                m_changedFiles << path;
+            }
+        }
+    }
+
+    if (!m_changedFiles.isEmpty() || !m_changedDirectories.isEmpty())
+        scheduleFlush();
+#endif
+}
+
+void FolderWatcher::scheduleFlush()
+{
+    if (!m_debounceTimer->isActive())
+        m_pendingSince.start();
+    // keep waiting while changes keep coming in, but not forever
+    if (m_pendingSince.elapsed() < s_maxDebounceDelay)
+        m_debounceTimer->start();
+}
+
+void FolderWatcher::flush()
+{
+    QStringList files(m_changedFiles.begin(), m_changedFiles.end());
+    QStringList directories(m_changedDirectories.begin(), m_changedDirectories.end());
+    m_changedFiles.clear();
+    m_changedDirectories.clear();
+    if (!files.isEmpty() || !directories.isEmpty())
+        emit changed(files, directories);
+}
@@ -0,0 +1,67 @@
+#ifndef FOLDERWATCHER_H
+#define FOLDERWATCHER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList> // IWYU pragma: keep
+
+class QFileSystemWatcher;
+class QSocketNotifier;
+class QTimer;
+
+
+/* Watches the directories of LocalDocs folders and reports what changed in them.
+ *
+ * On Linux we use inotify directly, which unlike QFileSystemWatcher tells us which file in a
+ * directory changed, so a directory with a lot of unrelated churn (e.g. a build directory) does not
+ * have to be scanned again on every change. Elsewhere, or if inotify is unavailable, we use
+ * QFileSystemWatcher and report the directory instead.
+ *
+ * Changes are coalesced until the directories have been quiet for a short while. Directories that
+ * cannot be watched, e.g. because the inotify watch limit was reached, are reported periodically so
+ * that changes to them are still picked up by a scan. */
+class FolderWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FolderWatcher(QObject *parent = nullptr);
+    ~FolderWatcher() override;
+
+    // not recursive, each subdirectory has to be added as well
+    void addDirectory(const QString &path);
+    // removes the directory and all of its subdirectories
+    void removeDirectory(const QString &path);
+    // true if the directory was added, even if it is only polled
+    bool isWatching(const QString &path) const
+    { return m_watchedPaths.contains(path) || m_polledPaths.contains(path); }
+
+Q_SIGNALS:
+    /* files: paths of files (or directories) that were written, created, moved, or removed
+     * directories: directories that have to be scanned to find out what changed in them */
+    void changed(const QStringList &files, const QStringList &directories);
+
+private:
+    void readInotifyEvents();
+    void addPolledDirectory(const QString &path);
+    void scheduleFlush();
+    void flush();
+
+private:
+    int                 m_inotifyFd = -1;
+    QSocketNotifier    *m_inotifyNotifier = nullptr;
+    QHash<int, QString> m_inotifyWatches; // watch descriptor -> directory
+    QFileSystemWatcher *m_fallbackWatcher = nullptr;
+    bool                m_watchLimitReached = false;
+    QSet<QString>       m_watchedPaths;
+    QSet<QString>       m_polledPaths; // directories we could not watch
+    QSet<QString>       m_changedFiles;
+    QSet<QString>       m_changedDirectories;
+    QTimer             *m_debounceTimer;
+    QElapsedTimer       m_pendingSince;
+    QTimer             *m_pollTimer;
+};
+
+#endif // FOLDERWATCHER_H
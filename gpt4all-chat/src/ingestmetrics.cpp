@@ -0,0 +1,129 @@
+#include "ingestmetrics.h"
+
+#include <QJsonDocument>
+#include <QtLogging>
+#include <QtMinMax>
+
+#include <bit>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+Q_LOGGING_CATEGORY(lcLocalDocsMetrics, "gpt4all.localdocs.metrics", QtInfoMsg)
+
+void LatencyHistogram::record(qint64 usecs)
+{
+    usecs = qMax(usecs, qint64(0));
+    // bucket i holds latencies below 2^i usecs
+    const int bucket = qMin(int(std::bit_width(quint64(usecs))), s_nBuckets - 1);
+    m_buckets[bucket]++;
+    m_count++;
+    m_sum += usecs;
+    m_max = qMax(m_max, usecs);
+}
+
+double LatencyHistogram::percentileMsecs(double p) const
+{
+    const qint64 rank = qMax(qint64(1), qint64(p * m_count + 0.5));
+    qint64 seen = 0;
+    for (int i = 0; i < s_nBuckets; i++) {
+        seen += m_buckets[i];
+        if (seen >= rank)
+            return qMin(double(qint64(1) << i), double(m_max)) / 1000;
+    }
+    return double(m_max) / 1000;
+}
+
+QJsonObject LatencyHistogram::toJson() const
+{
+    if (isEmpty())
+        return { { "count"_L1, 0 } };
+    return {
+        { "count"_L1,   m_count                          },
+        { "mean_ms"_L1, double(m_sum) / m_count / 1000   },
+        { "p50_ms"_L1,  percentileMsecs(0.50)            },
+        { "p90_ms"_L1,  percentileMsecs(0.90)            },
+        { "p99_ms"_L1,  percentileMsecs(0.99)            },
+        { "max_ms"_L1,  double(m_max) / 1000             },
+    };
+}
+
+bool CollectionIngestStats::isEmpty() const
+{
+    return !docsHashed && !docsParsed && !chunksParsed && !chunksWritten && !chunksEmbedded && !embedErrors
+        && !docsQueued && !docsInProgress;
+}
+
+bool IngestMetrics::isEmpty() const
+{
+    if (!m_commitLatency.isEmpty())
+        return false;
+    for (const auto &stats: m_collections) {
+        if (!stats.isEmpty())
+            return false;
+    }
+    return true;
+}
+
+void IngestMetrics::report(const IngestQueueDepths &queues)
+{
+    const double secs = qMax(m_interval.restart(), qint64(1)) / 1000.0;
+    auto rate = [secs](qint64 n) { return n / secs; };
+    auto log = [](const QJsonObject &obj) {
+        qCInfo(lcLocalDocsMetrics).noquote() << QJsonDocument(obj).toJson(QJsonDocument::Compact);
+    };
+
+    for (const auto &[name, stats]: m_collections.asKeyValueRange()) {
+        if (stats.isEmpty())
+            continue;
+        log({
+            { "collection"_L1, name },
+            { "interval_s"_L1, secs },
+            { "hash"_L1, QJsonObject {
+                { "docs"_L1,       stats.docsHashed              },
+                { "docs_per_s"_L1, rate(stats.docsHashed)        },
+                { "bytes"_L1,      stats.bytesHashed             },
+                { "latency"_L1,    stats.hashLatency.toJson()    },
+            } },
+            { "parse"_L1, QJsonObject {
+                { "docs"_L1,         stats.docsParsed              },
+                { "docs_per_s"_L1,   rate(stats.docsParsed)        },
+                { "bytes"_L1,        stats.bytesParsed             },
+                { "chunks"_L1,       stats.chunksParsed            },
+                { "chunks_per_s"_L1, rate(stats.chunksParsed)      },
+                { "latency"_L1,      stats.parseLatency.toJson()   },
+            } },
+            { "write"_L1, QJsonObject {
+                { "chunks"_L1,       stats.chunksWritten           },
+                { "chunks_per_s"_L1, rate(stats.chunksWritten)     },
+                { "latency"_L1,      stats.writeLatency.toJson()   },
+            } },
+            { "embed"_L1, QJsonObject {
+                { "chunks"_L1,       stats.chunksEmbedded          },
+                { "chunks_per_s"_L1, rate(stats.chunksEmbedded)    },
+                { "tokens"_L1,       stats.tokensEmbedded          },
+                { "tokens_per_s"_L1, rate(stats.tokensEmbedded)    },
+                { "errors"_L1,       stats.embedErrors             },
+                { "latency"_L1,      stats.embedLatency.toJson()   },
+            } },
+            { "queues"_L1, QJsonObject {
+                { "docs_queued"_L1,      stats.docsQueued      },
+                { "docs_in_progress"_L1, stats.docsInProgress  },
+            } },
+        });
+    }
+
+    log({
+        { "interval_s"_L1, secs },
+        { "commit"_L1, QJsonObject {
+            { "latency"_L1, m_commitLatency.toJson() },
+        } },
+        { "queues"_L1, QJsonObject {
+            { "chunk_batches"_L1,      queues.chunkBatches      },
+            { "pending_embeddings"_L1, queues.pendingEmbeddings },
+        } },
+    });
+
+    m_collections.clear();
+    m_commitLatency = {};
+}
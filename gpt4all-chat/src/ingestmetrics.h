@@ -0,0 +1,89 @@
+#ifndef INGESTMETRICS_H
+#define INGESTMETRICS_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QLoggingCategory>
+#include <QString>
+#include <QtTypes>
+
+#include <array>
+
+Q_DECLARE_LOGGING_CATEGORY(lcLocalDocsMetrics)
+
+
+// Latencies in power-of-two buckets of microseconds, so recording one is cheap and needs no memory.
+class LatencyHistogram {
+public:
+    void record(qint64 usecs);
+    bool isEmpty() const { return m_count == 0; }
+    // count, mean, max and percentiles in milliseconds, percentiles are the upper bound of their bucket
+    QJsonObject toJson() const;
+
+private:
+    double percentileMsecs(double p) const;
+
+    static constexpr int s_nBuckets = 40;
+    std::array<qint64, s_nBuckets> m_buckets {};
+    qint64 m_count = 0;
+    qint64 m_sum = 0;
+    qint64 m_max = 0;
+};
+
+// What the ingestion stages did for one collection since the last report.
+struct CollectionIngestStats {
+    // hashing the files to find out whether they changed
+    qint64           docsHashed = 0;
+    qint64           bytesHashed = 0;
+    LatencyHistogram hashLatency; // per document
+    // DocumentReader and ChunkStreamer
+    qint64           docsParsed = 0;
+    qint64           bytesParsed = 0;
+    qint64           chunksParsed = 0;
+    LatencyHistogram parseLatency; // per batch of chunks, not counting time blocked on a full queue
+    // SQLite
+    qint64           chunksWritten = 0;
+    LatencyHistogram writeLatency; // per batch of chunks
+    // the embedding model
+    qint64           chunksEmbedded = 0;
+    qint64           tokensEmbedded = 0; // 0 if the embedding model doesn't report them
+    qint64           embedErrors = 0;
+    LatencyHistogram embedLatency; // per batch, from the request to the result, including the wait in line
+
+    // queue depths, sampled when reporting
+    qint64           docsQueued = 0;
+    qint64           docsInProgress = 0;
+
+    bool isEmpty() const;
+};
+
+// the queues shared by all collections, sampled when reporting
+struct IngestQueueDepths {
+    qint64 chunkBatches = 0;      // parsed and waiting for the database thread
+    qint64 pendingEmbeddings = 0; // sent to the embedding model and not back yet
+};
+
+/* Counters and latencies of the LocalDocs ingestion pipeline, per collection, so that it can be seen
+ * which stage is the bottleneck. They are reported periodically as one JSON object per line in the
+ * gpt4all.localdocs.metrics logging category, which can be turned off with QT_LOGGING_RULES. Only
+ * used from the database thread. */
+class IngestMetrics {
+public:
+    IngestMetrics() { m_interval.start(); }
+
+    CollectionIngestStats &collection(const QString &name) { return m_collections[name]; }
+    LatencyHistogram &commitLatency() { return m_commitLatency; }
+
+    bool isEmpty() const;
+    // logs the rates since the last report and starts a new interval
+    void report(const IngestQueueDepths &queues);
+
+private:
+    QHash<QString, CollectionIngestStats> m_collections;
+    LatencyHistogram                      m_commitLatency; // per transaction of the database thread
+    QElapsedTimer                         m_interval;
+};
+
+#endif // INGESTMETRICS_H
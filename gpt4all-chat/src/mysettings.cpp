@@ -63,6 +63,12 @@ static const QVariantMap basicDefaults {
     { "networkPort",              4891, },
     { "systemTray",               false },
     { "serverChat",               false },
+    { "server/slots",             4 },
+    { "server/maxQueuedRequests", 16 },
+    { "server/queueTimeout",      60 },
+    { "server/responseCacheSize", 0 },
+    { "server/responseCacheTtl",  600 },
+    { "modelMemoryBudget",        0 },
     { "userDefaultModel",         "Application default" },
     { "suggestionMode",           QVariant::fromValue(SuggestionMode::LocalDocsOnly) },
     { "localdocs/chunkSize",      512 },
@@ -72,6 +78,10 @@ static const QVariantMap basicDefaults {
     { "localdocs/useRemoteEmbed", false },
     { "localdocs/nomicAPIKey",    "" },
     { "localdocs/embedDevice",    "Auto" },
+    { "localdocs/remoteEmbedUrl", "" },
+    { "localdocs/remoteEmbedModel", "nomic-embed-text-v1.5" },
+    { "localdocs/remoteEmbedMaxRequests", 4 },
+    { "localdocs/remoteEmbedRequestsPerMinute", 0 },
     { "network/attribution",      "" },
 };
 
@@ -254,6 +264,12 @@ void MySettings::restoreApplicationDefaults()
     setSystemTray(basicDefaults.value("systemTray").toBool());
     setServerChat(basicDefaults.value("serverChat").toBool());
     setNetworkPort(basicDefaults.value("networkPort").toInt());
+    setServerSlots(basicDefaults.value("server/slots").toInt());
+    setServerMaxQueuedRequests(basicDefaults.value("server/maxQueuedRequests").toInt());
+    setServerQueueTimeout(basicDefaults.value("server/queueTimeout").toInt());
+    setServerResponseCacheSize(basicDefaults.value("server/responseCacheSize").toInt());
+    setServerResponseCacheTtl(basicDefaults.value("server/responseCacheTtl").toInt());
+    setModelMemoryBudget(basicDefaults.value("modelMemoryBudget").toInt());
     setModelPath(defaultLocalModelsPath());
     setUserDefaultModel(basicDefaults.value("userDefaultModel").toString());
     setForceMetal(defaults::forceMetal);
@@ -270,6 +286,10 @@ void MySettings::restoreLocalDocsDefaults()
     setLocalDocsUseRemoteEmbed(basicDefaults.value("localdocs/useRemoteEmbed").toBool());
     setLocalDocsNomicAPIKey(basicDefaults.value("localdocs/nomicAPIKey").toString());
     setLocalDocsEmbedDevice(basicDefaults.value("localdocs/embedDevice").toString());
+    setLocalDocsRemoteEmbedUrl(basicDefaults.value("localdocs/remoteEmbedUrl").toString());
+    setLocalDocsRemoteEmbedModel(basicDefaults.value("localdocs/remoteEmbedModel").toString());
+    setLocalDocsRemoteEmbedMaxRequests(basicDefaults.value("localdocs/remoteEmbedMaxRequests").toInt());
+    setLocalDocsRemoteEmbedRequestsPerMinute(basicDefaults.value("localdocs/remoteEmbedRequestsPerMinute").toInt());
 }
 
 void MySettings::eraseModel(const ModelInfo &info)
@@ -620,6 +640,12 @@ void MySettings::setThreadCount(int value)
 bool        MySettings::systemTray() const              { return getBasicSetting("systemTray"              ).toBool(); }
 bool        MySettings::serverChat() const              { return getBasicSetting("serverChat"              ).toBool(); }
 int         MySettings::networkPort() const             { return getBasicSetting("networkPort"             ).toInt(); }
+int         MySettings::serverSlots() const             { return getBasicSetting("server/slots"            ).toInt(); }
+int         MySettings::serverMaxQueuedRequests() const { return getBasicSetting("server/maxQueuedRequests").toInt(); }
+int         MySettings::serverQueueTimeout() const      { return getBasicSetting("server/queueTimeout"     ).toInt(); }
+int         MySettings::serverResponseCacheSize() const { return getBasicSetting("server/responseCacheSize").toInt(); }
+int         MySettings::serverResponseCacheTtl() const  { return getBasicSetting("server/responseCacheTtl" ).toInt(); }
+int         MySettings::modelMemoryBudget() const       { return getBasicSetting("modelMemoryBudget"       ).toInt(); }
 QString     MySettings::userDefaultModel() const        { return getBasicSetting("userDefaultModel"        ).toString(); }
 QString     MySettings::lastVersionStarted() const      { return getBasicSetting("lastVersionStarted"      ).toString(); }
 int         MySettings::localDocsChunkSize() const      { return getBasicSetting("localdocs/chunkSize"     ).toInt(); }
@@ -629,6 +655,10 @@ QStringList MySettings::localDocsFileExtensions() const { return getBasicSetting
 bool        MySettings::localDocsUseRemoteEmbed() const { return getBasicSetting("localdocs/useRemoteEmbed").toBool(); }
 QString     MySettings::localDocsNomicAPIKey() const    { return getBasicSetting("localdocs/nomicAPIKey"   ).toString(); }
 QString     MySettings::localDocsEmbedDevice() const    { return getBasicSetting("localdocs/embedDevice"   ).toString(); }
+QString     MySettings::localDocsRemoteEmbedUrl() const { return getBasicSetting("localdocs/remoteEmbedUrl").toString(); }
+QString     MySettings::localDocsRemoteEmbedModel() const { return getBasicSetting("localdocs/remoteEmbedModel").toString(); }
+int         MySettings::localDocsRemoteEmbedMaxRequests() const { return getBasicSetting("localdocs/remoteEmbedMaxRequests").toInt(); }
+int         MySettings::localDocsRemoteEmbedRequestsPerMinute() const { return getBasicSetting("localdocs/remoteEmbedRequestsPerMinute").toInt(); }
 QString     MySettings::networkAttribution() const      { return getBasicSetting("network/attribution"     ).toString(); }
 
 ChatTheme      MySettings::chatTheme() const      { return ChatTheme     (getEnumSetting("chatTheme", chatThemeNames)); }
@@ -638,6 +668,12 @@ SuggestionMode MySettings::suggestionMode() const { return SuggestionMode(getEnu
 void MySettings::setSystemTray(bool value)                            { setBasicSetting("systemTray",               value); }
 void MySettings::setServerChat(bool value)                            { setBasicSetting("serverChat",               value); }
 void MySettings::setNetworkPort(int value)                            { setBasicSetting("networkPort",              value); }
+void MySettings::setServerSlots(int value)                            { setBasicSetting("server/slots",             value, "serverSlots"); }
+void MySettings::setServerMaxQueuedRequests(int value)                { setBasicSetting("server/maxQueuedRequests", value, "serverMaxQueuedRequests"); }
+void MySettings::setServerQueueTimeout(int value)                     { setBasicSetting("server/queueTimeout",      value, "serverQueueTimeout"); }
+void MySettings::setServerResponseCacheSize(int value)                { setBasicSetting("server/responseCacheSize", value, "serverResponseCacheSize"); }
+void MySettings::setServerResponseCacheTtl(int value)                 { setBasicSetting("server/responseCacheTtl",  value, "serverResponseCacheTtl"); }
+void MySettings::setModelMemoryBudget(int value)                      { setBasicSetting("modelMemoryBudget",        value); }
 void MySettings::setUserDefaultModel(const QString &value)            { setBasicSetting("userDefaultModel",         value); }
 void MySettings::setLastVersionStarted(const QString &value)          { setBasicSetting("lastVersionStarted",       value); }
 void MySettings::setLocalDocsChunkSize(int value)                     { setBasicSetting("localdocs/chunkSize",      value, "localDocsChunkSize"); }
@@ -647,6 +683,10 @@ void MySettings::setLocalDocsFileExtensions(const QStringList &value) { setBasic
 void MySettings::setLocalDocsUseRemoteEmbed(bool value)               { setBasicSetting("localdocs/useRemoteEmbed", value, "localDocsUseRemoteEmbed"); }
 void MySettings::setLocalDocsNomicAPIKey(const QString &value)        { setBasicSetting("localdocs/nomicAPIKey",    value, "localDocsNomicAPIKey"); }
 void MySettings::setLocalDocsEmbedDevice(const QString &value)        { setBasicSetting("localdocs/embedDevice",    value, "localDocsEmbedDevice"); }
+void MySettings::setLocalDocsRemoteEmbedUrl(const QString &value)     { setBasicSetting("localdocs/remoteEmbedUrl", value, "localDocsRemoteEmbedUrl"); }
+void MySettings::setLocalDocsRemoteEmbedModel(const QString &value)   { setBasicSetting("localdocs/remoteEmbedModel", value, "localDocsRemoteEmbedModel"); }
+void MySettings::setLocalDocsRemoteEmbedMaxRequests(int value)        { setBasicSetting("localdocs/remoteEmbedMaxRequests", value, "localDocsRemoteEmbedMaxRequests"); }
+void MySettings::setLocalDocsRemoteEmbedRequestsPerMinute(int value)  { setBasicSetting("localdocs/remoteEmbedRequestsPerMinute", value, "localDocsRemoteEmbedRequestsPerMinute"); }
 void MySettings::setNetworkAttribution(const QString &value)          { setBasicSetting("network/attribution",      value, "networkAttribution"); }
 
 void MySettings::setChatTheme(ChatTheme value)           { setBasicSetting("chatTheme",      chatThemeNames     .value(int(value))); }
@@ -71,6 +71,10 @@ class MySettings : public QObject
     Q_PROPERTY(bool localDocsUseRemoteEmbed READ localDocsUseRemoteEmbed WRITE setLocalDocsUseRemoteEmbed NOTIFY localDocsUseRemoteEmbedChanged)
     Q_PROPERTY(QString localDocsNomicAPIKey READ localDocsNomicAPIKey WRITE setLocalDocsNomicAPIKey NOTIFY localDocsNomicAPIKeyChanged)
     Q_PROPERTY(QString localDocsEmbedDevice READ localDocsEmbedDevice WRITE setLocalDocsEmbedDevice NOTIFY localDocsEmbedDeviceChanged)
+    Q_PROPERTY(QString localDocsRemoteEmbedUrl READ localDocsRemoteEmbedUrl WRITE setLocalDocsRemoteEmbedUrl NOTIFY localDocsRemoteEmbedUrlChanged)
+    Q_PROPERTY(QString localDocsRemoteEmbedModel READ localDocsRemoteEmbedModel WRITE setLocalDocsRemoteEmbedModel NOTIFY localDocsRemoteEmbedModelChanged)
+    Q_PROPERTY(int localDocsRemoteEmbedMaxRequests READ localDocsRemoteEmbedMaxRequests WRITE setLocalDocsRemoteEmbedMaxRequests NOTIFY localDocsRemoteEmbedMaxRequestsChanged)
+    Q_PROPERTY(int localDocsRemoteEmbedRequestsPerMinute READ localDocsRemoteEmbedRequestsPerMinute WRITE setLocalDocsRemoteEmbedRequestsPerMinute NOTIFY localDocsRemoteEmbedRequestsPerMinuteChanged)
     Q_PROPERTY(QString networkAttribution READ networkAttribution WRITE setNetworkAttribution NOTIFY networkAttributionChanged)
     Q_PROPERTY(bool networkIsActive READ networkIsActive WRITE setNetworkIsActive NOTIFY networkIsActiveChanged)
     Q_PROPERTY(bool networkUsageStatsActive READ networkUsageStatsActive WRITE setNetworkUsageStatsActive NOTIFY networkUsageStatsActiveChanged)
@@ -78,6 +82,12 @@ class MySettings : public QObject
     Q_PROPERTY(QStringList deviceList MEMBER m_deviceList CONSTANT)
     Q_PROPERTY(QStringList embeddingsDeviceList MEMBER m_embeddingsDeviceList CONSTANT)
     Q_PROPERTY(int networkPort READ networkPort WRITE setNetworkPort NOTIFY networkPortChanged)
+    Q_PROPERTY(int serverSlots READ serverSlots WRITE setServerSlots NOTIFY serverSlotsChanged)
+    Q_PROPERTY(int serverMaxQueuedRequests READ serverMaxQueuedRequests WRITE setServerMaxQueuedRequests NOTIFY serverMaxQueuedRequestsChanged)
+    Q_PROPERTY(int serverQueueTimeout READ serverQueueTimeout WRITE setServerQueueTimeout NOTIFY serverQueueTimeoutChanged)
+    Q_PROPERTY(int serverResponseCacheSize READ serverResponseCacheSize WRITE setServerResponseCacheSize NOTIFY serverResponseCacheSizeChanged)
+    Q_PROPERTY(int serverResponseCacheTtl READ serverResponseCacheTtl WRITE setServerResponseCacheTtl NOTIFY serverResponseCacheTtlChanged)
+    Q_PROPERTY(int modelMemoryBudget READ modelMemoryBudget WRITE setModelMemoryBudget NOTIFY modelMemoryBudgetChanged)
     Q_PROPERTY(SuggestionMode suggestionMode READ suggestionMode WRITE setSuggestionMode NOTIFY suggestionModeChanged)
     Q_PROPERTY(QStringList uiLanguages MEMBER m_uiLanguages CONSTANT)
 
@@ -205,6 +215,14 @@ public:
     void setLocalDocsNomicAPIKey(const QString &value);
     QString localDocsEmbedDevice() const;
     void setLocalDocsEmbedDevice(const QString &value);
+    QString localDocsRemoteEmbedUrl() const; // OpenAI-compatible embeddings endpoint, Nomic Atlas if empty
+    void setLocalDocsRemoteEmbedUrl(const QString &value);
+    QString localDocsRemoteEmbedModel() const;
+    void setLocalDocsRemoteEmbedModel(const QString &value);
+    int localDocsRemoteEmbedMaxRequests() const;
+    void setLocalDocsRemoteEmbedMaxRequests(int value);
+    int localDocsRemoteEmbedRequestsPerMinute() const; // 0 for no limit
+    void setLocalDocsRemoteEmbedRequestsPerMinute(int value);
 
     // Network settings
     QString networkAttribution() const;
@@ -217,6 +235,18 @@ public:
     void setNetworkUsageStatsActive(bool value);
     int networkPort() const;
     void setNetworkPort(int value);
+    int serverSlots() const; // requests the API server generates at once
+    void setServerSlots(int value);
+    int serverMaxQueuedRequests() const; // requests waiting for a slot before new ones are refused
+    void setServerMaxQueuedRequests(int value);
+    int serverQueueTimeout() const; // seconds a request may wait for a slot
+    void setServerQueueTimeout(int value);
+    int serverResponseCacheSize() const; // deterministic responses the API server keeps, 0 to not cache them
+    void setServerResponseCacheSize(int value);
+    int serverResponseCacheTtl() const; // seconds a cached response is kept
+    void setServerResponseCacheTtl(int value);
+    int modelMemoryBudget() const; // MiB the loaded models may take together, 0 to only keep the ones in use
+    void setModelMemoryBudget(int value);
 
 Q_SIGNALS:
     void nameChanged(const ModelInfo &info);
@@ -252,9 +282,19 @@ Q_SIGNALS:
     void localDocsUseRemoteEmbedChanged();
     void localDocsNomicAPIKeyChanged();
     void localDocsEmbedDeviceChanged();
+    void localDocsRemoteEmbedUrlChanged();
+    void localDocsRemoteEmbedModelChanged();
+    void localDocsRemoteEmbedMaxRequestsChanged();
+    void localDocsRemoteEmbedRequestsPerMinuteChanged();
     void networkAttributionChanged();
     void networkIsActiveChanged();
     void networkPortChanged();
+    void serverSlotsChanged();
+    void serverMaxQueuedRequestsChanged();
+    void serverQueueTimeoutChanged();
+    void serverResponseCacheSizeChanged();
+    void serverResponseCacheTtlChanged();
+    void modelMemoryBudgetChanged();
     void networkUsageStatsActiveChanged();
     void attemptModelLoadChanged();
     void deviceChanged();
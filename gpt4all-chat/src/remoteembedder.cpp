@@ -0,0 +1,290 @@
+#include "remoteembedder.h"
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QVariant>
+#include <QtLogging>
+#include <QtMinMax>
+
+#include <utility>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+static const QUrl     ATLAS_URL   (u"https://api-atlas.nomic.ai/v1/embedding/text"_s);
+static const QString  ATLAS_MODEL = u"nomic-embed-text-v1"_s;
+
+// attempts before the chunks of a request are given up on, queries are waited on so they give up sooner
+static constexpr int    s_maxAttempts      = 6;
+static constexpr int    s_maxQueryAttempts = 2;
+static constexpr qint64 s_initialBackoff   = 1000;  // ms
+static constexpr qint64 s_maxBackoff       = 60000; // ms
+// a request that does not make progress for this long is retried
+static constexpr int    s_transferTimeout  = 60000; // ms
+
+RemoteEmbedder::RemoteEmbedder(RemoteEmbedderConfig config, QObject *parent)
+    : QObject(parent)
+    , m_config(std::move(config))
+    , m_networkManager(new QNetworkAccessManager(this))
+    , m_pumpTimer(new QTimer(this))
+{
+    m_config.maxInFlight = qMax(m_config.maxInFlight, 1);
+    m_tokens = m_config.maxInFlight;
+    m_pumpTimer->setSingleShot(true);
+    m_pumpTimer->callOnTimeout(this, &RemoteEmbedder::pump);
+    m_refillClock.start();
+    m_clock.start();
+
+    // connected before the replies are, so that their aborts are not retried
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, this, [this] {
+        m_stopping = true;
+        // nothing is sent anymore, but the callers of queued queries are waiting for an answer
+        for (auto it = m_queue.begin(); it != m_queue.end();) {
+            if (it->chunks.isEmpty()) {
+                fail(*it, u"ERROR: Query embedding cancelled"_s);
+                it = m_queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    });
+}
+
+void RemoteEmbedder::embedDocuments(const QVector<EmbeddingChunk> &chunks)
+{
+    m_queue.enqueue({ .chunks = chunks });
+    pump();
+}
+
+void RemoteEmbedder::embedQuery(const QString &text, QueryCallback done)
+{
+    if (m_stopping)
+        return fail({ .query = text, .onQuery = std::move(done) }, u"ERROR: Query embedding cancelled"_s);
+    m_queue.prepend({ .query = text, .onQuery = std::move(done) });
+    pump();
+}
+
+void RemoteEmbedder::pump()
+{
+    while (!m_queue.isEmpty() && m_inFlight < m_config.maxInFlight && !m_stopping) {
+        qint64 wait = m_blockedUntil - m_clock.elapsed();
+        if (wait <= 0 && !takeToken())
+            wait = qMax(qint64(1000 * (1 - m_tokens) / m_config.requestsPerSecond), qint64(1));
+        if (wait > 0) {
+            if (!m_pumpTimer->isActive() || m_pumpTimer->remainingTime() > wait)
+                m_pumpTimer->start(int(wait));
+            return;
+        }
+        send(m_queue.dequeue());
+    }
+}
+
+bool RemoteEmbedder::takeToken()
+{
+    if (m_config.requestsPerSecond <= 0)
+        return true;
+
+    // the bucket holds at most a full pipeline of requests
+    const double elapsed = m_refillClock.restart() / 1000.0;
+    m_tokens = qMin(double(m_config.maxInFlight), m_tokens + elapsed * m_config.requestsPerSecond);
+    if (m_tokens < 1)
+        return false;
+    m_tokens -= 1;
+    return true;
+}
+
+void RemoteEmbedder::send(Request request)
+{
+    const bool isQuery = request.chunks.isEmpty();
+    QStringList texts;
+    if (isQuery) {
+        texts << request.query;
+    } else {
+        for (const auto &c: request.chunks)
+            texts << c.chunk;
+    }
+
+    QJsonObject root;
+    if (isAtlas()) {
+        root.insert("model"_L1, ATLAS_MODEL);
+        root.insert("texts"_L1, QJsonArray::fromStringList(texts));
+        root.insert("task_type"_L1, isQuery ? "search_query"_L1 : "search_document"_L1);
+    } else {
+        root.insert("model"_L1, m_config.model);
+        root.insert("input"_L1, QJsonArray::fromStringList(texts));
+        root.insert("encoding_format"_L1, "float"_L1);
+    }
+
+    QNetworkRequest networkRequest(isAtlas() ? ATLAS_URL : m_config.url);
+    networkRequest.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+    if (!m_config.apiKey.isEmpty())
+        networkRequest.setRawHeader("Authorization", u"Bearer %1"_s.arg(m_config.apiKey).trimmed().toUtf8());
+    networkRequest.setTransferTimeout(s_transferTimeout);
+
+    QNetworkReply *reply = m_networkManager->post(networkRequest, QJsonDocument(root).toJson(QJsonDocument::Compact));
+    m_inFlight++;
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
+    connect(reply, &QNetworkReply::finished, this, [this, reply, request = std::move(request)] {
+        m_inFlight--;
+        reply->deleteLater();
+        handleReply(reply, request);
+        pump();
+    });
+}
+
+// how long the service asked us to wait in ms, or -1
+static qint64 retryAfter(QNetworkReply *reply)
+{
+    const QByteArray value = reply->rawHeader("Retry-After").trimmed();
+    if (value.isEmpty())
+        return -1;
+
+    bool ok;
+    const qint64 secs = value.toLongLong(&ok);
+    if (ok)
+        return qMax(secs, qint64(0)) * 1000;
+    const QDateTime when = QDateTime::fromString(QString::fromLatin1(value), Qt::RFC2822Date);
+    if (when.isValid())
+        return qMax(QDateTime::currentDateTimeUtc().msecsTo(when), qint64(0));
+    return -1;
+}
+
+static std::vector<float> toEmbedding(const QJsonArray &array)
+{
+    std::vector<float> embedding;
+    embedding.reserve(array.size());
+    for (const auto &value: array) {
+        if (!value.isDouble())
+            return {};
+        embedding.push_back(float(value.toDouble()));
+    }
+    return embedding;
+}
+
+void RemoteEmbedder::handleReply(QNetworkReply *reply, Request request)
+{
+    const QString service = isAtlas() ? u"Nomic Atlas"_s : m_config.url.host();
+    const bool isQuery = request.chunks.isEmpty();
+
+    if (reply->error() != QNetworkReply::NoError) {
+        const QVariant status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+        const int code = status.toInt();
+        QString error = u"ERROR: %1 responded with error code \"%2\""_s.arg(service).arg(code);
+        const QString replyErrorString = reply->errorString().trimmed();
+        const QByteArray replyContent = reply->readAll().trimmed();
+        if (!replyErrorString.isEmpty())
+            error += u". Error Details: \"%1\""_s.arg(replyErrorString);
+        if (!replyContent.isEmpty())
+            error += u". Response Content: \"%1\""_s.arg(QString::fromUtf8(replyContent));
+
+        if (m_stopping)
+            return fail(request, error);
+        // rate limited, overloaded, or never got an answer
+        if (code == 429 || code >= 500 || !status.isValid())
+            return retry(std::move(request), retryAfter(reply), error);
+        // too many texts at once, send them in halves
+        if (code == 413 && request.chunks.size() > 1) {
+            const qsizetype half = request.chunks.size() / 2;
+            m_queue.prepend({ .chunks = request.chunks.mid(half), .attempt = request.attempt });
+            m_queue.prepend({ .chunks = request.chunks.first(half), .attempt = request.attempt });
+            return;
+        }
+        return fail(request, error);
+    }
+
+    const QByteArray jsonData = reply->readAll();
+    QJsonParseError err;
+    const QJsonDocument document = QJsonDocument::fromJson(jsonData, &err);
+    if (err.error != QJsonParseError::NoError) {
+        return retry(std::move(request), -1,
+                     u"ERROR: Couldn't parse %1 response: %2"_s.arg(service, err.errorString()));
+    }
+
+    const QJsonObject root = document.object();
+    const qint64 nTokens = root.value("usage"_L1).toObject().value("total_tokens"_L1).toInteger();
+
+    // one embedding per text, empty where the text did not come back
+    const qsizetype nTexts = isQuery ? 1 : request.chunks.size();
+    std::vector<std::vector<float>> embeddings(nTexts);
+    if (isAtlas()) {
+        const QJsonArray array = root.value("embeddings"_L1).toArray();
+        for (qsizetype i = 0; i < qMin(array.size(), nTexts); i++)
+            embeddings[i] = toEmbedding(array[i].toArray());
+    } else {
+        const QJsonArray data = root.value("data"_L1).toArray();
+        for (qsizetype i = 0; i < data.size(); i++) {
+            const QJsonObject item = data[i].toObject();
+            const qint64 index = item.value("index"_L1).toInteger(i);
+            if (index >= 0 && index < nTexts)
+                embeddings[index] = toEmbedding(item.value("embedding"_L1).toArray());
+        }
+    }
+
+    if (isQuery) {
+        if (embeddings[0].empty())
+            return retry(std::move(request), -1, u"ERROR: %1 did not return an embedding"_s.arg(service));
+        request.onQuery(std::move(embeddings[0]));
+        return;
+    }
+
+    QVector<EmbeddingResult> results;
+    Request missing { .attempt = request.attempt };
+    for (qsizetype i = 0; i < nTexts; i++) {
+        const auto &c = request.chunks[i];
+        if (embeddings[i].empty()) {
+            missing.chunks << c;
+            continue;
+        }
+        results << EmbeddingResult {
+            .model     = c.model,
+            .folder_id = c.folder_id,
+            .chunk_id  = c.chunk_id,
+            .embedding = std::move(embeddings[i]),
+        };
+    }
+
+    if (!results.isEmpty())
+        emit embeddingsGenerated(results, nTokens);
+    if (!missing.chunks.isEmpty()) {
+        retry(std::move(missing), -1,
+              u"ERROR: %1 did not return embeddings for %2 of %3 chunks"_s.arg(service).arg(missing.chunks.size())
+                  .arg(nTexts));
+    }
+}
+
+void RemoteEmbedder::retry(Request request, qint64 delayMs, const QString &error)
+{
+    const int maxAttempts = request.chunks.isEmpty() ? s_maxQueryAttempts : s_maxAttempts;
+    if (++request.attempt >= maxAttempts)
+        return fail(request, error);
+
+    // exponential backoff with jitter, but at least as long as the service asked for
+    qint64 backoff = qMin(s_initialBackoff << (request.attempt - 1), s_maxBackoff);
+    backoff += QRandomGenerator::global()->bounded(backoff / 4 + 1);
+    backoff = qMax(backoff, delayMs);
+    qWarning().noquote() << error << u"- retrying in %1 ms"_s.arg(backoff);
+
+    // the service is struggling or limiting us, so the rest of the queue waits as well
+    m_blockedUntil = qMax(m_blockedUntil, m_clock.elapsed() + backoff);
+    m_queue.prepend(std::move(request));
+}
+
+void RemoteEmbedder::fail(const Request &request, const QString &error)
+{
+    qWarning().noquote() << error;
+    if (request.chunks.isEmpty())
+        request.onQuery({});
+    else
+        emit errorGenerated(request.chunks, error);
+}
@@ -0,0 +1,83 @@
+#ifndef REMOTEEMBEDDER_H
+#define REMOTEEMBEDDER_H
+
+#include "embllm.h"
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QQueue>
+#include <QString>
+#include <QStringList>
+#include <QUrl>
+#include <QVector>
+#include <QtTypes>
+
+#include <functional>
+#include <vector>
+
+class QNetworkAccessManager;
+class QNetworkReply;
+class QTimer;
+
+
+struct RemoteEmbedderConfig {
+    QUrl    url;                    // an OpenAI-compatible embeddings endpoint, or Nomic Atlas if empty
+    QString apiKey;
+    QString model;                  // sent to OpenAI-compatible endpoints
+    int     maxInFlight = 4;        // requests sent and not answered yet
+    double  requestsPerSecond = 0;  // 0 for no limit
+};
+
+/* Embeds texts with a remote service. Document requests are pipelined up to the configured number in
+ * flight and paced by a token bucket. Requests that fail with 429, a 5xx status, or a network error are
+ * retried with exponential backoff, waiting at least as long as Retry-After says; only the chunks that
+ * did not come back are sent again. Every chunk passed to embedDocuments() is eventually answered by
+ * either embeddingsGenerated or errorGenerated, and every query by its callback. Lives on the thread it
+ * was created on. */
+class RemoteEmbedder : public QObject {
+    Q_OBJECT
+public:
+    explicit RemoteEmbedder(RemoteEmbedderConfig config, QObject *parent = nullptr);
+
+    bool isAtlas() const { return m_config.url.isEmpty(); }
+
+    // called with the embedding of a query, which is empty on error
+    using QueryCallback = std::function<void (std::vector<float> embedding)>;
+
+    void embedDocuments(const QVector<EmbeddingChunk> &chunks);
+    void embedQuery(const QString &text, QueryCallback done); // goes ahead of queued documents
+
+Q_SIGNALS:
+    void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings, qint64 nTokens); // 0 tokens if unknown
+    void errorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
+
+private:
+    struct Request {
+        QVector<EmbeddingChunk> chunks; // empty for a query
+        QString                 query;
+        QueryCallback           onQuery;
+        int                     attempt = 0;
+    };
+
+    void pump();
+    bool takeToken();
+    void send(Request request);
+    void handleReply(QNetworkReply *reply, Request request);
+    void retry(Request request, qint64 delayMs, const QString &error);
+    void fail(const Request &request, const QString &error);
+
+    RemoteEmbedderConfig    m_config;
+    QNetworkAccessManager  *m_networkManager;
+    QQueue<Request>         m_queue;
+    int                     m_inFlight = 0;
+    bool                    m_stopping = false; // the application is quitting
+    QTimer                 *m_pumpTimer;
+    // token bucket
+    double                  m_tokens = 0;
+    QElapsedTimer           m_refillClock;
+    // the service asked us to wait, nothing is sent until then
+    QElapsedTimer           m_clock;
+    qint64                  m_blockedUntil = 0; // ms on m_clock
+};
+
+#endif // REMOTEEMBEDDER_H
@@ -0,0 +1,46 @@
+#include "responsecache.h"
+
+#include <QMutexLocker>
+
+
+std::optional<QJsonObject> ResponseCache::find(const QByteArray &key)
+{
+    QMutexLocker locker(&m_mutex);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+        return std::nullopt;
+    if (it->expiry.hasExpired()) {
+        remove(it);
+        return std::nullopt;
+    }
+    m_recent.splice(m_recent.begin(), m_recent, it->recent);
+    return it->response;
+}
+
+void ResponseCache::insert(const QByteArray &key, const QJsonObject &response, qsizetype maxEntries,
+                           std::chrono::seconds ttl)
+{
+    QMutexLocker locker(&m_mutex);
+    if (auto it = m_entries.find(key); it != m_entries.end())
+        remove(it);
+    while (!m_recent.empty() && m_entries.size() >= maxEntries)
+        remove(m_entries.find(m_recent.back()));
+    if (maxEntries <= 0)
+        return;
+
+    m_recent.push_front(key);
+    m_entries.insert(key, { response, QDeadlineTimer(ttl), m_recent.begin() });
+}
+
+void ResponseCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_entries.clear();
+    m_recent.clear();
+}
+
+void ResponseCache::remove(QHash<QByteArray, Entry>::iterator it)
+{
+    m_recent.erase(it->recent);
+    m_entries.erase(it);
+}
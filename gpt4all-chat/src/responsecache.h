@@ -0,0 +1,42 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <QByteArray>
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QMutex>
+#include <QtTypes>
+
+#include <chrono>
+#include <list>
+#include <optional>
+
+
+/* Replies of the API server to requests that always get the same response, so that a repeated request is answered
+ * without the model. Keeps the most recently used ones up to a number of entries, each for a limited time.
+ * Thread-safe. */
+class ResponseCache
+{
+public:
+    std::optional<QJsonObject> find(const QByteArray &key);
+    void insert(const QByteArray &key, const QJsonObject &response, qsizetype maxEntries, std::chrono::seconds ttl);
+    void clear();
+
+private:
+    using Recent = std::list<QByteArray>;
+
+    struct Entry {
+        QJsonObject      response;
+        QDeadlineTimer   expiry;
+        Recent::iterator recent;
+    };
+
+    void remove(QHash<QByteArray, Entry>::iterator it);
+
+    QMutex                   m_mutex;
+    QHash<QByteArray, Entry> m_entries;
+    Recent                   m_recent; // the keys, the most recently used first
+};
+
+#endif // RESPONSECACHE_H
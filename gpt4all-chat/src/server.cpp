@@ -2,17 +2,23 @@
 
 #include "chat.h"
 #include "chatmodel.h"
+#include "embllm.h"
 #include "modellist.h"
 #include "mysettings.h"
+#include "serverbatch.h"
+#include "servermetrics.h"
+#include "serverresponse.h"
 #include "utils.h" // IWYU pragma: keep
 
 #include <fmt/format.h>
 #include <gpt4all-backend/llmodel.h>
 
 #include <QByteArray>
+#include <QByteArrayView>
 #include <QCborArray>
 #include <QCborMap>
 #include <QCborValue>
+#include <QCryptographicHash>
 #include <QDateTime>
 #include <QDebug>
 #include <QHostAddress>
@@ -20,13 +26,24 @@
 #include <QHttpServer>
 #include <QHttpServerRequest>
 #include <QHttpServerResponder>
+#include <QHttpServerResponse>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QLatin1StringView>
-#include <QPair> // IWYU pragma: keep
-#include <QTcpServer>
+#include <QElapsedTimer>
+#include <QtEndian>
+#include <QMetaObject>
+#include <QMutexLocker>
+#include <QScopeGuard>
+#include <QSet>
+#include <QStandardPaths>
+#include <QStringDecoder>
+#include <QStringList>
+#include <QTimer>
+#include <QUrl>
+#include <QUuid>
 #include <QVariant>
 #include <Qt>
 #include <QtAssert>
@@ -36,9 +53,12 @@
 #include <QtPreprocessorSupport>
 #include <QtTypes>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <span>
 #include <stdexcept>
@@ -122,7 +142,66 @@ static inline QJsonObject resultToJson(const ResultInfo &info)
     return result;
 }
 
-class BaseCompletionRequest {
+// Validates the parameters of a request as they are taken out of it.
+class BaseRequest {
+protected:
+    enum class Type : uint8_t {
+        Boolean,
+        Integer,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+
+    static const std::unordered_map<Type, const char *> s_typeNames;
+
+    static bool typeMatches(const QCborValue &value, Type type) noexcept {
+        using enum Type;
+        switch (type) {
+            case Boolean: return value.isBool();
+            case Integer: return value.isInteger();
+            case Number:  return value.isInteger() || value.isDouble();
+            case String:  return value.isString();
+            case Array:   return value.isArray();
+            case Object:  return value.isMap();
+        }
+        Q_UNREACHABLE();
+    }
+
+    static QCborValue takeValue(
+        QCborMap &obj, const char *key, std::optional<Type> type = {}, bool required = false,
+        std::optional<qint64> min = {}, std::optional<qint64> max = {}
+    ) {
+        auto value = obj.take(QLatin1StringView(key));
+        if (value.isUndefined())
+            value = QCborValue(QCborSimpleType::Null);
+        if (required && value.isNull())
+            throw InvalidRequestError(fmt::format("you must provide a {} parameter", key));
+        if (type && !value.isNull() && !typeMatches(value, *type))
+            throw InvalidRequestError(fmt::format("'{}' is not of type '{}' - '{}'",
+                                                  value.toVariant(), s_typeNames.at(*type), key));
+        if (!value.isNull()) {
+            double num = value.toDouble();
+            if (min && num < double(*min))
+                throw InvalidRequestError(fmt::format("{} is less than the minimum of {} - '{}'", num, *min, key));
+            if (max && num > double(*max))
+                throw InvalidRequestError(fmt::format("{} is greater than the maximum of {} - '{}'", num, *max, key));
+        }
+        return value;
+    }
+};
+
+const std::unordered_map<BaseRequest::Type, const char *> BaseRequest::s_typeNames = {
+    { BaseRequest::Type::Boolean, "boolean" },
+    { BaseRequest::Type::Integer, "integer" },
+    { BaseRequest::Type::Number,  "number"  },
+    { BaseRequest::Type::String,  "string"  },
+    { BaseRequest::Type::Array,   "array"   },
+    { BaseRequest::Type::Object,  "object"  },
+};
+
+class BaseCompletionRequest : public BaseRequest {
 public:
     QString model; // required
     // NB: some parameters are not supported yet
@@ -131,6 +210,8 @@ public:
     float temperature = 1.f;
     float top_p = 1.f;
     float min_p = 0.f;
+    bool stream = false;
+    bool include_usage = false; // stream_options
 
     BaseCompletionRequest() = default;
     virtual ~BaseCompletionRequest() = default;
@@ -180,12 +261,19 @@ protected:
             throw InvalidRequestError("'stop' is not supported");
 
         value = reqValue("stream", Boolean);
-        if (value.isTrue())
-            throw InvalidRequestError("'stream' is not supported");
+        this->stream = value.isTrue();
 
         value = reqValue("stream_options", Object);
-        if (!value.isNull())
-            throw InvalidRequestError("'stream_options' is not supported");
+        if (!value.isNull()) {
+            if (!this->stream)
+                throw InvalidRequestError("The 'stream_options' parameter is only allowed when 'stream' is enabled.");
+            QCborMap options = value.toMap();
+            this->include_usage = takeValue(options, "include_usage", Boolean).isTrue();
+            if (!options.isEmpty())
+                throw InvalidRequestError(fmt::format(
+                    "Invalid 'stream_options': unrecognized key: '{}'", options.keys().constFirst().toString()
+                ));
+        }
 
         value = reqValue("temperature", Number, false, /*min*/ 0, /*max*/ 2);
         if (!value.isNull())
@@ -202,52 +290,6 @@ protected:
         reqValue("user", String); // validate but don't use
     }
 
-    enum class Type : uint8_t {
-        Boolean,
-        Integer,
-        Number,
-        String,
-        Array,
-        Object,
-    };
-
-    static const std::unordered_map<Type, const char *> s_typeNames;
-
-    static bool typeMatches(const QCborValue &value, Type type) noexcept {
-        using enum Type;
-        switch (type) {
-            case Boolean: return value.isBool();
-            case Integer: return value.isInteger();
-            case Number:  return value.isInteger() || value.isDouble();
-            case String:  return value.isString();
-            case Array:   return value.isArray();
-            case Object:  return value.isMap();
-        }
-        Q_UNREACHABLE();
-    }
-
-    static QCborValue takeValue(
-        QCborMap &obj, const char *key, std::optional<Type> type = {}, bool required = false,
-        std::optional<qint64> min = {}, std::optional<qint64> max = {}
-    ) {
-        auto value = obj.take(QLatin1StringView(key));
-        if (value.isUndefined())
-            value = QCborValue(QCborSimpleType::Null);
-        if (required && value.isNull())
-            throw InvalidRequestError(fmt::format("you must provide a {} parameter", key));
-        if (type && !value.isNull() && !typeMatches(value, *type))
-            throw InvalidRequestError(fmt::format("'{}' is not of type '{}' - '{}'",
-                                                  value.toVariant(), s_typeNames.at(*type), key));
-        if (!value.isNull()) {
-            double num = value.toDouble();
-            if (min && num < double(*min))
-                throw InvalidRequestError(fmt::format("{} is less than the minimum of {} - '{}'", num, *min, key));
-            if (max && num > double(*max))
-                throw InvalidRequestError(fmt::format("{} is greater than the maximum of {} - '{}'", num, *max, key));
-        }
-        return value;
-    }
-
 private:
     Q_DISABLE_COPY_MOVE(BaseCompletionRequest)
 };
@@ -309,15 +351,6 @@ protected:
     }
 };
 
-const std::unordered_map<BaseCompletionRequest::Type, const char *> BaseCompletionRequest::s_typeNames = {
-    { BaseCompletionRequest::Type::Boolean, "boolean" },
-    { BaseCompletionRequest::Type::Integer, "integer" },
-    { BaseCompletionRequest::Type::Number,  "number"  },
-    { BaseCompletionRequest::Type::String,  "string"  },
-    { BaseCompletionRequest::Type::Array,   "array"   },
-    { BaseCompletionRequest::Type::Object,  "object"  },
-};
-
 class ChatRequest : public BaseCompletionRequest {
 public:
     struct Message {
@@ -427,6 +460,123 @@ protected:
     }
 };
 
+class EmbeddingRequest : public BaseRequest {
+public:
+    QString     model; // required
+    QStringList input; // required
+    bool        base64     = false; // encoding_format
+    int         dimensions = -1;    // all of them
+    std::optional<QString> prefix;  // the task type, e.g. "search_query", the same as in the Python bindings
+
+    EmbeddingRequest &parse(QCborMap request)
+    {
+        using enum Type;
+
+        auto reqValue = [&request](auto &&...args) { return takeValue(request, args...); };
+        QCborValue value;
+
+        this->model = reqValue("model", String, /*required*/ true).toString();
+
+        value = reqValue("input", std::nullopt, /*required*/ true);
+        if (value.isString()) {
+            this->input = { value.toString() };
+        } else if (value.isArray() && !value.toArray().isEmpty()) {
+            QCborArray arr = value.toArray();
+            if (arr.size() > MAX_INPUTS)
+                throw InvalidRequestError(fmt::format(
+                    "Invalid 'input': array too long. Expected an array with maximum length {}, but got an array "
+                    "with length {} instead.", MAX_INPUTS, arr.size()
+                ));
+            for (qsizetype i = 0; i < arr.size(); i++) {
+                if (!arr[i].isString())
+                    throw InvalidRequestError(fmt::format(
+                        "Invalid type for 'input[{}]': expected a string, but got '{}' instead. Token arrays are "
+                        "not supported.", i, arr[i].toVariant()
+                    ));
+                this->input.append(arr[i].toString());
+            }
+        } else {
+            throw InvalidRequestError(fmt::format(
+                "Invalid type for 'input': expected a string or a non-empty array of strings, but got '{}' instead.",
+                value.toVariant()
+            ));
+        }
+        if (this->input.contains(QString()))
+            throw InvalidRequestError("Invalid 'input': empty strings are not allowed.");
+
+        value = reqValue("encoding_format", String);
+        if (!value.isNull()) {
+            QString format = value.toString();
+            if (format == u"base64"_s) {
+                this->base64 = true;
+            } else if (format != u"float"_s) {
+                throw InvalidRequestError(fmt::format(
+                    "Invalid 'encoding_format': expected one of 'float' or 'base64', but got '{}' instead.",
+                    format.toStdString()
+                ));
+            }
+        }
+
+        value = reqValue("dimensions", Integer, false, /*min*/ 1);
+        if (!value.isNull())
+            this->dimensions = int(qMin(value.toInteger(), INT32_MAX));
+
+        value = reqValue("prefix", String);
+        if (!value.isNull())
+            this->prefix = value.toString();
+
+        reqValue("user", String); // validate but don't use
+
+        if (!request.isEmpty())
+            throw InvalidRequestError(fmt::format(
+                "Unrecognized request argument supplied: {}", request.keys().constFirst().toString()
+            ));
+        return *this;
+    }
+
+private:
+    static constexpr qsizetype MAX_INPUTS = 2048;
+};
+
+// A line of the JSONL input of a batch, which wraps a request to one of the completion endpoints.
+class BatchRequest : public BaseRequest {
+public:
+    QString     customId; // required
+    QString     url;      // required
+    QJsonObject body;     // required
+
+    BatchRequest &parse(QCborMap request)
+    {
+        using enum Type;
+
+        auto reqValue = [&request](auto &&...args) { return takeValue(request, args...); };
+        QCborValue value;
+
+        this->customId = reqValue("custom_id", String, /*required*/ true).toString();
+
+        QString method = reqValue("method", String, /*required*/ true).toString();
+        if (method != u"POST"_s)
+            throw InvalidRequestError(fmt::format(
+                "Invalid 'method': expected 'POST', but got '{}' instead.", method.toStdString()
+            ));
+
+        this->url = reqValue("url", String, /*required*/ true).toString();
+        if (this->url != u"/v1/completions"_s && this->url != u"/v1/chat/completions"_s)
+            throw InvalidRequestError(fmt::format(
+                "Invalid 'url': expected one of '/v1/completions' or '/v1/chat/completions', but got '{}' instead.",
+                this->url.toStdString()
+            ));
+
+        this->body = reqValue("body", Object, /*required*/ true).toMap().toJsonObject();
+
+        if (!request.isEmpty())
+            throw InvalidRequestError(fmt::format(
+                "Unrecognized request argument supplied: {}", request.keys().constFirst().toString()
+            ));
+        return *this;
+    }
+};
+
 template <typename T>
 T &parseRequest(T &request, QJsonObject &&obj)
 {
@@ -434,15 +584,59 @@ T &parseRequest(T &request, QJsonObject &&obj)
     return request.parse(QCborMap::fromJsonObject(obj));
 }
 
+void DecodeTurns::acquire()
+{
+    QMutexLocker locker(&m_mutex);
+    const quint64 ticket = m_nextTicket++;
+    while (m_serving != ticket)
+        m_turnChanged.wait(&m_mutex);
+}
+
+void DecodeTurns::release()
+{
+    QMutexLocker locker(&m_mutex);
+    m_serving++;
+    m_turnChanged.wakeAll();
+}
+
+void DecodeTurns::yield()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_nextTicket == m_serving + 1)
+            return; // nobody is waiting
+    }
+    release();
+    acquire();
+}
+
 Server::Server(Chat *chat)
     : ChatLLM(chat, true /*isServer*/)
     , m_chat(chat)
 {
     connect(this, &Server::threadStarted, this, &Server::start);
-    connect(this, &Server::databaseResultsChanged, this, &Server::handleDatabaseResultsChanged);
     connect(chat, &Chat::collectionListChanged, this, &Server::handleCollectionListChanged, Qt::QueuedConnection);
 }
 
+Server::~Server()
+{
+    // a request that waits on a slow client must not keep the LLM thread from finishing
+    m_stopping = true;
+    if (m_connections)
+        m_connections->cancelAll();
+    {
+        QMutexLocker locker(&m_queueMutex);
+        m_queue.clear();
+    }
+    m_slotPool.waitForDone();
+    m_embeddingPool.clear();
+    m_embeddingPool.waitForDone();
+    m_embLLM.reset();
+    destroy();
+    m_httpThread.quit();
+    m_httpThread.wait();
+}
+
 static QJsonObject requestFromJson(const QByteArray &request)
 {
     QJsonParseError err;
@@ -455,17 +649,218 @@ static QJsonObject requestFromJson(const QByteArray &request)
     return document.object();
 }
 
+static ModelInfo findModel(const QString &name)
+{
+    ModelInfo modelInfo = ModelList::globalInstance()->defaultModelInfo();
+    const QList<ModelInfo> modelList = ModelList::globalInstance()->selectableModelList();
+    for (const ModelInfo &info : modelList) {
+        Q_ASSERT(info.installed);
+        if (!info.installed)
+            continue;
+        if (name == info.name() || name == info.filename()) {
+            modelInfo = info;
+            break;
+        }
+    }
+    return modelInfo;
+}
+
+// the server can't take the request right now, the client should try again later
+static QHttpServerResponse busyResponse(QHttpServerResponder::StatusCode status, const char *message,
+                                        const QString &type, const QJsonValue &code)
+{
+    QJsonObject error {
+        { "message", QString::fromUtf8(message) },
+        { "type",    type                       },
+        { "param",   QJsonValue::Null           },
+        { "code",    code                       },
+    };
+    QHttpServerResponse response(QJsonObject {{ "error", error }}, status);
+    auto headers = response.headers();
+    headers.append(QHttpHeaders::WellKnownHeader::RetryAfter, "1"_L1);
+    response.setHeaders(std::move(headers));
+    return response;
+}
+
+static QHttpServerResponse batchNotFound(const QString &id)
+{
+    QJsonObject error {
+        { "message", u"No batch found with id '%1'."_s.arg(id) },
+        { "type",    u"invalid_request_error"_s                },
+        { "param",   QJsonValue::Null                          },
+        { "code",    QJsonValue::Null                          },
+    };
+    return QHttpServerResponse(QJsonObject {{ "error", error }}, QHttpServerResponder::StatusCode::NotFound);
+}
+
+static std::vector<MessageInput> chatMessages(const ChatRequest &request)
+{
+    std::vector<MessageInput> messages;
+    messages.reserve(request.messages.size());
+    for (auto &message : request.messages) {
+        using enum ChatRequest::Message::Role;
+        switch (message.role) {
+            case System:    messages.push_back({ MessageInput::Type::System,   message.content }); break;
+            case User:      messages.push_back({ MessageInput::Type::Prompt,   message.content }); break;
+            case Assistant: messages.push_back({ MessageInput::Type::Response, message.content }); break;
+        }
+    }
+    return messages;
+}
+
+// the LocalDocs sources go with the last message, if it is from the user
+static std::vector<MessageItem> chatMessageItems(const std::vector<MessageInput> &messages,
+                                                 const QList<ResultInfo> &sources)
+{
+    std::vector<MessageItem> messageItems;
+    messageItems.reserve(messages.size());
+    for (qsizetype i = 0; i < qsizetype(messages.size()); i++) {
+        auto &message = messages[i];
+        switch (message.type) {
+            using enum MessageInput::Type;
+            case System:
+                messageItems.emplace_back(MessageItem::system_tag, message.content);
+                break;
+            case Prompt: {
+                bool isLast = i == qsizetype(messages.size()) - 1;
+                messageItems.emplace_back(i, MessageItem::Type::Prompt, message.content,
+                                          isLast ? sources : QList<ResultInfo>(), QList<PromptAttachment>());
+                break;
+            }
+            case Response:
+                messageItems.emplace_back(i, MessageItem::Type::Response, message.content);
+                break;
+        }
+    }
+    return messageItems;
+}
+
+static constexpr QByteArrayView s_cacheHeader = "X-Cache";
+
+// The key of a request in the response cache, or empty if its response is not deterministic. It is made of the
+// request and the settings of the model rather than the rendered prompt, so that it can be looked up right away.
+static QByteArray responseCacheKey(const BaseCompletionRequest &request, const ModelInfo &modelInfo,
+                                   QJsonObject input)
+{
+    if (request.stream || request.temperature > 0)
+        return {};
+
+    auto *mySettings = MySettings::globalInstance();
+    input.insert("model",          modelInfo.filename());
+    input.insert("max_tokens",     request.max_tokens);
+    input.insert("n",              request.n);
+    input.insert("top_p",          request.top_p);
+    input.insert("min_p",          request.min_p);
+    input.insert("top_k",          mySettings->modelTopK(modelInfo));
+    input.insert("repeat_penalty", mySettings->modelRepeatPenalty(modelInfo));
+    input.insert("repeat_last_n",  mySettings->modelRepeatPenaltyTokens(modelInfo));
+    input.insert("context_length", mySettings->modelContextLength(modelInfo));
+    input.insert("chat_template",  QJsonValue::fromVariant(mySettings->modelChatTemplate(modelInfo).value()));
+    input.insert("system_message", QJsonValue::fromVariant(mySettings->modelSystemMessage(modelInfo).value()));
+    // the keys of a QJsonObject are sorted, so equal requests serialize the same
+    return QCryptographicHash::hash(QJsonDocument(input).toJson(QJsonDocument::Compact), QCryptographicHash::Sha256);
+}
+
+bool Server::respondFromCache(ServerResponse &response, const QByteArray &key)
+{
+    if (MySettings::globalInstance()->serverResponseCacheSize() <= 0)
+        return false;
+    if (key.isEmpty()) {
+        response.setHeader(s_cacheHeader, "BYPASS");
+        return false;
+    }
+
+    std::optional<QJsonObject> cached = m_responseCache.find(key);
+    if (!cached) {
+        response.setHeader(s_cacheHeader, "MISS");
+        return false;
+    }
+    cached->insert("created", QDateTime::currentSecsSinceEpoch());
+    response.setHeader(s_cacheHeader, "HIT");
+    response.respond(QHttpServerResponse(*cached));
+    return true;
+}
+
+void Server::cacheResponse(const QByteArray &key, const QJsonObject &response)
+{
+    auto *mySettings = MySettings::globalInstance();
+    if (!key.isEmpty())
+        m_responseCache.insert(key, response, mySettings->serverResponseCacheSize(),
+                               std::chrono::seconds(mySettings->serverResponseCacheTtl()));
+}
+
+// Reads the requests of a batch, a JSON object per line, and orders them by model and prompt so that the ones that
+// share a prefix run one after another and find it in the cache of a slot.
+static std::vector<ServerBatch::Item> batchFromJsonl(const QByteArray &jsonl)
+{
+    std::vector<std::pair<std::pair<QString, QString>, ServerBatch::Item>> items; // by model and prompt
+    QSet<QString> customIds;
+    const QList<QByteArray> lines = jsonl.split('\n');
+    for (qsizetype i = 0; i < lines.size(); i++) {
+        if (lines[i].trimmed().isEmpty())
+            continue;
+        try {
+            BatchRequest line;
+            parseRequest(line, requestFromJson(lines[i]));
+            if (customIds.contains(line.customId))
+                throw InvalidRequestError(fmt::format("Duplicate 'custom_id': '{}'", line.customId.toStdString()));
+            customIds << line.customId;
+
+            auto order = [](const BaseCompletionRequest &request, QString prompt) {
+                if (request.stream)
+                    throw InvalidRequestError("'stream' is not supported in a batch");
+                return std::pair(request.model, std::move(prompt));
+            };
+            std::pair<QString, QString> key;
+            if (line.url == u"/v1/completions"_s) {
+                CompletionRequest request;
+                parseRequest(request, QJsonObject(line.body));
+                key = order(request, request.prompt);
+            } else {
+                ChatRequest request;
+                parseRequest(request, QJsonObject(line.body));
+                QString prompt;
+                for (auto &message : std::as_const(request.messages))
+                    prompt += message.content + u'\n';
+                key = order(request, std::move(prompt));
+            }
+            items.emplace_back(std::move(key), ServerBatch::Item { i + 1, line.customId, line.url, line.body });
+        } catch (const InvalidRequestError &e) {
+            throw InvalidRequestError(fmt::format("Invalid line {} of the batch: {}", i + 1, e.what()));
+        }
+    }
+    if (items.empty())
+        throw InvalidRequestError("The batch does not contain any requests.");
+
+    std::stable_sort(items.begin(), items.end(), [](auto &a, auto &b) { return a.first < b.first; });
+    std::vector<ServerBatch::Item> sorted;
+    sorted.reserve(items.size());
+    for (auto &item : items)
+        sorted.push_back(std::move(item.second));
+    return sorted;
+}
+
 void Server::start()
 {
-    m_server = std::make_unique<QHttpServer>(this);
-    auto *tcpServer = new QTcpServer(m_server.get());
+    m_queueTimer = new QTimer(this);
+    m_queueTimer->setInterval(1000);
+    m_queueTimer->callOnTimeout(this, &Server::schedule);
+    m_slotPool.setObjectName(u"serverslots"_s);
+    m_slotPool.setMaxThreadCount(1);
+    // the model is loaded with the first request and kept, whichever chat model is loaded
+    m_embLLM = std::make_unique<EmbeddingLLM>(/*localOnly*/ true);
+    m_embeddingPool.setObjectName(u"serverembeddings"_s);
+    m_embeddingPool.setMaxThreadCount(1);
+
+    m_server = std::make_unique<QHttpServer>();
+    m_connections = new ServerConnections(m_server.get());
 
     auto port = MySettings::globalInstance()->networkPort();
-    if (!tcpServer->listen(QHostAddress::LocalHost, port)) {
+    if (!m_connections->listen(QHostAddress::LocalHost, port)) {
         qWarning() << "Server ERROR: Failed to listen on port" << port;
         return;
     }
-    if (!m_server->bind(tcpServer)) {
+    if (!m_server->bind(m_connections)) {
         qWarning() << "Server ERROR: Failed to HTTP server to socket" << port;
         return;
     }
@@ -511,52 +906,139 @@ void Server::start()
         }
     );
 
+    // The completion routes parse requests on the HTTP thread and queue them for a slot.
     m_server->route("/v1/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
+        [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+            auto response = m_connections->createResponse(request, responder);
             if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+                return response->respond(QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized));
 
             try {
                 auto reqObj = requestFromJson(request.body());
 #if defined(DEBUG)
                 qDebug().noquote() << "/v1/completions request" << QJsonDocument(reqObj).toJson(QJsonDocument::Indented);
 #endif
-                CompletionRequest req;
-                parseRequest(req, std::move(reqObj));
-                auto [resp, respObj] = handleCompletionRequest(req);
-#if defined(DEBUG)
-                if (respObj)
-                    qDebug().noquote() << "/v1/completions reply" << QJsonDocument(*respObj).toJson(QJsonDocument::Indented);
-#endif
-                return std::move(resp);
+                auto req = std::make_shared<CompletionRequest>();
+                parseRequest(*req, std::move(reqObj));
+                queueCompletionRequest(req, response, /*batched*/ false);
             } catch (const InvalidRequestError &e) {
-                return e.asResponse();
+                response->respond(e.asResponse());
             }
         }
     );
 
     m_server->route("/v1/chat/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
+        [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+            auto response = m_connections->createResponse(request, responder);
             if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+                return response->respond(QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized));
 
             try {
                 auto reqObj = requestFromJson(request.body());
 #if defined(DEBUG)
                 qDebug().noquote() << "/v1/chat/completions request" << QJsonDocument(reqObj).toJson(QJsonDocument::Indented);
 #endif
-                ChatRequest req;
-                parseRequest(req, std::move(reqObj));
-                auto [resp, respObj] = handleChatRequest(req);
-                (void)respObj;
-#if defined(DEBUG)
-                if (respObj)
-                    qDebug().noquote() << "/v1/chat/completions reply" << QJsonDocument(*respObj).toJson(QJsonDocument::Indented);
-#endif
-                return std::move(resp);
+                auto req = std::make_shared<ChatRequest>();
+                parseRequest(*req, std::move(reqObj));
+                queueChatRequest(req, response, /*batched*/ false);
+            } catch (const InvalidRequestError &e) {
+                response->respond(e.asResponse());
+            }
+        }
+    );
+
+    // Embeddings don't need the chat model, so they skip the slot queue and are made one request at a time.
+    m_server->route("/v1/embeddings", QHttpServerRequest::Method::Post,
+        [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+            auto response = m_connections->createResponse(request, responder);
+            if (!MySettings::globalInstance()->serverChat())
+                return response->respond(QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized));
+
+            try {
+                auto req = std::make_shared<EmbeddingRequest>();
+                parseRequest(*req, requestFromJson(request.body()));
+                if (req->model != EmbeddingLLM::model()) {
+                    QJsonObject error {
+                        { "message", u"The model `%1` does not exist."_s.arg(req->model) },
+                        { "type",    u"invalid_request_error"_s                          },
+                        { "param",   QJsonValue::Null                                    },
+                        { "code",    u"model_not_found"_s                                },
+                    };
+                    return response->respond(QHttpServerResponse(QJsonObject {{ "error", error }},
+                                                                 QHttpServerResponder::StatusCode::NotFound));
+                }
+                m_embeddingPool.start([this, req, response] { handleEmbeddingRequest(*req, *response); });
+            } catch (const InvalidRequestError &e) {
+                response->respond(e.asResponse());
+            }
+        }
+    );
+
+    // A batch is checked as a whole when it is posted, then run in the background next to the other requests.
+    m_server->route("/v1/batches", QHttpServerRequest::Method::Post,
+        [this](const QHttpServerRequest &request) {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            std::shared_ptr<ServerBatch> batch;
+            try {
+                batch = std::make_shared<ServerBatch>(u"batch_"_s + QUuid::createUuid().toString(QUuid::Id128),
+                                                      batchFromJsonl(request.body()));
             } catch (const InvalidRequestError &e) {
                 return e.asResponse();
             }
+            if (!batch->open(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + u"/batches"_s))
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+            {
+                QMutexLocker locker(&m_batchesMutex);
+                m_batches << batch;
+            }
+            QMetaObject::invokeMethod(this, [this, batch] { feedBatch(batch); }, Qt::QueuedConnection);
+            return QHttpServerResponse(batch->toJson());
+        }
+    );
+
+    m_server->route("/v1/batches", QHttpServerRequest::Method::Get,
+        [this](const QHttpServerRequest &) {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            QJsonArray data;
+            QMutexLocker locker(&m_batchesMutex);
+            for (auto &batch : std::as_const(m_batches))
+                data << batch->toJson();
+            return QHttpServerResponse(QJsonObject {{ "object", "list" }, { "data", data }});
+        }
+    );
+
+    m_server->route("/v1/batches/<arg>", QHttpServerRequest::Method::Get,
+        [this](const QString &id, const QHttpServerRequest &) {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            auto batch = findBatch(id);
+            return batch ? QHttpServerResponse(batch->toJson()) : batchNotFound(id);
+        }
+    );
+
+    // the results so far, a JSON object per line
+    m_server->route("/v1/batches/<arg>/output", QHttpServerRequest::Method::Get,
+        [this](const QString &id, const QHttpServerRequest &) {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            auto batch = findBatch(id);
+            return batch ? QHttpServerResponse("application/jsonl"_ba, batch->output()) : batchNotFound(id);
+        }
+    );
+
+    m_server->route("/v1/batches/<arg>/cancel", QHttpServerRequest::Method::Post,
+        [this](const QString &id, const QHttpServerRequest &) {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            auto batch = findBatch(id);
+            if (!batch)
+                return batchNotFound(id);
+            batch->cancel();
+            return QHttpServerResponse(batch->toJson());
         }
     );
 
@@ -608,62 +1090,383 @@ void Server::start()
         }
     );
 
-    m_server->addAfterRequestHandler(this, [](const QHttpServerRequest &req, QHttpServerResponse &resp) {
-        Q_UNUSED(req);
+    m_server->route("/v1/embeddings", QHttpServerRequest::Method::Get,
+        [] {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            return QHttpServerResponse(
+                QJsonDocument::fromJson("{\"error\": {\"message\": \"Only POST requests are accepted.\","
+                    " \"type\": \"invalid_request_error\", \"param\": null, \"code\": \"method_not_supported\"}}").object(),
+                QHttpServerResponder::StatusCode::MethodNotAllowed);
+        }
+    );
+
+    m_server->route("/metrics", QHttpServerRequest::Method::Get,
+        [] {
+            if (!MySettings::globalInstance()->serverChat())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            return QHttpServerResponse("text/plain; version=0.0.4"_ba, ServerMetrics::globalInstance()->toPrometheus());
+        }
+    );
+
+    // requests answered through a ServerResponse are counted by it
+    m_server->addAfterRequestHandler(m_server.get(), [](const QHttpServerRequest &req, QHttpServerResponse &resp) {
+        ServerMetrics::globalInstance()->countRequest(ServerMetrics::routeLabel(req.url().path()),
+                                                      int(resp.statusCode()));
         auto headers = resp.headers();
         headers.append("Access-Control-Allow-Origin"_L1, "*"_L1);
         resp.setHeaders(std::move(headers));
     });
 
     connect(this, &Server::requestResetResponseState, m_chat, &Chat::resetResponseState, Qt::BlockingQueuedConnection);
+
+    m_httpThread.setObjectName(u"httpserver"_s);
+    m_server->moveToThread(&m_httpThread);
+    m_httpThread.start();
+}
+
+void Server::queueCompletionRequest(const std::shared_ptr<CompletionRequest> &request,
+                                    const std::shared_ptr<ServerResponse> &response, bool batched)
+{
+    ModelInfo modelInfo = findModel(request->model);
+    if (modelInfo.filename().isEmpty()) {
+        std::cerr << "ERROR: couldn't load default model " << request->model.toStdString() << std::endl;
+        return response->respond(QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
+    }
+    QByteArray cacheKey = responseCacheKey(*request, modelInfo, {
+        { "prompt", request->prompt },
+        { "echo",   request->echo   },
+    });
+    if (respondFromCache(*response, cacheKey))
+        return;
+    submit({
+        .modelInfo = modelInfo,
+        .response  = response,
+        .batched   = batched,
+        .render    = [request] { return request->prompt.toStdString(); },
+        .run       = [this, request, response, modelInfo, cacheKey](ServerSlot &slot, const QList<QString> &) {
+            auto respObj = handleCompletionRequest(*request, *response, slot, modelInfo);
+            if (respObj)
+                cacheResponse(cacheKey, *respObj);
+#if defined(DEBUG)
+            if (respObj)
+                qDebug().noquote() << "/v1/completions reply" << QJsonDocument(*respObj).toJson(QJsonDocument::Indented);
+#endif
+        },
+    });
+}
+
+void Server::queueChatRequest(const std::shared_ptr<ChatRequest> &request,
+                              const std::shared_ptr<ServerResponse> &response, bool batched)
+{
+    ModelInfo modelInfo = findModel(request->model);
+    if (modelInfo.filename().isEmpty()) {
+        std::cerr << "ERROR: couldn't load default model " << request->model.toStdString() << std::endl;
+        return response->respond(QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
+    }
+    QJsonArray messages;
+    for (auto &message : std::as_const(request->messages))
+        messages << QJsonArray { int(message.role), message.content };
+    QByteArray cacheKey = responseCacheKey(*request, modelInfo, {{ "messages", messages }});
+    if (respondFromCache(*response, cacheKey))
+        return;
+    submit({
+        .modelInfo = modelInfo,
+        .response  = response,
+        .batched   = batched,
+        // LocalDocs sources only change the end of the prompt, so they can be left out here
+        .render    = [this, request] {
+            auto items = chatMessageItems(chatMessages(*request), {});
+            return renderPrompt(loadedModel(), std::span<const MessageItem>(items));
+        },
+        .run       = [this, request, response, modelInfo, cacheKey](ServerSlot &slot,
+                                                                    const QList<QString> &collections) {
+            auto respObj = handleChatRequest(*request, *response, slot, modelInfo, collections);
+            // the LocalDocs sources are not part of the key, the cache is cleared when they change
+            if (respObj && collections.isEmpty())
+                cacheResponse(cacheKey, *respObj);
+#if defined(DEBUG)
+            if (respObj)
+                qDebug().noquote() << "/v1/chat/completions reply" << QJsonDocument(*respObj).toJson(QJsonDocument::Indented);
+#endif
+        },
+    });
 }
 
-static auto makeError(auto &&...args) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>
+std::shared_ptr<ServerBatch> Server::findBatch(const QString &id)
 {
-    return {QHttpServerResponse(args...), std::nullopt};
+    QMutexLocker locker(&m_batchesMutex);
+    auto it = std::ranges::find_if(m_batches, [&id](auto &batch) { return batch->id() == id; });
+    return it == m_batches.end() ? nullptr : *it;
 }
 
-auto Server::handleCompletionRequest(const CompletionRequest &request)
-    -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>
+void Server::feedBatch(const std::shared_ptr<ServerBatch> &batch)
 {
-    Q_ASSERT(m_chatModel);
+    if (m_stopping)
+        return;
 
+    const qsizetype maxRunning = qMax(MySettings::globalInstance()->serverSlots(), 1);
+    while (auto item = batch->takeItem(maxRunning)) {
+        auto response = m_connections->createDetachedResponse(item->url.toUtf8(),
+            [this, batch, item = *item](int status, const QByteArray &body) {
+                batch->finishItem(item, status, body);
+                QMetaObject::invokeMethod(this, [this, batch] { feedBatch(batch); }, Qt::QueuedConnection);
+            }
+        );
+        try {
+            if (item->url == u"/v1/completions"_s) {
+                auto req = std::make_shared<CompletionRequest>();
+                parseRequest(*req, QJsonObject(item->body));
+                queueCompletionRequest(req, response, /*batched*/ true);
+            } else {
+                auto req = std::make_shared<ChatRequest>();
+                parseRequest(*req, QJsonObject(item->body));
+                queueChatRequest(req, response, /*batched*/ true);
+            }
+        } catch (const InvalidRequestError &e) {
+            response->respond(e.asResponse());
+        }
+    }
+}
+
+void Server::submit(Job job)
+{
     auto *mySettings = MySettings::globalInstance();
+    {
+        QMutexLocker locker(&m_queueMutex);
+        if (!job.batched && qsizetype(m_queue.size()) >= mySettings->serverMaxQueuedRequests()) {
+            locker.unlock();
+            job.response->respond(busyResponse(
+                QHttpServerResponder::StatusCode::TooManyRequests,
+                "Too many requests are waiting to be processed, please try again later",
+                u"requests"_s, u"rate_limit_exceeded"_s
+            ));
+            return;
+        }
+        job.deadline = job.batched ? QDeadlineTimer(QDeadlineTimer::Forever)
+                                   : QDeadlineTimer(std::chrono::seconds(mySettings->serverQueueTimeout()));
+        job.queued.start();
+        m_queue.push_back(std::move(job));
+        ServerMetrics::globalInstance()->setQueueDepth(m_queue.size());
+    }
+    QMetaObject::invokeMethod(this, &Server::schedule, Qt::QueuedConnection);
+}
 
-    ModelInfo modelInfo = ModelList::globalInstance()->defaultModelInfo();
-    const QList<ModelInfo> modelList = ModelList::globalInstance()->selectableModelList();
-    for (const ModelInfo &info : modelList) {
-        Q_ASSERT(info.installed);
-        if (!info.installed)
+void Server::schedule()
+{
+    if (m_stopping)
+        return;
+
+    QMutexLocker locker(&m_queueMutex);
+
+    std::erase_if(m_queue, [](const Job &job) {
+        // nobody waits for the response anymore
+        if (job.response->isCancelled())
+            return true;
+        if (!job.deadline.hasExpired())
+            return false;
+        job.response->respond(busyResponse(
+            QHttpServerResponder::StatusCode::ServiceUnavailable,
+            "The server is currently overloaded, please try again later",
+            u"server_error"_s, QJsonValue::Null
+        ));
+        return true;
+    });
+
+    while (!m_queue.empty()) {
+        const ModelInfo requested = m_queue.front().modelInfo;
+        if (!isModelLoaded() || !(modelInfo() == requested)) {
+            // the model can only be switched once the requests for the current one are done
+            if (std::ranges::any_of(m_slots, [](auto &slot) { return slot->busy; }))
+                break;
+
+            locker.unlock();
+            m_slots.clear();
+            ServerMetrics::globalInstance()->clearSlotCaches();
+            m_canAddSlots = true;
+            setShouldBeLoaded(true);
+            const bool loaded = loadModel(requested);
+            locker.relock();
+
+            if (!loaded) {
+                std::cerr << "ERROR: couldn't load model " << requested.name().toStdString() << std::endl;
+                std::erase_if(m_queue, [&requested](const Job &job) {
+                    if (!(job.modelInfo == requested))
+                        return false;
+                    job.response->respond(QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
+                    return true;
+                });
+            }
             continue;
-        if (request.model == info.name() || request.model == info.filename()) {
-            modelInfo = info;
-            break;
         }
+
+        // the reference is taken under the lock; only this thread takes jobs off the queue, and adding to a deque
+        // keeps references to the others valid
+        const Job &job = m_queue.front();
+        locker.unlock();
+        ServerSlot *slot = freeSlot(job);
+        locker.relock();
+        if (!slot)
+            break;
+
+        slot->busy = true;
+        ServerMetrics::globalInstance()->observeQueueWait(job.queued.nsecsElapsed() / 1e9);
+        m_slotPool.start([this, slot, job = std::move(m_queue.front()), collections = m_collections] {
+            job.run(*slot, collections);
+            ServerMetrics::globalInstance()->setSlotCache(slot->index, slot->model->cacheLength(),
+                                                          slot->model->contextLength());
+            QMetaObject::invokeMethod(this, [this, slot] {
+                slot->busy = false;
+                schedule();
+            }, Qt::QueuedConnection);
+        });
+        m_queue.pop_front();
     }
 
-    // load the new model if necessary
-    setShouldBeLoaded(true);
+    auto *metrics = ServerMetrics::globalInstance();
+    metrics->setQueueDepth(m_queue.size());
+    metrics->setSlots(int(std::ranges::count_if(m_slots, [](auto &slot) { return slot->busy; })), int(m_slots.size()));
 
-    if (modelInfo.filename().isEmpty()) {
-        std::cerr << "ERROR: couldn't load default model " << request.model.toStdString() << std::endl;
-        return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+    // waiting requests are checked for their deadline every second
+    if (m_queue.empty())
+        m_queueTimer->stop();
+    else if (!m_queueTimer->isActive())
+        m_queueTimer->start();
+}
+
+ServerSlot *Server::freeSlot(const Job &job)
+{
+    std::vector<ServerSlot *> idle;
+    for (auto &slot : m_slots) {
+        if (!slot->busy)
+            idle.push_back(slot.get());
+    }
+    const bool canAdd = m_canAddSlots
+        && qsizetype(m_slots.size()) < qMax(MySettings::globalInstance()->serverSlots(), 1);
+
+    ServerSlot *chosen = nullptr;
+    if (idle.size() > 1 || (!idle.empty() && canAdd)) {
+        // Prefer the slot that has the most of the prompt cached, e.g. the one that answered the earlier turns of
+        // a conversation. The last batch of the prompt is decoded again anyway, so less than that does not count.
+        int32_t bestCached = MySettings::globalInstance()->modelPromptBatchSize(job.modelInfo);
+        try {
+            const std::string prompt = job.render();
+            for (auto *slot : idle) {
+                int32_t cached = slot->model->cachedPrefixLength(prompt);
+                if (cached > bestCached) {
+                    bestCached = cached;
+                    chosen = slot;
+                }
+            }
+        } catch (const std::exception &e) {
+            // the request will fail on its own once it runs
+            Q_UNUSED(e);
+#if defined(DEBUG)
+            qDebug() << "could not render the prompt to find a slot:" << e.what();
+#endif
+        }
     }
 
-    emit requestResetResponseState(); // blocks
-    qsizetype prevMsgIndex = m_chatModel->count() - 1;
-    if (prevMsgIndex >= 0)
-        m_chatModel->updateCurrentResponse(prevMsgIndex, false);
+    if (!chosen && canAdd)
+        chosen = addSlot();
+    if (!chosen && !idle.empty()) {
+        // keep the caches that were used most recently
+        chosen = *std::ranges::min_element(idle, {}, &ServerSlot::lastUsed);
+    }
+    if (chosen)
+        chosen->lastUsed = ++m_slotUses;
+    return chosen;
+}
 
-    // NB: this resets the context, regardless of whether this model is already loaded
-    if (!loadModel(modelInfo)) {
-        std::cerr << "ERROR: couldn't load model " << modelInfo.name().toStdString() << std::endl;
-        return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+ServerSlot *Server::addSlot()
+{
+    auto slot = std::make_unique<ServerSlot>();
+    slot->index = m_slots.size();
+    if (m_slots.empty()) {
+        slot->model = loadedModel();
+    } else {
+        // not every backend can make another context that shares the weights
+        slot->context.reset(loadedModel()->newContext());
+        if (!slot->context) {
+            m_canAddSlots = false;
+            return nullptr;
+        }
+        slot->model = slot->context.get();
     }
+    m_slots.push_back(std::move(slot));
+    m_slotPool.setMaxThreadCount(qMax(m_slotPool.maxThreadCount(), int(m_slots.size())));
+    return m_slots.back().get();
+}
 
-    // add prompt/response items to GUI
-    m_chatModel->appendPrompt(request.prompt);
-    m_chatModel->appendResponse();
+auto Server::generate(ServerSlot &slot, const ServerResponse &response,
+                      const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
+                      const LLModel::PromptContext &ctx, int n,
+                      const std::function<bool(int, const QByteArray &)> &onToken) -> std::vector<PromptResult>
+{
+    // a client that went away stops its generation, even in the middle of a batch of the prompt
+    auto stopped = [this, &response] { return m_stopping || response.isCancelled(); };
+    slot.model->setAbortCallback(stopped);
+    auto resetAbort = qScopeGuard([&slot] { slot.model->setAbortCallback({}); });
+
+    m_turns.acquire();
+    auto endTurn = qScopeGuard([this] { m_turns.release(); });
+
+    // each batch of the prompt is a step of its own
+    int32_t nDecoded = 0;
+    auto handlePrompt = [&](std::span<const LLModel::Token> batch, bool cached) {
+        if (!cached) {
+            nDecoded += batch.size();
+            if (nDecoded >= ctx.n_batch) {
+                nDecoded = 0;
+                m_turns.yield();
+            }
+        }
+        return !stopped();
+    };
+    // the others can decode while the token is sent, which may wait for the client
+    auto handleToken = [&](int index, const QByteArray &token) {
+        m_turns.release();
+        bool ok = onToken(index, token);
+        m_turns.acquire();
+        return ok && !stopped();
+    };
+
+    return promptDetached(slot.model, prompt, ctx, handlePrompt, n, handleToken);
+}
+
+static std::nullopt_t respondWithError(ServerResponse &response, QHttpServerResponder::StatusCode status)
+{
+    response.respond(QHttpServerResponse(status));
+    return std::nullopt;
+}
+
+static QByteArray toEvent(const QJsonObject &obj)
+{
+    return QJsonDocument(obj).toJson(QJsonDocument::Compact);
+}
+
+// once an event stream has begun, errors can only be reported as an event
+static std::nullopt_t sendErrorEvent(ServerResponse &response, const char *message)
+{
+    QJsonObject error {
+        { "message", QString::fromUtf8(message) },
+        { "type",    u"server_error"_s,         },
+        { "param",   QJsonValue::Null           },
+        { "code",    QJsonValue::Null           },
+    };
+    response.sendEvent(toEvent(QJsonObject {{ "error", error }}));
+    response.endEvents();
+    return std::nullopt;
+}
+
+auto Server::handleCompletionRequest(const CompletionRequest &request, ServerResponse &response, ServerSlot &slot,
+                                     const ModelInfo &modelInfo) -> std::optional<QJsonObject>
+{
+    auto *mySettings = MySettings::globalInstance();
+
+    QElapsedTimer totalTime;
+    totalTime.start();
+    const std::vector<MessageInput> exchange { { MessageInput::Type::Prompt, request.prompt } };
 
     // FIXME(jared): taking parameters from the UI inhibits reproducibility of results
     LLModel::PromptContext promptCtx {
@@ -677,106 +1480,139 @@ auto Server::handleCompletionRequest(const CompletionRequest &request)
         .repeat_last_n  = mySettings->modelRepeatPenaltyTokens(modelInfo),
     };
 
+    QJsonObject responseObject {
+        { "id",      "placeholder"                      },
+        { "object",  "text_completion"                  },
+        { "created", QDateTime::currentSecsSinceEpoch() },
+        { "model",   modelInfo.name()                   },
+    };
+
+    // streamed chunks are completion objects with a single choice each
+    QJsonObject chunkObject = responseObject;
+    if (request.include_usage)
+        chunkObject.insert("usage", QJsonValue::Null);
+    auto sendChunk = [&](qint64 index, const QString &text, const QJsonValue &finishReason) {
+        QJsonObject chunk = chunkObject;
+        chunk.insert("choices", QJsonArray { QJsonObject {
+            { "text",          text             },
+            { "index",         index            },
+            { "logprobs",      QJsonValue::Null },
+            { "finish_reason", finishReason     },
+        }});
+        response.sendEvent(toEvent(chunk));
+    };
+    if (request.stream)
+        response.beginEvents();
+
+    if (request.stream && request.echo) {
+        for (int i = 0; i < request.n; ++i)
+            sendChunk(i, request.prompt, QJsonValue::Null);
+    }
+
+    // the choices are generated together, so their tokens arrive interleaved
+    std::vector<QStringDecoder> decoders;
+    for (int i = 0; i < request.n; ++i)
+        decoders.emplace_back(QStringDecoder::Utf8);
+    auto onToken = [&](int index, const QByteArray &token) {
+        if (request.stream) {
+            // tokens can end in the middle of a character
+            QString delta = decoders[index].decode(token);
+            if (!delta.isEmpty())
+                sendChunk(index, delta, QJsonValue::Null);
+        }
+        return true;
+    };
+
     auto promptUtf8 = request.prompt.toUtf8();
-    int promptTokens = 0;
+    std::vector<PromptResult> results;
+    try {
+        results = generate(slot, response, std::string_view(promptUtf8.cbegin(), promptUtf8.cend()), promptCtx,
+                           int(request.n), onToken);
+    } catch (const std::exception &e) {
+        logExchange(exchange, {}, QString::fromUtf8(e.what()), /*isError*/ true, totalTime.elapsed());
+        if (request.stream)
+            return sendErrorEvent(response, e.what());
+        return respondWithError(response, QHttpServerResponder::StatusCode::InternalServerError);
+    }
+
+    // the client is gone, there is nobody to answer
+    if (response.isCancelled())
+        return std::nullopt;
+
+    int promptTokens = results.front().promptTokens;
     int responseTokens = 0;
     QStringList responses;
-    for (int i = 0; i < request.n; ++i) {
-        PromptResult result;
-        try {
-            result = promptInternal(std::string_view(promptUtf8.cbegin(), promptUtf8.cend()),
-                                    promptCtx,
-                                    /*usedLocalDocs*/ false);
-        } catch (const std::exception &e) {
-            m_chatModel->setResponseValue(e.what());
-            m_chatModel->setError();
-            emit responseStopped(0);
-            return makeError(QHttpServerResponder::StatusCode::InternalServerError);
-        }
+    QStringList finishReasons;
+    for (qsizetype i = 0; auto &result : std::as_const(results)) {
         QString resp = QString::fromUtf8(result.response);
         if (request.echo)
             resp = request.prompt + resp;
         responses << resp;
-        if (i == 0)
-            promptTokens = result.promptTokens;
+        finishReasons << (result.responseTokens == request.max_tokens ? u"length"_s : u"stop"_s);
+        if (request.stream)
+            sendChunk(i, QString(), finishReasons.last());
         responseTokens += result.responseTokens;
+        i++;
     }
 
-    QJsonObject responseObject {
-        { "id",      "placeholder"                      },
-        { "object",  "text_completion"                  },
-        { "created", QDateTime::currentSecsSinceEpoch() },
-        { "model",   modelInfo.name()                   },
+    logExchange(exchange, {}, responses.first(), /*isError*/ false, totalTime.elapsed());
+
+    QJsonObject usage {
+        { "prompt_tokens",     promptTokens                  },
+        { "completion_tokens", responseTokens                },
+        { "total_tokens",      promptTokens + responseTokens },
     };
 
+    if (request.stream) {
+        if (request.include_usage) {
+            QJsonObject chunk = chunkObject;
+            chunk.insert("choices", QJsonArray());
+            chunk.insert("usage", usage);
+            response.sendEvent(toEvent(chunk));
+        }
+        response.endEvents();
+        return std::nullopt;
+    }
+
     QJsonArray choices;
     for (qsizetype i = 0; auto &resp : std::as_const(responses)) {
         choices << QJsonObject {
-            { "text",          resp                                                     },
-            { "index",         i++                                                      },
-            { "logprobs",      QJsonValue::Null                                         },
-            { "finish_reason", responseTokens == request.max_tokens ? "length" : "stop" },
+            { "text",          resp             },
+            { "index",         i                },
+            { "logprobs",      QJsonValue::Null },
+            { "finish_reason", finishReasons[i] },
         };
+        i++;
     }
 
     responseObject.insert("choices", choices);
-    responseObject.insert("usage", QJsonObject {
-        { "prompt_tokens",     promptTokens                  },
-        { "completion_tokens", responseTokens                },
-        { "total_tokens",      promptTokens + responseTokens },
-    });
+    responseObject.insert("usage", usage);
 
-    return {QHttpServerResponse(responseObject), responseObject};
+    response.respond(QHttpServerResponse(responseObject));
+    return responseObject;
 }
 
-auto Server::handleChatRequest(const ChatRequest &request)
-    -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>
+auto Server::handleChatRequest(const ChatRequest &request, ServerResponse &response, ServerSlot &slot,
+                               const ModelInfo &modelInfo, const QList<QString> &collections)
+    -> std::optional<QJsonObject>
 {
     auto *mySettings = MySettings::globalInstance();
 
-    ModelInfo modelInfo = ModelList::globalInstance()->defaultModelInfo();
-    const QList<ModelInfo> modelList = ModelList::globalInstance()->selectableModelList();
-    for (const ModelInfo &info : modelList) {
-        Q_ASSERT(info.installed);
-        if (!info.installed)
-            continue;
-        if (request.model == info.name() || request.model == info.filename()) {
-            modelInfo = info;
-            break;
-        }
-    }
-
-    // load the new model if necessary
-    setShouldBeLoaded(true);
+    QElapsedTimer totalTime;
+    totalTime.start();
 
-    if (modelInfo.filename().isEmpty()) {
-        std::cerr << "ERROR: couldn't load default model " << request.model.toStdString() << std::endl;
-        return makeError(QHttpServerResponder::StatusCode::InternalServerError);
-    }
+    Q_ASSERT(!request.messages.isEmpty());
 
-    emit requestResetResponseState(); // blocks
+    const std::vector<MessageInput> messages = chatMessages(request);
 
-    // NB: this resets the context, regardless of whether this model is already loaded
-    if (!loadModel(modelInfo)) {
-        std::cerr << "ERROR: couldn't load model " << modelInfo.name().toStdString() << std::endl;
-        return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+    // LocalDocs are searched with the last message, if it is from the user
+    QList<ResultInfo> databaseResults;
+    if (!collections.isEmpty() && messages.back().type == MessageInput::Type::Prompt) {
+        const int retrievalSize = mySettings->localDocsRetrievalSize();
+        emit requestRetrieveFromDB(collections, messages.back().content, retrievalSize, &databaseResults); // blocks
     }
 
-    m_chatModel->updateCurrentResponse(m_chatModel->count() - 1, false);
-
-    Q_ASSERT(!request.messages.isEmpty());
-
-    // adds prompt/response items to GUI
-    std::vector<MessageInput> messages;
-    for (auto &message : request.messages) {
-        using enum ChatRequest::Message::Role;
-        switch (message.role) {
-            case System:    messages.push_back({ MessageInput::Type::System,   message.content }); break;
-            case User:      messages.push_back({ MessageInput::Type::Prompt,   message.content }); break;
-            case Assistant: messages.push_back({ MessageInput::Type::Response, message.content }); break;
-        }
-    }
-    auto startOffset = m_chatModel->appendResponseWithHistory(messages);
+    const std::vector<MessageItem> messageItems = chatMessageItems(messages, databaseResults);
 
     // FIXME(jared): taking parameters from the UI inhibits reproducibility of results
     LLModel::PromptContext promptCtx {
@@ -790,25 +1626,6 @@ auto Server::handleChatRequest(const ChatRequest &request)
         .repeat_last_n  = mySettings->modelRepeatPenaltyTokens(modelInfo),
     };
 
-    int promptTokens   = 0;
-    int responseTokens = 0;
-    QList<QPair<QString, QList<ResultInfo>>> responses;
-    for (int i = 0; i < request.n; ++i) {
-        ChatPromptResult result;
-        try {
-            result = promptInternalChat(m_collections, promptCtx, startOffset);
-        } catch (const std::exception &e) {
-            m_chatModel->setResponseValue(e.what());
-            m_chatModel->setError();
-            emit responseStopped(0);
-            return makeError(QHttpServerResponder::StatusCode::InternalServerError);
-        }
-        responses.emplace_back(result.response, result.databaseResults);
-        if (i == 0)
-            promptTokens = result.promptTokens;
-        responseTokens += result.responseTokens;
-    }
-
     QJsonObject responseObject {
         { "id",      "placeholder"                      },
         { "object",  "chat.completion"                  },
@@ -816,38 +1633,215 @@ auto Server::handleChatRequest(const ChatRequest &request)
         { "model",   modelInfo.name()                   },
     };
 
-    QJsonArray choices;
-    {
-        int index = 0;
-        for (const auto &r : responses) {
-            QString result = r.first;
-            QList<ResultInfo> infos = r.second;
-            QJsonObject message {
-                { "role",    "assistant" },
-                { "content", result      },
-            };
-            QJsonObject choice {
-                { "index",         index++                                                  },
-                { "message",       message                                                  },
-                { "finish_reason", responseTokens == request.max_tokens ? "length" : "stop" },
-                { "logprobs",      QJsonValue::Null                                         },
-            };
-            if (MySettings::globalInstance()->localDocsShowReferences()) {
-                QJsonArray references;
-                for (const auto &ref : infos)
-                    references.append(resultToJson(ref));
-                choice.insert("references", references.isEmpty() ? QJsonValue::Null : QJsonValue(references));
-            }
-            choices.append(choice);
+    const bool showReferences = mySettings->localDocsShowReferences();
+    auto referencesToJson = [](const QList<ResultInfo> &infos) -> QJsonValue {
+        QJsonArray references;
+        for (const auto &ref : infos)
+            references.append(resultToJson(ref));
+        return references.isEmpty() ? QJsonValue::Null : QJsonValue(references);
+    };
+
+    // streamed chunks carry a delta of a single choice each
+    QJsonObject chunkObject = responseObject;
+    chunkObject.insert("object", "chat.completion.chunk");
+    if (request.include_usage)
+        chunkObject.insert("usage", QJsonValue::Null);
+    auto sendChunk = [&](const QJsonObject &choice) {
+        QJsonObject chunk = chunkObject;
+        chunk.insert("choices", QJsonArray { choice });
+        response.sendEvent(toEvent(chunk));
+    };
+    auto deltaChoice = [](qint64 index, const QJsonObject &delta, const QJsonValue &finishReason) {
+        return QJsonObject {
+            { "index",         index            },
+            { "delta",         delta            },
+            { "logprobs",      QJsonValue::Null },
+            { "finish_reason", finishReason     },
+        };
+    };
+    if (request.stream)
+        response.beginEvents();
+
+    if (request.stream) {
+        for (int i = 0; i < request.n; ++i)
+            sendChunk(deltaChoice(i, {{ "role", "assistant" }, { "content", "" }}, QJsonValue::Null));
+    }
+
+    // the choices are generated together, so their tokens arrive interleaved
+    std::vector<QStringDecoder> decoders;
+    for (int i = 0; i < request.n; ++i)
+        decoders.emplace_back(QStringDecoder::Utf8);
+    auto onToken = [&](int index, const QByteArray &token) {
+        if (request.stream) {
+            // tokens can end in the middle of a character
+            QString delta = decoders[index].decode(token);
+            if (!delta.isEmpty())
+                sendChunk(deltaChoice(index, {{ "content", delta }}, QJsonValue::Null));
         }
+        return true;
+    };
+
+    std::vector<PromptResult> results;
+    try {
+        results = generate(slot, response, std::span<const MessageItem>(messageItems), promptCtx, int(request.n),
+                           onToken);
+    } catch (const std::exception &e) {
+        logExchange(messages, databaseResults, QString::fromUtf8(e.what()), /*isError*/ true, totalTime.elapsed());
+        if (request.stream)
+            return sendErrorEvent(response, e.what());
+        return respondWithError(response, QHttpServerResponder::StatusCode::InternalServerError);
     }
 
-    responseObject.insert("choices", choices);
-    responseObject.insert("usage", QJsonObject {
+    // the client is gone, there is nobody to answer
+    if (response.isCancelled())
+        return std::nullopt;
+
+    int promptTokens   = results.front().promptTokens;
+    int responseTokens = 0;
+    QStringList responses;
+    QStringList finishReasons;
+    for (qsizetype i = 0; auto &result : std::as_const(results)) {
+        finishReasons << (result.responseTokens == request.max_tokens ? u"length"_s : u"stop"_s);
+        if (request.stream) {
+            QJsonObject choice = deltaChoice(i, QJsonObject(), finishReasons.last());
+            if (showReferences)
+                choice.insert("references", referencesToJson(databaseResults));
+            sendChunk(choice);
+        }
+        responses << QString::fromUtf8(result.response);
+        responseTokens += result.responseTokens;
+        i++;
+    }
+
+    logExchange(messages, databaseResults, responses.first(), /*isError*/ false, totalTime.elapsed());
+
+    QJsonObject usage {
         { "prompt_tokens",     promptTokens                  },
         { "completion_tokens", responseTokens                },
         { "total_tokens",      promptTokens + responseTokens },
-    });
+    };
+
+    if (request.stream) {
+        if (request.include_usage) {
+            QJsonObject chunk = chunkObject;
+            chunk.insert("choices", QJsonArray());
+            chunk.insert("usage", usage);
+            response.sendEvent(toEvent(chunk));
+        }
+        response.endEvents();
+        return std::nullopt;
+    }
+
+    QJsonArray choices;
+    for (qsizetype i = 0; auto &resp : std::as_const(responses)) {
+        QJsonObject message {
+            { "role",    "assistant" },
+            { "content", resp        },
+        };
+        QJsonObject choice {
+            { "index",         i                },
+            { "message",       message          },
+            { "finish_reason", finishReasons[i] },
+            { "logprobs",      QJsonValue::Null },
+        };
+        if (showReferences)
+            choice.insert("references", referencesToJson(databaseResults));
+        choices.append(choice);
+        i++;
+    }
+
+    responseObject.insert("choices", choices);
+    responseObject.insert("usage", usage);
+
+    response.respond(QHttpServerResponse(responseObject));
+    return responseObject;
+}
 
-    return {QHttpServerResponse(responseObject), responseObject};
+// the raw little-endian floats, as the OpenAI clients decode them
+static QString toBase64(std::span<const float> embedding)
+{
+    QByteArray bytes(embedding.size() * sizeof(float), Qt::Uninitialized);
+    qToLittleEndian<float>(embedding.data(), embedding.size(), bytes.data());
+    return QString::fromLatin1(bytes.toBase64());
+}
+
+void Server::handleEmbeddingRequest(const EmbeddingRequest &request, ServerResponse &response)
+{
+    std::vector<std::string> texts;
+    texts.reserve(request.input.size());
+    for (auto &text : request.input)
+        texts.push_back(text.toStdString());
+    std::optional<std::string> prefix;
+    if (request.prefix)
+        prefix = request.prefix->toStdString();
+
+    std::vector<float> embeddings;
+    qint64 nTokens = 0;
+    try {
+        embeddings = m_embLLM->embedTexts(texts, prefix, request.dimensions, &nTokens);
+    } catch (const std::invalid_argument &e) { // unknown task type
+        response.respond(InvalidRequestError(e.what()).asResponse());
+        return;
+    } catch (const std::out_of_range &e) { // unsupported dimensions
+        response.respond(InvalidRequestError(e.what()).asResponse());
+        return;
+    } catch (const std::exception &e) {
+        std::cerr << "ERROR: couldn't embed: " << e.what() << std::endl;
+        response.respond(QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError));
+        return;
+    }
+
+    const size_t embeddingSize = embeddings.size() / texts.size();
+    QJsonArray data;
+    for (size_t i = 0; i < texts.size(); i++) {
+        std::span<const float> embedding(embeddings.data() + i * embeddingSize, embeddingSize);
+        QJsonValue value;
+        if (request.base64) {
+            value = toBase64(embedding);
+        } else {
+            QJsonArray floats;
+            for (float f : embedding)
+                floats.append(double(f));
+            value = floats;
+        }
+        data.append(QJsonObject {
+            { "object",    "embedding" },
+            { "index",     qint64(i)   },
+            { "embedding", value       },
+        });
+    }
+
+    response.respond(QHttpServerResponse(QJsonObject {
+        { "object", "list"                },
+        { "data",   data                  },
+        { "model",  EmbeddingLLM::model() },
+        { "usage",  QJsonObject {
+            { "prompt_tokens", nTokens },
+            { "total_tokens",  nTokens },
+        }},
+    }));
+}
+
+void Server::logExchange(const std::vector<MessageInput> &messages, const QList<ResultInfo> &sources,
+                         const QString &response, bool isError, qint64 elapsedMs)
+{
+    // the chat model is only changed on the LLM thread
+    QMetaObject::invokeMethod(this, [=, this] {
+        Q_ASSERT(m_chatModel);
+
+        emit requestResetResponseState(); // blocks
+        qsizetype prevMsgIndex = m_chatModel->count() - 1;
+        if (prevMsgIndex >= 0)
+            m_chatModel->updateCurrentResponse(prevMsgIndex, false);
+
+        auto startOffset = m_chatModel->appendResponseWithHistory(messages);
+        if (!sources.isEmpty() && messages.back().type == MessageInput::Type::Prompt) {
+            m_chatModel->updateSources(startOffset + qsizetype(messages.size()) - 1, sources);
+            emit databaseResultsChanged(sources);
+        }
+        m_chatModel->setResponseValue(response);
+        if (isError)
+            m_chatModel->setError();
+        emit responseStopped(elapsedMs);
+    }, Qt::QueuedConnection);
 }
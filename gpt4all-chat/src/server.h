@@ -3,30 +3,79 @@
 
 #include "chatllm.h"
 #include "database.h"
+#include "modellist.h"
+#include "responsecache.h"
 
+#include <QByteArray>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
 #include <QHttpServer>
-#include <QHttpServerResponse>
 #include <QJsonObject>
 #include <QList>
+#include <QMutex>
 #include <QObject> // IWYU pragma: keep
 #include <QString>
+#include <QThread>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtTypes>
 
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <optional>
-#include <utility>
+#include <span>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 class Chat;
 class ChatRequest;
 class CompletionRequest;
+class EmbeddingLLM;
+class EmbeddingRequest;
+class LLModel;
+class QTimer;
+class ServerBatch;
+class ServerConnections;
+class ServerResponse;
 
 
+// Lets the slots of the server take turns at the model, one decode step at a time, in the order they asked.
+class DecodeTurns
+{
+public:
+    void acquire();
+    void release();
+    // lets everyone who is waiting have a step first
+    void yield();
+
+private:
+    QMutex         m_mutex;
+    QWaitCondition m_turnChanged;
+    quint64        m_nextTicket = 0;
+    quint64        m_serving    = 0;
+};
+
+// An instance of the loaded model that the server generates responses on, one request at a time.
+struct ServerSlot
+{
+    LLModel                 *model    = nullptr; // the server's own model for the first slot
+    std::unique_ptr<LLModel> context;           // owns the model of the other slots
+    bool                     busy     = false;
+    quint64                  lastUsed = 0;       // when it last got a request, so the oldest cache is given up first
+    int                      index    = 0;       // label for the metrics
+};
+
 class Server : public ChatLLM
 {
     Q_OBJECT
 
 public:
     explicit Server(Chat *chat);
-    ~Server() override = default;
+    ~Server() override;
 
 public Q_SLOTS:
     void start();
@@ -35,18 +84,88 @@ Q_SIGNALS:
     void requestResetResponseState();
 
 private:
-    auto handleCompletionRequest(const CompletionRequest &request) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>;
-    auto handleChatRequest(const ChatRequest &request) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>;
+    // A request waiting for a slot.
+    struct Job {
+        ModelInfo                       modelInfo;
+        std::shared_ptr<ServerResponse> response;
+        bool                            batched = false; // from a batch, so neither limited by the queue nor timed out
+        QDeadlineTimer                  deadline; // answered with 503 if it did not get a slot by then
+        QElapsedTimer                   queued;
+        // the prompt as the model will see it, to find the slot that has the most of it cached
+        std::function<std::string()>    render;
+        // on a thread of the slot pool, with the LocalDocs collections enabled when it got its slot
+        std::function<void(ServerSlot &, const QList<QString> &)> run;
+    };
+
+    // find the model of a parsed request and queue it for a slot, unless the response cache has the reply
+    void queueCompletionRequest(const std::shared_ptr<CompletionRequest> &request,
+                                const std::shared_ptr<ServerResponse> &response, bool batched);
+    void queueChatRequest(const std::shared_ptr<ChatRequest> &request, const std::shared_ptr<ServerResponse> &response,
+                          bool batched);
+    void submit(Job job);
+    void schedule();
+    // the idle slot to run the job on, or a new one if none of them has its prompt cached
+    ServerSlot *freeSlot(const Job &job);
+    ServerSlot *addSlot();
+
+    // generates n responses on the slot, taking turns at the model with the other slots, until the client goes away
+    auto generate(ServerSlot &slot, const ServerResponse &response,
+                  const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
+                  const LLModel::PromptContext &ctx, int n, const std::function<bool(int, const QByteArray &)> &onToken)
+        -> std::vector<PromptResult>;
+
+    std::shared_ptr<ServerBatch> findBatch(const QString &id);
+    // queues the next requests of the batch, so that as many of them run at a time as there are slots
+    void feedBatch(const std::shared_ptr<ServerBatch> &batch);
+
+    // answers from the response cache if it has the reply, otherwise says in a header whether it will be cached
+    bool respondFromCache(ServerResponse &response, const QByteArray &key);
+    void cacheResponse(const QByteArray &key, const QJsonObject &response);
+
+    // these respond through the given response and return the reply object, if it was not streamed
+    auto handleCompletionRequest(const CompletionRequest &request, ServerResponse &response, ServerSlot &slot,
+                                 const ModelInfo &modelInfo) -> std::optional<QJsonObject>;
+    auto handleChatRequest(const ChatRequest &request, ServerResponse &response, ServerSlot &slot,
+                           const ModelInfo &modelInfo, const QList<QString> &collections) -> std::optional<QJsonObject>;
+    void handleEmbeddingRequest(const EmbeddingRequest &request, ServerResponse &response);
+
+    // adds a finished request to the chat view of the server
+    void logExchange(const std::vector<MessageInput> &messages, const QList<ResultInfo> &sources,
+                     const QString &response, bool isError, qint64 elapsedMs);
 
 private Q_SLOTS:
-    void handleDatabaseResultsChanged(const QList<ResultInfo> &results) { m_databaseResults = results; }
-    void handleCollectionListChanged(const QList<QString> &collectionList) { m_collections = collectionList; }
+    void handleCollectionListChanged(const QList<QString> &collectionList)
+    { m_collections = collectionList; m_responseCache.clear(); }
 
 private:
     Chat *m_chat;
+    // the HTTP server runs on its own thread, so that it keeps streaming while the model generates
+    QThread m_httpThread;
     std::unique_ptr<QHttpServer> m_server;
-    QList<ResultInfo> m_databaseResults;
+    ServerConnections *m_connections = nullptr;
     QList<QString> m_collections;
+
+    // Requests wait in m_queue, which is shared with the HTTP thread, until schedule() finds them a slot. Slots
+    // are created as needed up to the configured number, and only used and changed on the LLM thread.
+    QMutex m_queueMutex;
+    std::deque<Job> m_queue;
+    QTimer *m_queueTimer = nullptr;
+    std::vector<std::unique_ptr<ServerSlot>> m_slots;
+    bool m_canAddSlots = true; // false once the loaded model could not make another context
+    quint64 m_slotUses = 0;
+    QThreadPool m_slotPool;
+    DecodeTurns m_turns;
+    std::atomic<bool> m_stopping = false;
+
+    // a local embedding model of its own, so that it does not depend on the LocalDocs settings
+    std::unique_ptr<EmbeddingLLM> m_embLLM;
+    QThreadPool m_embeddingPool; // one request at a time, each is spread over the contexts of the model
+
+    // replies to requests with deterministic sampling, looked up on the HTTP thread before they are queued
+    ResponseCache m_responseCache;
+
+    QMutex m_batchesMutex;
+    QList<std::shared_ptr<ServerBatch>> m_batches; // kept until the application quits, their output files remain
 };
 
 #endif // SERVER_H
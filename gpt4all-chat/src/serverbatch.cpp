@@ -0,0 +1,143 @@
+#include "serverbatch.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QIODevice>
+#include <QJsonDocument>
+#include <QJsonValue>
+#include <QMutexLocker>
+#include <QtLogging>
+
+#include <utility>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+ServerBatch::ServerBatch(QString id, std::vector<Item> items)
+    : m_id(std::move(id))
+    , m_createdAt(QDateTime::currentSecsSinceEpoch())
+    , m_total(qsizetype(items.size()))
+    , m_items(std::move(items))
+{}
+
+bool ServerBatch::open(const QString &dir)
+{
+    if (!QDir().mkpath(dir)) {
+        qWarning() << "ERROR: Could not create the batch output directory:" << dir;
+        return false;
+    }
+    m_output.setFileName(QDir(dir).filePath(m_id + u".jsonl"_s));
+    if (!m_output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "ERROR: Could not open the batch output file:" << m_output.fileName()
+                   << m_output.errorString();
+        return false;
+    }
+    return true;
+}
+
+std::optional<ServerBatch::Item> ServerBatch::takeItem(qsizetype maxRunning)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_cancelled || m_next >= m_items.size() || m_running >= maxRunning)
+        return std::nullopt;
+    m_running++;
+    return m_items[m_next++];
+}
+
+void ServerBatch::finishItem(const Item &item, int status, const QByteArray &body)
+{
+    QMutexLocker locker(&m_mutex);
+    m_running--;
+    if (status) {
+        const QJsonDocument doc = QJsonDocument::fromJson(body);
+        writeResult(item, status, doc.isObject() ? QJsonValue(doc.object()) : QJsonValue::Null, QJsonValue::Null);
+    } else {
+        writeResult(item, 0, QJsonValue::Null, QJsonObject {
+            { "code",    u"request_cancelled"_s                                },
+            { "message", u"The request was cancelled before it was answered."_s },
+        });
+    }
+    updateFinished();
+}
+
+void ServerBatch::cancel()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_cancelled || m_finishedAt)
+        return;
+    m_cancelled = true;
+    for (; m_next < m_items.size(); m_next++) {
+        writeResult(m_items[m_next], 0, QJsonValue::Null, QJsonObject {
+            { "code",    u"batch_cancelled"_s                                  },
+            { "message", u"The batch was cancelled before this request ran."_s },
+        });
+    }
+    updateFinished();
+}
+
+QJsonObject ServerBatch::toJson() const
+{
+    QMutexLocker locker(&m_mutex);
+    QString status;
+    if (!m_finishedAt)
+        status = m_cancelled ? u"cancelling"_s : u"in_progress"_s;
+    else
+        status = m_cancelled ? u"cancelled"_s : u"completed"_s;
+    auto finishedAt = [&](bool cancelled) {
+        return m_finishedAt && m_cancelled == cancelled ? QJsonValue(*m_finishedAt) : QJsonValue::Null;
+    };
+
+    return QJsonObject {
+        { "id",             m_id                   },
+        { "object",         u"batch"_s             },
+        { "status",         status                 },
+        { "output_file",    m_output.fileName()    },
+        { "created_at",     m_createdAt            },
+        { "completed_at",   finishedAt(false)      },
+        { "cancelled_at",   finishedAt(true)       },
+        { "request_counts", QJsonObject {
+            { "total",     m_total     },
+            { "completed", m_completed },
+            { "failed",    m_failed    },
+        }},
+    };
+}
+
+QByteArray ServerBatch::output() const
+{
+    QMutexLocker locker(&m_mutex); // so that the last line is complete
+    QFile file(m_output.fileName());
+    if (!file.open(QIODevice::ReadOnly))
+        return {};
+    return file.readAll();
+}
+
+// the line of the output file for a request, which is written with m_mutex held
+void ServerBatch::writeResult(const Item &item, int status, const QJsonValue &body, const QJsonValue &error)
+{
+    const bool succeeded = status >= 200 && status < 300;
+    (succeeded ? m_completed : m_failed)++;
+
+    QJsonValue response = QJsonValue::Null;
+    if (status)
+        response = QJsonObject {{ "status_code", status }, { "body", body }};
+    QJsonObject line {
+        { "id",        u"%1-%2"_s.arg(m_id).arg(item.line) },
+        { "custom_id", item.customId                       },
+        { "response",  response                            },
+        { "error",     error                               },
+    };
+    m_output.write(QJsonDocument(line).toJson(QJsonDocument::Compact) + '\n');
+    m_output.flush();
+}
+
+void ServerBatch::updateFinished()
+{
+    if (!m_finishedAt && m_next >= m_items.size() && !m_running) {
+        m_finishedAt = QDateTime::currentSecsSinceEpoch();
+        m_output.close();
+        m_items = {};
+        m_next = 0;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef SERVERBATCH_H
+#define SERVERBATCH_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QMutex>
+#include <QString>
+#include <QtTypes>
+
+#include <optional>
+#include <vector>
+
+
+/* A batch of requests to the API server, read from a JSONL file in the format of OpenAI's batch API. The server runs
+ * them in the background and writes each response to an output file as a line of JSON once it is done. Thread-safe. */
+class ServerBatch
+{
+public:
+    struct Item {
+        qsizetype   line;     // in the input file, from 1
+        QString     customId;
+        QString     url;      // the endpoint, /v1/completions or /v1/chat/completions
+        QJsonObject body;
+    };
+
+    // the items are run in the given order
+    ServerBatch(QString id, std::vector<Item> items);
+
+    // creates the output file in the directory, where it is kept after the batch is done
+    bool open(const QString &dir);
+
+    const QString &id() const { return m_id; }
+    // the next request to run, if fewer than maxRunning are running and the batch was not cancelled
+    std::optional<Item> takeItem(qsizetype maxRunning);
+    // writes the response to a request that was taken; a status of 0 means that it was cancelled before it was answered
+    void finishItem(const Item &item, int status, const QByteArray &body);
+    // the requests that did not start are written as cancelled, the running ones finish
+    void cancel();
+
+    QJsonObject toJson() const;
+    QByteArray output() const;
+
+private:
+    void writeResult(const Item &item, int status, const QJsonValue &body, const QJsonValue &error);
+    void updateFinished();
+
+    const QString         m_id;
+    const qint64          m_createdAt;
+    const qsizetype       m_total;
+    mutable QMutex        m_mutex;
+    std::vector<Item>     m_items; // let go of once the batch is done
+    size_t                m_next      = 0; // the first item that was not taken
+    qsizetype             m_running   = 0;
+    qsizetype             m_completed = 0;
+    qsizetype             m_failed    = 0;
+    bool                  m_cancelled = false;
+    std::optional<qint64> m_finishedAt;
+    QFile                 m_output;
+};
+
+#endif // SERVERBATCH_H
@@ -0,0 +1,167 @@
+#include "servermetrics.h"
+
+#include <QGlobalStatic>
+#include <QLatin1StringView>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QtMinMax>
+
+#include <algorithm>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+MetricsHistogram::MetricsHistogram(std::initializer_list<double> bounds)
+    : m_bounds(bounds)
+    , m_counts(bounds.size() + 1)
+{}
+
+void MetricsHistogram::observe(double secs)
+{
+    secs = qMax(secs, 0.0);
+    const size_t bucket = std::ranges::lower_bound(m_bounds, secs) - m_bounds.begin();
+    QMutexLocker locker(&m_mutex);
+    m_counts[bucket]++;
+    m_sum += secs;
+}
+
+void MetricsHistogram::write(QByteArray &out, QByteArrayView name, QByteArrayView help) const
+{
+    std::vector<quint64> counts;
+    double sum;
+    {
+        QMutexLocker locker(&m_mutex);
+        counts = m_counts;
+        sum = m_sum;
+    }
+
+    out.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    out.append("# TYPE ").append(name).append(" histogram\n");
+    quint64 cumulative = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        cumulative += counts[i];
+        const QByteArray le = i < m_bounds.size() ? QByteArray::number(m_bounds[i]) : "+Inf"_ba;
+        out.append(name).append("_bucket{le=\"").append(le).append("\"} ")
+           .append(QByteArray::number(cumulative)).append('\n');
+    }
+    out.append(name).append("_sum ").append(QByteArray::number(sum, 'g', 10)).append('\n');
+    out.append(name).append("_count ").append(QByteArray::number(cumulative)).append('\n');
+}
+
+class MyServerMetrics : public ServerMetrics { };
+Q_GLOBAL_STATIC(MyServerMetrics, metricsInstance)
+ServerMetrics *ServerMetrics::globalInstance()
+{
+    return metricsInstance();
+}
+
+void ServerMetrics::countRequest(QByteArrayView route, int status)
+{
+    QMutexLocker locker(&m_requestsMutex);
+    m_requests[{ route.toByteArray(), status }]++;
+}
+
+void ServerMetrics::setSlotCache(int slot, qint64 tokens, qint64 capacity)
+{
+    QMutexLocker locker(&m_slotCachesMutex);
+    m_slotCaches[slot] = { tokens, capacity };
+}
+
+void ServerMetrics::clearSlotCaches()
+{
+    QMutexLocker locker(&m_slotCachesMutex);
+    m_slotCaches.clear();
+}
+
+QByteArray ServerMetrics::routeLabel(const QString &path)
+{
+    static const QStringList routes {
+        u"/v1/models"_s, u"/v1/completions"_s, u"/v1/chat/completions"_s, u"/v1/embeddings"_s, u"/v1/batches"_s,
+        u"/metrics"_s,
+    };
+    if (routes.contains(path))
+        return path.toUtf8();
+    if (path.startsWith("/v1/models/"_L1))
+        return "/v1/models/{model}"_ba;
+    if (path.startsWith("/v1/batches/"_L1)) {
+        if (path.endsWith("/output"_L1))
+            return "/v1/batches/{id}/output"_ba;
+        if (path.endsWith("/cancel"_L1))
+            return "/v1/batches/{id}/cancel"_ba;
+        return "/v1/batches/{id}"_ba;
+    }
+    return "other"_ba;
+}
+
+static void writeHeader(QByteArray &out, QByteArrayView name, QByteArrayView type, QByteArrayView help)
+{
+    out.append("# HELP ").append(name).append(' ').append(help).append('\n');
+    out.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+}
+
+static void writeScalar(QByteArray &out, QByteArrayView name, QByteArrayView type, QByteArrayView help,
+                        qint64 value)
+{
+    writeHeader(out, name, type, help);
+    out.append(name).append(' ').append(QByteArray::number(value)).append('\n');
+}
+
+QByteArray ServerMetrics::toPrometheus() const
+{
+    QByteArray out;
+
+    writeHeader(out, "gpt4all_http_requests_total", "counter", "Requests answered by the API server.");
+    {
+        QMutexLocker locker(&m_requestsMutex);
+        for (const auto &[key, count] : m_requests.asKeyValueRange()) {
+            out += "gpt4all_http_requests_total{route=\""_ba + key.first + "\",status=\""_ba
+                 + QByteArray::number(key.second) + "\"} "_ba + QByteArray::number(count) + '\n';
+        }
+    }
+    writeScalar(out, "gpt4all_queue_depth", "gauge", "API requests waiting for a slot.", m_queueDepth);
+    writeScalar(out, "gpt4all_slots", "gauge", "Contexts of the loaded model that the API server uses.",
+                m_slotsTotal);
+    writeScalar(out, "gpt4all_slots_busy", "gauge", "Slots that are generating a response.", m_slotsBusy);
+    m_queueWait.write(out, "gpt4all_queue_wait_seconds", "Time API requests waited for a slot.");
+
+    {
+        QMutexLocker locker(&m_slotCachesMutex);
+        writeHeader(out, "gpt4all_kv_cache_tokens", "gauge",
+                    "Tokens in the KV cache of each slot after its last request.");
+        for (const auto &[slot, cache] : m_slotCaches.asKeyValueRange())
+            out += "gpt4all_kv_cache_tokens{slot=\""_ba + QByteArray::number(slot) + "\"} "_ba
+                 + QByteArray::number(cache.first) + '\n';
+        writeHeader(out, "gpt4all_kv_cache_capacity_tokens", "gauge", "Size of the context of each slot.");
+        for (const auto &[slot, cache] : m_slotCaches.asKeyValueRange())
+            out += "gpt4all_kv_cache_capacity_tokens{slot=\""_ba + QByteArray::number(slot) + "\"} "_ba
+                 + QByteArray::number(cache.second) + '\n';
+    }
+
+    writeScalar(out, "gpt4all_prompt_tokens_total", "counter", "Prompt tokens decoded by the model.",
+                qint64(m_promptTokens));
+    writeScalar(out, "gpt4all_prompt_tokens_cached_total", "counter",
+                "Prompt tokens that were already in the KV cache.", qint64(m_promptTokensCached));
+    writeScalar(out, "gpt4all_generated_tokens_total", "counter", "Tokens generated by the model.",
+                qint64(m_responseTokens));
+    writeScalar(out, "gpt4all_context_shifts_total", "counter",
+                "Times the context was full and its oldest tokens were erased.", qint64(m_contextShifts));
+    m_timeToFirstToken.write(out, "gpt4all_time_to_first_token_seconds",
+                             "Time from the start of prompt processing to the first generated token.");
+    m_tokenLatency.write(out, "gpt4all_token_latency_seconds", "Time between generated tokens.");
+    m_modelLoad.write(out, "gpt4all_model_load_seconds", "Time taken to load a model.");
+
+    m_retrieval.write(out, "gpt4all_localdocs_retrieval_seconds", "Time taken to retrieve LocalDocs snippets.");
+    return out;
+}
+
+void ResponseTimer::onToken()
+{
+    auto *metrics = ServerMetrics::globalInstance();
+    const qint64 now = m_timer.nsecsElapsed();
+    if (m_lastToken < 0)
+        metrics->m_timeToFirstToken.observe(now / 1e9);
+    else
+        metrics->m_tokenLatency.observe((now - m_lastToken) / 1e9);
+    m_lastToken = now;
+    metrics->m_responseTokens++;
+}
@@ -0,0 +1,100 @@
+#ifndef SERVERMETRICS_H
+#define SERVERMETRICS_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QtTypes>
+
+#include <atomic>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+
+// Durations in seconds, counted in fixed buckets the way Prometheus histograms are. Thread-safe.
+class MetricsHistogram {
+public:
+    MetricsHistogram(std::initializer_list<double> bounds);
+
+    void observe(double secs);
+    void write(QByteArray &out, QByteArrayView name, QByteArrayView help) const;
+
+private:
+    const std::vector<double> m_bounds; // upper bounds of the buckets, without +Inf
+    mutable QMutex            m_mutex;
+    std::vector<quint64>      m_counts; // not cumulative, the last one is +Inf
+    double                    m_sum = 0;
+};
+
+/* Counters, gauges, and histograms of the API server and of inference in any chat, which the server
+ * exposes at /metrics in the Prometheus text format. Can be used from any thread. */
+class ServerMetrics {
+public:
+    static ServerMetrics *globalInstance();
+
+    // the API server
+    void countRequest(QByteArrayView route, int status);
+    void setQueueDepth(qsizetype n) { m_queueDepth = n; }
+    void setSlots(int busy, int total) { m_slotsBusy = busy; m_slotsTotal = total; }
+    void observeQueueWait(double secs) { m_queueWait.observe(secs); }
+    // the tokens in the KV cache of each slot after its last request
+    void setSlotCache(int slot, qint64 tokens, qint64 capacity);
+    void clearSlotCaches();
+
+    // inference
+    void countPromptTokens(qsizetype n, bool cached) { (cached ? m_promptTokensCached : m_promptTokens) += n; }
+    void countContextShifts(quint64 n) { m_contextShifts += n; }
+    void observeModelLoad(double secs) { m_modelLoad.observe(secs); }
+
+    // LocalDocs
+    void observeRetrieval(double secs) { m_retrieval.observe(secs); }
+
+    // the route label of a request path, with the model name left out so that there are only a few of them
+    static QByteArray routeLabel(const QString &path);
+
+    QByteArray toPrometheus() const;
+
+private:
+    ServerMetrics() = default;
+    friend class MyServerMetrics;
+    friend class ResponseTimer;
+
+    mutable QMutex                          m_requestsMutex;
+    QMap<std::pair<QByteArray, int>, quint64> m_requests; // by route and status
+
+    std::atomic<qsizetype> m_queueDepth = 0;
+    std::atomic<int>       m_slotsBusy  = 0;
+    std::atomic<int>       m_slotsTotal = 0;
+    MetricsHistogram       m_queueWait { 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60 };
+
+    mutable QMutex                         m_slotCachesMutex;
+    QMap<int, std::pair<qint64, qint64>>   m_slotCaches; // tokens and capacity, by slot
+
+    std::atomic<quint64> m_promptTokens       = 0;
+    std::atomic<quint64> m_promptTokensCached = 0;
+    std::atomic<quint64> m_responseTokens     = 0;
+    std::atomic<quint64> m_contextShifts      = 0;
+    MetricsHistogram     m_timeToFirstToken { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+    MetricsHistogram     m_tokenLatency     { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1 };
+    MetricsHistogram     m_modelLoad        { 0.5, 1, 2.5, 5, 10, 20, 30, 60, 120 };
+
+    MetricsHistogram     m_retrieval { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5 };
+};
+
+// Times one response from when its prompt starts to be processed: the first token, then each one after it.
+class ResponseTimer {
+public:
+    ResponseTimer() { m_timer.start(); }
+
+    void onToken();
+
+private:
+    QElapsedTimer m_timer;
+    qint64        m_lastToken = -1; // nsecs
+};
+
+#endif // SERVERMETRICS_H
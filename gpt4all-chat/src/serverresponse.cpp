@@ -0,0 +1,184 @@
+#include "serverresponse.h"
+
+#include "servermetrics.h"
+
+#include <QHostAddress>
+#include <QHttpHeaders>
+#include <QHttpServerRequest>
+#include <QHttpServerResponse>
+#include <QLatin1StringView>
+#include <QMutexLocker>
+#include <QTcpSocket>
+#include <QUrl>
+#include <Qt>
+#include <QtAssert>
+
+#include <algorithm>
+#include <utility>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// how much of an event stream may be unread by the client before generation waits for it
+static constexpr qint64 s_maxPendingBytes = 64 * 1024;
+
+std::shared_ptr<ServerResponse> ServerConnections::createResponse(const QHttpServerRequest &request,
+                                                                  QHttpServerResponder &responder)
+{
+    QTcpSocket *socket = m_sockets.value(request.remotePort());
+    std::shared_ptr<ServerResponse> response(new ServerResponse(responder, this, socket));
+    response->m_route = ServerMetrics::routeLabel(request.url().path());
+    addResponse(response);
+
+    if (socket) {
+        std::weak_ptr<ServerResponse> weak = response;
+        response->m_connections << connect(socket, &QIODevice::bytesWritten, this, [weak] {
+            if (auto r = weak.lock())
+                r->updatePending();
+        });
+        response->m_connections << connect(socket, &QAbstractSocket::disconnected, this, [weak] {
+            if (auto r = weak.lock())
+                r->cancel();
+        });
+    }
+    return response;
+}
+
+std::shared_ptr<ServerResponse> ServerConnections::createDetachedResponse(
+    QByteArrayView route, std::function<void(int, const QByteArray &)> onResponse
+) {
+    std::shared_ptr<ServerResponse> response(new ServerResponse(this, std::move(onResponse)));
+    response->m_route = route.toByteArray();
+    addResponse(response);
+    return response;
+}
+
+void ServerConnections::addResponse(const std::shared_ptr<ServerResponse> &response)
+{
+    QMutexLocker locker(&m_responsesMutex);
+    std::erase_if(m_responses, [](auto &r) { return r.expired(); });
+    m_responses << response;
+    if (m_cancelled)
+        response->cancel();
+}
+
+void ServerConnections::cancelAll()
+{
+    QMutexLocker locker(&m_responsesMutex);
+    m_cancelled = true;
+    for (auto &weak: std::as_const(m_responses)) {
+        if (auto r = weak.lock())
+            r->cancel();
+    }
+}
+
+void ServerConnections::incomingConnection(qintptr handle)
+{
+    auto *socket = new QTcpSocket(this);
+    if (!socket->setSocketDescriptor(handle)) {
+        delete socket;
+        return;
+    }
+
+    const quint16 port = socket->peerPort();
+    m_sockets.insert(port, socket);
+    connect(socket, &QObject::destroyed, this, [this, port] {
+        if (!m_sockets.value(port))
+            m_sockets.remove(port);
+    });
+    addPendingConnection(socket);
+}
+
+ServerResponse::ServerResponse(QHttpServerResponder &responder, QObject *context, QTcpSocket *socket)
+    : m_responder(std::move(responder))
+    , m_context(context)
+    , m_socket(socket)
+{}
+
+ServerResponse::ServerResponse(QObject *context, std::function<void(int, const QByteArray &)> onResponse)
+    : m_onResponse(std::move(onResponse))
+    , m_context(context)
+{}
+
+ServerResponse::~ServerResponse()
+{
+    for (const auto &connection: std::as_const(m_connections))
+        QObject::disconnect(connection);
+    if (m_onResponse && !m_responded)
+        m_onResponse(0, {});
+}
+
+void ServerResponse::respond(QHttpServerResponse &&response)
+{
+    ServerMetrics::globalInstance()->countRequest(m_route, int(response.statusCode()));
+    if (m_onResponse) {
+        m_responded = true;
+        return m_onResponse(int(response.statusCode()), response.data());
+    }
+    auto shared = std::make_shared<QHttpServerResponse>(std::move(response));
+    QMetaObject::invokeMethod(m_context, [self = shared_from_this(), shared, extra = m_headers] {
+        auto headers = shared->headers();
+        headers.append("Access-Control-Allow-Origin"_L1, "*"_L1);
+        for (qsizetype i = 0; i < extra.size(); i++)
+            headers.append(extra.nameAt(i), extra.valueAt(i));
+        shared->setHeaders(std::move(headers));
+        self->m_responder->sendResponse(*shared);
+    }, Qt::QueuedConnection);
+}
+
+void ServerResponse::beginEvents()
+{
+    Q_ASSERT(m_responder); // detached responses are never streamed
+    ServerMetrics::globalInstance()->countRequest(m_route, 200);
+    QMetaObject::invokeMethod(m_context, [self = shared_from_this(), headers = m_headers]() mutable {
+        headers.append(QHttpHeaders::WellKnownHeader::ContentType, "text/event-stream"_L1);
+        headers.append(QHttpHeaders::WellKnownHeader::CacheControl, "no-cache"_L1);
+        headers.append("Access-Control-Allow-Origin"_L1, "*"_L1);
+        self->m_responder->writeBeginChunked(headers);
+    }, Qt::QueuedConnection);
+}
+
+bool ServerResponse::sendEvent(const QByteArray &data)
+{
+    QByteArray event = "data: "_ba + data + "\n\n"_ba;
+    {
+        QMutexLocker locker(&m_mutex);
+        while (!m_cancelled && m_queuedBytes + m_socketBytes > s_maxPendingBytes)
+            m_drained.wait(&m_mutex);
+        if (m_cancelled)
+            return false;
+        m_queuedBytes += event.size();
+    }
+
+    QMetaObject::invokeMethod(m_context, [self = shared_from_this(), event = std::move(event)] {
+        self->m_responder->writeChunk(event);
+        {
+            QMutexLocker locker(&self->m_mutex);
+            self->m_queuedBytes -= event.size();
+        }
+        self->updatePending();
+    }, Qt::QueuedConnection);
+    return true;
+}
+
+void ServerResponse::endEvents()
+{
+    QMetaObject::invokeMethod(m_context, [self = shared_from_this()] {
+        self->m_responder->writeEndChunked("data: [DONE]\n\n"_ba);
+    }, Qt::QueuedConnection);
+}
+
+void ServerResponse::cancel()
+{
+    QMutexLocker locker(&m_mutex);
+    m_cancelled = true;
+    m_drained.wakeAll();
+}
+
+void ServerResponse::updatePending()
+{
+    QMutexLocker locker(&m_mutex);
+    m_socketBytes = m_socket ? m_socket->bytesToWrite() : 0;
+    if (m_queuedBytes + m_socketBytes <= s_maxPendingBytes)
+        m_drained.wakeAll();
+}
@@ -0,0 +1,106 @@
+#ifndef SERVERRESPONSE_H
+#define SERVERRESPONSE_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QHash>
+#include <QHttpHeaders>
+#include <QHttpServerResponder>
+#include <QList>
+#include <QMetaObject>
+#include <QMutex>
+#include <QPointer>
+#include <QTcpServer>
+#include <QWaitCondition>
+#include <QtTypes>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+
+class QHttpServerRequest;
+class QHttpServerResponse;
+class QTcpSocket;
+class ServerResponse;
+
+
+// Accepts the connections of the API server and remembers them, so that responses can watch their socket.
+class ServerConnections : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    using QTcpServer::QTcpServer;
+
+    // must be called on the thread of the HTTP server
+    std::shared_ptr<ServerResponse> createResponse(const QHttpServerRequest &request, QHttpServerResponder &responder);
+    // a response that is given to a callback instead of a client, for the requests of a batch; can be called from
+    // any thread
+    std::shared_ptr<ServerResponse> createDetachedResponse(QByteArrayView route,
+                                                           std::function<void(int, const QByteArray &)> onResponse);
+    // cancels every response, including the ones created from now on; can be called from any thread
+    void cancelAll();
+
+protected:
+    void incomingConnection(qintptr handle) override;
+
+private:
+    void addResponse(const std::shared_ptr<ServerResponse> &response);
+
+    // by peer port, they all come from localhost
+    QHash<quint16, QPointer<QTcpSocket>> m_sockets;
+
+    QMutex                              m_responsesMutex;
+    QList<std::weak_ptr<ServerResponse>> m_responses;
+    bool                                m_cancelled = false;
+};
+
+/* The reply to a request of the API server, which can be given from any thread after the route handler
+ * has returned. Everything that touches the connection is posted to the thread of the HTTP server. */
+class ServerResponse : public std::enable_shared_from_this<ServerResponse>
+{
+public:
+    ~ServerResponse();
+
+    // adds a header to the response, before it is given
+    void setHeader(QByteArrayView name, QByteArrayView value) { m_headers.append(name, value); }
+
+    void respond(QHttpServerResponse &&response);
+
+    // server-sent events
+    void beginEvents();
+    // blocks while the client has not read what was sent so far, returns false once it is gone
+    bool sendEvent(const QByteArray &data);
+    void endEvents(); // sends [DONE]
+
+    // the client closed the connection, or the server is shutting down
+    bool isCancelled() const { return m_cancelled; }
+    void cancel();
+
+private:
+    ServerResponse(QHttpServerResponder &responder, QObject *context, QTcpSocket *socket);
+    ServerResponse(QObject *context, std::function<void(int, const QByteArray &)> onResponse);
+
+    void updatePending();
+
+    std::optional<QHttpServerResponder> m_responder; // only used on the thread of the HTTP server
+    // takes the place of the responder, and is called with a status of 0 if the response was never given
+    std::function<void(int, const QByteArray &)> m_onResponse;
+    bool                            m_responded = false;
+    QByteArray                      m_route;     // label for the metrics
+    QHttpHeaders                    m_headers;   // extra headers of the response
+    QObject                        *m_context;   // lives on the thread of the HTTP server
+    QPointer<QTcpSocket>            m_socket;
+    QList<QMetaObject::Connection>  m_connections;
+    std::atomic<bool>               m_cancelled = false;
+
+    QMutex                          m_mutex;
+    QWaitCondition                  m_drained;
+    qint64                          m_queuedBytes = 0; // posted, not yet written to the socket
+    qint64                          m_socketBytes = 0; // written to the socket, not yet sent
+
+    friend class ServerConnections;
+};
+
+#endif // SERVERRESPONSE_H
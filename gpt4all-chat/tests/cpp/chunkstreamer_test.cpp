@@ -0,0 +1,62 @@
+#include "database.h"
+#include "embllm.h"
+
+#include <gtest/gtest.h>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QStringView>
+#include <QTemporaryDir>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+namespace {
+
+// a word is a token
+int countWords(QStringView text)
+{
+    return int(text.count(u' ')) + 1;
+}
+
+} // namespace
+
+TEST(ChunkStreamerTest, SplitsChunksAtTheTokenCap)
+{
+    const QString text = u"alpha bravo charlie delta echo foxtrot golf hotel india juliett kilo lima mike november "
+                         "oscar papa quebec romeo sierra tango"_s;
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    QFile file(dir.filePath(u"words.txt"_s));
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    file.write(text.toUtf8());
+    file.close();
+
+    // a chunk of 60 characters holds about ten of these words, the cap lets three through
+    const int maxTokens = 3;
+    ChunkStreamer streamer(DocumentInfo { 1, QFileInfo(file.fileName()) }, /*chunkSize*/ 60,
+                           EmbeddingTokenizer { countWords, maxTokens });
+
+    // one chunk per step, so the words left over by the cap are carried from one step to the next
+    QList<ParsedChunk> chunks;
+    ChunkStreamer::Status status;
+    do {
+        status = streamer.step(chunks, chunks.size() + 1);
+    } while (status == ChunkStreamer::Status::INTERRUPTED);
+    ASSERT_EQ(status, ChunkStreamer::Status::DOC_COMPLETE);
+
+    QStringList texts;
+    int words = 0;
+    for (const auto &chunk: chunks) {
+        EXPECT_GT(chunk.tokens, 0);
+        EXPECT_LE(chunk.tokens, maxTokens);
+        texts << chunk.text;
+        words += chunk.words;
+    }
+    EXPECT_EQ(texts.join(u' '), text);
+    EXPECT_EQ(words, countWords(text));
+}
@@ -0,0 +1,252 @@
+#include "remoteembedder.h"
+
+#include <gtest/gtest.h>
+
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QEventLoop>
+#include <QHostAddress>
+#include <QHttpHeaders>
+#include <QHttpServer>
+#include <QHttpServerRequest>
+#include <QHttpServerResponder>
+#include <QHttpServerResponse>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QList>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QTcpServer>
+#include <QTimer>
+#include <QUrl>
+#include <QVector>
+#include <QtMinMax>
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+namespace {
+
+// an OpenAI-compatible embeddings endpoint that can be told to misbehave
+class MockEmbeddingService
+{
+public:
+    MockEmbeddingService()
+        : m_tcpServer(new QTcpServer(&m_server))
+    {
+        m_server.route("/v1/embeddings", QHttpServerRequest::Method::Post,
+            [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+                handleRequest(request, responder);
+            }
+        );
+        if (!m_tcpServer->listen(QHostAddress::LocalHost) || !m_server.bind(m_tcpServer))
+            ADD_FAILURE() << "Could not start the mock embedding service";
+    }
+
+    QUrl url() const { return QUrl(u"http://127.0.0.1:%1/v1/embeddings"_s.arg(m_tcpServer->serverPort())); }
+
+    int                maxInputs = std::numeric_limits<int>::max(); // larger requests are answered with 413
+    QList<int>         failures;        // the status codes of the next responses, sent with Retry-After: 0
+    int                delayMs = 0;     // before each request is answered
+
+    QList<QStringList> requests;        // the inputs of each request, in the order they came in
+    int                inFlight = 0;
+    int                maxInFlight = 0; // the most requests that waited for an answer at once
+
+private:
+    void handleRequest(const QHttpServerRequest &request, QHttpServerResponder &responder)
+    {
+        QStringList texts;
+        const QJsonArray inputs = QJsonDocument::fromJson(request.body()).object().value("input"_L1).toArray();
+        for (const auto &input: inputs)
+            texts << input.toString();
+        requests << texts;
+        maxInFlight = qMax(maxInFlight, ++inFlight);
+
+        int status = 200;
+        if (!failures.isEmpty())
+            status = failures.takeFirst();
+        else if (texts.size() > maxInputs)
+            status = 413;
+
+        auto shared = std::make_shared<QHttpServerResponder>(std::move(responder));
+        QTimer::singleShot(delayMs, &m_server, [this, shared, texts, status] {
+            inFlight--;
+            shared->sendResponse(makeResponse(texts, status));
+        });
+    }
+
+    static QHttpServerResponse makeResponse(const QStringList &texts, int status)
+    {
+        if (status != 200) {
+            QHttpServerResponse response(QHttpServerResponder::StatusCode(status));
+            QHttpHeaders headers = response.headers();
+            headers.append("Retry-After"_L1, "0"_L1);
+            response.setHeaders(std::move(headers));
+            return response;
+        }
+
+        QJsonArray data;
+        for (qsizetype i = 0; i < texts.size(); i++) {
+            data << QJsonObject {
+                { "index",     i                                              },
+                { "embedding", QJsonArray { double(texts[i].size()), 1.0 } },
+            };
+        }
+        return QHttpServerResponse(QJsonObject {
+            { "data",  data                                         },
+            { "usage", QJsonObject {{ "total_tokens", texts.size() }} },
+        });
+    }
+
+    QHttpServer  m_server;
+    QTcpServer  *m_tcpServer; // owned by m_server
+};
+
+// runs the event loop until done() returns true, false if it did not in time
+bool waitFor(const std::function<bool ()> &done, int timeoutMs = 15000)
+{
+    QDeadlineTimer deadline(timeoutMs);
+    while (!done()) {
+        if (deadline.hasExpired())
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+    return true;
+}
+
+class RemoteEmbedderTest : public testing::Test
+{
+protected:
+    void createEmbedder(int maxInFlight)
+    {
+        embedder = std::make_unique<RemoteEmbedder>(RemoteEmbedderConfig {
+            .url         = service.url(),
+            .model       = u"test-embedder"_s,
+            .maxInFlight = maxInFlight,
+        });
+        QObject::connect(embedder.get(), &RemoteEmbedder::embeddingsGenerated,
+            [this](const QVector<EmbeddingResult> &results, qint64) {
+                for (const auto &result: results)
+                    embedded << result.chunk_id;
+            }
+        );
+        QObject::connect(embedder.get(), &RemoteEmbedder::errorGenerated,
+            [this](const QVector<EmbeddingChunk> &chunks, const QString &) {
+                for (const auto &chunk: chunks)
+                    failed << chunk.chunk_id;
+            }
+        );
+    }
+
+    static QVector<EmbeddingChunk> chunks(int first, int count)
+    {
+        QVector<EmbeddingChunk> result;
+        for (int id = first; id < first + count; id++)
+            result << EmbeddingChunk { .model = u"test-embedder"_s, .folder_id = 1, .chunk_id = id,
+                                       .chunk = u"chunk %1"_s.arg(id) };
+        return result;
+    }
+
+    static QList<int> range(int first, int count)
+    {
+        QList<int> result;
+        for (int id = first; id < first + count; id++)
+            result << id;
+        return result;
+    }
+
+    MockEmbeddingService            service;
+    std::unique_ptr<RemoteEmbedder> embedder;
+    QList<int>                      embedded; // chunk ids, in the order they came back
+    QList<int>                      failed;
+};
+
+} // namespace
+
+TEST_F(RemoteEmbedderTest, PipelinesUpToMaxInFlight)
+{
+    service.delayMs = 100;
+    createEmbedder(/*maxInFlight*/ 2);
+    for (int i = 0; i < 6; i++)
+        embedder->embedDocuments(chunks(i, 1));
+
+    ASSERT_TRUE(waitFor([&] { return embedded.size() + failed.size() == 6; }));
+    EXPECT_TRUE(failed.isEmpty());
+    EXPECT_EQ(service.requests.size(), 6);
+    EXPECT_EQ(service.maxInFlight, 2);
+}
+
+TEST_F(RemoteEmbedderTest, RetriesAfterRateLimitAndServerErrors)
+{
+    service.failures = { 429, 503 };
+    createEmbedder(/*maxInFlight*/ 1);
+    embedder->embedDocuments(chunks(0, 3));
+
+    ASSERT_TRUE(waitFor([&] { return embedded.size() + failed.size() == 3; }));
+    EXPECT_TRUE(failed.isEmpty());
+    EXPECT_EQ(embedded, range(0, 3));
+    // the same chunks are sent again after each failure
+    ASSERT_EQ(service.requests.size(), 3);
+    EXPECT_EQ(service.requests[1], service.requests[0]);
+    EXPECT_EQ(service.requests[2], service.requests[0]);
+}
+
+TEST_F(RemoteEmbedderTest, SplitsRequestsThatAreTooLarge)
+{
+    service.maxInputs = 2;
+    createEmbedder(/*maxInFlight*/ 4);
+    embedder->embedDocuments(chunks(0, 7));
+
+    ASSERT_TRUE(waitFor([&] { return embedded.size() + failed.size() == 7; }));
+    EXPECT_TRUE(failed.isEmpty());
+    std::ranges::sort(embedded);
+    EXPECT_EQ(embedded, range(0, 7));
+    EXPECT_EQ(service.requests.first().size(), 7);
+    // 7 -> 3 + 4 -> 1 + 2 + 2 + 2
+    const auto accepted = std::ranges::count_if(service.requests, [](auto &r) { return r.size() <= 2; });
+    EXPECT_EQ(accepted, 4);
+}
+
+TEST_F(RemoteEmbedderTest, GivesUpOnClientErrors)
+{
+    service.failures = { 400 };
+    createEmbedder(/*maxInFlight*/ 1);
+    embedder->embedDocuments(chunks(0, 2));
+
+    ASSERT_TRUE(waitFor([&] { return embedded.size() + failed.size() == 2; }));
+    EXPECT_TRUE(embedded.isEmpty());
+    EXPECT_EQ(failed, range(0, 2));
+    EXPECT_EQ(service.requests.size(), 1);
+}
+
+TEST_F(RemoteEmbedderTest, QueryGoesAheadOfQueuedDocuments)
+{
+    service.delayMs = 50;
+    createEmbedder(/*maxInFlight*/ 1);
+    // the first one is sent right away, the others wait for it
+    for (int i = 0; i < 3; i++)
+        embedder->embedDocuments(chunks(i, 1));
+
+    bool answered = false;
+    std::vector<float> queryEmbedding;
+    embedder->embedQuery(u"the query"_s, [&](std::vector<float> embedding) {
+        queryEmbedding = std::move(embedding);
+        answered = true;
+    });
+
+    ASSERT_TRUE(waitFor([&] { return answered && embedded.size() + failed.size() == 3; }));
+    EXPECT_FALSE(queryEmbedding.empty());
+    ASSERT_EQ(service.requests.size(), 4);
+    EXPECT_EQ(service.requests[1], QStringList { u"the query"_s });
+}
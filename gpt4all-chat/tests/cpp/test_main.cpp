@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 
+#include <QCoreApplication>
+
 int main(int argc, char **argv) {
+    QCoreApplication app(argc, argv); // for the tests that run an event loop
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
@@ -1,10 +1,15 @@
+import base64
+import json
 import os
 import shutil
 import signal
+import struct
 import subprocess
 import sys
 import tempfile
 import textwrap
+import time
+from concurrent.futures import ThreadPoolExecutor
 from contextlib import contextmanager
 from pathlib import Path
 from subprocess import CalledProcessError
@@ -52,7 +57,7 @@ class Requestor:
 request = Requestor()
 
 
-def create_chat_server_config(tmpdir: Path, model_copied: bool = False) -> dict[str, str]:
+def create_chat_server_config(tmpdir: Path, model_copied: bool = False, response_cache_size: int = 0) -> dict[str, str]:
     xdg_confdir = tmpdir / 'config'
     app_confdir = xdg_confdir / 'nomic.ai'
     app_confdir.mkdir(parents=True)
@@ -67,6 +72,9 @@ def create_chat_server_config(tmpdir: Path, model_copied: bool = False) -> dict[
             [network]
             isActive=false
             usageStatsActive=false
+
+            [server]
+            responseCacheSize={response_cache_size}
         """))
 
     if model_copied:
@@ -85,13 +93,13 @@ def create_chat_server_config(tmpdir: Path, model_copied: bool = False) -> dict[
 
 
 @contextmanager
-def prepare_chat_server(model_copied: bool = False) -> Iterator[dict[str, str]]:
+def prepare_chat_server(model_copied: bool = False, response_cache_size: int = 0) -> Iterator[dict[str, str]]:
     if os.name != 'posix' or sys.platform == 'darwin':
         pytest.skip('Need non-Apple Unix to use alternate config path')
 
     with tempfile.TemporaryDirectory(prefix='gpt4all-test') as td:
         tmpdir = Path(td)
-        config = create_chat_server_config(tmpdir, model_copied=model_copied)
+        config = create_chat_server_config(tmpdir, model_copied=model_copied, response_cache_size=response_cache_size)
         yield config
 
 
@@ -120,6 +128,12 @@ def chat_server_with_model() -> Iterator[None]:
         yield from start_chat_server(config)
 
 
+@pytest.fixture
+def chat_server_with_cache() -> Iterator[None]:
+    with prepare_chat_server(model_copied=True, response_cache_size=8) as config:
+        yield from start_chat_server(config)
+
+
 def test_with_models_empty(chat_server: None) -> None:
     # non-sense endpoint
     status_code, response = request.get('foobarbaz', wait=True, raise_for_status=False)
@@ -261,3 +275,262 @@ def test_with_models_temperature(chat_server_with_model: None) -> None:
     }
 
     request.post('completions', data=data, wait=True, raise_for_status=True)
+
+
+def test_with_models_stream(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+
+    data = dict(
+        model          = 'Llama 3.2 1B Instruct',
+        prompt         = 'The quick brown fox',
+        temperature    = 0,
+        max_tokens     = 6,
+        stream         = True,
+        stream_options = dict(include_usage=True),
+    )
+    resp = request.session.post('http://localhost:4891/v1/completions', json=data, stream=True)
+    resp.raise_for_status()
+    assert resp.headers['Content-Type'] == 'text/event-stream'
+
+    events = [line.removeprefix('data: ') for line in resp.iter_lines(decode_unicode=True) if line]
+    assert events[-1] == '[DONE]'
+    chunks = [json.loads(e) for e in events[:-1]]
+    for chunk in chunks:
+        assert chunk['id'] == 'placeholder'
+        assert chunk['object'] == 'text_completion'
+
+    *deltas, usage = chunks
+    expected_choice = EXPECTED_COMPLETIONS_RESPONSE['choices'][0]
+    assert ''.join(c['choices'][0]['text'] for c in deltas) == expected_choice['text']
+    assert deltas[-1]['choices'][0]['finish_reason'] == expected_choice['finish_reason']
+    assert usage['choices'] == []
+    assert usage['usage'] == EXPECTED_COMPLETIONS_RESPONSE['usage']
+
+    # stream_options needs stream
+    del data['stream']
+    status_code, response = request.post('completions', data=data, raise_for_status=False)
+    assert status_code == 400
+    assert response['error']['message'] == "The 'stream_options' parameter is only allowed when 'stream' is enabled."
+
+
+def test_with_models_concurrent(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    )
+
+    def complete(_: int) -> Any:
+        # sessions are not thread-safe
+        resp = requests.post('http://localhost:4891/v1/completions', json=data)
+        resp.raise_for_status()
+        return resp.json()
+
+    # requests that run on different slots get the same response as one alone
+    with ThreadPoolExecutor(max_workers=3) as executor:
+        responses = list(executor.map(complete, range(3)))
+    for response in responses:
+        del response['created']
+        assert response == EXPECTED_COMPLETIONS_RESPONSE
+
+
+def test_with_models_n(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+        n           = 3,
+    )
+    response = request.post('completions', data=data)
+
+    # the choices are sampled together from one decode of the prompt
+    expected_choice = EXPECTED_COMPLETIONS_RESPONSE['choices'][0]
+    assert [c['index'] for c in response['choices']] == [0, 1, 2]
+    for choice in response['choices']:
+        assert choice['text'] == expected_choice['text']
+        assert choice['finish_reason'] == expected_choice['finish_reason']
+    assert response['usage'] == {
+        'completion_tokens': 18,
+        'prompt_tokens': 5,
+        'total_tokens': 23,
+    }
+
+
+def test_with_models_prefix_cache(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    )
+    # a longer prompt that starts with one already decoded on a slot gives the same response as it would alone
+    request.post('completions', data=dict(data, prompt=' '.join(['The quick brown fox'] * 200)))
+    response = request.post('completions', data=data)
+    del response['created']
+    assert response == EXPECTED_COMPLETIONS_RESPONSE
+
+
+def test_with_models_metrics(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+    request.post('completions', data=dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    ))
+
+    resp = requests.get('http://localhost:4891/metrics')
+    resp.raise_for_status()
+    assert resp.headers['Content-Type'].startswith('text/plain')
+    samples = {}
+    for line in resp.text.splitlines():
+        if line and not line.startswith('#'):
+            name, value = line.rsplit(' ', 1)
+            samples[name] = float(value)
+
+    assert samples['gpt4all_http_requests_total{route="/v1/completions",status="200"}'] == 1
+    assert samples['gpt4all_http_requests_total{route="/v1/models",status="200"}'] >= 1
+    assert samples['gpt4all_generated_tokens_total'] == 6
+    assert samples['gpt4all_time_to_first_token_seconds_count'] == 1
+    assert samples['gpt4all_token_latency_seconds_count'] == 5
+    assert samples['gpt4all_queue_wait_seconds_count'] == 1
+    assert samples['gpt4all_kv_cache_tokens{slot="0"}'] > 0
+    assert samples['gpt4all_slots_busy'] == 0
+
+
+def test_with_models_disconnect(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 2000,
+        stream      = True,
+    )
+    with requests.post('http://localhost:4891/v1/completions', json=data, stream=True) as resp:
+        resp.raise_for_status()
+        next(resp.iter_lines())
+
+    # the abandoned generation stops, and the next request gets the model to itself
+    response = request.post('completions', data=dict(data, max_tokens=6, stream=False))
+    del response['created']
+    assert response == EXPECTED_COMPLETIONS_RESPONSE
+
+    resp = requests.get('http://localhost:4891/metrics')
+    resp.raise_for_status()
+    generated = next(float(line.split()[1]) for line in resp.text.splitlines()
+                     if line.startswith('gpt4all_generated_tokens_total '))
+    assert generated < 2000
+
+
+def test_with_models_response_cache(chat_server_with_cache: None) -> None:
+    request.get('models', wait=True)
+
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    )
+    statuses = []
+    for _ in range(2):
+        resp = requests.post('http://localhost:4891/v1/completions', json=data)
+        resp.raise_for_status()
+        statuses.append(resp.headers['X-Cache'])
+        response = resp.json()
+        del response['created']
+        assert response == EXPECTED_COMPLETIONS_RESPONSE
+    assert statuses == ['MISS', 'HIT']
+
+    # a different prompt is not a hit
+    resp = requests.post('http://localhost:4891/v1/completions', json=dict(data, prompt='The lazy dog'))
+    resp.raise_for_status()
+    assert resp.headers['X-Cache'] == 'MISS'
+
+    # sampling with a temperature is not deterministic
+    resp = requests.post('http://localhost:4891/v1/completions', json=dict(data, temperature=0.5))
+    resp.raise_for_status()
+    assert resp.headers['X-Cache'] == 'BYPASS'
+
+
+def test_with_models_batch(chat_server_with_model: None) -> None:
+    request.get('models', wait=True)
+
+    body = dict(model='Llama 3.2 1B Instruct', prompt='The quick brown fox', temperature=0, max_tokens=6)
+    lines = [
+        dict(custom_id=f'req-{i}', method='POST', url='/v1/completions', body=body)
+        for i in range(3)
+    ]
+    resp = requests.post('http://localhost:4891/v1/batches', data='\n'.join(map(json.dumps, lines)))
+    resp.raise_for_status()
+    batch = resp.json()
+    assert batch['object'] == 'batch'
+    assert batch['request_counts']['total'] == 3
+
+    while batch['status'] == 'in_progress':
+        time.sleep(0.5)
+        resp = requests.get(f'http://localhost:4891/v1/batches/{batch["id"]}')
+        resp.raise_for_status()
+        batch = resp.json()
+    assert batch['status'] == 'completed'
+    assert batch['request_counts'] == dict(total=3, completed=3, failed=0)
+
+    resp = requests.get(f'http://localhost:4891/v1/batches/{batch["id"]}/output')
+    resp.raise_for_status()
+    results = {r['custom_id']: r for r in map(json.loads, resp.text.splitlines())}
+    assert sorted(results) == ['req-0', 'req-1', 'req-2']
+    for i in range(3):
+        result = results[f'req-{i}']
+        assert result['error'] is None
+        assert result['response']['status_code'] == 200
+        response = result['response']['body']
+        del response['created']
+        assert response == EXPECTED_COMPLETIONS_RESPONSE
+
+    # every line is checked before the batch starts
+    lines.append(dict(custom_id='req-0', method='POST', url='/v1/completions', body=body))
+    resp = requests.post('http://localhost:4891/v1/batches', data='\n'.join(map(json.dumps, lines)))
+    assert resp.status_code == 400
+    assert 'line 4' in resp.json()['error']['message']
+
+
+def test_embeddings(chat_server: None) -> None:
+    # the embedding model does not depend on the chat model
+    data = dict(
+        model = 'nomic-embed-text-v1.5',
+        input = ['The quick brown fox', 'jumps over the lazy dog'],
+    )
+    response = request.post('embeddings', data=data, wait=True)
+    assert response['object'] == 'list'
+    assert response['model'] == 'nomic-embed-text-v1.5'
+    assert [d['index'] for d in response['data']] == [0, 1]
+    floats = [d['embedding'] for d in response['data']]
+    assert all(len(e) == 768 for e in floats)
+    assert response['usage']['prompt_tokens'] == response['usage']['total_tokens'] > 0
+
+    # base64 is the same little-endian floats
+    response = request.post('embeddings', data=dict(data, encoding_format='base64'))
+    for d, expected in zip(response['data'], floats):
+        decoded = struct.unpack(f'<{len(expected)}f', base64.b64decode(d['embedding']))
+        assert decoded == pytest.approx(expected, abs=1e-5)
+
+    # a single string, with fewer dimensions
+    response = request.post('embeddings', data=dict(data, input='The quick brown fox', dimensions=256))
+    assert len(response['data']) == 1
+    assert len(response['data'][0]['embedding']) == 256
+
+    status_code, response = request.post('embeddings', data=dict(data, model='foo'), raise_for_status=False)
+    assert status_code == 404
+    assert response['error']['code'] == 'model_not_found'
+
+    status_code, response = request.post('embeddings', data=dict(data, input=[]), raise_for_status=False)
+    assert status_code == 400